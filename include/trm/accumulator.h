@@ -0,0 +1,89 @@
+#ifndef TRM_ULTRACAM_ACCUMULATOR_H
+#define TRM_ULTRACAM_ACCUMULATOR_H
+
+#include <string>
+#include <vector>
+#include "trm/subs.h"
+#include "trm/frame.h"
+
+namespace Ultracam {
+
+  //! Running per-pixel statistics of a set of frames
+
+  /** An Accumulator allows a master bias or flat to be built up a frame at a time rather than
+   * by combining a complete set of frames in one go, as with combine. For each pixel it keeps
+   * the number of frames added, the sum of their values and the sum of their squares. These
+   * give the mean and RMS at any point. It can also keep a fixed-size reservoir of values per
+   * pixel, selected at random from those added so that every frame has the same chance of
+   * being represented. The median of the reservoir estimates the median of all frames, exactly
+   * so while no more frames have been added than the reservoir holds.
+   *
+   * Accumulators can be saved to and loaded from disk so that frames can be folded in as they
+   * arrive. The format of the frames and the header of the first frame are kept. As with
+   * combine, CCD 3 of frames flagged with bad blue data is not added.
+   */
+  class Accumulator {
+
+  public:
+
+    //! Default constructor
+    Accumulator() : count_(), sum_(), sumsq_(), nreservoir_(0), reservoir_(), seed_(SEED) {}
+
+    //! Constructor of an empty Accumulator with the format of a frame
+    Accumulator(const Frame& frame, int nreservoir=0);
+
+    //! Constructor from a file
+    Accumulator(const std::string& file);
+
+    //! Adds a frame
+    void add(const Frame& frame);
+
+    //! Computes the mean of each pixel
+    void mean(Frame& out) const;
+
+    //! Computes the RMS of each pixel
+    void rms(Frame& out) const;
+
+    //! Estimates the median of each pixel from the reservoir
+    void median(Frame& out) const;
+
+    //! The number of frames added to each pixel
+    const Frame& count() const {return count_;}
+
+    //! Size of the reservoir per pixel
+    int nreservoir() const {return nreservoir_;}
+
+    //! Reads an Accumulator from a file
+    void read(const std::string& file);
+
+    //! Writes an Accumulator to a file
+    void write(const std::string& file) const;
+
+    //! Standard extension for Accumulator files
+    static std::string extnam() {return ".uca";}
+
+  private:
+
+    // magic number identifying Accumulator files, file format version, initial random number seed
+    static const Subs::INT4 AMAGIC  = 47561010;
+    static const Subs::INT4 VERSION = 1;
+    static const Subs::UINT4 SEED   = 2463534242U;
+
+    // number of frames added to each pixel, which also defines the format and header
+    Frame count_;
+
+    // sums and sums of squares, pixel by pixel in the order of the windows
+    std::vector<double> sum_, sumsq_;
+
+    // number of reservoir values per pixel and the reservoirs, nreservoir_ per pixel
+    int nreservoir_;
+    std::vector<float> reservoir_;
+
+    // state of the random number generator used to select reservoir values
+    Subs::UINT4 seed_;
+
+  };
+
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef TRM_ULTRACAM_CALIBRATE_H
+#define TRM_ULTRACAM_CALIBRATE_H
+
+#include <vector>
+#include "trm/frame.h"
+#include "trm/aperture.h"
+#include "trm/ultracam.h"
+
+namespace Ultracam {
+
+  //! A rectangular region of a window
+
+  /** Pixel_box defines the pixels ixlo <= ix < ixhi, iylo <= iy < iyhi of window
+   * nwin of a CCD, in the binned pixel indices of the window.
+   */
+  struct Pixel_box {
+
+    //! Default constructor
+    Pixel_box() : nwin(0), ixlo(0), iylo(0), ixhi(0), iyhi(0) {}
+
+    //! General constructor
+    Pixel_box(int nwin, int ixlo, int iylo, int ixhi, int iyhi) :
+      nwin(nwin), ixlo(ixlo), iylo(iylo), ixhi(ixhi), iyhi(iyhi) {}
+
+    int nwin; /**< the window */
+    int ixlo; /**< first X pixel */
+    int iylo; /**< first Y pixel */
+    int ixhi; /**< one more than the last X pixel */
+    int iyhi; /**< one more than the last Y pixel */
+  };
+
+  //! Computes the boxes of pixels around apertures
+  void aperture_boxes(const Frame& data, const Maperture& aperture, const std::vector<float>& radius,
+                      std::vector<std::vector<Pixel_box> >& boxes);
+
+  //! Class to apply bias, dark and flat field calibration and compute variances
+
+  /** Calibrator carries out the standard calibration of a data frame, i.e. bias
+   * subtraction, computation of the variance frame from the gain and readout noise,
+   * scaled dark subtraction and flat fielding, in a single sweep over the pixels
+   * rather than with a separate pass over the whole frame for each operation. For
+   * each pixel the calculation is:
+   *
+   * \code
+   * data -= bias;
+   * var   = max(data,0)/gain + readout;
+   * data -= scale*dark;
+   * data /= flat;
+   * var  /= flat*flat;
+   * \endcode
+   *
+   * The reciprocals of the gain and the flat field are computed once by Calibrator::set
+   * so that only multiplications are needed per frame.
+   *
+   * When only a few parts of a frame are of interest, as is usually the case in
+   * photometry, the calibration can be confined to a set of boxes, which may overlap,
+   * using the version of Calibrator::apply that takes a set of Pixel_box objects.
+   *
+   * The calibration frames are referred to rather than copied, so they must not be
+   * altered or destroyed between a call to Calibrator::set and later calls to
+   * Calibrator::apply.
+   */
+
+  class Calibrator {
+
+  public:
+
+    //! Default constructor
+    Calibrator();
+
+    //! Defines the calibration frames
+    void set(const Frame* bias, const Frame* dark, const Frame* flat, const Frame& gain, const Frame& readout);
+
+    //! Calibrates a frame and computes its variance
+    void apply(Frame& data, Frame& dvar, const std::vector<float>& dark_scale, int nthreads=1) const;
+
+    //! Calibrates a set of regions of a frame and computes their variance
+    void apply(Frame& data, Frame& dvar, const std::vector<float>& dark_scale,
+               const std::vector<std::vector<Pixel_box> >& boxes, int nthreads=1) const;
+
+    //! Calibrates one window, or part of one, of a frame and computes its variance
+    void apply(Frame& data, Frame& dvar, const std::vector<float>& dark_scale, int nccd, int nwin,
+               int ixlo, int iylo, int ixhi, int iyhi) const;
+
+  private:
+
+    // Calibration frames
+    const Frame *bias, *dark, *readout;
+
+    // Reciprocal of the gain frame
+    Frame rgain;
+
+    // Reciprocal of the flat field
+    Frame rflat;
+
+    // Flat field or not
+    bool flat;
+
+  };
+
+};
+
+#endif
@@ -35,6 +35,12 @@ namespace Ultracam {
     
     //! Get next pixel value
     Ultracam::internal_data get_next();
+
+    //! Get the next n pixel values
+    void get_next(Ultracam::internal_data* dest, int n, int stride=1);
+
+    //! Skip the next n pixel values
+    void skip(size_t n);
     
   private:
     
@@ -0,0 +1,51 @@
+#ifndef TRM_ULTRACAM_FINDPOS_H
+#define TRM_ULTRACAM_FINDPOS_H
+
+#include <vector>
+#include "trm/ultracam.h"
+
+namespace Ultracam {
+
+  //! Locates a target by collapse and cross-correlation, as findpos
+
+  /** Findpos carries out the measurement of the function findpos, which it underlies,
+   * using buffers that it keeps from one call to the next. The profiles are indexed by
+   * pixel position, as Subs::centroid expects, and so are as long as the search box reaches
+   * into the window, but repeated calls allocate nothing once they have grown to that size
+   * and nothing is placed on the stack however wide the window. A Findpos should only be
+   * used by one thread at a time.
+   */
+  class Findpos {
+
+  public:
+
+    //! Default constructor
+    Findpos();
+
+    //! Locates one target
+    void find(internal_data **dat, internal_data **var, int nx, int ny, float fwhm_x, float fwhm_y,
+              int hwidth_x, int hwidth_y, float xstart, float ystart, bool bias,
+              double& xpos, double &ypos, float& ex, float& ey);
+
+  private:
+
+    // Sets the search box around a position and zeroes the profiles over it
+    void set_box(int nx, int ny, int hwidth_x, int hwidth_y, double x, double y);
+
+    // Subtracts the median of elements i1 to i2 of a profile
+    void sub_back(std::vector<float>& prof, int i1, int i2);
+
+    // The search box
+    int xlo, xhi, ylo, yhi;
+
+    // Profiles and weights, indexed by pixel position
+    std::vector<float> xprof, vxprof, yprof, vyprof, wgt;
+
+    // Workspace of sub_back
+    std::vector<float> temp;
+
+  };
+
+};
+
+#endif
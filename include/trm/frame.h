@@ -156,6 +156,9 @@ namespace Ultracam {
     
 	//! Read an ULTRACAM file.
 	void read(const std::string& file, int nc=0);
+
+	//! Read just the header of an ULTRACAM file.
+	void read_header(const std::string& file);
     
 	//! Write an ULTRACAM file.
 	void write(const std::string& file, Windata::Out_type otype=Windata::NORMAL) const;
@@ -0,0 +1,113 @@
+#ifndef TRM_ULTRACAM_FRAME_PREFETCH_H
+#define TRM_ULTRACAM_FRAME_PREFETCH_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include "trm/frame.h"
+#include "trm/header_items.h"
+#include "trm/frame_source.h"
+#include "trm/ultracam.h"
+#include "trm/parallel.h"
+
+namespace Ultracam {
+
+  //! Class to read frames ahead in a separate thread
+
+  /** Frame_prefetch runs a reader thread which pulls frames first, first+1, ...
+   * from a Frame_source, de-multiplexes them and places them in a bounded queue
+   * while the calling thread works on earlier frames. Once the queue holds
+   * 'depth' frames the reader waits for the consumer to catch up. The net effect
+   * is that for long runs the time per frame approaches the larger of the I/O and
+   * the processing times rather than their sum.
+   *
+   * The frames in the queue are a fixed pool allocated at the start. When a frame is
+   * handed over, its pixel buffers are swapped with those of the Frame passed to
+   * get, and the latter's are recycled for a future read, so that no allocation
+   * or copying of pixel data takes place once the run is under way.
+   *
+   * Errors raised within the reader thread are passed back and re-thrown from get, with
+   * their original type (see Task_error), once all frames read before the error have been
+   * consumed.
+   */
+
+  class Frame_prefetch {
+
+  public:
+
+    //! Constructor, which starts the reader thread
+    Frame_prefetch(Frame_source& server, const Frame& format, size_t first, int depth,
+                   double twait, double tmax);
+
+    //! Destructor, which stops the reader thread
+    ~Frame_prefetch();
+
+    //! Gets the next frame
+    bool get(Frame& data, size_t& nfile);
+
+    //! Returns the header items of the last frame returned by get
+    const Header_items& items() const {return items_;}
+
+  private:
+
+    // no copying
+    Frame_prefetch(const Frame_prefetch& obj);
+    Frame_prefetch& operator=(const Frame_prefetch& obj);
+
+    // Entry point of the reader thread
+    static void* reader(void* arg);
+
+    // The work done by the reader thread
+    void run();
+
+    // the source of frames
+    Frame_source& server;
+
+    // the waiting parameters passed to Frame_source::get
+    double twait, tmax;
+
+    // the next frame to read
+    size_t next;
+
+    // pool of frames
+    std::vector<Frame> pool;
+
+    // frame numbers of the pool frames
+    std::vector<size_t> pool_nfile;
+
+    // header items of the pool frames
+    std::vector<Header_items> pool_items;
+
+    // header items of the last frame handed over
+    Header_items items_;
+
+    // indices of free and loaded frames of the pool
+    std::deque<int> free_slots, full_slots;
+
+    // set once the reader has hit the end of the data
+    bool finished;
+
+    // set to ask the reader to stop
+    bool stop;
+
+    // set if the reader failed with an error
+    bool failed;
+
+    // the error raised by the reader
+    Task_error error;
+
+    // the reader thread
+    pthread_t thread;
+
+    // controls access to everything above that is shared
+    pthread_mutex_t mutex;
+
+    // signals changes of state
+    pthread_cond_t cond;
+
+  };
+
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef TRM_ULTRACAM_FRAME_SOURCE_H
+#define TRM_ULTRACAM_FRAME_SOURCE_H
+
+#include <string>
+#include <curl/curl.h>
+#include "trm/frame.h"
+#include "trm/ultracam.h"
+#include "trm/header_items.h"
+#include "trm/raw_archive.h"
+
+namespace Ultracam {
+
+  //! Class to deliver raw frames from a server or a local .dat file
+
+  /** Frame_source wraps up everything that is needed to read a sequence
+   * of raw frames from either the ULTRACAM fileserver ('S') or a local
+   * .dat file ('L'). If there is no .dat file, a compressed .dcz version of
+   * the run is read instead (see Raw_archive). It is designed to live for the whole of a run, so that
+   * the cURL handle (and with it the keep-alive connection to the server),
+   * the input stream and the raw data buffer are set up once only rather than
+   * for every frame. At high frame rates this saves a TCP handshake and a
+   * multi-megabyte allocation per frame.
+   *
+   * Typical use is:
+   * \code
+   * Ultracam::Frame_source server;
+   * server.open(source, url, serverdata);
+   * while(server.get(data, nfile, twait, tmax)){
+   *   ...
+   *   nfile++;
+   * }
+   * \endcode
+   *
+   * Ultracam::get_server_frame remains available and is now a thin wrapper
+   * around a Frame_source that persists between calls.
+   */
+
+  class Frame_source {
+
+  public:
+
+    //! Default constructor; the source must then be defined with open
+    Frame_source();
+
+    //! Constructor
+    Frame_source(char source, const std::string& url, const ServerData& serverdata);
+
+    //! Defines the source
+    void open(char source, const std::string& url, const ServerData& serverdata);
+
+    //! Destructor
+    ~Frame_source();
+
+    //! Gets a frame
+    bool get(Frame& data, size_t& nfile, double twait, double tmax, bool reset=false, bool demultiplex=true);
+
+    //! Checks whether the source matches particular settings
+    bool matches(char source, const std::string& url) const {
+      return (source == source_ && url == url_);
+    }
+
+    //! Returns the data source ('S' or 'L')
+    char source() const {return source_;}
+
+    //! Returns the server data associated with the source
+    const ServerData& serverdata() const {return serverdata_;}
+
+    //! Sets the number of threads used to de-multiplex each frame
+    void set_nthreads(int nthreads){nthreads_ = nthreads > 1 ? nthreads : 1;}
+
+    //! Returns the number of threads used to de-multiplex each frame
+    int nthreads() const {return nthreads_;}
+
+    //! Returns the header items of the last frame read
+    const Header_items& items() const {return items_;}
+
+  private:
+
+    // no copying
+    Frame_source(const Frame_source& obj);
+    Frame_source& operator=(const Frame_source& obj);
+
+    // Locates raw frame nfile, setting frame to point at it
+    bool fetch(size_t& nfile, double twait, double tmax, bool reset);
+
+    // Translates the raw frame pointed to by frame into a Frame
+    void interpret(Frame& data, size_t nfile, bool demultiplex);
+
+    // Opens the local file if need be
+    void open_local();
+
+    // Closes the local file
+    void close_local();
+
+    // Returns the number of complete frames in the local file, extending the mapping if it has grown
+    size_t local_nframes();
+
+    // Points frame at local frame nfile
+    void local_frame(size_t nfile);
+
+    // Releases cURL handle, file and buffer
+    void close();
+
+    // 'S' or 'L'
+    char source_;
+
+    // URL or file name
+    std::string url_;
+
+    // Information from the XML file
+    ServerData serverdata_;
+
+    // Number of header bytes
+    size_t headerskip;
+
+    // Last frame number found when asking for the most recent frame
+    size_t lastfile;
+
+    // cURL handle, kept open for the whole run
+    CURL *curl_handle;
+
+    // cURL error messages
+    char error_buffer[CURL_ERROR_SIZE];
+
+    // Raw data buffer, re-used for every frame
+    MemoryStruct buffer;
+
+    // The current raw frame, either in the buffer or in the mapped file
+    char *frame;
+
+    // File descriptor for the local file case, -1 if not open
+    int fd;
+
+    // Start of the mapping of the local file, NULL if not mapped
+    char *map_start;
+
+    // Number of bytes mapped
+    size_t map_size;
+
+    // Compressed run, open if the local run has no .dat file
+    Raw_archive archive;
+
+    // Number of threads for de-multiplexing
+    int nthreads_;
+
+    // Typed header items of the last frame read
+    Header_items items_;
+
+  };
+
+};
+
+#endif
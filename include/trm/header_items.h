@@ -0,0 +1,121 @@
+#ifndef TRM_ULTRACAM_HEADER_ITEMS_H
+#define TRM_ULTRACAM_HEADER_ITEMS_H
+
+#include <string>
+#include "trm/subs.h"
+#include "trm/header.h"
+#include "trm/ultracam.h"
+
+namespace Ultracam {
+
+  //! Typed copy of the header items needed frame-by-frame
+
+  /** Reading an item such as "UT_date" from a Subs::Header involves splitting
+   * the name and a string search at each level of the header, followed by a
+   * virtual call to extract the value. This is done several times per frame by
+   * the de-multiplexing routines and by programs such as reduce and grab and at
+   * high frame rates becomes a noticeable overhead. Header_items holds the values
+   * with their proper types instead so that they can be read as plain members.
+   *
+   * The items split into those which are constant for a run, which are loaded once
+   * with set_run, and those which change from frame to frame, which are loaded
+   * either from a header with set_frame or, when frames come from a Frame_source,
+   * directly from the timing information without going through a header at all.
+   *
+   * set_run throws if any item needed to de-multiplex the data is missing, just as
+   * the de-multiplexing routines did when they looked the items up themselves. The
+   * other look-ups are tolerant of missing items, which are given defaults. The has_*
+   * flags record whether optional frame items were actually found, so that callers
+   * can decide for themselves whether a missing item is an error.
+   */
+  struct Header_items {
+
+    //! Default constructor
+    Header_items();
+
+    //! Loads the items constant for a run
+    void set_run(const Subs::Header& head);
+
+    //! Loads the items that change from frame to frame from a header
+    void set_frame(const Subs::Header& head);
+
+    //! Loads the items that change from frame to frame from timing information
+    void set_frame(const TimingInfo& timing);
+
+    //! Have the run items been loaded?
+    bool run_set;
+
+    //! Instrument, "Instrument.instrument", blank if not found
+    std::string instrument;
+
+    //! Software version, "Instrument.version", -1 if not found (only allowed for ULTRASPEC)
+    int version;
+
+    //! Whether trimming was applied, "Trimming.applied"
+    bool trimmed;
+
+    //! Number of columns trimmed, "Trimming.ncols", 0 if trimming was not applied
+    int ncols;
+
+    //! Number of rows trimmed, "Trimming.nrows", 0 if trimming was not applied
+    int nrows;
+
+    //! Readout mode, "Instrument.Readout_Mode_Flag", -1 if not found (only allowed for ULTRASPEC)
+    int readout_mode;
+
+    //! L3CCD output, "Instrument.Output", 0 if not found (not allowed for ULTRASPEC)
+    int output;
+
+    //! Number of u-band co-adds, "Instrument.nblue", 1 if not found
+    int nblue;
+
+    //! Was "UT_date" found?
+    bool has_time;
+
+    //! Time at the centre of the exposure, "UT_date"
+    Subs::Time ut_date;
+
+    //! Was "UT_date_blue" found?
+    bool has_time_blue;
+
+    //! Time at the centre of the u-band exposure, "UT_date_blue", equal to ut_date if not found
+    Subs::Time ut_date_blue;
+
+    //! Was "Exposure" found?
+    bool has_exposure;
+
+    //! Exposure time, seconds, "Exposure", 0 if not found
+    float exposure;
+
+    //! Was "Exposure_blue" found?
+    bool has_exposure_blue;
+
+    //! u-band exposure time, seconds, "Exposure_blue", equal to exposure if not found
+    float exposure_blue;
+
+    //! Was "Frame.reliable" found?
+    bool has_reliable;
+
+    //! Time reliable? "Frame.reliable", true if not found
+    bool reliable;
+
+    //! Was "Frame.reliable_blue" found?
+    bool has_reliable_blue;
+
+    //! u-band time reliable? "Frame.reliable_blue", equal to reliable if not found
+    bool reliable_blue;
+
+    //! u-band data junk? "Frame.bad_blue", false if not found
+    bool bad_blue;
+
+    //! Was "Frame.satellites" found?
+    bool has_satellites;
+
+    //! Number of satellites, "Frame.satellites", 0 if not found
+    int satellites;
+
+  };
+
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef TRM_ULTRACAM_PARALLEL_H
+#define TRM_ULTRACAM_PARALLEL_H
+
+#include <string>
+#include <pthread.h>
+
+namespace Subs {
+  class Subs_Error;
+};
+
+namespace Ultracam {
+
+  //! Runs a set of independent tasks using several threads
+
+  /** Calls task(n, arg) for n = 0 to ntask-1 using up to nthreads threads
+   * including the calling thread. Tasks are handed out one at a time as threads
+   * become free, so the order of execution is undefined; each task must therefore
+   * only modify data that no other task touches. If nthreads < 2 or there is only
+   * one task, the tasks are simply run in order by the calling thread.
+   * The extra threads come from a pool that is started on first use and kept for the
+   * rest of the program, so thread-specific data set up by tasks (such as the buffers
+   * of the sky estimates and the aperture weight caches) are re-used from call to call.
+   * Calls may be made at the same time from several threads and from within tasks.
+   * If any task throws an exception, the remaining tasks are abandoned and the first
+   * error is thrown again from the calling thread once all threads have finished. It keeps
+   * its type if it is one of the Ultracam_Error classes, a Subs::Subs_Error, a plain
+   * std::string or a std::bad_alloc; anything else becomes an Ultracam_Error. This is the
+   * same whatever the number of threads.
+   * \param task     the function to call for each task
+   * \param arg      pointer passed through to each call of task
+   * \param ntask    the number of tasks
+   * \param nthreads the maximum number of threads to use
+   */
+  void run_parallel(void (*task)(int n, void* arg), void* arg, int ntask, int nthreads);
+
+  //! An object of type T for each thread
+
+  /** Thread_cache gives each thread its own T, made with the default constructor when the
+   * thread first asks for it and deleted when the thread ends. It is for buffers and caches
+   * that are expensive to set up and are needed again and again by the tasks of run_parallel:
+   * since the threads of run_parallel last for the whole program, each one sets up its T
+   * once only. A Thread_cache should be defined at namespace scope so that it is constructed
+   * before any thread uses it, e.g.
+   * \code
+   * namespace {
+   *   Ultracam::Thread_cache<Buffers> buffers;
+   * }
+   * ...
+   * Buffers& buff = buffers.get();
+   * \endcode
+   */
+  template <class T>
+  class Thread_cache {
+
+  public:
+
+    //! Constructor
+    Thread_cache(){
+      pthread_key_create(&key, destroy);
+    }
+
+    //! Returns the T of the calling thread
+    T& get(){
+      T* ptr = static_cast<T*>(pthread_getspecific(key));
+      if(ptr == 0){
+        ptr = new T;
+        pthread_setspecific(key, ptr);
+      }
+      return *ptr;
+    }
+
+  private:
+
+    // no copying
+    Thread_cache(const Thread_cache&);
+    Thread_cache& operator=(const Thread_cache&);
+
+    // Called as each thread ends
+    static void destroy(void* ptr){
+      delete static_cast<T*>(ptr);
+    }
+
+    pthread_key_t key;
+
+  };
+
+  //! Holds an exception raised in one thread so that it can be thrown again in another
+
+  /** Task_error is for code that catches an error in a worker thread and must pass it
+   * back to the thread that asked for the work, as run_parallel does. store, called within
+   * a catch block, records the exception being handled; rethrow throws it again with the
+   * same type if it is one of the Ultracam_Error classes, a Subs::Subs_Error, a plain
+   * std::string or a std::bad_alloc. Anything else becomes an Ultracam_Error.
+   */
+  class Task_error {
+
+  public:
+
+    //! Default constructor, with no error stored
+    Task_error() : kind(NONE), message(), subs_error(0) {}
+
+    //! Destructor
+    ~Task_error();
+
+    //! Whether an error has been stored
+    bool set() const {return kind != NONE;}
+
+    //! Stores the exception being handled
+    void store();
+
+    //! Throws the stored error again
+    void rethrow(const std::string& where) const;
+
+  private:
+
+    // no copying
+    Task_error(const Task_error&);
+    Task_error& operator=(const Task_error&);
+
+    enum Kind {NONE, FILE_OPEN, MODIFY, INPUT, READ, WRITE, ULTRACAM, SUBS, STRING, BAD_ALLOC, UNKNOWN};
+
+    Kind kind;
+    std::string message;
+    Subs::Subs_Error* subs_error;
+
+  };
+
+};
+
+#endif
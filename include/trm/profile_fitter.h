@@ -0,0 +1,79 @@
+#ifndef TRM_ULTRACAM_PROFILE_FITTER_H
+#define TRM_ULTRACAM_PROFILE_FITTER_H
+
+#include <vector>
+#include "trm/subs.h"
+#include "trm/buffer2d.h"
+#include "trm/windata.h"
+#include "trm/ultracam.h"
+
+namespace Ultracam {
+
+  //! Levenberg-Marquardt fitter of Gaussian and Moffat profiles
+
+  /** Profile_fitter fits a Gaussian or Moffat profile, as defined by a Ppars, to a region
+   * of a Windata. It keeps all the state of a fit between iterations, so unlike the
+   * functions fitgaussian and fitmoffat, which it underlies, any number of fits can proceed
+   * at once, e.g. in different threads, each with its own Profile_fitter.
+   *
+   * Profile_fitter::fit iterates to convergence in one call, after which Profile_fitter::covariances
+   * returns the covariances of the fitted parameters. Profile_fitter::iterate carries out a single
+   * iteration following the 'alambda' protocol of fitgaussian and fitmoffat for callers that need
+   * to control the iterations themselves.
+   *
+   * The model and its derivatives are computed a row at a time for all unmasked pixels of the
+   * row, which are first gathered into contiguous arrays, and the normal equations are then
+   * accumulated with simple loops over the row that the compiler can vectorise. The Moffat
+   * profile is computed from the logarithm, which is needed for the derivative with respect to
+   * beta anyway, rather than with a separate call to pow. The results are the same as computing
+   * pixel by pixel apart from rounding.
+   */
+  class Profile_fitter {
+
+  public:
+
+    //! Default constructor
+    Profile_fitter();
+
+    //! Carries out one iteration of a fit
+    void iterate(const Windata& data, const Windata& sigma, int xlo, int xhi, int ylo, int yhi,
+                 Ppars& params, double& chisq, double& alambda, Subs::Buffer2D<double>& covar);
+
+    //! Fits a profile, iterating to convergence
+    int fit(const Windata& data, const Windata& sigma, int xlo, int xhi, int ylo, int yhi,
+            Ppars& params, double& chisq, Subs::Buffer2D<double>& covar, int nmax=100);
+
+    //! Computes the covariances of the last fit
+    void covariances(const Ppars& params, Subs::Buffer2D<double>& covar);
+
+  private:
+
+    // Maximum number of parameters of any profile
+    static const int NMAX = 8;
+
+    // Computes the curvature matrix, gradient and chi**2
+    void cof(const Windata& data, const Windata& sigma, const Ppars& params, int xlo, int xhi, int ylo, int yhi,
+             Subs::Buffer2D<double>& alpha, Subs::Buffer1D<double>& beta, double& chisq);
+
+    // State of the fit between iterations: trial parameters, number of variable parameters, last chi**2,
+    // curvature matrix and gradient
+    Ppars atry;
+    int nvar;
+    double ochisq;
+    Subs::Buffer2D<double> alpha;
+    Subs::Buffer1D<double> beta;
+
+    // Trial curvature matrix, gradient and matrix solution
+    Subs::Buffer2D<double> talpha, oneda;
+    Subs::Buffer1D<double> tbeta;
+
+    // Row workspace: indices of variable parameters, offsets, weights, data, residuals, derivatives
+    // and weighted derivatives of the unmasked pixels of a row
+    std::vector<int> vindex;
+    std::vector<double> xoff, wgt, dat, diff, dyda, wdyda;
+
+  };
+
+};
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef TRM_ULTRACAM_RAW_ARCHIVE_H
+#define TRM_ULTRACAM_RAW_ARCHIVE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdint.h>
+#include "trm/subs.h"
+
+namespace Ultracam {
+
+  //! Reads raw frames from a losslessly compressed run
+
+  /** A run of raw ULTRACAM or ULTRASPEC frames, normally stored in a .dat file
+   * as a sequence of frames of fixed size, can instead be stored in compressed
+   * form in a .dcz file. Each frame is compressed separately into a block. An index
+   * of the block offsets at the end of the file allows any frame to be read without
+   * decompressing those before it, so a .dcz file can be used anywhere a .dat file
+   * can be, including by Frame_source for the 'L' source.
+   *
+   * Within each block the timing header of the frame is stored as is. The 16-bit
+   * pixels are replaced by their differences from the previous pixel of the same
+   * readout, 'stride' words earlier in the multiplexed order, which are then
+   * Rice coded in groups of 32 with the coding parameter chosen for each group,
+   * as in the Rice compression of FITS tiles. This suits the low-entropy, largely
+   * bias-level data of most frames and needs only a single pass to decode.
+   *
+   * The file starts with a magic number, a version number, the frame size, the
+   * header size and the stride as 4-byte integers. Then come the blocks and then the
+   * index, as 8-byte offsets of the start of each block plus one for the end of the last,
+   * followed by the number of frames, the offset of the index and the magic number again.
+   * Files are written in native byte order and can only be read on machines of the same
+   * byte order.
+   */
+  class Raw_archive {
+
+  public:
+
+    //! Default constructor
+    Raw_archive();
+
+    //! Destructor
+    ~Raw_archive();
+
+    //! Opens a compressed run
+    void open(const std::string& file);
+
+    //! Closes the run
+    void close();
+
+    //! Is a run open?
+    bool is_open() const {return map_start != NULL;}
+
+    //! Returns the number of frames
+    size_t nframes() const {return nframes_;}
+
+    //! Returns the number of bytes per frame
+    size_t framesize() const {return framesize_;}
+
+    //! Returns the number of header bytes per frame
+    size_t headerskip() const {return headerskip_;}
+
+    //! Reads a frame
+    void read(size_t nfile, char* buffer) const;
+
+    //! Standard extension of compressed runs
+    static std::string extnam() {return ".dcz";}
+
+    //! Tests whether a compressed version of a run exists
+    static bool exists(const std::string& file);
+
+  private:
+
+    friend class Raw_archive_writer;
+
+    // Magic number and format version
+    static const Subs::INT4 DMAGIC  = 47561012;
+    static const Subs::INT4 VERSION = 1;
+
+    // Not copyable
+    Raw_archive(const Raw_archive&);
+    Raw_archive& operator=(const Raw_archive&);
+
+    // The mapping
+    char *map_start;
+    size_t map_size;
+
+    // Frame size, header size, stride and number of frames
+    size_t framesize_, headerskip_, stride_, nframes_;
+
+    // Pointer to the index in the mapping
+    const char *index;
+
+  };
+
+  //! Writes raw frames to a compressed run
+
+  /** Raw_archive_writer compresses frames one at a time into the format read
+   * by Raw_archive. The index is written when the writer is closed, so a run is
+   * only readable once Raw_archive_writer::close has been called.
+   */
+  class Raw_archive_writer {
+
+  public:
+
+    //! Default constructor
+    Raw_archive_writer() : fout(), framesize_(0), headerskip_(0), stride_(1), offset(), buff() {}
+
+    //! Destructor, which closes the file
+    ~Raw_archive_writer();
+
+    //! Opens a compressed run for output
+    void open(const std::string& file, size_t framesize, size_t headerskip, size_t stride);
+
+    //! Compresses and writes a frame
+    void write(const char* frame);
+
+    //! Writes the index and closes the file
+    void close();
+
+  private:
+
+    // Not copyable
+    Raw_archive_writer(const Raw_archive_writer&);
+    Raw_archive_writer& operator=(const Raw_archive_writer&);
+
+    std::ofstream fout;
+    size_t framesize_, headerskip_, stride_;
+    std::vector<uint64_t> offset;
+    std::vector<unsigned char> buff;
+
+  };
+
+};
+
+#endif
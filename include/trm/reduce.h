@@ -2,6 +2,8 @@
 #define TRM_REDUCE_H
 
 #include "trm/ultracam.h"
+#include "trm/aperture.h"
+#include "trm/mccd.h"
 
 //! Namespace for 'reduce' related items
 namespace Reduce {
@@ -58,6 +60,17 @@ namespace Reduce {
     bool set; /**< Is this shape structure set or not? */
   };
 
+  //! Stores the state kept by rejig_apertures from one frame to the next
+  struct Rejig_state {
+
+    //! Default constructor
+    Rejig_state() : first(true), link(), previous() {}
+
+    bool first; /**< true until the first frame has been handled */
+    std::vector<std::map<int,int> > link; /**< Master aperture of each linked aperture, for each CCD */
+    Ultracam::Maperture previous; /**< Last apertures of each CCD which were all valid */
+  };
+
   //! Stores info for one aperture of one CCD
   struct Point{
     Point() : flux(0.), ferr(0.), xpos(0.), ypos(0.), fwhm(0.), code(OK), exposure(1.f), time_ok(true)  {}
@@ -208,6 +221,9 @@ namespace Reduce {
     //! Default constructor
     //    Twopass() : time(0.), shape(), ref_pos(), ref_valid(), offset() {}
 
+    //! Frame number of this point, to check that both passes see the same frames
+    size_t nfile;
+
     //! Time for this point
     double time;
 
@@ -224,6 +240,17 @@ namespace Reduce {
     std::vector<std::vector<Offset> > offset;
   };
 
+  //! Magic number of two pass files
+  const Subs::INT4 TWOPASS_MAGIC = 47561013;
+
+  //! Writes the results of the first pass of two pass mode to a file
+  void write_twopass(const std::string& file, const std::string& key, const Ultracam::Maperture& aperture,
+                     const std::vector<Twopass>& twopass, bool blue_is_bad);
+
+  //! Reads the results of the first pass of two pass mode from a file
+  bool read_twopass(const std::string& file, const std::string& key, Ultracam::Maperture& aperture,
+                    std::vector<Twopass>& twopass, bool& blue_is_bad);
+
 };
 
 #endif
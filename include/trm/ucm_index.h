@@ -0,0 +1,59 @@
+#ifndef TRM_ULTRACAM_UCM_INDEX_H
+#define TRM_ULTRACAM_UCM_INDEX_H
+
+#include <vector>
+#include <fstream>
+#include "trm/subs.h"
+
+namespace Ultracam {
+
+  //! Index of the byte offsets of the parts of a ucm file
+
+  /** A ucm file consists of a magic number, a header, the number of CCDs and then for each
+   * CCD the number of windows followed by each window's format, data type and data. All of
+   * these vary in size, so reaching a particular CCD or window normally means reading or
+   * skipping everything before it.
+   *
+   * Version 2 ucm files, as written by Frame::write, add an index after the data giving the
+   * byte offsets from the start of the file of the header, of each CCD and of each window.
+   * The file ends with the offset of the index and a magic number so that the index can be
+   * found by seeking back from the end of the file. Since the index follows the data, which
+   * is otherwise unchanged, version 2 files can still be read sequentially exactly as version
+   * 1 files, including by older software.
+   *
+   * The layout of the index, all in 4-byte integers, is: magic number, version, header offset,
+   * number of CCDs, then for each CCD its offset and number of windows followed by the offset of
+   * each window. Then come the offset of the index and the magic number again. Offsets are
+   * limited to 2 GB.
+   */
+  struct Ucm_index {
+
+    //! Magic number marking the index
+    static const Subs::INT4 IMAGIC = 47561011;
+
+    //! Format version of files with an index
+    static const Subs::INT4 VERSION = 2;
+
+    //! Offset of the header
+    Subs::INT4 header;
+
+    //! Offset of each CCD, i.e. of its number of windows
+    std::vector<Subs::INT4> ccd;
+
+    //! Offset of each window of each CCD, i.e. of its format
+    std::vector<std::vector<Subs::INT4> > win;
+
+    //! Reads the index of a file if it has one
+    bool read(std::ifstream& fin, bool swap_bytes);
+
+    //! Writes the index at the current position of a file
+    void write(std::ofstream& fout) const;
+
+    //! Returns the current position of an output file as an offset
+    static Subs::INT4 offset(std::ofstream& fout);
+
+  };
+
+};
+
+#endif
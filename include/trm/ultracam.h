@@ -64,6 +64,7 @@ namespace Ultracam {
   template <class Obj> class CCD;
   template <class Obj> class MCCD;
   class Image;
+  struct Header_items;
 
   //! Multiple apertures
   typedef MCCD<Ultracam::Aperture> Maperture;
@@ -916,14 +917,23 @@ namespace Ultracam {
   };
 
   //! De-multiplexes raw ULTRACAM data
-  void de_multiplex_ultracam(char *buffer, Frame& data);
+  void de_multiplex_ultracam(char *buffer, Frame& data, int nthreads=1);
+
+  //! De-multiplexes raw ULTRACAM data given pre-loaded header items
+  void de_multiplex_ultracam(char *buffer, Frame& data, const Header_items& items, int nthreads=1);
 
   //! De-multiplexes raw ULTRASPEC data
-  void de_multiplex_ultraspec(char *buffer, Frame& data, const std::vector<int>& nchop);
+  void de_multiplex_ultraspec(char *buffer, Frame& data, const std::vector<int>& nchop, int nthreads=1);
+
+  //! De-multiplexes raw ULTRASPEC data given pre-loaded header items
+  void de_multiplex_ultraspec(char *buffer, Frame& data, const Header_items& items, const std::vector<int>& nchop, int nthreads=1);
 
   //! De-multiplexes raw ULTRASPEC drift-mode data
   void de_multiplex_ultraspec_drift(char *buffer, Frame& data, const std::vector<int>& nchop);
 
+  //! De-multiplexes raw ULTRASPEC drift-mode data given pre-loaded header items
+  void de_multiplex_ultraspec_drift(char *buffer, Frame& data, const Header_items& items, const std::vector<int>& nchop);
+
   //! Interprets time from raw header
   void read_header(char* buffer, const Ultracam::ServerData& serverdata, Ultracam::TimingInfo& timing);
 
@@ -1000,12 +1010,14 @@ namespace Ultracam {
 
   //! Updates the aperture file, also returns shape and uncertainty structures
   void rejig_apertures(const Frame& data, const Frame& dvar, const Subs::Plot& profile_fit_plot, bool blue_is_bad,
-		       Maperture& aperture, std::vector<Reduce::Meanshape>& shape, std::vector<std::vector<Fxy> >& errors);
+		       Reduce::Rejig_state& state, Maperture& aperture, std::vector<Reduce::Meanshape>& shape,
+		       std::vector<std::vector<Fxy> >& errors, int nthreads=1);
 
   //! Estimates the sky in an aperture annulus
   void sky_estimate(const Aperture& aperture, const Windata& dwin, const Windata& vwin, const Windata& bwin,
 		    Reduce::SKY_METHOD sky_method, float sky_clip, Reduce::SKY_ERROR sky_error,
-		    float& sky, float& sky_sigma, double& rms, int& nsky, int& nrej, bool& overlap);
+		    float& sky, float& sky_sigma, double& rms, int& nsky, int& nrej, bool& overlap,
+		    float annulus_tol=-1.f);
 
   //! Extracts flux in an aperture
   void extract_flux(const Image& data, const Image& dvar, const Image& bad,
@@ -1013,7 +1025,15 @@ namespace Ultracam {
 		    float sky_clip, Reduce::SKY_ERROR sky_error, Reduce::EXTRACTION_METHOD extraction_method,
 		    const std::vector<std::pair<int,int> >& zapped, const Reduce::Meanshape& shape, float pepper, float saturate,
 		    float& counts, float& sigma, float& sky, int& nsky, int& nrej,
-		    Reduce::ERROR_CODES& ecode, int& worst);
+		    Reduce::ERROR_CODES& ecode, int& worst, int nsubdiv=0, float annulus_tol=-1.f);
+
+  //! Extracts flux in an aperture for several star radii at once
+  void extract_flux(const Image& data, const Image& dvar, const Image& bad,
+		    const Image& gain, const Image& bias, const Aperture& aperture, const std::vector<float>& rstar,
+		    Reduce::SKY_METHOD sky_method, float sky_clip, Reduce::SKY_ERROR sky_error, Reduce::EXTRACTION_METHOD extraction_method,
+		    const std::vector<std::pair<int,int> >& zapped, const Reduce::Meanshape& shape, float pepper, float saturate,
+		    std::vector<float>& counts, std::vector<float>& sigma, float& sky, int& nsky, int& nrej,
+		    std::vector<Reduce::ERROR_CODES>& ecode, std::vector<int>& worst, int nsubdiv=0, float annulus_tol=-1.f);
 
   //! Light curve plotter for reduce
   void light_plot(const Subs::Plot& lcurve_plot, const std::vector<std::vector<Reduce::Point> >& all_ccds, 
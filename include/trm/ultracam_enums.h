@@ -8,6 +8,7 @@
 namespace Reduce {
 
     class Meanshape;
+    struct Rejig_state;
     class Point;
     class Moffset;
         
@@ -21,7 +22,9 @@ namespace Reduce {
     enum SKY_METHOD {
 	CLIPPED_MEAN,  /**< Mean after rejection of outliers */
 	MEDIAN,        /**< Median (suffers from digitisation) */
-	MODE           /**< Mode -- not implemented yet */
+	MODE,          /**< Mode -- not implemented yet */
+	HISTOGRAM_MEAN,   /**< Clipped mean computed from a histogram of the sky pixels */
+	HISTOGRAM_MEDIAN  /**< Median computed from a histogram of the sky pixels */
     };
     
     //! Method for estimating errors in sky
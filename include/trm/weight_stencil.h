@@ -0,0 +1,90 @@
+#ifndef TRM_ULTRACAM_WEIGHT_STENCIL_H
+#define TRM_ULTRACAM_WEIGHT_STENCIL_H
+
+#include <vector>
+#include "trm/reduce.h"
+
+namespace Ultracam {
+
+  //! Precomputed extraction weights of a star aperture
+
+  /** extract_flux assigns each pixel near a star aperture a weight between 0 and 1, with
+   * a linear taper at the edge of the aperture and, for optimal extraction, a Gaussian or
+   * Moffat profile, at the cost of a square root and perhaps an exp or pow per pixel. The
+   * weights only depend upon the position of the aperture relative to the pixel grid, the
+   * aperture radius, the binning factors and the profile. A Weight_stencil holds the
+   * weights for a given set of these, rounded so that apertures which repeat them from frame
+   * to frame can re-use the weights even when the radius and profile are re-measured every
+   * frame. With nsubdiv subdivisions per binned pixel:
+   *
+   * \li the position is rounded to 1/nsubdiv of a binned pixel in X and Y. This is equivalent
+   * to moving the aperture by at most half of 1/nsubdiv of a binned pixel in X and Y, which
+   * changes the tapered weights at the aperture edge by at most about 1/nsubdiv.
+   * \li the radius is rounded to 1/nsubdiv of the smaller binning factor, which changes the
+   * tapered weights at the aperture edge by at most 1/(2 nsubdiv).
+   * \li for optimal extraction, the profile coefficients a and c and the Moffat exponent beta
+   * are rounded in their logarithms to 1/nsubdiv, and b to 1/nsubdiv of sqrt(a c). Each of
+   * these changes the profile weights by at most about 1/(2 e nsubdiv), and all of them
+   * together by at most about 1/(2 nsubdiv).
+   *
+   * The changes add, so that the weights can differ from the exact ones by up to about
+   * 1.5/nsubdiv in all.
+   *
+   * Stencils are obtained through Weight_stencil::get, which keeps a cache of recently used
+   * stencils for each thread with a hashed look-up.
+   */
+  class Weight_stencil {
+
+  public:
+
+    //! Returns the stencils for several radii of an aperture, computing those not in the cache
+    static bool get(int qx, int qy, int nsubdiv, int nrad, const float* rstar, int xbin, int ybin,
+                    Reduce::EXTRACTION_METHOD extraction_method, const Reduce::Meanshape& shape,
+                    const Weight_stencil** stencil);
+
+    //! Half-width of the stencil in X, binned pixels
+    int hx() const {return hx_;}
+
+    //! Half-width of the stencil in Y, binned pixels
+    int hy() const {return hy_;}
+
+    //! Weight of the pixel offset by kx, ky from the centre pixel, |kx| <= hx, |ky| <= hy
+    float weight(int kx, int ky) const {return wgt[(ky+hy_)*(2*hx_+1)+kx+hx_];}
+
+    //! Is the pixel offset by kx, ky within the outer edge of the taper?
+    bool inside(int kx, int ky) const {return in[(ky+hy_)*(2*hx_+1)+kx+hx_];}
+
+    //! The rounded parameters which define a stencil
+    struct Key {
+      int qx, qy, nsubdiv, xbin, ybin, method, qrad, fit, symm, weights, qa, qb, qc, qbeta;
+      bool operator==(const Key& key) const;
+      size_t hash() const;
+    };
+
+    //! The parameters of the stencil
+    const Key& key() const {return key_;}
+
+  private:
+
+    // Computes the stencil
+    Weight_stencil(const Key& key);
+
+    // Rounds the parameters of an aperture to make a key, returning false if they cannot be
+    static bool make_key(int qx, int qy, int nsubdiv, float rstar, int xbin, int ybin,
+                         Reduce::EXTRACTION_METHOD extraction_method, const Reduce::Meanshape& shape, Key& key);
+
+    // the parameters
+    Key key_;
+
+    // half-widths
+    int hx_, hy_;
+
+    // weights and flags, row by row
+    std::vector<float> wgt;
+    std::vector<char>  in;
+
+  };
+
+};
+
+#endif
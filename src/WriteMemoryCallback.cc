@@ -14,14 +14,16 @@ extern "C" {
     register size_t realsize = size * nmemb;
     MemoryStruct *mem = (MemoryStruct *) stream;
 
-    // Only reallocate when necessary
-    if(mem->posn + realsize > mem->size)
-      mem->memory = (char *)realloc(mem->memory, mem->size + realsize);
+    // Only reallocate when necessary. 'size' tracks the allocated size so
+    // that the buffer can be re-used from one frame to the next.
+    if(mem->posn + realsize > mem->size){
+      mem->memory = (char *)realloc(mem->memory, mem->posn + realsize);
+      if(mem->memory) mem->size = mem->posn + realsize;
+    }
 
     // Copy data starting at posn
     if(mem->memory) {
       memcpy(&(mem->memory[mem->posn]), ptr, realsize);
-      mem->size += realsize;
       mem->posn += realsize;
     }
     return realsize;
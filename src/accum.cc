@@ -0,0 +1,163 @@
+/*
+
+!!begin
+
+!!title   accum, builds up calibration frames incrementally
+!!author  agent
+!!created 16 Oct 2026
+!!descr   adds frames to running per-pixel statistics for making master calibration frames
+!!css     style.css
+!!root    accum
+!!index   accum
+!!class   Programs
+!!class   Arithematic
+!!head1   accum - builds up calibration frames incrementally
+
+!!emph{accum} maintains an accumulator file (extension .uca) containing the number of frames,
+the sum and the sum of squares at each pixel, and optionally a reservoir of values per pixel for
+estimating medians. Each time it is run, it adds a list of frames to the accumulator and then,
+optionally, writes out the mean, median or RMS frame. This allows master bias and flat frames to
+be built up as frames arrive, e.g. from !!ref{grab.html}{grab}, without re-reading all previous
+frames each time as !!ref{combine.html}{combine} would require.
+
+The mean is exact. The median is estimated from a reservoir of values per pixel, selected at
+random so that each frame has an equal chance of being included. It is the exact median as long
+as no more frames have been added than the reservoir size. A reservoir of size 101 gives the median
+to an accuracy of about 1/10 of the RMS per pixel. Reservoirs take 4 bytes per pixel per value
+and can make for large accumulator files. As with !!ref{combine.html}{combine}, CCD 3 of frames
+with bad blue data is ignored. Unlike !!ref{combine.html}{combine}, there is no clipped mean and no
+adjustment of mean levels.
+
+!!head2 Invocation
+
+accum accum list (reservoir) method output
+
+!!head2 Arguments
+
+!!table
+!!arg{accum}{Accumulator file. If it does not exist, it will be created with the format and header
+of the first frame of the list.}
+!!arg{list}{List of frames to add, or 'none' to add nothing.}
+!!arg{reservoir}{Number of values to store per pixel for estimating medians, 0 for none. Only needed if the
+accumulator is created.}
+!!arg{method}{What to output after adding the frames: 'a' = mean, 'm' = median, 'r' = RMS, 'n' = nothing.}
+!!arg{output}{Output frame, if method is not 'n'.}
+!!table
+
+!!end
+
+*/
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fstream>
+#include "trm/subs.h"
+#include "trm/input.h"
+#include "trm/frame.h"
+#include "trm/ultracam.h"
+#include "trm/accumulator.h"
+
+int main(int argc, char* argv[]){
+
+  using Ultracam::Ultracam_Error;
+
+  try{
+
+    // Construct Input object
+    Subs::Input input(argc, argv, Ultracam::ULTRACAM_ENV, Ultracam::ULTRACAM_DIR);
+
+    // sign-in input variables
+    input.sign_in("accum",     Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("list",      Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("reservoir", Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("method",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("output",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
+
+    // Get inputs
+    std::string accum;
+    input.get_value("accum", accum, "accum", "accumulator file");
+    accum = Subs::filnam(accum, Ultracam::Accumulator::extnam());
+    std::ifstream ftest(accum.c_str());
+    bool exists = ftest.good();
+    ftest.close();
+
+    std::string stlist;
+    input.get_value("list", stlist, "list", "list of frames to add ('none' for none)");
+
+    int nreservoir = 0;
+    if(!exists)
+      input.get_value("reservoir", nreservoir, 0, 0, 100000, "number of values to keep per pixel for medians");
+
+    char method;
+    input.get_value("method", method, 'a', "aAmMrRnN", "a(verage), m(edian), r(ms) or n(othing)");
+    method = toupper(method);
+    std::string output;
+    if(method != 'N')
+      input.get_value("output", output, "output", "output file");
+
+    // Read file list
+    std::vector<std::string> flist;
+    if(Subs::toupper(stlist) != "NONE"){
+      std::string name;
+      std::ifstream istr(stlist.c_str());
+      if(!istr)
+        throw Ultracam::Input_Error("Failed to open list = " + stlist);
+      while(istr >> name)
+        flist.push_back(name);
+      istr.close();
+    }
+
+    // Load or create the accumulator
+    Ultracam::Accumulator acc;
+    Ultracam::Frame frame;
+    size_t nf = 0;
+    if(exists){
+      acc.read(accum);
+    }else if(flist.size()){
+      frame.read(flist[nf++]);
+      acc = Ultracam::Accumulator(frame, nreservoir);
+      acc.add(frame);
+    }else{
+      throw Ultracam::Input_Error("Accumulator = " + accum + " does not exist and there are no frames to create it from");
+    }
+
+    if(method == 'M' && acc.nreservoir() == 0)
+      throw Ultracam::Input_Error("Accumulator = " + accum + " has no reservoir for computing medians");
+
+    for(; nf<flist.size(); nf++){
+      frame.read(flist[nf]);
+      acc.add(frame);
+    }
+    std::cout << flist.size() << " frames added to " << accum << std::endl;
+
+    if(flist.size())
+      acc.write(accum);
+
+    // Output
+    if(method != 'N'){
+      if(method == 'A')
+        acc.mean(frame);
+      else if(method == 'M')
+        acc.median(frame);
+      else if(method == 'R')
+        acc.rms(frame);
+      frame.write(output);
+    }
+  }
+
+  catch(const Ultracam_Error& err){
+    std::cerr << "\nUltracam::Ultracam_Error exception:" << std::endl;
+    std::cerr << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  catch(const Subs::Subs_Error& err){
+    std::cerr << "\nSubs::Subs_Error exception:" << std::endl;
+    std::cerr << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  catch(const std::string& err){
+    std::cerr << "\n" << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
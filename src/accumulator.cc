@@ -0,0 +1,257 @@
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include "trm/subs.h"
+#include "trm/header.h"
+#include "trm/frame.h"
+#include "trm/ultracam.h"
+#include "trm/accumulator.h"
+
+namespace {
+
+  // xorshift random number generator used to select reservoir values
+  inline Subs::UINT4 next_random(Subs::UINT4& seed){
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+  }
+
+  // Total number of pixels of a frame
+  size_t npixel(const Ultracam::Frame& frame){
+    size_t ntot = 0;
+    for(size_t nc=0; nc<frame.size(); nc++)
+      for(size_t nw=0; nw<frame[nc].size(); nw++)
+        ntot += frame[nc][nw].ntot();
+    return ntot;
+  }
+
+}
+
+/** Constructs an empty Accumulator with the format and header of a frame
+ * \param frame the frame providing the format. Its data are not added.
+ * \param nreservoir number of values to keep per pixel for estimating medians. 0 for none.
+ */
+Ultracam::Accumulator::Accumulator(const Frame& frame, int nreservoir) :
+  count_(frame), sum_(npixel(frame), 0.), sumsq_(npixel(frame), 0.), nreservoir_(nreservoir),
+  reservoir_(size_t(nreservoir)*npixel(frame)), seed_(SEED) {
+
+  if(nreservoir < 0)
+    throw Ultracam_Error("Ultracam::Accumulator::Accumulator(const Frame&, int): nreservoir = " +
+                         Subs::str(nreservoir) + " must be >= 0");
+  count_ = 0;
+}
+
+/** Constructs an Accumulator from a file written by Accumulator::write
+ * \param file the file name. The standard extension will be added if need be.
+ */
+Ultracam::Accumulator::Accumulator(const std::string& file) :
+  count_(), sum_(), sumsq_(), nreservoir_(0), reservoir_(), seed_(SEED) {
+  read(file);
+}
+
+/** Adds a frame to the statistics of each pixel. CCD 3 is skipped if the frame
+ * has the header item "Frame.bad_blue" set.
+ * \param frame the frame to add, which must have the same format as the Accumulator
+ */
+void Ultracam::Accumulator::add(const Frame& frame){
+
+  if(frame != count_)
+    throw Ultracam_Error("Ultracam::Accumulator::add(const Frame&): frame format does not match the accumulator");
+
+  Subs::Header::Hnode *hnode = frame.find("Frame.bad_blue");
+  bool bad_blue = hnode->has_data() ? hnode->value->get_bool() : false;
+
+  size_t np = 0;
+  for(size_t nc=0; nc<frame.size(); nc++){
+    for(size_t nw=0; nw<frame[nc].size(); nw++){
+      const Windata& dwin = frame[nc][nw];
+      Windata& cwin = count_[nc][nw];
+
+      if(nc == 2 && bad_blue){
+        np += dwin.ntot();
+        continue;
+      }
+
+      for(int iy=0; iy<dwin.ny(); iy++){
+        const internal_data* dptr = dwin.row(iy);
+        internal_data* cptr = cwin.row(iy);
+        for(int ix=0; ix<dwin.nx(); ix++, np++){
+          double value = dptr[ix];
+          sum_[np]   += value;
+          sumsq_[np] += value*value;
+          size_t nadd = size_t(cptr[ix]);
+          cptr[ix]    = internal_data(nadd+1);
+
+          // Reservoir sampling: fill up, then replace a random entry with probability nreservoir/(nadd+1)
+          if(nreservoir_){
+            float* res = &reservoir_[nreservoir_*np];
+            if(nadd < size_t(nreservoir_)){
+              res[nadd] = dptr[ix];
+            }else{
+              size_t j = next_random(seed_) % (nadd+1);
+              if(j < size_t(nreservoir_)) res[j] = dptr[ix];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/** Computes the mean of each pixel. Pixels to which no frames have been added are set to 0.
+ * \param out the mean, returned with the format and header of the Accumulator
+ */
+void Ultracam::Accumulator::mean(Frame& out) const {
+  out = count_;
+  size_t np = 0;
+  for(size_t nc=0; nc<out.size(); nc++){
+    for(size_t nw=0; nw<out[nc].size(); nw++){
+      Windata& owin = out[nc][nw];
+      for(int iy=0; iy<owin.ny(); iy++){
+        internal_data* optr = owin.row(iy);
+        for(int ix=0; ix<owin.nx(); ix++, np++)
+          optr[ix] = optr[ix] > 0 ? sum_[np]/optr[ix] : 0.;
+      }
+    }
+  }
+}
+
+/** Computes the RMS of each pixel about its mean. Pixels to which fewer than two frames
+ * have been added are set to 0.
+ * \param out the RMS, returned with the format and header of the Accumulator
+ */
+void Ultracam::Accumulator::rms(Frame& out) const {
+  out = count_;
+  size_t np = 0;
+  for(size_t nc=0; nc<out.size(); nc++){
+    for(size_t nw=0; nw<out[nc].size(); nw++){
+      Windata& owin = out[nc][nw];
+      for(int iy=0; iy<owin.ny(); iy++){
+        internal_data* optr = owin.row(iy);
+        for(int ix=0; ix<owin.nx(); ix++, np++){
+          double n = optr[ix];
+          if(n > 1.){
+            double mean = sum_[np]/n;
+            optr[ix] = sqrt(std::max(0., (sumsq_[np] - n*mean*mean)/(n-1.)));
+          }else{
+            optr[ix] = 0.;
+          }
+        }
+      }
+    }
+  }
+}
+
+/** Estimates the median of each pixel from the values in its reservoir, taking the average
+ * of the two middle values for even numbers. This is the exact median while no more frames
+ * have been added than the reservoir size. Pixels to which no frames have been added are set to 0.
+ * \param out the median, returned with the format and header of the Accumulator
+ */
+void Ultracam::Accumulator::median(Frame& out) const {
+
+  if(nreservoir_ == 0)
+    throw Ultracam_Error("Ultracam::Accumulator::median(Frame&): no reservoir for computing medians");
+
+  out = count_;
+  std::vector<float> buff(nreservoir_);
+  size_t np = 0;
+  for(size_t nc=0; nc<out.size(); nc++){
+    for(size_t nw=0; nw<out[nc].size(); nw++){
+      Windata& owin = out[nc][nw];
+      for(int iy=0; iy<owin.ny(); iy++){
+        internal_data* optr = owin.row(iy);
+        for(int ix=0; ix<owin.nx(); ix++, np++){
+          size_t nok = std::min(size_t(optr[ix]), size_t(nreservoir_));
+          if(nok){
+            std::copy(&reservoir_[nreservoir_*np], &reservoir_[nreservoir_*np] + nok, buff.begin());
+            std::nth_element(buff.begin(), buff.begin()+nok/2, buff.begin()+nok);
+            if(nok % 2 == 0)
+              optr[ix] = (*std::max_element(buff.begin(), buff.begin()+nok/2) + buff[nok/2])/2.;
+            else
+              optr[ix] = buff[nok/2];
+          }else{
+            optr[ix] = 0.;
+          }
+        }
+      }
+    }
+  }
+}
+
+/** Reads an Accumulator from a file written by Accumulator::write. Only files written
+ * on machines of the same byte order can be read.
+ * \param file the file name. The standard extension will be added if need be.
+ */
+void Ultracam::Accumulator::read(const std::string& file){
+
+  std::string name = Subs::filnam(file, extnam());
+  std::ifstream fin(name.c_str(), std::ios::binary);
+  if(!fin)
+    throw File_Open_Error("Ultracam::Accumulator::read(const std::string&): failed to open \"" + name + "\"");
+
+  Subs::INT4 magic, version;
+  if(!fin.read((char*)&magic, sizeof(Subs::INT4)) || !fin.read((char*)&version, sizeof(Subs::INT4)))
+    throw Read_Error("Ultracam::Accumulator::read(const std::string&): failed to read start of \"" + name + "\"");
+
+  if(magic != AMAGIC){
+    if(Subs::byte_swap(magic) == AMAGIC)
+      throw Read_Error("Ultracam::Accumulator::read(const std::string&): \"" + name +
+                       "\" was written on a machine of different byte order");
+    throw Read_Error("Ultracam::Accumulator::read(const std::string&): \"" + name + "\" is not an accumulator file");
+  }
+  if(version != VERSION)
+    throw Read_Error("Ultracam::Accumulator::read(const std::string&): \"" + name + "\" has unrecognised version = " +
+                     Subs::str(version));
+
+  // Header and counts
+  count_.Subs::Header::read(fin, false);
+  count_.Mimage::read(fin, false, 0);
+  size_t ntot = npixel(count_);
+
+  // Sums, reservoir
+  Subs::INT4 nres;
+  sum_.resize(ntot);
+  sumsq_.resize(ntot);
+  fin.read((char*)&sum_[0], sizeof(double)*ntot);
+  fin.read((char*)&sumsq_[0], sizeof(double)*ntot);
+  fin.read((char*)&nres, sizeof(Subs::INT4));
+  fin.read((char*)&seed_, sizeof(Subs::UINT4));
+  if(!fin)
+    throw Read_Error("Ultracam::Accumulator::read(const std::string&): failed to read sums from \"" + name + "\"");
+
+  nreservoir_ = nres;
+  reservoir_.resize(size_t(nreservoir_)*ntot);
+  if(nreservoir_ && !fin.read((char*)&reservoir_[0], sizeof(float)*reservoir_.size()))
+    throw Read_Error("Ultracam::Accumulator::read(const std::string&): failed to read reservoir from \"" + name + "\"");
+}
+
+/** Writes an Accumulator to a file, over-writing any that already exists.
+ * \param file the file name. The standard extension will be added if need be.
+ */
+void Ultracam::Accumulator::write(const std::string& file) const {
+
+  std::string name = Subs::filnam(file, extnam());
+  std::ofstream fout(name.c_str(), std::ios::binary);
+  if(!fout)
+    throw File_Open_Error("Ultracam::Accumulator::write(const std::string&): failed to open \"" + name + "\"");
+
+  Subs::INT4 magic = AMAGIC, version = VERSION, nres = nreservoir_;
+  fout.write((char*)&magic, sizeof(Subs::INT4));
+  fout.write((char*)&version, sizeof(Subs::INT4));
+
+  count_.Subs::Header::write(fout);
+  count_.Mimage::write(fout);
+
+  fout.write((char*)&sum_[0], sizeof(double)*sum_.size());
+  fout.write((char*)&sumsq_[0], sizeof(double)*sumsq_.size());
+  fout.write((char*)&nres, sizeof(Subs::INT4));
+  fout.write((char*)&seed_, sizeof(Subs::UINT4));
+  if(nreservoir_)
+    fout.write((char*)&reservoir_[0], sizeof(float)*reservoir_.size());
+
+  if(!fout)
+    throw Ultracam_Error("Ultracam::Accumulator::write(const std::string&): failed to write \"" + name + "\"");
+}
@@ -0,0 +1,288 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "trm/subs.h"
+#include "trm/frame.h"
+#include "trm/aperture.h"
+#include "trm/ultracam.h"
+#include "trm/parallel.h"
+#include "trm/calibrate.h"
+
+namespace {
+
+  // Replaces every pixel of a frame by its reciprocal
+  void reciprocal(Ultracam::Frame& frame){
+    for(size_t nccd=0; nccd<frame.size(); nccd++){
+      for(size_t nwin=0; nwin<frame[nccd].size(); nwin++){
+        Ultracam::Windata& win = frame[nccd][nwin];
+        for(int iy=0; iy<win.ny(); iy++){
+          Ultracam::internal_data* row = win.row(iy);
+          for(int ix=0; ix<win.nx(); ix++)
+            row[ix] = 1./row[ix];
+        }
+      }
+    }
+  }
+
+  // Arguments passed to ccd_task
+  struct Calibrate_args {
+    const Ultracam::Calibrator* calibrator;
+    Ultracam::Frame* data;
+    Ultracam::Frame* dvar;
+    const std::vector<float>* dark_scale;
+  };
+
+  // Task for run_parallel: calibrates all windows of CCD n
+  void ccd_task(int n, void* arg){
+    const Calibrate_args& args = *static_cast<Calibrate_args*>(arg);
+    Ultracam::Frame& data = *args.data;
+    for(size_t nwin=0; nwin<data[n].size(); nwin++)
+      args.calibrator->apply(data, *args.dvar, *args.dark_scale, n, nwin, 0, 0, data[n][nwin].nx(), data[n][nwin].ny());
+  }
+
+  // Arguments passed to box_task
+  struct Box_args {
+    const Ultracam::Calibrator* calibrator;
+    Ultracam::Frame* data;
+    Ultracam::Frame* dvar;
+    const std::vector<float>* dark_scale;
+    const std::vector<std::vector<Ultracam::Pixel_box> >* boxes;
+  };
+
+  // Compares X ranges by their start
+  bool xstart_less(const std::pair<int,int>& r1, const std::pair<int,int>& r2){
+    return r1.first < r2.first;
+  }
+
+  // Task for run_parallel: calibrates the boxes of CCD n. Each row of each window is calibrated
+  // over the union of the X ranges of the boxes covering it, so pixels in overlapping boxes are only
+  // calibrated once.
+  void box_task(int n, void* arg){
+
+    const Box_args& args = *static_cast<Box_args*>(arg);
+    Ultracam::Frame& data = *args.data;
+    const std::vector<Ultracam::Pixel_box>& boxes = (*args.boxes)[n];
+    std::vector<std::pair<int,int> > xrange;
+
+    for(size_t nwin=0; nwin<data[n].size(); nwin++){
+
+      // Range of rows covered
+      int iylo = data[n][nwin].ny(), iyhi = 0;
+      for(size_t i=0; i<boxes.size(); i++){
+        if(boxes[i].nwin == int(nwin)){
+          iylo = std::min(iylo, boxes[i].iylo);
+          iyhi = std::max(iyhi, boxes[i].iyhi);
+        }
+      }
+
+      for(int iy=iylo; iy<iyhi; iy++){
+
+        xrange.clear();
+        for(size_t i=0; i<boxes.size(); i++)
+          if(boxes[i].nwin == int(nwin) && iy >= boxes[i].iylo && iy < boxes[i].iyhi)
+            xrange.push_back(std::make_pair(boxes[i].ixlo, boxes[i].ixhi));
+        std::sort(xrange.begin(), xrange.end(), xstart_less);
+
+        size_t i = 0;
+        while(i < xrange.size()){
+          int ixlo = xrange[i].first, ixhi = xrange[i].second;
+          for(i++; i<xrange.size() && xrange[i].first <= ixhi; i++)
+            ixhi = std::max(ixhi, xrange[i].second);
+          args.calibrator->apply(data, *args.dvar, *args.dark_scale, n, nwin, ixlo, iy, ixhi, iy+1);
+        }
+      }
+    }
+  }
+
+}
+
+//! Default constructor
+Ultracam::Calibrator::Calibrator() : bias(NULL), dark(NULL), readout(NULL), rgain(), rflat(), flat(false) {}
+
+/** Defines the calibration frames and pre-computes the reciprocals of the gain and flat field.
+ * This should be called once the calibration frames have been cropped to match the data. All frames
+ * must have the format of the data.
+ * \param bias    the bias frame, NULL for no bias subtraction
+ * \param dark    the dark frame, NULL for no dark subtraction
+ * \param flat    the flat field, NULL for no flat fielding
+ * \param gain    the gain frame, electrons/count
+ * \param readout the readout noise frame, as a variance (counts**2)
+ */
+void Ultracam::Calibrator::set(const Frame* bias, const Frame* dark, const Frame* flat, const Frame& gain, const Frame& readout){
+
+  this->bias    = bias;
+  this->dark    = dark;
+  this->readout = &readout;
+
+  rgain = gain;
+  reciprocal(rgain);
+
+  this->flat = (flat != NULL);
+  if(this->flat){
+    rflat = *flat;
+    reciprocal(rflat);
+  }else{
+    rflat = Frame();
+  }
+}
+
+/** Calibrates a frame and computes its variance frame as described in the class documentation.
+ * \param data the frame to calibrate. It must have the same format as the calibration frames.
+ * \param dvar returned as the variance frame. It is re-formatted if need be.
+ * \param dark_scale factor to scale the dark frame by for each CCD. Not used if there is no dark frame.
+ * \param nthreads number of threads to use. With more than one, the CCDs are calibrated in parallel.
+ */
+void Ultracam::Calibrator::apply(Frame& data, Frame& dvar, const std::vector<float>& dark_scale, int nthreads) const {
+
+  if(readout == NULL)
+    throw Ultracam_Error("Ultracam::Calibrator::apply: calibration frames have not been defined");
+
+  if(dvar != data) dvar.format(data);
+
+  Calibrate_args args;
+  args.calibrator = this;
+  args.data       = &data;
+  args.dvar       = &dvar;
+  args.dark_scale = &dark_scale;
+  run_parallel(ccd_task, &args, data.size(), nthreads);
+}
+
+/** Calibrates a set of regions of a frame and computes their variance. Pixels outside the
+ * regions are left untouched in both data and dvar. The regions may overlap; each pixel is
+ * calibrated once only.
+ * \param data the frame to calibrate. It must have the same format as the calibration frames.
+ * \param dvar returned as the variance frame. It is re-formatted if need be.
+ * \param dark_scale factor to scale the dark frame by for each CCD. Not used if there is no dark frame.
+ * \param boxes the regions to calibrate for each CCD, e.g. as computed by aperture_boxes.
+ * \param nthreads number of threads to use. With more than one, the CCDs are calibrated in parallel.
+ */
+void Ultracam::Calibrator::apply(Frame& data, Frame& dvar, const std::vector<float>& dark_scale,
+                                 const std::vector<std::vector<Pixel_box> >& boxes, int nthreads) const {
+
+  if(readout == NULL)
+    throw Ultracam_Error("Ultracam::Calibrator::apply: calibration frames have not been defined");
+
+  if(boxes.size() != data.size())
+    throw Ultracam_Error("Ultracam::Calibrator::apply: number of CCDs in boxes = " + Subs::str(boxes.size()) +
+                         " does not match the data = " + Subs::str(data.size()));
+
+  if(dvar != data) dvar.format(data);
+
+  Box_args args;
+  args.calibrator = this;
+  args.data       = &data;
+  args.dvar       = &dvar;
+  args.dark_scale = &dark_scale;
+  args.boxes      = &boxes;
+  run_parallel(box_task, &args, data.size(), nthreads);
+}
+
+/** Calibrates a rectangular region of one window and computes its variance. Pixels outside the region
+ * are left untouched. This is the kernel which does all the work; each row of the region is swept
+ * once with all calibration frames read alongside.
+ * \param data the frame to calibrate
+ * \param dvar the variance frame, which must already have the format of data
+ * \param dark_scale factor to scale the dark frame by for each CCD. Not used if there is no dark frame.
+ * \param nccd the CCD
+ * \param nwin the window
+ * \param ixlo the first X pixel of the region
+ * \param iylo the first Y pixel of the region
+ * \param ixhi one more than the last X pixel of the region
+ * \param iyhi one more than the last Y pixel of the region
+ */
+void Ultracam::Calibrator::apply(Frame& data, Frame& dvar, const std::vector<float>& dark_scale, int nccd, int nwin,
+                                 int ixlo, int iylo, int ixhi, int iyhi) const {
+
+  Windata& dwin = data[nccd][nwin];
+  Windata& vwin = dvar[nccd][nwin];
+  const Windata& gwin = rgain[nccd][nwin];
+  const Windata& rwin = (*readout)[nccd][nwin];
+  const Windata* bwin = bias ? &(*bias)[nccd][nwin] : NULL;
+  const Windata* kwin = dark ? &(*dark)[nccd][nwin] : NULL;
+  const Windata* fwin = flat ? &rflat[nccd][nwin] : NULL;
+  const float scale   = dark ? dark_scale[nccd] : 0.f;
+
+  for(int iy=iylo; iy<iyhi; iy++){
+
+    internal_data* dptr = dwin.row(iy);
+    internal_data* vptr = vwin.row(iy);
+    const internal_data* gptr = gwin.row(iy);
+    const internal_data* rptr = rwin.row(iy);
+    const internal_data* bptr = bwin ? bwin->row(iy) : NULL;
+    const internal_data* kptr = kwin ? kwin->row(iy) : NULL;
+    const internal_data* fptr = fwin ? fwin->row(iy) : NULL;
+
+    for(int ix=ixlo; ix<ixhi; ix++){
+
+      internal_data d = dptr[ix];
+
+      // bias subtraction
+      if(bptr) d -= bptr[ix];
+
+      // variance defined after bias subtraction but before dark subtraction
+      internal_data v = (d > 0 ? d : 0)*gptr[ix] + rptr[ix];
+
+      // dark subtraction
+      if(kptr) d -= scale*kptr[ix];
+
+      // flat field
+      if(fptr){
+        const internal_data f = fptr[ix];
+        d *= f;
+        v *= f*f;
+      }
+
+      dptr[ix] = d;
+      vptr[ix] = v;
+    }
+  }
+}
+
+/** Computes boxes of pixels which enclose circles centred on a set of apertures. For each aperture
+ * the box covers both its reference position and its actual position (they differ for offset apertures) and
+ * any extra star positions. Every window of the CCD that overlaps the circle gets a box.
+ * \param data     frame defining the format of the windows
+ * \param aperture the apertures
+ * \param radius   radius of circle around each aperture for each CCD, unbinned pixels.
+ * \param boxes    returned with the boxes for each CCD
+ */
+void Ultracam::aperture_boxes(const Frame& data, const Maperture& aperture, const std::vector<float>& radius,
+                              std::vector<std::vector<Pixel_box> >& boxes){
+
+  if(aperture.size() != data.size() || radius.size() != data.size())
+    throw Ultracam_Error("Ultracam::aperture_boxes: numbers of CCDs in data, apertures and radii do not match");
+
+  boxes.resize(data.size());
+  for(size_t nccd=0; nccd<data.size(); nccd++){
+    boxes[nccd].clear();
+    for(size_t naper=0; naper<aperture[nccd].size(); naper++){
+
+      const Aperture& app = aperture[nccd][naper];
+
+      // Region in CCD coordinates
+      double x1 = std::min(app.xref(), app.xpos()), x2 = std::max(app.xref(), app.xpos());
+      double y1 = std::min(app.yref(), app.ypos()), y2 = std::max(app.yref(), app.ypos());
+      for(int i=0; i<app.nextra(); i++){
+        x1 = std::min(x1, app.xpos() + app.extra(i).x);
+        x2 = std::max(x2, app.xpos() + app.extra(i).x);
+        y1 = std::min(y1, app.ypos() + app.extra(i).y);
+        y2 = std::max(y2, app.ypos() + app.extra(i).y);
+      }
+      x1 -= radius[nccd];
+      x2 += radius[nccd];
+      y1 -= radius[nccd];
+      y2 += radius[nccd];
+
+      // Convert to binned pixels of each window, rounding outwards
+      for(size_t nwin=0; nwin<data[nccd].size(); nwin++){
+        const Windata& dwin = data[nccd][nwin];
+        int ixlo = std::max(0, int(std::floor(dwin.xcomp(x1))));
+        int iylo = std::max(0, int(std::floor(dwin.ycomp(y1))));
+        int ixhi = std::min(dwin.nx(), int(std::ceil(dwin.xcomp(x2)))+1);
+        int iyhi = std::min(dwin.ny(), int(std::ceil(dwin.ycomp(y2)))+1);
+        if(ixlo < ixhi && iylo < iyhi)
+          boxes[nccd].push_back(Pixel_box(nwin, ixlo, iylo, ixhi, iyhi));
+      }
+    }
+  }
+}
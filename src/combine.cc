@@ -23,13 +23,19 @@ for getting mean bias and flat field frames.
 frames in the first place, but then to ctrl-C it and end up with the final file corrupted.
 You need to take care not to include it in the file list you supply to !!emph{combine}.
 
-There is a limit to the number of frames that this routine can handle set by the compiler because all files
-have to be opened simultaneously. This is of order 1000 to 4000 files depending on the system. The program will
-collapse if you exceed this limit.
+Normally all files are opened simultaneously, which is limited by the system to of order 1000 to 4000 files.
+If there are more files than the hidden parameter maxopen, combine instead works through the frames one block
+of rows at a time, opening the files in groups of at most maxopen for each block and seeking to its start. This
+reads each file once but opens it, parses its header and seeks within it once per block, so that the number of
+file openings is the number of files times the number of blocks, which is reported before the combination starts.
+The block size, set by the hidden parameter memory, should therefore be as large as possible; its default is
+raised from 32 to 512 MB in this case. For example, 2000 files with a 1024 by 1024 window are read 4 rows at a time,
+in 256 blocks and half a million openings per window, with 32 MB, but in 16 blocks with 512 MB. The results are
+identical either way.
 
 !!head2 Invocation
 
-combine list method (sigma careful) adjust output
+combine list method (sigma careful) adjust output [nthreads maxopen memory]
 
 !!head2 Arguments
 
@@ -47,6 +53,12 @@ The adjustment is done on an individual CCD basis. 'b' is useful for combining b
 may be an overall drift from frame to frame. 'n' is for combining (bias subtracted) sky flats
 for example where the level varies substantially but the shape is fixed.}
 !!arg{output}{Output frame}
+!!arg{nthreads}{Number of threads to use for the combination, which is carried out on blocks of rows read from
+all of the files at once. The pixels of each block are shared between the threads. Hidden, default 1.}
+!!arg{maxopen}{Maximum number of files to have open at once. Above this number, the files are read in groups
+block by block. Hidden, default 1000.}
+!!arg{memory}{Memory in MB to use for the blocks of pixels read from all of the files, which sets the number of
+rows per block. Hidden, default 32, or 512 if there are more than maxopen files.}
 !!table
 
 !!end
@@ -57,11 +69,86 @@ for example where the level varies substantially but the shape is fixed.}
 #include <cfloat>
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include "trm/subs.h"
 #include "trm/input.h"
 #include "trm/frame.h"
 #include "trm/fdisk.h"
 #include "trm/ultracam.h"
+#include "trm/parallel.h"
+
+namespace {
+
+    // Number of pixels per combination task
+    const int NPIX_TASK = 256;
+
+    // A block of pixels to combine. data holds the values of each pixel from every file
+    // contiguously, i.e. data[nfile*np + nf] is the value of pixel np from file nf.
+    struct Combine_tile {
+    char method;
+    float sigma;
+    bool careful;
+    Ultracam::internal_data* data;
+    size_t nfile;
+    int npix;
+    std::vector<Ultracam::internal_data> comb;
+    std::vector<size_t> nrej;
+    };
+
+    // The Fdisks of combine, deleted on the way out whether or not an exception is thrown
+    class Fdisk_list {
+    public:
+    Fdisk_list(size_t nfile) : file(nfile, static_cast<Ultracam::Fdisk*>(NULL)) {}
+    ~Fdisk_list(){
+        for(size_t i=0; i<file.size(); i++) delete file[i];
+    }
+    Ultracam::Fdisk*& operator[](size_t i){return file[i];}
+    private:
+    Fdisk_list(const Fdisk_list&);
+    Fdisk_list& operator=(const Fdisk_list&);
+    std::vector<Ultracam::Fdisk*> file;
+    };
+
+    // Number of tasks needed for npix pixels
+    int ntask(int npix){
+    return (npix + NPIX_TASK - 1) / NPIX_TASK;
+    }
+
+    // Combines the pixels of task n. The median uses a single partial sort per pixel, the
+    // lower of the two middle values for even numbers following as the largest value in the
+    // lower partition.
+    void combine_task(int n, void* arg){
+    Combine_tile& tile = *static_cast<Combine_tile*>(arg);
+    int np1 = n*NPIX_TASK, np2 = std::min(tile.npix, np1 + NPIX_TASK);
+    size_t nok = tile.nfile;
+
+    for(int np=np1; np<np2; np++){
+        Ultracam::internal_data* cdat = tile.data + nok*np;
+
+        if(tile.method == 'M'){
+
+        std::nth_element(cdat, cdat+nok/2, cdat+nok);
+        if(nok % 2 == 0){
+            Ultracam::internal_data m1 = *std::max_element(cdat, cdat+nok/2);
+            Ultracam::internal_data m2 = cdat[nok/2];
+            tile.comb[np] = (m1+m2)/2.;
+        }else{
+            tile.comb[np] = cdat[nok/2];
+        }
+
+        }else if(tile.method == 'C'){
+
+        double rawmean, rawrms, mean, rms;
+        int nrej;
+        Subs::sigma_reject(cdat,nok,tile.sigma,tile.careful,rawmean,rawrms,mean,rms,nrej);
+        tile.nrej[n] += nrej;
+        tile.comb[np] = mean;
+        }
+    }
+    }
+
+}
 
 int main(int argc, char* argv[]){
 
@@ -83,6 +170,9 @@ int main(int argc, char* argv[]){
     input.sign_in("careful",   Subs::Input::LOCAL,  Subs::Input::PROMPT);
     input.sign_in("adjust",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
     input.sign_in("output",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("nthreads",  Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("maxopen",   Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
+    input.sign_in("memory",    Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
 
     // Get inputs
 
@@ -91,8 +181,8 @@ int main(int argc, char* argv[]){
     char method;
     input.get_value("method", method, 'c', "cCmM", "what combination method?");
     method = toupper(method);
-    float sigma;
-    bool careful;
+    float sigma = 3.f;
+    bool careful = true;
     if(method == 'C'){
         input.get_value("sigma",   sigma, 3.f, 1.f, FLT_MAX, "threshold multiple of RMS to reject");
         input.get_value("careful", careful, true, "reject pixels one at a time?");
@@ -103,6 +193,10 @@ int main(int argc, char* argv[]){
     adjust = toupper(adjust);
     std::string output;
     input.get_value("output", output, "output", "output file");
+    int nthreads;
+    input.get_value("nthreads", nthreads, 1, 1, 256, "number of threads to use");
+    int maxopen;
+    input.get_value("maxopen", maxopen, 1000, 1, 1000000, "maximum number of files to open at once");
 
     // Read file list
 
@@ -119,6 +213,11 @@ int main(int argc, char* argv[]){
     if(nfile == 0)
         throw Ultracam::Input_Error("No file names loaded");
 
+    // Files are re-opened for every block of rows if they cannot all be open at once, so
+    // then the blocks are made larger by default
+    int memory;
+    input.get_value("memory", memory, nfile > size_t(maxopen) ? 512 : 32, 1, 1000000, "memory to use for blocks of pixels (MB)");
+
     // Read first frame in straight off to provide format
     // information and to set up the final output frame.
 
@@ -239,87 +338,119 @@ int main(int argc, char* argv[]){
         for(size_t ia=0; ia<MXDOT; ia++) std::cout << ".";
         std::cout << std::endl;
 
-        // Fdisk
-        Ultracam::Fdisk* file[nfile];
+        // Fdisk. If there are too many files to open at once, they are opened in groups
+        // for each block of rows in turn, skipping to the start of the block each time.
+        Fdisk_list file(nfile);
+        bool banded = (nfile > size_t(maxopen));
+        size_t nopen = banded ? size_t(maxopen) : nfile;
 
         const size_t MXBUFF = 8000000; // total buffer size.
-        const size_t NBUFF  = MXBUFF/nfile; // individual buffer size.
+        const size_t NBUFF  = MXBUFF/nopen; // individual buffer size.
 
         // Create the Fdisks
         for(size_t nf=0; nf<nfile; nf++)
-        file[nf] = new Ultracam::Fdisk(flist[nf],NBUFF);
+        file[nf] = banded ? NULL : new Ultracam::Fdisk(flist[nf],NBUFF);
+
+        // Tile buffer, [pixel][file]
+        const size_t MXTILE = size_t(memory)*1024*1024/sizeof(internal_data);
+        std::vector<internal_data> tile;
+        size_t npos = 0;
+        if(banded){
+        size_t nblock = 0, nopening = 0;
+        for(size_t nc=0; nc<out.size(); nc++){
+            size_t nok = 0;
+            for(size_t nf=0; nf<nfile; nf++)
+            if(nc != 2 || !blue_bad[nf]) nok++;
+            for(size_t nw=0; nw<out[nc].size(); nw++){
+            const Ultracam::Windata& owin = out[nc][nw];
+            int nrow = std::max(1, int(MXTILE/std::max(size_t(1),nok)/owin.nx()));
+            nblock   += (owin.ny() + nrow - 1)/nrow;
+            nopening += nok*((owin.ny() + nrow - 1)/nrow);
+            }
+        }
+        std::cout << "Opening at most " << maxopen << " files at a time, once per block of rows: "
+              << nblock << " blocks, " << nopening << " file openings in all." << std::endl;
+        }
 
-        // Buffer for combining data
-        Ultracam::internal_data comb=0, cdat[nfile];
+        Combine_tile ctile;
+        ctile.method  = method;
+        ctile.sigma   = sigma;
+        ctile.careful = careful;
 
         size_t nrejtot = 0, ntot=0;
-        // Now wind through CCDs and windows
+        // Now wind through CCDs and windows, a block of rows at a time
         for(size_t nc=0; nc<out.size(); nc++){
-        for(size_t nw=0; nw<out[nc].size(); nw++){
-            ntot += out[nc][nw].ntot();
-            for(int ny=0; ny<out[nc][nw].ny(); ny++){
-            for(int nx=0; nx<out[nc][nw].nx(); nx++){
 
-                // Extract data from the files. Note we have to extract bad blue
-                // data even though it is not used
-                size_t nok=0;
+        // Files to use for this CCD. Bad blue data has to be read even though it is not used
+        std::vector<size_t> use;
+        for(size_t nf=0; nf<nfile; nf++)
+            if(nc != 2 || !blue_bad[nf]) use.push_back(nf);
+        size_t nok = use.size();
+
+        for(size_t nw=0; nw<out[nc].size(); nw++){
+            Ultracam::Windata& owin = out[nc][nw];
+            ntot += owin.ntot();
+
+            int nrow = std::max(1, int(MXTILE/std::max(size_t(1),nok)/owin.nx()));
+            for(int ny=0; ny<owin.ny(); ny+=nrow){
+            int npix = owin.nx()*std::min(nrow, owin.ny()-ny);
+            if(tile.size() < npix*nok) tile.resize(npix*nok);
+
+            // Extract data from the files
+            size_t nu = 0;
+            for(size_t nf=0; nf<nfile; nf++){
+                if(banded && nu < nok && use[nu] == nf && nu % nopen == 0){
+                // Open the next group, positioned at the start of the block
+                for(size_t ng=nu; ng<std::min(nok, nu+nopen); ng++){
+                    file[use[ng]] = new Ultracam::Fdisk(flist[use[ng]],std::min(NBUFF,size_t(npix)));
+                    file[use[ng]]->skip(npos);
+                }
+                }
+                if(nu < nok && use[nu] == nf){
+                internal_data* tptr = &tile[nu];
+                file[nf]->get_next(tptr, npix, nok);
                 if(adjust == 'N'){
-                for(size_t nf=0; nf<nfile; nf++)
-                    if(nc != 2 || !blue_bad[nf])
-                    cdat[nok++] = file[nf]->get_next()/mean[nf][nc];
-                    else
-                    file[nf]->get_next();
+                    for(int np=0; np<npix; np++, tptr+=nok)
+                    *tptr /= mean[nf][nc];
                 }else if(adjust == 'B'){
-                for(size_t nf=0; nf<nfile; nf++)
-                    if(nc != 2 || !blue_bad[nf])
-                    cdat[nok++] = file[nf]->get_next() - mean[nf][nc];
-                    else
-                    file[nf]->get_next();
-                }else{
-                for(size_t nf=0; nf<nfile; nf++)
-                    if(nc != 2 || !blue_bad[nf])
-                    cdat[nok++] = file[nf]->get_next();
-                    else
-                    file[nf]->get_next();
+                    for(int np=0; np<npix; np++, tptr+=nok)
+                    *tptr -= mean[nf][nc];
                 }
-
-                // Process the data
-                if(method == 'M'){
-
-                if(nok % 2 == 0){
-                    Ultracam::internal_data m1 = Subs::select(cdat,nok,nok/2-1);
-                    Ultracam::internal_data m2 = Subs::select(cdat,nok,nok/2);
-                    comb = (m1+m2)/2.;
-                }else{
-                    comb = Subs::select(cdat,nok,nok/2);
+                if(banded){
+                    delete file[nf];
+                    file[nf] = NULL;
                 }
-
-                }else if(method == 'C'){
-
-                double rawmean, rawrms, mean, rms;
-                int nrej;
-                Subs::sigma_reject(cdat,nok,sigma,careful,rawmean,rawrms,mean,rms,nrej);
-                nrejtot += nrej;
-                comb = mean;
+                nu++;
+                }else if(!banded){
+                file[nf]->skip(npix);
                 }
-
-                // Store
-                out[nc][nw][ny][nx] = comb;
-
-                // Progress indicator
-                ndtot++;
-                if((ndadd = ((MXDOT*ndtot)/nptot - ndot))){
+            }
+            npos += npix;
+
+            // Process the data
+            ctile.data  = &tile[0];
+            ctile.nfile = nok;
+            ctile.npix  = npix;
+            ctile.comb.resize(npix);
+            ctile.nrej.assign(ntask(npix), 0);
+            Ultracam::run_parallel(combine_task, &ctile, ntask(npix), nthreads);
+            for(size_t nt=0; nt<ctile.nrej.size(); nt++)
+                nrejtot += ctile.nrej[nt];
+
+            // Store
+            for(int np=0; np<npix; np++)
+                owin[ny + np/owin.nx()][np % owin.nx()] = ctile.comb[np];
+
+            // Progress indicator
+            ndtot += npix;
+            if((ndadd = ((MXDOT*ndtot)/nptot - ndot))){
                 for(size_t ia=0; ia<ndadd; ia++) std::cout << "." << std::flush;
                 ndot += ndadd;
-                }
             }
             }
         }
         }
 
-        // clear up
-        for(size_t i=0; i<nfile; i++) delete file[i];
-
         float percent = 100.*nrejtot/float(ntot)/nfile;
         percent = int(100.*percent+0.5)/100.;
         if(method == 'C')
@@ -0,0 +1,172 @@
+/*
+
+!!begin
+
+!!title   dcz, compresses and expands raw data runs
+!!author  agent
+!!created 16 Oct 2026
+!!descr   converts runs between .dat files and losslessly compressed .dcz files
+!!css     style.css
+!!root    dcz
+!!index   dcz
+!!class   Programs
+!!class   IO
+!!head1   dcz - compresses and expands raw data runs
+
+!!emph{dcz} converts the .dat file of a run into a losslessly compressed .dcz file, or back again.
+Each frame is compressed separately and the .dcz file carries an index of the frames, so any program
+which reads a local run (source = 'L') can use the .dcz file directly, without expanding it, when the
+.dat file is not present. The .xml file of the run is needed in either case and is left untouched.
+
+The timing bytes of each frame are stored as they are. The pixels are stored as differences from the
+previous pixel of the same readout, Rice coded in small groups as in the compression of FITS tiles. This
+works best on frames dominated by the bias level and readout noise.
+
+!!emph{dcz} does not delete the input file; you should do so yourself once you are happy with the output.
+The .dcz format is specific to the byte order of the machine that wrote it.
+
+!!head2 Invocation
+
+dcz run compress (check)
+
+!!head2 Arguments
+
+!!table
+!!arg{run}{The run, e.g. 'run012', without the .xml, .dat or .dcz extension.}
+!!arg{compress}{true to compress run.dat into run.dcz, false to expand run.dcz into run.dat. Any existing
+output file is over-written.}
+!!arg{check}{true to check a compressed file by reading every frame back and comparing it with the original.
+This takes about as long again as the compression.}
+!!table
+
+!!end
+
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <fstream>
+#include "trm/subs.h"
+#include "trm/input.h"
+#include "trm/header.h"
+#include "trm/ultracam.h"
+#include "trm/raw_archive.h"
+
+int main(int argc, char* argv[]){
+
+  using Ultracam::Ultracam_Error;
+
+  try{
+
+    // Construct Input object
+    Subs::Input input(argc, argv, Ultracam::ULTRACAM_ENV, Ultracam::ULTRACAM_DIR);
+
+    // sign-in input variables
+    input.sign_in("run",      Subs::Input::LOCAL, Subs::Input::PROMPT);
+    input.sign_in("compress", Subs::Input::LOCAL, Subs::Input::PROMPT);
+    input.sign_in("check",    Subs::Input::LOCAL, Subs::Input::NOPROMPT);
+
+    // Get inputs
+    std::string run;
+    input.get_value("run", run, "run", "run to compress or expand");
+    bool compress;
+    input.get_value("compress", compress, true, "compress (else expand)?");
+    bool check = false;
+    if(compress)
+      input.get_value("check", check, true, "check the compressed file?");
+
+    // Frame format from the XML file
+    Ultracam::Mwindow mwindow;
+    Subs::Header header;
+    Ultracam::ServerData serverdata;
+    Ultracam::parseXML('L', run, mwindow, header, serverdata, false, 0, 0, 1., 0.);
+    const size_t framesize  = serverdata.framesize;
+    const size_t headerskip = serverdata.headerwords*serverdata.wordsize;
+    std::vector<char> frame(framesize), copy(framesize);
+
+    if(compress){
+
+      // Pixels of the same readout are 2*NCCD words apart for ULTRACAM (two windows per CCD), adjacent for ULTRASPEC
+      Subs::Header::Hnode *hnode = header.find("Instrument.instrument");
+      bool ultraspec = (hnode->has_data() && hnode->value->get_string() == "ULTRASPEC");
+      size_t stride = ultraspec ? 1 : 2*mwindow.size();
+
+      std::string dat = run + ".dat";
+      std::ifstream fin(dat.c_str(), std::ios::binary);
+      if(!fin)
+        throw Ultracam::File_Open_Error("Failed to open " + dat);
+
+      Ultracam::Raw_archive_writer writer;
+      writer.open(run, framesize, headerskip, stride);
+      size_t nframe = 0;
+      while(fin.read(&frame[0], framesize)){
+        writer.write(&frame[0]);
+        nframe++;
+      }
+      if(fin.gcount() > 0)
+        std::cerr << "Ignored incomplete frame of " << fin.gcount() << " bytes at the end of " << dat << std::endl;
+      writer.close();
+      fin.close();
+
+      std::string dcz = run + Ultracam::Raw_archive::extnam();
+      std::ifstream fdat(dat.c_str(), std::ios::binary | std::ios::ate), fdcz(dcz.c_str(), std::ios::binary | std::ios::ate);
+      double ndat = double(fdat.tellg()), ndcz = double(fdcz.tellg());
+      std::cout << nframe << " frames written to " << dcz << ", compressed to "
+                << Subs::str(100.*ndcz/std::max(1.,ndat)) << "% of the size of " << dat << std::endl;
+
+      if(check){
+        Ultracam::Raw_archive archive;
+        archive.open(run);
+        if(archive.nframes() != nframe)
+          throw Ultracam_Error("Check failed: " + dcz + " contains " + Subs::str(archive.nframes()) +
+                               " frames rather than " + Subs::str(nframe));
+        fin.clear();
+        fin.open(dat.c_str(), std::ios::binary);
+        for(size_t nf=1; nf<=nframe; nf++){
+          fin.read(&frame[0], framesize);
+          archive.read(nf, &copy[0]);
+          if(!fin || memcmp(&frame[0], &copy[0], framesize))
+            throw Ultracam_Error("Check failed: frame " + Subs::str(nf) + " of " + dcz + " differs from the original");
+        }
+        std::cout << "Checked all " << nframe << " frames against " << dat << std::endl;
+      }
+
+    }else{
+
+      Ultracam::Raw_archive archive;
+      archive.open(run);
+      if(archive.framesize() != framesize || archive.headerskip() != headerskip)
+        throw Ultracam_Error("Frame or header size of " + run + Ultracam::Raw_archive::extnam() + " does not match " + run + ".xml");
+
+      std::string dat = run + ".dat";
+      std::ofstream fout(dat.c_str(), std::ios::binary);
+      if(!fout)
+        throw Ultracam::File_Open_Error("Failed to open " + dat);
+      for(size_t nf=1; nf<=archive.nframes(); nf++){
+        archive.read(nf, &frame[0]);
+        if(!fout.write(&frame[0], framesize))
+          throw Ultracam::Write_Error("Failed to write frame " + Subs::str(nf) + " to " + dat);
+      }
+      fout.close();
+      std::cout << archive.nframes() << " frames written to " << dat << std::endl;
+    }
+  }
+
+  catch(const Ultracam_Error& err){
+    std::cerr << "\nUltracam::Ultracam_Error exception:" << std::endl;
+    std::cerr << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  catch(const Subs::Subs_Error& err){
+    std::cerr << "\nSubs::Subs_Error exception:" << std::endl;
+    std::cerr << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  catch(const std::string& err){
+    std::cerr << "\n" << err << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
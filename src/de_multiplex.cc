@@ -3,6 +3,167 @@
 #include "trm/subs.h"
 #include "trm/frame.h"
 #include "trm/ultracam.h"
+#include "trm/parallel.h"
+#include "trm/header_items.h"
+
+// Converts n pixels starting at p and separated by 'step' bytes. Pixel i is stored in out[i].
+// The raw data are little-endian whatever the machine; assembling each value from its two bytes
+// gives the same result on any machine as the byte swap it replaces and leaves the loop simple
+// enough for the compiler to vectorise.
+static inline void unpack_run(const char *p, size_t step, int n, Ultracam::internal_data *out){
+    const unsigned char *q = reinterpret_cast<const unsigned char*>(p);
+    for(int i=0; i<n; i++, q += step)
+        out[i] = Ultracam::internal_data(Subs::UINT2(q[0] | (q[1] << 8)));
+}
+
+// As unpack_run, but pixel i is stored in out[-i], for windows that are read from the right.
+static inline void unpack_run_reversed(const char *p, size_t step, int n, Ultracam::internal_data *out){
+    const unsigned char *q = reinterpret_cast<const unsigned char*>(p);
+    for(int i=0; i<n; i++, q += step)
+        out[-i] = Ultracam::internal_data(Subs::UINT2(q[0] | (q[1] << 8)));
+}
+
+// Unpacks a run of n pixel pairs of one CCD from the raw data of a row. The pixels of a pair are
+// 2 bytes apart and the pairs are 4*NCCD bytes apart. The first of each pair goes into left[0], left[1], ...
+// and the second into right[0], right[-1], ...
+static inline void unpack_pairs(const char *p, int NCCD, int n, Ultracam::internal_data *left,
+                                Ultracam::internal_data *right){
+    unpack_run(p, 4*NCCD, n, left);
+    unpack_run_reversed(p+2, 4*NCCD, n, right);
+}
+
+namespace {
+
+    // Parameters of an ULTRACAM de-multiplex, shared between threads
+    struct Ultracam_demux {
+        char *buffer;
+        Ultracam::Frame *data;
+        int  NCCD, NCOL, NROW;
+        bool STRIP, normal;
+    };
+
+    // De-multiplexes CCDs ccd1 to ccd2-1
+    void ultracam_ccds(const Ultracam_demux& dm, int ccd1, int ccd2){
+
+        Ultracam::Frame& data = *dm.data;
+        const int NCCD = dm.NCCD, NCOL = dm.NCOL, NROW = dm.NROW;
+        size_t ip = 0;
+
+        if(dm.normal){
+
+            for(size_t nwin1=0, nwin2=1; nwin2<data[0].size(); nwin1+=2, nwin2+=2){
+
+                const int NX = data[0][nwin1].nx();
+                const int NY = data[0][nwin1].ny();
+
+                // Skip lower rows if trimming enabled. The factor 4 comes from 2 bytes for
+                // each pixel and 2 windows. Should not have been done in overscan mode
+                if(dm.STRIP) ip += 4*NCCD*(NX+NCOL)*NROW;
+
+                for(int iy=0; iy<NY; iy++){
+
+                    // skip columns on left of left window, right of right window
+                    if(dm.STRIP) ip += 4*NCCD*NCOL;
+
+                    // Each CCD contributes a pair of pixels, one from the left of the left window and
+                    // one from the right of the right window, every 4*NCCD bytes. This loop is the critical one for speed.
+                    for(int nccd=ccd1; nccd<ccd2; nccd++)
+                        unpack_pairs(dm.buffer+ip+4*nccd, NCCD, NX, data[nccd][nwin1].row(iy), data[nccd][nwin2].row(iy)+NX-1);
+
+                    ip += 4*NCCD*NX;
+                }
+            }
+
+        }else{
+
+            // Overscan mode is a bit of a bugger. 24 columns on left of left window and right
+            // of right window, plus 4 on right of left window and left of right window
+            // plus another 8 rows at the top. Very specific implementation here to split
+            // between 6 windows with the two parts of the overscan combined into single strips
+            // which appear on the right of the main windows and an extra part at the top. This
+            // way the mapping of real pixels to image pixel is preserved so object positions stay
+            // the same.
+
+            const int XBIN = data[0][0].xbin();
+            const int YBIN = data[0][0].ybin();
+
+            // Each raw row is split into three runs of pixel pairs: left and right overscan windows,
+            // then the data windows (or the top overscan windows), then the overscan windows again.
+            const int IX1 = 24/XBIN, IX2 = 536/XBIN, NXR = 540/XBIN;
+
+            for(int iy=0; iy<1032/YBIN; iy++){
+                for(int nccd=ccd1; nccd<ccd2; nccd++){
+                    const char *p = dm.buffer + ip + 4*nccd;
+
+                    // left and right overscan windows
+                    unpack_pairs(p, NCCD, IX1, data[nccd][2].row(iy), data[nccd][3].row(iy)+28/XBIN-1);
+
+                    if(iy < 1024/YBIN){
+                        // left and right data windows
+                        unpack_pairs(p+4*NCCD*IX1, NCCD, IX2-IX1, data[nccd][0].row(iy), data[nccd][1].row(iy)+IX2-1-IX1);
+                    }else{
+                        // top left and right overscan windows
+                        unpack_pairs(p+4*NCCD*IX1, NCCD, IX2-IX1, data[nccd][4].row(iy-1024/YBIN),
+                                     data[nccd][5].row(iy-1024/YBIN)+IX2-1-IX1);
+                    }
+
+                    // left and right overscan windows again
+                    unpack_pairs(p+4*NCCD*IX2, NCCD, NXR-IX2, data[nccd][2].row(iy)+IX2-512/XBIN,
+                                 data[nccd][3].row(iy)+NXR-1-IX2);
+                }
+                ip += 4*NCCD*NXR;
+            }
+        }
+    }
+
+    // Task for run_parallel: de-multiplexes CCD n
+    void ultracam_task(int n, void *arg){
+        ultracam_ccds(*static_cast<Ultracam_demux*>(arg), n, n+1);
+    }
+
+    // Parameters of an ULTRASPEC de-multiplex, shared between threads
+    struct Ultraspec_demux {
+        char *buffer;
+        Ultracam::Frame *data;
+        const std::vector<int> *nchop;
+        std::vector<size_t> start;
+        int  NCOL, NROW;
+        bool normal;
+    };
+
+    // De-multiplexes window nwin of an ULTRASPEC frame
+    void ultraspec_window(const Ultraspec_demux& dm, size_t nwin){
+
+        Ultracam::Windata& win = (*dm.data)[0][nwin];
+        const int NX    = win.nx();
+        const int NCHOP = (*dm.nchop)[nwin];
+
+        // Each row in the buffer consists of trimmed columns, overscan pixels and then the data.
+        // Skip the lower rows if trimming is enabled. The factor 2 comes from 2 bytes for each pixel.
+        size_t ip = dm.start[nwin] + 2*(NX+NCHOP+dm.NCOL)*dm.NROW;
+
+        for(int iy=0; iy<win.ny(); iy++){
+
+            // skip columns on left of window and overscan pixels
+            ip += 2*(dm.NCOL+NCHOP);
+
+            if(dm.normal){
+                // 'normal' mode we assume that the first pixel read out is the left-most
+                unpack_run(dm.buffer+ip, 2, NX, win.row(iy));
+            }else{
+                // 'abnormal' mode we assume that the first pixel read out is the right-most
+                unpack_run_reversed(dm.buffer+ip, 2, NX, win.row(iy)+NX-1);
+            }
+            ip += 2*NX;
+        }
+    }
+
+    // Task for run_parallel: de-multiplexes window n
+    void ultraspec_task(int n, void *arg){
+        ultraspec_window(*static_cast<Ultraspec_demux*>(arg), n);
+    }
+
+}
 
 // See later for the ULTRASPEC version.
 
@@ -42,191 +203,55 @@ This routine puts all of this into the standard arrays inside the Frame passed t
 \param buffer a buffer of data returned by the server, without a header
 \param data   a data frame to store it into. Needs its format to have been defined
 by running parseXML
+\param nthreads the number of threads to use. The CCDs are independent of each other
+and with more than one thread they are unpacked concurrently, one CCD per thread.
+
+Rather than following the order of the buffer pixel by pixel, the data are unpacked a row
+at a time for each CCD in turn, so that each window row is written as a single contiguous
+run (the right-hand window from its end backwards) with a fixed stride through the raw
+data. The rows of the raw data are small enough to stay in cache while all CCDs are unpacked.
 
-The routine tries to work out what sort of machine we are one and will swap bytes
-if it is thought to be big-endian (as opposed to intel / linux little endian)
+The raw data are little-endian; the bytes are swapped if this is thought to be a
+big-endian machine (as opposed to intel / linux little endian)
 
 */
 
-void Ultracam::de_multiplex_ultracam(char *buffer, Frame& data){
+void Ultracam::de_multiplex_ultracam(char *buffer, Frame& data, int nthreads){
+    Header_items items;
+    items.set_run(data);
+    de_multiplex_ultracam(buffer, data, items, nthreads);
+}
+
+/** As de_multiplex_ultracam(char*, Frame&, int) but with the header items it needs already
+ * loaded, so that no header look-ups take place per frame.
+ * \param buffer a buffer of data returned by the server, without a header
+ * \param data   a data frame to store it into
+ * \param items  header items of the run, loaded from the header of data with Header_items::set_run
+ * \param nthreads the number of threads to use
+ */
+void Ultracam::de_multiplex_ultracam(char *buffer, Frame& data, const Header_items& items, int nthreads){
 
     // Initialise.
     // PIX_SHIFT accounts for a problem that was present until May 2007 the cure for which
     // is to remove the outermost pixel of all windows.
-    const int  PIX_SHIFT = data["Instrument.version"]->get_int() < 0 ? 1 : 0;
-    const bool TRIM      = data["Trimming.applied"]->get_bool();
-    const int  NCOL      = TRIM ? data["Trimming.ncols"]->get_int() + PIX_SHIFT: PIX_SHIFT;
-    const int  NROW      = TRIM ? data["Trimming.nrows"]->get_int() : 0;
-    const bool LITTLE    = Subs::is_little_endian();
-    const bool STRIP     = NCOL > 0 || NROW > 0;
-
-    size_t nwin1=0, nwin2=1;
+    const int PIX_SHIFT = items.version < 0 ? 1 : 0;
+    const bool TRIM     = items.trimmed;
 
-    // Variables accessed most often are declared 'register' in the hope of speeding things
-    register int nccd;
-    register const int NCCD = data.size();
-    register size_t ip = 0;
-    register int iy;
-    register Subs::UCHAR cbuff[2];
+    Ultracam_demux dm;
+    dm.buffer = buffer;
+    dm.data   = &data;
+    dm.NCCD   = data.size();
+    dm.NCOL   = TRIM ? items.ncols + PIX_SHIFT: PIX_SHIFT;
+    dm.NROW   = TRIM ? items.nrows : 0;
+    dm.STRIP  = dm.NCOL > 0 || dm.NROW > 0;
 
     // Overscan mode is a special case. Separate it because of rarity and difficulty
-    bool normal = (data["Instrument.Readout_Mode_Flag"]->get_int() != ServerData::FULLFRAME_OVERSCAN);
-
-    if(normal){
-
-    register int NX = data[0][nwin1].nx();
-    register int ix1=0, ix2 = NX-1;
-    iy = 0;
-
-    // Advance buffer pointer if trimming enabled. The factor 4 comes from 2 bytes for
-    // each pixel and 2 windows. Should not have been done in overscan mode
-    if(STRIP){
-        ip += 4*NCCD*(NX+NCOL)*NROW;
-        ip += 4*NCCD*NCOL;
-    }
-
-    for(;;){
-
-        // Add in pixels from the left of the left window and from the right of the right window for each window
-        // pair and CCD in turn. The pointer to char is cast to a pointer to an unsigned 2-byte integer and then the value
-        // of the thing pointed at is converted to the internal data type of ULTRACAM, and the pointer is advanced
-        // appropriately. This loop is the critical one for speed.
-
-        for(nccd=0; nccd<NCCD; nccd++){
-        if(LITTLE){
-            data[nccd][nwin1][iy][ix1] = internal_data(*(Subs::UINT2*)(buffer+ip));
-            ip += 2;
-            data[nccd][nwin2][iy][ix2] = internal_data(*(Subs::UINT2*)(buffer+ip));
-            ip += 2;
-        }else{
-            cbuff[1] = buffer[ip++];
-            cbuff[0] = buffer[ip++];
-            data[nccd][nwin1][iy][ix1] = internal_data(*(Subs::UINT2*)cbuff);
-            cbuff[1] = buffer[ip++];
-            cbuff[0] = buffer[ip++];
-            data[nccd][nwin2][iy][ix2] = internal_data(*(Subs::UINT2*)cbuff);
-        }
-        }
-
-        // Update pointers for next round.
-        ix1++;
-        ix2--;
-        if(ix1 == NX){
-        ix1 = 0;
-        ix2 = NX-1;
-        iy++;
-        if(iy == data[0][nwin1].ny()){
-            nwin2 += 2;
-
-            // Finished
-            if(nwin2 > data[0].size()) break;
-
-            nwin1 += 2;
-            iy     = 0;
-            NX     = data[0][nwin1].nx();
-            ix2    = NX-1;
-
-            // skip lower rows
-            if(STRIP) ip += 4*NCCD*(NX+NCOL)*NROW;
-
-        }
-
-        // skip columns on left of left window, right of right window
-        if(STRIP) ip += 4*NCCD*NCOL;
-        }
-    }
+    dm.normal = (items.readout_mode != ServerData::FULLFRAME_OVERSCAN);
 
-    }else{
-
-    // Overscan mode is a bit of a bugger. 24 columns on left of left window and right
-    // of right window, plus 4 on right of left window and left of right window
-    // plus another 8 rows at the top. Very specific implementation here to split
-    // between 6 windows with the two parts of the overscan combined into single strips
-    // which appear on the right of the main windows and an extra part at the top. This
-    // way the mapping of real pixels to image pixel is preserved so object positions stay
-    // the same.
-
-    register int ix;
-    const int  XBIN      = data[0][0].xbin();
-    const int  YBIN      = data[0][0].ybin();
-
-    for(iy=0; iy<1032/YBIN; iy++){
-        for(ix=0; ix<540/XBIN; ix++){
-        for(nccd=0; nccd<NCCD; nccd++){
-            if(ix < 24/XBIN){
-
-            // left and right overscan windows
-            if(LITTLE){
-                data[nccd][2][iy][ix]   = internal_data(*(Subs::UINT2*)(buffer+ip));
-                ip += 2;
-                data[nccd][3][iy][28/XBIN-1-ix] = internal_data(*(Subs::UINT2*)(buffer+ip));
-                ip += 2;
-            }else{
-                cbuff[1] = buffer[ip++];
-                cbuff[0] = buffer[ip++];
-                data[nccd][2][iy][ix]   = internal_data(*(Subs::UINT2*)cbuff);
-                cbuff[1] = buffer[ip++];
-                cbuff[0] = buffer[ip++];
-                data[nccd][3][iy][28/XBIN-1-ix] = internal_data(*(Subs::UINT2*)cbuff);
-            }
-
-            }else if(ix < 536/XBIN){
-
-            if(iy < 1024/YBIN){
-                // left and right data windows
-                if(LITTLE){
-                data[nccd][0][iy][ix-24/XBIN]  = internal_data(*(Subs::UINT2*)(buffer+ip));
-                ip += 2;
-                data[nccd][1][iy][536/XBIN-1-ix] = internal_data(*(Subs::UINT2*)(buffer+ip));
-                ip += 2;
-                }else{
-                cbuff[1] = buffer[ip++];
-                cbuff[0] = buffer[ip++];
-                data[nccd][0][iy][ix-24/XBIN]  = internal_data(*(Subs::UINT2*)cbuff);
-                cbuff[1] = buffer[ip++];
-                cbuff[0] = buffer[ip++];
-                data[nccd][1][iy][536/XBIN-1-ix] = internal_data(*(Subs::UINT2*)cbuff);
-                }
-
-            }else{
-
-                // top left and right overscan windows
-                if(LITTLE){
-                data[nccd][4][iy-1024/YBIN][ix-24/XBIN]  = internal_data(*(Subs::UINT2*)(buffer+ip));
-                ip += 2;
-                data[nccd][5][iy-1024/YBIN][536/XBIN-1-ix] = internal_data(*(Subs::UINT2*)(buffer+ip));
-                ip += 2;
-                }else{
-                cbuff[1] = buffer[ip++];
-                cbuff[0] = buffer[ip++];
-                data[nccd][4][iy-1024/YBIN][ix-24/XBIN]  = internal_data(*(Subs::UINT2*)cbuff);
-                cbuff[1] = buffer[ip++];
-                cbuff[0] = buffer[ip++];
-                data[nccd][5][iy-1024/YBIN][536/XBIN-1-ix] = internal_data(*(Subs::UINT2*)cbuff);
-                }
-            }
-
-            }else{
-
-            // left and right overscan windows again
-            if(LITTLE){
-                data[nccd][2][iy][ix-512/XBIN] = internal_data(*(Subs::UINT2*)(buffer+ip));
-                ip += 2;
-                data[nccd][3][iy][540/XBIN-1-ix] = internal_data(*(Subs::UINT2*)(buffer+ip));
-                ip += 2;
-            }else{
-                cbuff[1] = buffer[ip++];
-                cbuff[0] = buffer[ip++];
-                data[nccd][2][iy][ix-512/XBIN] = internal_data(*(Subs::UINT2*)cbuff);
-                cbuff[1] = buffer[ip++];
-                cbuff[0] = buffer[ip++];
-                data[nccd][3][iy][540/XBIN-1-ix] = internal_data(*(Subs::UINT2*)cbuff);
-            }
-            }
-        }
-        }
-    }
-    }
+    if(nthreads > 1)
+        run_parallel(ultracam_task, &dm, dm.NCCD, nthreads);
+    else
+        ultracam_ccds(dm, 0, dm.NCCD);
 }
 
 
@@ -264,137 +289,58 @@ remove any pixels if they are amongst the first 16 that can be read out by
 either port (overscan pixels). These are thus ignored and never appear at any
 stage.
 
+\param buffer a buffer of data returned by the server, without a header
+\param data   a data frame to store it into. Needs its format to have been defined
+by running parseXML
+\param nchop  the number of overscan pixels to remove from each window
+\param nthreads the number of threads to use. The windows are independent of each other
+and with more than one thread they are unpacked concurrently, one window per thread.
+
 */
 
-void Ultracam::de_multiplex_ultraspec(char *buffer, Frame& data, const std::vector<int>& nchop){
+void Ultracam::de_multiplex_ultraspec(char *buffer, Frame& data, const std::vector<int>& nchop, int nthreads){
+    Header_items items;
+    items.set_run(data);
+    de_multiplex_ultraspec(buffer, data, items, nchop, nthreads);
+}
+
+/** As de_multiplex_ultraspec(char*, Frame&, const std::vector<int>&, int) but with the header
+ * items it needs already loaded, so that no header look-ups take place per frame.
+ * \param buffer a buffer of data returned by the server, without a header
+ * \param data   a data frame to store it into
+ * \param items  header items of the run, loaded from the header of data with Header_items::set_run
+ * \param nchop  the number of overscan pixels to remove from each window
+ * \param nthreads the number of threads to use
+ */
+void Ultracam::de_multiplex_ultraspec(char *buffer, Frame& data, const Header_items& items, const std::vector<int>& nchop, int nthreads){
 
     // Initialise
-    const bool TRIM   = data["Trimming.applied"]->get_bool();
-    const int  NCOL   = TRIM ? data["Trimming.ncols"]->get_int() : 0;
-    const int  NROW   = TRIM ? data["Trimming.nrows"]->get_int() : 0;
-    const bool LITTLE = Subs::is_little_endian();
+    const bool TRIM = items.trimmed;
 
-    // Variables accessed most often are declared 'register' in the hope of speeding things
-    register size_t ip = 0;
-    register int iy;
-    register Subs::UCHAR cbuff[2];
+    Ultraspec_demux dm;
+    dm.buffer = buffer;
+    dm.data   = &data;
+    dm.nchop  = &nchop;
+    dm.NCOL   = TRIM ? items.ncols : 0;
+    dm.NROW   = TRIM ? items.nrows : 0;
 
     // Flag the output being used. This is what indicates reversal or not.
-    bool normal = (data["Instrument.Output"]->get_int() == 0);
-
-    if(normal){
-
-    register size_t nwin = 0;
-    register int NX = data[0][0].nx();
-    register int ix=0;
-    iy = 0;
-
-    // Advance buffer pointer if trimming enabled. The factor 2 comes from 2 bytes for each pixel.
-    if(TRIM){
-        ip += 2*(NX+nchop[nwin]+NCOL)*NROW;
-        ip += 2*NCOL;
+    dm.normal = (items.output == 0);
+
+    // Work out where each window starts in the buffer
+    const size_t NWIN = data[0].size();
+    dm.start.resize(NWIN);
+    size_t ip = 0;
+    for(size_t nwin=0; nwin<NWIN; nwin++){
+        dm.start[nwin] = ip;
+        ip += 2*(data[0][nwin].nx()+nchop[nwin]+dm.NCOL)*(dm.NROW+data[0][nwin].ny());
     }
 
-    // Skip overscan pixels
-    ip += 2*nchop[nwin];
-
-    for(;;){
-
-        // 'normal' mode we assume that the first pixel read out is the left-most
-        if(LITTLE){
-        data[0][nwin][iy][ix] = internal_data(*(Subs::UINT2*)(buffer+ip));
-        ip += 2;
-        }else{
-        cbuff[1] = buffer[ip++];
-        cbuff[0] = buffer[ip++];
-        data[0][nwin][iy][ix] = internal_data(*(Subs::UINT2*)cbuff);
-        }
-
-        // Update pointers for next round.
-        ix++;
-        if(ix == NX){
-        ix = 0;
-        iy++;
-        if(iy == data[0][nwin].ny()){
-
-            nwin++;
-
-            // Finished
-            if(nwin >= data[0].size()) break;
-
-            iy     = 0;
-            NX     = data[0][nwin].nx();
-
-            // skip lower rows
-            if(TRIM) ip += 2*(NX+nchop[nwin]+NCOL)*NROW;
-
-        }
-
-        // skip columns on left of window
-        if(TRIM) ip += 2*NCOL;
-
-        // Skip overscan pixels
-        ip += 2*nchop[nwin];
-        }
-    }
-
-    }else{
-
-    register size_t nwin = 0;
-    register int NX = data[0][nwin].nx();
-    register int ix = NX-1;
-    iy = 0;
-
-    // Advance buffer pointer if trimming enabled. The factor 2 comes from 2 bytes for each pixel.
-    if(TRIM){
-        ip += 2*(NX+nchop[nwin]+NCOL)*NROW;
-        ip += 2*NCOL;
-    }
-
-    // Skip overscan pixels
-    ip += 2*nchop[nwin];
-
-    for(;;){
-
-        // 'abnormal' mode we assume that the first pixel read out is the right-most
-        if(LITTLE){
-        data[0][nwin][iy][ix] = internal_data(*(Subs::UINT2*)(buffer+ip));
-        ip += 2;
-        }else{
-        cbuff[1] = buffer[ip++];
-        cbuff[0] = buffer[ip++];
-        data[0][nwin][iy][ix] = internal_data(*(Subs::UINT2*)cbuff);
-        }
-
-        // Update pointers for next round.
-        ix--;
-        if(ix < 0){
-        iy++;
-        if(iy == data[0][nwin].ny()){
-
-            nwin++;
-
-            // Finished
-            if(nwin >= data[0].size()) break;
-
-            iy     = 0;
-            NX     = data[0][nwin].nx();
-
-            // skip lower rows
-            if(TRIM) ip += 2*(NX+nchop[nwin]+NCOL)*NROW;
-
-        }
-
-        ix = NX-1;
-
-        // skip columns on right window
-        if(TRIM) ip += 2*NCOL;
-
-        // Skip overscan pixels
-        ip += 2*nchop[nwin];
-        }
-    }
-    }
+    if(nthreads > 1)
+        run_parallel(ultraspec_task, &dm, NWIN, nthreads);
+    else
+        for(size_t nwin=0; nwin<NWIN; nwin++)
+            ultraspec_window(dm, nwin);
 }
 
 /**
@@ -431,11 +377,24 @@ thus ignored and never appear at any stage.
 */
 
 void Ultracam::de_multiplex_ultraspec_drift(char *buffer, Frame& data, const std::vector<int>& nchop){
+    Header_items items;
+    items.set_run(data);
+    de_multiplex_ultraspec_drift(buffer, data, items, nchop);
+}
+
+/** As de_multiplex_ultraspec_drift(char*, Frame&, const std::vector<int>&) but with the header
+ * items it needs already loaded, so that no header look-ups take place per frame.
+ * \param buffer a buffer of data returned by the server, without a header
+ * \param data   a data frame to store it into
+ * \param items  header items of the run, loaded from the header of data with Header_items::set_run
+ * \param nchop  the number of overscan pixels to remove from each window
+ */
+void Ultracam::de_multiplex_ultraspec_drift(char *buffer, Frame& data, const Header_items& items, const std::vector<int>& nchop){
 
     // Initialise
-    const bool TRIM   = data["Trimming.applied"]->get_bool();
-    const int  NCOL   = TRIM ? data["Trimming.ncols"]->get_int() : 0;
-    const int  NROW   = TRIM ? data["Trimming.nrows"]->get_int() : 0;
+    const bool TRIM   = items.trimmed;
+    const int  NCOL   = TRIM ? items.ncols : 0;
+    const int  NROW   = TRIM ? items.nrows : 0;
     const bool LITTLE = Subs::is_little_endian();
 
     // Variables accessed most often are declared 'register' in the hope of speeding things
@@ -443,7 +402,7 @@ void Ultracam::de_multiplex_ultraspec_drift(char *buffer, Frame& data, const std
     register Subs::UCHAR cbuff[2];
 
     // Flag the output being used. This is what indicates reversal or not.
-    bool normal = (data["Instrument.Output"]->get_int() == 0);
+    bool normal = (items.output == 0);
 
     if(normal){
 
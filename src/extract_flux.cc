@@ -3,49 +3,36 @@
 #include "trm/aperture.h"
 #include "trm/ultracam.h"
 #include "trm/reduce.h"
+#include "trm/weight_stencil.h"
 
 // Globals read by read_reduce_file
 
-/** Routine to carry out the determination of the flux given an aperture and
- * a CCD
- * \param data data frame of interest, bias subtracted
- * \param dvar equivalent variance frame
- * \param bad  bad pixel frame. 0 if OK, then 10, 20, 30 etc for successively worse pixels. Values below
- * 10 are reserved for future automated cosmic ray detection.
- * \param gain equivalent gain frame
- * \param bias bias frame
- * \param aperture the aperture
- * \param sky_method method of estimating the sky
- * \param sky_thresh   threshold number of RMS to reject at.
- * \param sky_error  method of estimating the error on the sky
- * \param extraction_method type of extraction
- * \param zapped list of pixel positions rejected by cosmic ray cleaning
- * \param shape shape parameters from any fits made for this CCD
- * \param pepper  level at which peppering occurs
- * \param saturate level at which saturation occurs
- * \param counts  returned, the flux in counts
- * \param sigma   returned, estimated error on the flux in counts.
- * \param sky     returned, sky level, counts/pixel
- * \param nsky    returned, number of sky pixels
- * \param nrej    returned, number of sky pixels rejected
- * \param ecode   returned, error code
- * \param worst   value of worst bad pixel in aperture (0 = OK)
- */
+namespace {
 
-void Ultracam::extract_flux(const Image& data, const Image& dvar, const Image& bad,
-                const Image& gain, const Image& bias, const Aperture& aperture, Reduce::SKY_METHOD sky_method,
-                float sky_thresh, Reduce::SKY_ERROR sky_error, Reduce::EXTRACTION_METHOD extraction_method,
-                const std::vector<std::pair<int,int> >& zapped, const Reduce::Meanshape& shape, float pepper, float saturate,
-                float& counts, float& sigma, float& sky, int& nsky, int& nrej,
-                Reduce::ERROR_CODES& ecode, int& worst){
+// Carries out Ultracam::extract_flux for nrad star aperture radii at once. The sky is estimated once for all of them and the pixels are
+// visited once, each radius keeping its own sums, so the results for each radius are exactly as if
+// it had been extracted on its own.
+void extract(const Ultracam::Image& data, const Ultracam::Image& dvar, const Ultracam::Image& bad,
+             const Ultracam::Image& gain, const Ultracam::Image& bias, const Ultracam::Aperture& aperture, int nrad, const float* rstar,
+             Ultracam::Reduce::SKY_METHOD sky_method, float sky_thresh, Ultracam::Reduce::SKY_ERROR sky_error,
+             Ultracam::Reduce::EXTRACTION_METHOD extraction_method,
+             const std::vector<std::pair<int,int> >& zapped, const Ultracam::Reduce::Meanshape& shape, float pepper, float saturate,
+             float* counts, float* sigma, float& sky, int& nsky, int& nrej,
+             Ultracam::Reduce::ERROR_CODES* ecode, int* worst, int nsubdiv, float annulus_tol){
+
+    using namespace Ultracam;
 
     // flag to skip extra aperture section
     bool skip = (extraction_method == Reduce::OPTIMAL || aperture.nextra() == 0);
 
-    worst = 0;
+    for(int k=0; k<nrad; k++) worst[k] = 0;
 
     if(aperture.valid()){
 
+    // Radii for which the results are settled, so that a failure does not change them
+    bool done[nrad];
+    for(int k=0; k<nrad; k++) done[k] = false;
+
     try{
 
         const Windata &dwin  = data.enclose(aperture.xpos(), aperture.ypos());
@@ -56,58 +43,85 @@ void Ultracam::extract_flux(const Image& data, const Image& dvar, const Image& b
 
         // window found for this aperture, but need to check that
         // star aperture and any extra apertures are fully enclosed by it
-        bool enclosed = (
-        dwin.left()   < aperture.xpos()-aperture.rstar() &&
-        dwin.bottom() < aperture.ypos()-aperture.rstar() &&
-        dwin.right()  > aperture.xpos()+aperture.rstar() &&
-        dwin.top()    > aperture.ypos()+aperture.rstar());
+        bool enclosed[nrad], any_enclosed = false;
+        for(int k=0; k<nrad; k++){
+        enclosed[k] = (
+            dwin.left()   < aperture.xpos()-rstar[k] &&
+            dwin.bottom() < aperture.ypos()-rstar[k] &&
+            dwin.right()  > aperture.xpos()+rstar[k] &&
+            dwin.top()    > aperture.ypos()+rstar[k]);
 
         if(!skip){
-        for(int i=0; i<aperture.nextra(); i++){
-            enclosed = enclosed &&
-            (dwin.left()   < aperture.xpos()+aperture.extra(i).x-aperture.rstar() &&
-             dwin.bottom() < aperture.ypos()+aperture.extra(i).y-aperture.rstar() &&
-             dwin.right()  > aperture.xpos()+aperture.extra(i).x+aperture.rstar() &&
-             dwin.top()    > aperture.ypos()+aperture.extra(i).y+aperture.rstar());
+            for(int i=0; i<aperture.nextra(); i++){
+            enclosed[k] = enclosed[k] &&
+                (dwin.left()   < aperture.xpos()+aperture.extra(i).x-rstar[k] &&
+                 dwin.bottom() < aperture.ypos()+aperture.extra(i).y-rstar[k] &&
+                 dwin.right()  > aperture.xpos()+aperture.extra(i).x+rstar[k] &&
+                 dwin.top()    > aperture.ypos()+aperture.extra(i).y+rstar[k]);
+            }
+        }
+
+        if(enclosed[k]){
+            any_enclosed = true;
+        }else{
+            counts[k] = 0.;
+            sigma[k]  = -1.;
+            ecode[k]  = Reduce::TARGET_APERTURE_AT_EDGE_OF_WINDOW;
+            done[k]   = true;
         }
         }
 
-        if(enclosed){
+        if(any_enclosed){
 
         // Estimate sky background value
         float sky_sigma;
         bool overlap;
         double rms;
-        sky_estimate(aperture, dwin, vwin, bwin, sky_method, sky_thresh, sky_error, sky, sky_sigma, rms, nsky, nrej, overlap);
+        sky_estimate(aperture, dwin, vwin, bwin, sky_method, sky_thresh, sky_error, sky, sky_sigma, rms, nsky, nrej, overlap,
+                     annulus_tol);
 
-        // Define the region for extraction of counts
-        int xlo = int(Subs::nint(dwin.xcomp(aperture.xpos()-aperture.rstar())));
-        int ylo = int(Subs::nint(dwin.ycomp(aperture.ypos()-aperture.rstar())));
-        int xhi = int(Subs::nint(dwin.xcomp(aperture.xpos()+aperture.rstar())));
-        int yhi = int(Subs::nint(dwin.ycomp(aperture.ypos()+aperture.rstar())));
+        // Define the region for extraction of counts for each radius, and the region covering all of them
+        int xlo[nrad], ylo[nrad], xhi[nrad], yhi[nrad];
+        int xmin = dwin.nx(), ymin = dwin.ny(), xmax = -1, ymax = -1;
+        for(int k=0; k<nrad; k++){
+            if(!enclosed[k]) continue;
 
-        if(!skip){
+            xlo[k] = int(Subs::nint(dwin.xcomp(aperture.xpos()-rstar[k])));
+            ylo[k] = int(Subs::nint(dwin.ycomp(aperture.ypos()-rstar[k])));
+            xhi[k] = int(Subs::nint(dwin.xcomp(aperture.xpos()+rstar[k])));
+            yhi[k] = int(Subs::nint(dwin.ycomp(aperture.ypos()+rstar[k])));
+
+            if(!skip){
             for(int i=0; i<aperture.nextra(); i++){
-            xlo = std::min(xlo, int(Subs::nint(dwin.xcomp(aperture.xpos()+aperture.extra(i).x-aperture.rstar()))));
-            ylo = std::min(ylo, int(Subs::nint(dwin.ycomp(aperture.ypos()+aperture.extra(i).y-aperture.rstar()))));
-            xhi = std::max(xhi, int(Subs::nint(dwin.xcomp(aperture.xpos()+aperture.extra(i).x+aperture.rstar()))));
-            yhi = std::max(yhi, int(Subs::nint(dwin.ycomp(aperture.ypos()+aperture.extra(i).y+aperture.rstar()))));
+                xlo[k] = std::min(xlo[k], int(Subs::nint(dwin.xcomp(aperture.xpos()+aperture.extra(i).x-rstar[k]))));
+                ylo[k] = std::min(ylo[k], int(Subs::nint(dwin.ycomp(aperture.ypos()+aperture.extra(i).y-rstar[k]))));
+                xhi[k] = std::max(xhi[k], int(Subs::nint(dwin.xcomp(aperture.xpos()+aperture.extra(i).x+rstar[k]))));
+                yhi[k] = std::max(yhi[k], int(Subs::nint(dwin.ycomp(aperture.ypos()+aperture.extra(i).y+rstar[k]))));
             }
-        }
+            }
+
+            xlo[k] = std::max(0, xlo[k]);
+            ylo[k] = std::max(0, ylo[k]);
+            xhi[k] = std::min(dwin.nx()-1, xhi[k]);
+            yhi[k] = std::min(dwin.ny()-1, yhi[k]);
 
-        xlo = std::max(0, xlo);
-        ylo = std::max(0, ylo);
-        xhi = std::min(dwin.nx()-1, xhi);
-        yhi = std::min(dwin.ny()-1, yhi);
+            xmin = std::min(xmin, xlo[k]);
+            ymin = std::min(ymin, ylo[k]);
+            xmax = std::max(xmax, xhi[k]);
+            ymax = std::max(ymax, yhi[k]);
+        }
 
         // Approximate pixellation correction. Pixels fade out over
         // length of 2.*rpix, where rpix is the "radius" of a pixel
         // which depends upon the binning factors (=0.5 for xbin=ybin=1).
-        float r, rpix=0.f, mweight, weight = 0, targ = 0;
-        float fvar = 0.f, tpix = 0.f, fac, norm=0.f;
+        float r, rpix=0.f, rp, weight = 0, base = 0, targ = 0, fac;
+        float mweight[nrad], tpix[nrad], norm[nrad], fvar[nrad], maxval[nrad];
         bool  same = (dwin.xbin() == dwin.ybin());
         if(same) rpix = dwin.xbin()/2.;
-        counts = 0.;
+        for(int k=0; k<nrad; k++){
+            counts[k] = 0.;
+            tpix[k]   = norm[k] = fvar[k] = maxval[k] = 0.;
+        }
 
         int naper;
         if(skip)
@@ -116,84 +130,154 @@ void Ultracam::extract_flux(const Image& data, const Image& dvar, const Image& b
             naper = 1 +  aperture.nextra();
 
         float sdx[naper], dx[naper], sdy[naper], dy[naper];
-        float maxval = 0.;
 
-        // Start the loop over all possible pixels. Aim is to work out a weight for each one.
-        // In the normal case this is something from 0 to 1 depending upon whether a pixel
-        // is included in an aperture or not. Linear tapering of the weight is used to reduce
-        // pixellation noise.
-        for(int iy=ylo; iy<=yhi; iy++){
+        // Cached weights if wanted, one per radius, centred on pixel ixc, iyc. They are fetched in
+        // one call so that none of them can be dropped from the cache to make room for another.
+        const Weight_stencil *stencil[nrad];
+        bool use_stencil = (nsubdiv > 0 && naper == 1);
+        int ixc = 0, iyc = 0;
+        if(use_stencil){
+            double cx = dwin.xcomp(double(aperture.xpos())), cy = dwin.ycomp(double(aperture.ypos()));
+            ixc = int(floor(cx + 0.5));
+            iyc = int(floor(cy + 0.5));
+            float renc[nrad];
+            const Weight_stencil *senc[nrad];
+            int nget = 0;
+            for(int k=0; k<nrad; k++)
+                if(enclosed[k]) renc[nget++] = rstar[k];
+            use_stencil = Weight_stencil::get(int(Subs::nint(nsubdiv*(cx-ixc))), int(Subs::nint(nsubdiv*(cy-iyc))), nsubdiv,
+                                              nget, renc, dwin.xbin(), dwin.ybin(), extraction_method, shape, senc);
+            for(int k=0, j=0; k<nrad && use_stencil; k++)
+                if(enclosed[k]) stencil[k] = senc[j++];
+        }
+
+        // The radii in order of decreasing size. The region of a radius contains those of all smaller
+        // ones, and a pixel within reach of a radius is within reach of all larger ones, so the radii
+        // affected by a pixel are always the first few of this list.
+        int order[nrad], nenc = 0;
+        for(int k=0; k<nrad; k++){
+            if(!enclosed[k]) continue;
+            int j = nenc++;
+            while(j > 0 && rstar[order[j-1]] < rstar[k]){
+                order[j] = order[j-1];
+                j--;
+            }
+            order[j] = k;
+        }
+        for(int k=0; k<nrad; k++) mweight[k] = 0.;
+
+        // Start the loop over all possible pixels. Aim is to work out a weight for each one
+        // and each radius. In the normal case this is something from 0 to 1 depending upon
+        // whether a pixel is included in an aperture or not. Linear tapering of the weight is
+        // used to reduce pixellation noise. Only the taper depends upon the radius.
+        for(int iy=ymin; iy<=ymax; iy++){
             sdy[0] = Subs::sqr(dy[0] = dwin.yccd(iy)-aperture.ypos());
             if(!skip){
             for(int i=0; i<aperture.nextra(); i++)
                 sdy[i+1] = Subs::sqr(dy[i+1] = dwin.yccd(iy)-aperture.ypos()-aperture.extra(i).y);
             }
 
-            for(int ix=xlo; ix<=xhi; ix++){
-            sdx[0] = Subs::sqr(dx[0] = dwin.xccd(ix)-aperture.xpos());
-            if(!skip){
-                for(int i=0; i<aperture.nextra(); i++)
-                sdx[i+1] = Subs::sqr(dx[i+1] = dwin.xccd(ix)-aperture.xpos()-aperture.extra(i).x);
-            }
+            // Number of radii whose region contains this row
+            int nrow = 0;
+            while(nrow < nenc && iy >= ylo[order[nrow]] && iy <= yhi[order[nrow]]) nrow++;
 
-            // Now wind through all star apertures (main plus extras) to compute the weight for this pixel
-            mweight = 0.;
-            for(int i=0; i<naper; i++){
-                r = sqrt(sdx[i] + sdy[i]);
-                if(!same){
-                if(r == 0.f)
-                    rpix = aperture.rstar()/2.;
-                else
-                    rpix = sqrt(Subs::sqr(dwin.xbin())*sdx[i] + Subs::sqr(dwin.ybin())*sdy[i])/r/2.;
-                }
+            for(int ix=xmin; ix<=xmax; ix++){
 
-                // only consider at all if within rpix of the outer radius.
-                if(r < aperture.rstar() + rpix){
+            // Number of radii whose region contains this pixel, and of those given a weight
+            int nin = 0, nweight = 0;
+            while(nin < nrow && ix >= xlo[order[nin]] && ix <= xhi[order[nin]]) nin++;
+            if(nin == 0) continue;
 
-                // Keep up with bad pixels
-                if(bwin[iy][ix] > 0.5)
-                    worst = std::max(worst, int(floor(bwin[iy][ix]+0.5f)));
+            if(use_stencil){
 
-                // Now compute extraction weights.
-                if(extraction_method == Reduce::OPTIMAL){
+                // Weights from the stencils
+                const int kx = ix - ixc, ky = iy - iyc;
+                for(int j=0; j<nin; j++){
+                const int k = order[j];
+                if(kx >= -stencil[k]->hx() && kx <= stencil[k]->hx() && ky >= -stencil[k]->hy() && ky <= stencil[k]->hy()){
+                    if(stencil[k]->inside(kx,ky) && bwin[iy][ix] > 0.5)
+                    worst[k] = std::max(worst[k], int(floor(bwin[iy][ix]+0.5f)));
+                    mweight[k] = stencil[k]->weight(kx,ky);
+                }
+                }
+                nweight = nin;
 
-                    if(shape.profile_fit_symm)
-                    fac = shape.a*(sdx[i] + sdy[i]);
-                    else
-                    fac = shape.a*sdx[i] + 2.*shape.b*dx[i]*dy[i] + shape.c*sdy[i];
-
-                    if(shape.profile_fit_method == Reduce::GAUSSIAN){
-                    weight = exp(-fac);
-                    }else if(shape.profile_fit_method == Reduce::MOFFAT){
-                    // In the case of moffat fit but gaussian extraction (the reverse is
-                    // not allowed), derive a scaling factor to ensure the same FWHM
-                    if(shape.extraction_weights == Reduce::GAUSSIAN)
-                        weight = exp(-log(2.)/(pow(2.,1./shape.beta)-1)*fac);
-                    else
-                        weight = 1./pow(1.+fac, shape.beta);
-                    }
-                }else{
-                    weight = 1.;
+            }else{
+
+                sdx[0] = Subs::sqr(dx[0] = dwin.xccd(ix)-aperture.xpos());
+                if(!skip){
+                    for(int i=0; i<aperture.nextra(); i++)
+                    sdx[i+1] = Subs::sqr(dx[i+1] = dwin.xccd(ix)-aperture.xpos()-aperture.extra(i).x);
                 }
 
-                // Apply linear taper at edge
-                if(r > aperture.rstar() - rpix) weight *= (aperture.rstar()+rpix-r)/(2.*rpix);
+                // Now wind through all star apertures (main plus extras) to compute the weight for this pixel
+                for(int i=0; i<naper; i++){
+                    r = sqrt(sdx[i] + sdy[i]);
+                    if(!same && r != 0.f)
+                    rpix = sqrt(Subs::sqr(dwin.xbin())*sdx[i] + Subs::sqr(dwin.ybin())*sdy[i])/r/2.;
+
+                    bool have_base = false;
+                    for(int j=0; j<nin; j++){
+                    const int k = order[j];
+
+                    rp = rpix;
+                    if(!same && r == 0.f) rp = rstar[k]/2.;
+
+                    // only consider at all if within rp of the outer radius, which will not
+                    // be so for any smaller radius either
+                    if(r >= rstar[k] + rp) break;
+                    nweight = std::max(nweight, j+1);
+
+                    // Keep up with bad pixels
+                    if(bwin[iy][ix] > 0.5)
+                        worst[k] = std::max(worst[k], int(floor(bwin[iy][ix]+0.5f)));
+
+                    // Now compute extraction weights, which only need doing once for all radii
+                    if(!have_base){
+                        if(extraction_method == Reduce::OPTIMAL){
+
+                        if(shape.profile_fit_symm)
+                            fac = shape.a*(sdx[i] + sdy[i]);
+                        else
+                            fac = shape.a*sdx[i] + 2.*shape.b*dx[i]*dy[i] + shape.c*sdy[i];
+
+                        if(shape.profile_fit_method == Reduce::GAUSSIAN){
+                            base = exp(-fac);
+                        }else if(shape.profile_fit_method == Reduce::MOFFAT){
+                            // In the case of moffat fit but gaussian extraction (the reverse is
+                            // not allowed), derive a scaling factor to ensure the same FWHM
+                            if(shape.extraction_weights == Reduce::GAUSSIAN)
+                            base = exp(-log(2.)/(pow(2.,1./shape.beta)-1)*fac);
+                            else
+                            base = 1./pow(1.+fac, shape.beta);
+                        }
+                        }else{
+                        base = 1.;
+                        }
+                        have_base = true;
+                    }
+                    weight = base;
 
-                // The final weight used is the maximum ever encountered.
-                mweight = std::max(mweight, weight);
+                    // Apply linear taper at edge
+                    if(r > rstar[k] - rp) weight *= (rstar[k]+rp-r)/(2.*rp);
 
+                    // The final weight used is the maximum ever encountered.
+                    mweight[k] = std::max(mweight[k], weight);
+                    }
                 }
             }
 
             // Finally form the weighted sums
-            if(mweight > 0.){
+            targ = dwin[iy][ix] - sky;
+            for(int j=0; j<nweight; j++){
+            const int k = order[j];
+            if(mweight[k] > 0.){
 
                 // Sky subtracted flux
-                targ    = dwin[iy][ix] - sky;
-                counts += mweight*targ;
-                tpix   += mweight;
-                norm   += mweight*mweight;
-                maxval  = std::max(maxval, bswin[iy][ix]+dwin[iy][ix]);
+                counts[k] += mweight[k]*targ;
+                tpix[k]   += mweight[k];
+                norm[k]   += mweight[k]*mweight[k];
+                maxval[k]  = std::max(maxval[k], bswin[iy][ix]+dwin[iy][ix]);
 
                 // In the case of VARIANCE, our background variance estimate
                 // includes readout and sky photon noise thus we just add the additional
@@ -202,107 +286,183 @@ void Ultracam::extract_flux(const Image& data, const Image& dvar, const Image& b
                 // and could thus under-estimate the value. ??
                 switch (sky_error) {
                 case Reduce::VARIANCE:
-                    fvar += Subs::sqr(mweight)*(Subs::sqr(rms) + std::max(0.f,targ)/gwin[iy][ix]);
+                    fvar[k] += Subs::sqr(mweight[k])*(Subs::sqr(rms) + std::max(0.f,targ)/gwin[iy][ix]);
                     break;
                 case Reduce::PHOTON:
-                    fvar += Subs::sqr(mweight)*vwin[iy][ix];
+                    fvar[k] += Subs::sqr(mweight[k])*vwin[iy][ix];
                 }
+                mweight[k] = 0.;
+            }
             }
             }
         }
 
-        // Add in the contribution to the variuance from the uncertainty in the sky estimate
-        fvar += Subs::sqr(tpix*sky_sigma);
+        for(int k=0; k<nrad; k++){
+            if(!enclosed[k]) continue;
 
-        // Check whether a cosmic ray was deleted from this aperture
-        bool cosmic_detected = false;
-        for(size_t ncos=0; ncos<zapped.size(); ncos++){
+            // Add in the contribution to the variuance from the uncertainty in the sky estimate
+            fvar[k] += Subs::sqr(tpix[k]*sky_sigma);
+
+            // Check whether a cosmic ray was deleted from this aperture
+            bool cosmic_detected = false;
+            for(size_t ncos=0; ncos<zapped.size(); ncos++){
             float sdx = Subs::sqr(dwin.xccd(zapped[ncos].first)-aperture.xpos());
             float sdy = Subs::sqr(dwin.yccd(zapped[ncos].second)-aperture.ypos());
 
             r   = sqrt(sdx + sdy);
             if(!same){
-            if(r == 0.f)
-                rpix = aperture.rstar()/2.;
-            else
+                if(r == 0.f)
+                rpix = rstar[k]/2.;
+                else
                 rpix = sqrt(Subs::sqr(dwin.xbin())*sdx + Subs::sqr(dwin.ybin())*sdy)/r;
             }
 
-            if(r < aperture.rstar() + rpix){
-            cosmic_detected = true;
-            break;
+            if(r < rstar[k] + rpix){
+                cosmic_detected = true;
+                break;
             }
 
             if(!skip){
-            for(int i=0; i<aperture.nextra(); i++){
+                for(int i=0; i<aperture.nextra(); i++){
                 sdx = Subs::sqr(dwin.xccd(zapped[ncos].first)-aperture.xpos()-aperture.extra(i).x);
                 sdy = Subs::sqr(dwin.yccd(zapped[ncos].second)-aperture.ypos()-aperture.extra(i).y);
 
                 r   = sqrt(sdx + sdy);
                 if(!same){
-                if(r == 0.f)
-                    rpix = aperture.rstar()/2.;
-                else
+                    if(r == 0.f)
+                    rpix = rstar[k]/2.;
+                    else
                     rpix = sqrt(Subs::sqr(dwin.xbin())*sdx + Subs::sqr(dwin.ybin())*sdy)/r;
                 }
 
-                if(r < aperture.rstar() + rpix){
-                cosmic_detected = true;
-                break;
+                if(r < rstar[k] + rpix){
+                    cosmic_detected = true;
+                    break;
+                }
                 }
             }
             }
-        }
 
-        // Error code
-        if(maxval >  saturate){
-            ecode = Reduce::SATURATION;
-        }else if(nsky == 0){
-            ecode = Reduce::NO_SKY;
-        }else if(maxval > dwin.xbin()*dwin.ybin()*pepper){
-            ecode = Reduce::PEPPERED;
-        }else if(overlap && cosmic_detected){
-            ecode = Reduce::SKY_OVERLAPS_AND_COSMIC_RAY_DETECTED;
-        }else if(overlap){
-            ecode = Reduce::SKY_OVERLAPS_EDGE_OF_WINDOW;
-        }else if(cosmic_detected){
-            ecode = Reduce::COSMIC_RAY_DETECTED_IN_TARGET_APERTURE;
-        }else if(sky < -5.){
-            ecode = Reduce::SKY_NEGATIVE;
-        }else if(extraction_method == Reduce::OPTIMAL && aperture.nextra()){
-            ecode = Reduce::EXTRA_APERTURES_IGNORED;
-        }else{
-            ecode = Reduce::OK;
-        }
+            // Error code
+            if(maxval[k] >  saturate){
+            ecode[k] = Reduce::SATURATION;
+            }else if(nsky == 0){
+            ecode[k] = Reduce::NO_SKY;
+            }else if(maxval[k] > dwin.xbin()*dwin.ybin()*pepper){
+            ecode[k] = Reduce::PEPPERED;
+            }else if(overlap && cosmic_detected){
+            ecode[k] = Reduce::SKY_OVERLAPS_AND_COSMIC_RAY_DETECTED;
+            }else if(overlap){
+            ecode[k] = Reduce::SKY_OVERLAPS_EDGE_OF_WINDOW;
+            }else if(cosmic_detected){
+            ecode[k] = Reduce::COSMIC_RAY_DETECTED_IN_TARGET_APERTURE;
+            }else if(sky < -5.){
+            ecode[k] = Reduce::SKY_NEGATIVE;
+            }else if(extraction_method == Reduce::OPTIMAL && aperture.nextra()){
+            ecode[k] = Reduce::EXTRA_APERTURES_IGNORED;
+            }else{
+            ecode[k] = Reduce::OK;
+            }
 
-        sigma = sqrt(fvar);
+            sigma[k] = sqrt(fvar[k]);
 
-        // Try to get counts in the optimal case in rough agreement
-        // with expected values. Need to check that this does not screw
-        // things up.
-        if(extraction_method == Reduce::OPTIMAL){
-            counts *= (tpix/norm);
-            sigma  *= (tpix/norm);
+            // Try to get counts in the optimal case in rough agreement
+            // with expected values. Need to check that this does not screw
+            // things up.
+            if(extraction_method == Reduce::OPTIMAL){
+            counts[k] *= (tpix[k]/norm[k]);
+            sigma[k]  *= (tpix[k]/norm[k]);
+            }
+            done[k] = true;
         }
-
-        }else{
-        counts = 0.;
-        sigma  = -1.;
-        ecode  = Reduce::TARGET_APERTURE_AT_EDGE_OF_WINDOW;
         }
     }
     catch(const Ultracam::Ultracam_Error& err){
-        counts = 0.;
-        sigma  = -1.;
-        ecode  = Reduce::APERTURE_OUTSIDE_WINDOW;
+        for(int k=0; k<nrad; k++){
+        if(!done[k]){
+            counts[k] = 0.;
+            sigma[k]  = -1.;
+            ecode[k]  = Reduce::APERTURE_OUTSIDE_WINDOW;
+        }
+        }
     }
 
     }else{
 
-    ecode  = Reduce::APERTURE_INVALID;
-    counts = 0.;
-    sigma  = -1.;
+    for(int k=0; k<nrad; k++){
+        ecode[k]  = Reduce::APERTURE_INVALID;
+        counts[k] = 0.;
+        sigma[k]  = -1.;
     }
+    }
+
+}
 
 }
 
+/** Routine to carry out the determination of the flux given an aperture and
+ * a CCD
+ * \param data data frame of interest, bias subtracted
+ * \param dvar equivalent variance frame
+ * \param bad  bad pixel frame. 0 if OK, then 10, 20, 30 etc for successively worse pixels. Values below
+ * 10 are reserved for future automated cosmic ray detection.
+ * \param gain equivalent gain frame
+ * \param bias bias frame
+ * \param aperture the aperture
+ * \param sky_method method of estimating the sky
+ * \param sky_thresh   threshold number of RMS to reject at.
+ * \param sky_error  method of estimating the error on the sky
+ * \param extraction_method type of extraction
+ * \param zapped list of pixel positions rejected by cosmic ray cleaning
+ * \param shape shape parameters from any fits made for this CCD
+ * \param pepper  level at which peppering occurs
+ * \param saturate level at which saturation occurs
+ * \param counts  returned, the flux in counts
+ * \param sigma   returned, estimated error on the flux in counts.
+ * \param sky     returned, sky level, counts/pixel
+ * \param nsky    returned, number of sky pixels
+ * \param nrej    returned, number of sky pixels rejected
+ * \param ecode   returned, error code
+ * \param worst   value of worst bad pixel in aperture (0 = OK)
+ * \param nsubdiv if > 0, the pixel weights are taken from a cached Weight_stencil with the aperture
+ * position and radius rounded to 1/nsubdiv of a binned pixel, and the profile rounded to a similar precision,
+ * rather than computed afresh. This is not done when there are extra star apertures. See Weight_stencil for
+ * the differences this can make. 0 for the exact weights.
+ * \param annulus_tol tolerance for re-using cached sky annulus pixels, passed to sky_estimate. < 0 to
+ * compute the annulus pixel by pixel.
+ */
+
+void Ultracam::extract_flux(const Image& data, const Image& dvar, const Image& bad,
+                const Image& gain, const Image& bias, const Aperture& aperture, Reduce::SKY_METHOD sky_method,
+                float sky_thresh, Reduce::SKY_ERROR sky_error, Reduce::EXTRACTION_METHOD extraction_method,
+                const std::vector<std::pair<int,int> >& zapped, const Reduce::Meanshape& shape, float pepper, float saturate,
+                float& counts, float& sigma, float& sky, int& nsky, int& nrej,
+                Reduce::ERROR_CODES& ecode, int& worst, int nsubdiv, float annulus_tol){
+    const float rstar = aperture.rstar();
+    extract(data, dvar, bad, gain, bias, aperture, 1, &rstar, sky_method, sky_thresh, sky_error, extraction_method,
+            zapped, shape, pepper, saturate, &counts, &sigma, sky, nsky, nrej, &ecode, &worst, nsubdiv, annulus_tol);
+}
+
+/** As the first version of extract_flux, but for several radii of the star aperture at once, all of which must
+ * be valid for the aperture, the radius of which is otherwise ignored. The sky is estimated once for all of
+ * the radii and the pixels are visited just once, so this is much faster than extracting each radius in turn,
+ * while giving exactly the same results. The counts, sigma, ecode and worst arguments are returned for each radius;
+ * the sky, nsky and nrej arguments are shared by all the radii.
+ * \param rstar the star aperture radii, unbinned pixels
+ */
+void Ultracam::extract_flux(const Image& data, const Image& dvar, const Image& bad,
+                const Image& gain, const Image& bias, const Aperture& aperture, const std::vector<float>& rstar,
+                Reduce::SKY_METHOD sky_method, float sky_thresh, Reduce::SKY_ERROR sky_error, Reduce::EXTRACTION_METHOD extraction_method,
+                const std::vector<std::pair<int,int> >& zapped, const Reduce::Meanshape& shape, float pepper, float saturate,
+                std::vector<float>& counts, std::vector<float>& sigma, float& sky, int& nsky, int& nrej,
+                std::vector<Reduce::ERROR_CODES>& ecode, std::vector<int>& worst, int nsubdiv, float annulus_tol){
+    const int nrad = rstar.size();
+    counts.resize(nrad);
+    sigma.resize(nrad);
+    ecode.resize(nrad);
+    worst.resize(nrad);
+    if(nrad == 0) return;
+    extract(data, dvar, bad, gain, bias, aperture, nrad, &rstar[0], sky_method, sky_thresh, sky_error, extraction_method,
+            zapped, shape, pepper, saturate, &counts[0], &sigma[0], sky, nsky, nrej, &ecode[0], &worst[0],
+            nsubdiv, annulus_tol);
+}
@@ -1,6 +1,7 @@
 #include "trm/frame.h"
 #include "trm/header.h"
 #include "trm/fdisk.h"
+#include "trm/ucm_index.h"
 
 /** Constructor of an Fdisk which opens a disk file, reads the start and positions an internal
  * pointer just before the start of the data
@@ -52,8 +53,13 @@ Ultracam::Fdisk::Fdisk(const std::string& file, int nbuff, int wccd) : nbuff_(nb
   if(wccd_ && wccd_ > num_ccd)
     throw Ultracam::Ultracam_Error("Ultracam::Fdisk::Fdisk(const std::string&, int, int): failed to read number of ccds");
 
-  // Now get to start of the CCD requested
-  if(wccd_ > 1){
+  // Now get to start of the CCD requested, directly if the file has an index
+  Ultracam::Ucm_index index;
+  if(wccd_ > 1 && !old && index.read(fin, swap_bytes)){
+
+    fin.seekg(index.ccd[wccd_-1]);
+
+  }else if(wccd_ > 1){
 
     int nsofar = 1;
     while(nsofar < wccd_){
@@ -218,3 +224,85 @@ Ultracam::internal_data Ultracam::Fdisk::get_next() {
   return buff[ptr];
 }
 
+
+/** Gets the next n pixel values, equivalent to n calls to get_next() but copying
+ * straight from the buffer as far as possible.
+ * \param dest   array to store the values in
+ * \param n      the number of values to get
+ * \param stride the spacing of the values in dest, so that the i-th value goes into dest[i*stride].
+ * This allows the values from several files to be interleaved.
+ */
+void Ultracam::Fdisk::get_next(Ultracam::internal_data* dest, int n, int stride) {
+
+  while(n > 0){
+
+    // Number of pixels available in the buffer without moving to a new window or refilling
+    int pos   = window.nx()*ny_ + nx_;
+    int avail = std::min(nbuff_ - ptr - 1, window.ntot() - pos - 1);
+
+    if(avail > 0){
+      int ncopy = std::min(n, avail);
+      const Ultracam::internal_data* bptr = buff + ptr + 1;
+      for(int i=0; i<ncopy; i++, dest += stride)
+        *dest = bptr[i];
+      ptr += ncopy;
+      pos += ncopy;
+      ny_  = pos / window.nx();
+      nx_  = pos % window.nx();
+      n   -= ncopy;
+
+    }else{
+
+      // Let get_next deal with the change of window or buffer refill
+      *dest = get_next();
+      dest += stride;
+      n--;
+    }
+  }
+}
+
+/** Skips the next n pixel values, equivalent to n calls to get_next() but seeking past
+ * data within a window rather than reading it. This allows a part of a frame to be accessed
+ * without reading everything before it.
+ * \param n the number of values to skip
+ */
+void Ultracam::Fdisk::skip(size_t n) {
+
+  while(n > 0){
+
+    int pos   = window.nx()*ny_ + nx_;
+    int left  = window.ntot() - pos - 1;
+    int avail = std::min(nbuff_ - ptr - 1, left);
+
+    if(avail > 0){
+
+      // Skip within the buffer
+      int nskip = int(std::min(n, size_t(avail)));
+      ptr += nskip;
+      pos += nskip;
+      ny_  = pos / window.nx();
+      nx_  = pos % window.nx();
+      n   -= nskip;
+
+    }else if(left > 1 && n > 1){
+
+      // Buffer exhausted part way through a window. Seek past all but the last pixel to
+      // skip in this window so that get_next refills the buffer from there.
+      int nseek = int(std::min(n, size_t(left))) - 1;
+      size_t nbytes = out_type_ == Windata::RAW ? sizeof(Ultracam::raw_data) : sizeof(Ultracam::internal_data);
+      if(!fin.seekg(nbytes*nseek, std::ios::cur))
+        throw Ultracam::Read_Error("Ultracam::Fdisk::skip(size_t): error seeking past data");
+      nread_ += nseek;
+      pos    += nseek;
+      ny_     = pos / window.nx();
+      nx_     = pos % window.nx();
+      n      -= nseek;
+
+    }else{
+
+      // Let get_next deal with the change of window or buffer refill
+      get_next();
+      n--;
+    }
+  }
+}
@@ -1,15 +1,23 @@
 #include <cstdlib>
 #include <string>
+#include <vector>
 #include "trm/subs.h"
 #include "trm/constants.h"
 #include "trm/ultracam.h"
-
-void sub_back(float* y, int i1, int i2);
+#include "trm/parallel.h"
+#include "trm/findpos.h"
 
 /*! \file
-  \brief Defines the findpos function
+  \brief Defines the findpos function and the Findpos class
 */
 
+namespace {
+
+  // The Findpos of each thread used by findpos
+  Ultracam::Thread_cache<Ultracam::Findpos> thread_findpos;
+
+}
+
 /**
  * findpos is a workhorse routine for measuring target positions
  * as required when defining aperture positions.
@@ -26,8 +34,8 @@ void sub_back(float* y, int i1, int i2);
  *
  * If the routine gets stuck it will throw an Ultracam_Error.
  *
- * If you compile with -DPLOT then extra plotting section are enabled which can be useful
- * for checking on troublesome cases.
+ * The work is done by a Findpos kept for each thread, so that buffers are not re-allocated from
+ * one call to the next.
  *
  * \param dat 2D array such that dat[iy][ix] gives the value of (ix,iy).
  * \param var 2D array such that var[iy][ix] gives the variance of (ix,iy).
@@ -54,6 +62,19 @@ void Ultracam::findpos(internal_data **dat, internal_data **var, int nx, int ny,
                int hwidth_x, int hwidth_y, float xstart, float ystart, bool bias,
                double& xpos, double &ypos, float& ex, float& ey){
 
+  thread_findpos.get().find(dat, var, nx, ny, fwhm_x, fwhm_y, hwidth_x, hwidth_y, xstart, ystart, bias, xpos, ypos, ex, ey);
+
+}
+
+Ultracam::Findpos::Findpos() : xlo(0), xhi(-1), ylo(0), yhi(-1), xprof(), vxprof(), yprof(), vyprof(), wgt(), temp() {}
+
+/**
+ * Locates one target exactly as findpos does; see findpos for the arguments.
+ */
+void Ultracam::Findpos::find(internal_data **dat, internal_data **var, int nx, int ny, float fwhm_x, float fwhm_y,
+                             int hwidth_x, int hwidth_y, float xstart, float ystart, bool bias,
+                             double& xpos, double &ypos, float& ex, float& ey){
+
   try {
 
     // Check start position
@@ -61,27 +82,20 @@ void Ultracam::findpos(internal_data **dat, internal_data **var, int nx, int ny,
       throw Ultracam_Error("findpos: initial posiion outside array boundary");
 
     // Define region to examine
-    int xlo = int(xstart+0.5) - hwidth_x;
-    int xhi = int(xstart+0.5) + hwidth_x;
-    int ylo = int(ystart+0.5) - hwidth_y;
-    int yhi = int(ystart+0.5) + hwidth_y;
-
-    // Make sure its in range
-    xlo = xlo < 0  ? 0   : xlo;
-    xhi = xhi < nx ? xhi : nx-1;
-    ylo = ylo < 0  ? 0   : ylo;
-    yhi = yhi < ny ? yhi : ny-1;
-
-    // Collapse in X
-    float xprof[nx], vxprof[nx];
-    for(int ix=xlo; ix<=xhi; ix++)
-      xprof[ix]  = vxprof[ix] = 0.;
+    set_box(nx, ny, hwidth_x, hwidth_y, xstart, ystart);
 
+    // Collapse in X and Y
     for(int iy=ylo; iy<=yhi; iy++){
+      const internal_data *d = dat[iy], *v = var[iy];
+      float ysum = 0., vysum = 0.;
       for(int ix=xlo; ix<=xhi; ix++){
-    xprof[ix]  += dat[iy][ix];
-    vxprof[ix] += var[iy][ix];
+        xprof[ix]  += d[ix];
+        vxprof[ix] += v[ix];
+        ysum       += d[ix];
+        vysum      += v[ix];
       }
+      yprof[iy]  = ysum;
+      vyprof[iy] = vysum;
     }
 
     // Search for maximum
@@ -89,120 +103,121 @@ void Ultracam::findpos(internal_data **dat, internal_data **var, int nx, int ny,
     float fmax = xprof[xmax];
     if(!bias){
       for(int ix=xlo+1; ix<=xhi-1; ix++){
-    if(xprof[ix] > fmax){
-      fmax = xprof[ix];
-      xmax = ix;
-    }
+        if(xprof[ix] > fmax){
+          fmax = xprof[ix];
+          xmax = ix;
+        }
       }
       xstart = float(xmax);
     }
 
     // Measure first X position
     sub_back(xprof, xlo, xhi);
-    Subs::centroid(xprof,vxprof,xlo,xhi,fwhm_x,xstart,true,xpos,ex);
-
-    // Collapse in Y
-    float yprof[ny], vyprof[ny];
-
-    for(int iy=ylo; iy<=yhi; iy++)
-      vyprof[iy] = yprof[iy]  = 0.;
-
-    for(int iy=ylo; iy<=yhi; iy++){
-      for(int ix=xlo; ix<=xhi; ix++){
-    yprof[iy]  += dat[iy][ix];
-    vyprof[iy] += var[iy][ix];
-      }
-    }
+    Subs::centroid(&xprof[0],&vxprof[0],xlo,xhi,fwhm_x,xstart,true,xpos,ex);
 
     // Search for maximum
     int   ymax = ylo+1;
     fmax = yprof[ymax];
     if(!bias){
       for(int iy=ylo+1; iy<=yhi-1; iy++){
-    if(yprof[iy] > fmax){
-      fmax = yprof[iy];
-      ymax = iy;
-    }
+        if(yprof[iy] > fmax){
+          fmax = yprof[iy];
+          ymax = iy;
+        }
       }
       ystart = float(ymax);
     }
 
     // Measure first Y position
     sub_back(yprof, ylo, yhi);
-    Subs::centroid(yprof,vyprof,ylo,yhi,fwhm_y,ystart,true,ypos,ey);
+    Subs::centroid(&yprof[0],&vyprof[0],ylo,yhi,fwhm_y,ystart,true,ypos,ey);
 
     // Redefine region to examine
-    xlo = int(xpos+0.5) - hwidth_x;
-    xhi = int(xpos+0.5) + hwidth_x;
-    ylo = int(ypos+0.5) - hwidth_y;
-    yhi = int(ypos+0.5) + hwidth_y;
-
-    // Make sure its in range
-    xlo = xlo < 0  ? 0   : xlo;
-    xhi = xhi < nx ? xhi : nx-1;
-    ylo = ylo < 0  ? 0   : ylo;
-    yhi = yhi < ny ? yhi : ny-1;
+    set_box(nx, ny, hwidth_x, hwidth_y, xpos, ypos);
 
     // Weighted collapse in X
-    float wgt;
-    float norm = 0.;
-    for(int ix=xlo; ix<=xhi; ix++){
-      xprof[ix]  = 0.;
-      vxprof[ix] = 0.;
-    }
+    const double sigma_x = fwhm_x/Constants::EFAC, sigma_y = fwhm_y/Constants::EFAC;
     for(int iy=ylo; iy<=yhi; iy++){
-      wgt = exp(-Subs::sqr((float(iy)-ypos)/(fwhm_y/Constants::EFAC))/2.);
-      norm += wgt;
+      float w = exp(-Subs::sqr((float(iy)-ypos)/sigma_y)/2.);
+      const internal_data *d = dat[iy], *v = var[iy];
       for(int ix=xlo; ix<=xhi; ix++){
-    xprof[ix]  += wgt*dat[iy][ix];
-    vxprof[ix] += wgt*wgt*var[iy][ix];
+        xprof[ix]  += w*d[ix];
+        vxprof[ix] += w*w*v[ix];
       }
     }
 
-    xstart = xpos;
-
     // Measure weighted X position
+    xstart = xpos;
     sub_back(xprof, xlo, xhi);
-    Subs::centroid(xprof,vxprof,xlo,xhi,fwhm_x,xstart,true,xpos,ex);
+    Subs::centroid(&xprof[0],&vxprof[0],xlo,xhi,fwhm_x,xstart,true,xpos,ex);
+
+    // Weighted collapse in Y, a row at a time
+    for(int ix=xlo; ix<=xhi; ix++)
+      wgt[ix] = exp(-Subs::sqr((float(ix)-xpos)/sigma_x)/2.);
 
-    // Weighted collapse in Y
     for(int iy=ylo; iy<=yhi; iy++){
-      yprof[iy]  = 0.;
-      vyprof[iy] = 0.;
-    }
-    norm = 0.;
-    for(int ix=xlo; ix<=xhi; ix++){
-      wgt = exp(-Subs::sqr((float(ix)-xpos)/(fwhm_x/Constants::EFAC))/2.);
-      norm += wgt;
-      for(int iy=ylo; iy<=yhi; iy++){
-    yprof[iy]  += wgt*dat[iy][ix];
-    vyprof[iy] += wgt*wgt*var[iy][ix];
+      const internal_data *d = dat[iy], *v = var[iy];
+      float ysum = 0., vysum = 0.;
+      for(int ix=xlo; ix<=xhi; ix++){
+        ysum  += wgt[ix]*d[ix];
+        vysum += wgt[ix]*wgt[ix]*v[ix];
       }
+      yprof[iy]  = ysum;
+      vyprof[iy] = vysum;
     }
 
     // Measure weighted Y position
     ystart = ypos;
     sub_back(yprof, ylo, yhi);
-    Subs::centroid(yprof,vyprof,ylo,yhi,fwhm_y,ystart,true,ypos,ey);
+    Subs::centroid(&yprof[0],&vyprof[0],ylo,yhi,fwhm_y,ystart,true,ypos,ey);
   }
   catch(const Subs::Subs_Error& err){
     throw Ultracam_Error("Ultracam::findpos: failed to measure position. Re-thrown this error\n" + err);
   }
 }
 
-// Subtracts median as an estimate of the background
-// y is the array, i1 and i2 are the first and last elements
-// to consider. This is to help the centroiding which may otherwise
-// be affected by edge effects.
-void sub_back(float* y, int i1, int i2){
+// Sets the region to examine, +/- the half-widths around the pixel nearest to x,y,
+// making sure that it is in range, and zeroes the profiles over it. The profiles
+// reach one element beyond the box so that the element read by the maximum search
+// is always there.
+void Ultracam::Findpos::set_box(int nx, int ny, int hwidth_x, int hwidth_y, double x, double y){
+
+  xlo = int(x+0.5) - hwidth_x;
+  xhi = int(x+0.5) + hwidth_x;
+  ylo = int(y+0.5) - hwidth_y;
+  yhi = int(y+0.5) + hwidth_y;
+
+  xlo = xlo < 0  ? 0   : xlo;
+  xhi = xhi < nx ? xhi : nx-1;
+  ylo = ylo < 0  ? 0   : ylo;
+  yhi = yhi < ny ? yhi : ny-1;
+
+  if(int(xprof.size()) < xhi+2){
+    xprof.resize(xhi+2);
+    vxprof.resize(xhi+2);
+    wgt.resize(xhi+2);
+  }
+  if(int(yprof.size()) < yhi+2){
+    yprof.resize(yhi+2);
+    vyprof.resize(yhi+2);
+  }
+  for(int ix=xlo; ix<=xhi+1; ix++)
+    xprof[ix] = vxprof[ix] = 0.f;
+  for(int iy=ylo; iy<=yhi+1; iy++)
+    yprof[iy] = vyprof[iy] = 0.f;
+}
+
+// Subtracts median as an estimate of the background from elements i1 to i2 of
+// a profile. This is to help the centroiding which may otherwise be affected by edge effects.
+void Ultracam::Findpos::sub_back(std::vector<float>& prof, int i1, int i2){
 
   // make a temporary copy of the input data
-  float temp[i2-i1+1];
-  for(int i=i1,j=0; i<=i2; i++,j++) temp[j] = y[i];
+  temp.assign(prof.begin()+i1, prof.begin()+i2+1);
 
   // determine the median
-  float back = Subs::select(temp,i2-i1+1,(i2-i1+1)/2);
+  const int n = i2 - i1 + 1;
+  float back = Subs::select(&temp[0],n,n/2);
 
   // subtract
-  for(int i=i1; i<=i2; i++) y[i] -= back;
+  for(int i=i1; i<=i2; i++) prof[i] -= back;
 }
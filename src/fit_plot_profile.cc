@@ -1,6 +1,7 @@
 #include "trm/subs.h"
 #include "trm/ccd.h"
 #include "trm/ultracam.h"
+#include "trm/profile_fitter.h"
 
 /** fit_plot_profile is a high-level routine that carries out initialisation,
  * position tweaking, fitting, rejection and plotting of gaussian or moffat profiles.
@@ -113,30 +114,14 @@ void Ultracam::fit_plot_profile(const Image& data, const Image& dvar, Ppars& pro
   iprofile.rmax = rmax;
 
   // Fit
-  double alambda, alambdaold;
-  double oldchisq, chisq, sfac;
+  Profile_fitter fitter;
+  double chisq, sfac;
   int nits = 0, nrej = 0, nrejected = 1, ncycle = 0, ndof = (yhi-ylo)*(xhi-xlo) - profile.npar();
 
   if(ndof < 5) throw Ultracam::Ultracam_Error("Oops! Too few points for profile fit");
 
   while(nits < 4 && nrejected > 0){
-    alambda  = -1.;
-    alambdaold  = -2.;
-    int ncount   = 0;
-    oldchisq = 1.;
-    chisq    = 0.;
-    while((oldchisq - chisq > 0.001 || alambda > alambdaold || alambda > 0.001) && ncount < 100){
-      alambdaold = alambda;
-      oldchisq   = chisq;
-
-      if(profile.ptype == Ppars::GAUSSIAN){
-    Ultracam::fitgaussian(win, sigwin, xlo, xhi, ylo, yhi, profile, chisq, alambda, iprofile.covar);
-      }else if(profile.ptype == Ppars::MOFFAT){
-    Ultracam::fitmoffat(win, sigwin, xlo, xhi, ylo, yhi, profile, chisq, alambda, iprofile.covar);
-      }
-      ncount++;
-    }
-    nits += ncount;
+    nits += fitter.fit(win, sigwin, xlo, xhi, ylo, yhi, profile, chisq, iprofile.covar);
 
     // Rejection loop
     if(nits < 4){
@@ -196,13 +181,8 @@ void Ultracam::fit_plot_profile(const Image& data, const Image& dvar, Ppars& pro
     throw Ultracam::Ultracam_Error("fit_plot_profile: the fit has failed");
 
 
-  // Set alambda = 0. to get the covariances right
-  alambda = 0.;
-  if(profile.ptype == Ppars::GAUSSIAN){
-    Ultracam::fitgaussian(win, sigwin, xlo, xhi, ylo, yhi, profile, chisq, alambda, iprofile.covar);
-  }else if(profile.ptype == Ppars::MOFFAT){
-    Ultracam::fitmoffat(win, sigwin, xlo, xhi, ylo, yhi, profile, chisq, alambda, iprofile.covar);
-  }
+  // Get the covariances right
+  fitter.covariances(profile, iprofile.covar);
 
   iprofile.chisq  = chisq;
   iprofile.ndof   = ndof;
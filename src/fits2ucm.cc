@@ -20,7 +20,9 @@ require updates to this routine to adjust for different header names. Usually
 I base these on one or two example frames so they may not be completely
 general.  The times in the headers are corrected to the mid-exposure time as
 assumed in the ultracam software. The file name is preserved by this routine
-so that 'abc.fits' for instance becomes 'abc.ucm'
+so that 'abc.fits' for instance becomes 'abc.ucm'. The ucm files are written in version 2
+format, which adds an index of the positions of the CCDs and windows to the end of the file.
+Software that predates the index can still read these files.
 
 If you want to add another format, please look at the code for instructions.
 
@@ -4,6 +4,7 @@
 #include "trm/mccd.h"
 #include "trm/subs.h"
 #include "trm/ultracam.h"
+#include "trm/ucm_index.h"
 
 Ultracam::Frame::Frame(const std::string& file, int nc){
     read(file,nc);
@@ -56,44 +57,73 @@ void Ultracam::Frame::format(const Ultracam::Frame& frame){
 
 // Read files
 
-/**
- * This function reads in an ULTRACAM file from disk. \sa Ultracam::Frame::Frame(const string&, int)
- * \param file the file name to read
- * \param nc the CCD number to read, 0 for all of them.
- */
-void Ultracam::Frame::read(const std::string& file, int nc){
+namespace {
+
+  // Opens a ucm file and reads its magic number, leaving the stream at the start of the header.
+  // Returns true if the file is in the old format which pre-dates the magic number.
+  bool open_ucm(const std::string& file, std::ifstream& fin, bool& swap_bytes){
+
+    fin.open(Subs::filnam(file,Ultracam::Frame::extnam()).c_str(), std::ios::binary);
 
-  std::ifstream fin(Subs::filnam(file,Ultracam::Frame::extnam()).c_str(), std::ios::binary);
+    if(!fin)
+      throw Ultracam::File_Open_Error("Ultracam::Frame::read(std::string&, int): failed to open \"" +
+                                      Subs::filnam(file,Ultracam::Frame::extnam()));
 
-  if(!fin)
-    throw File_Open_Error("Ultracam::Frame::read(std::string&, int): failed to open \"" + Subs::filnam(file,extnam()));
+    // Read and test magic number which is supposed to indicate that this is a ucm file. This
+    // was introduced only in Sept 2004 so there are backwards compatibility issues to deal with
+    // too as the format changed slightly at the same time.
+    Subs::INT4 magic;
+    fin.read((char*)&magic,sizeof(Subs::INT4));
+    if(!fin)
+      throw Ultracam::Ultracam_Error("Ultracam::Frame::read(std::string&, int): failed to read ucm magic number");
 
-  // Read and test magic number which is supposed to indicate that this is a ucm file. This
-  // was introduced only in Sept 2004 so there are backwards compatibility issues to deal with
-  // too as the format changed slightly at the same time.
-  Subs::INT4 magic;
-  fin.read((char*)&magic,sizeof(Subs::INT4));
-  if(!fin)
-    throw Ultracam_Error("Ultracam::Frame::read(std::string&, int): failed to read ucm magic number");
+    // Check for non-native data
+    swap_bytes = (Subs::byte_swap(magic) == Ultracam::MAGIC);
 
-  // Check for non-native data
-  bool swap_bytes = (Subs::byte_swap(magic) == Ultracam::MAGIC);
+    // Check here also allows for swapping
+    bool old = !swap_bytes && (magic != Ultracam::MAGIC);
 
-  // Check here also allows for swapping
-  bool old = !swap_bytes && (magic != Ultracam::MAGIC);
+    // If it is old, and we are on a bigendian machine, then
+    // we will have to swap bytes (because all old files were written on little-endian machines)
+    if(old && Subs::is_big_endian()) swap_bytes = true;
 
-  // If it is old, and we are on a bigendian machine, then
-  // we will have to swap bytes (because all old files were written on little-endian machines)
-  if(old && Subs::is_big_endian()) swap_bytes = true;
+    // If 'old' then no magic number and we should wind back to start
+    if(old) fin.seekg(0);
+
+    return old;
+  }
+
+}
+
+/**
+ * This function reads in an ULTRACAM file from disk. \sa Ultracam::Frame::Frame(const string&, int)
+ * \param file the file name to read
+ * \param nc the CCD number to read, 0 for all of them. If the file has an index, a single CCD
+ * is read by seeking straight to it.
+ */
+void Ultracam::Frame::read(const std::string& file, int nc){
 
-  // If 'old' then no magic number and we should wind back to start
-  if(old) fin.seekg(0);
+  std::ifstream fin;
+  bool swap_bytes;
+  bool old = open_ucm(file, fin, swap_bytes);
 
   // Read header as usual
   Subs::Header::read(fin, swap_bytes);
 
-  // backwards compatible stuff
-  if(old){
+  // A single CCD of a file with an index can be read directly
+  Ultracam::Ucm_index index;
+  if(!old && nc > 0 && index.read(fin, swap_bytes)){
+    if(nc > int(index.ccd.size()))
+      throw Ultracam_Error("nc = " + Subs::str(nc) + " too large. Max value = " + Subs::str(index.ccd.size()) +
+                           " in void Ultracam::Frame::read(const std::string&, int)");
+    if(index.ccd.size() != this->size()) this->Mimage::resize(index.ccd.size());
+    fin.seekg(index.ccd[nc-1]);
+    (*this)[nc-1].read(fin, swap_bytes);
+    if(!fin)
+      throw Read_Error("Ultracam::Frame::read(const std::string&, int): failed to read CCD " + Subs::str(nc) +
+                       " of " + Subs::filnam(file,extnam()));
+
+  }else if(old){
     Mimage::read_old(fin,swap_bytes,nc);
   }else{
     Mimage::read(fin,swap_bytes,nc);
@@ -101,11 +131,26 @@ void Ultracam::Frame::read(const std::string& file, int nc){
   fin.close();
 }
 
+/**
+ * This function reads just the header of an ULTRACAM file, which comes at the start of
+ * the file, leaving the data and format untouched. This is much faster than reading the
+ * whole file when only header items such as the time are needed.
+ * \param file the file name to read
+ */
+void Ultracam::Frame::read_header(const std::string& file){
+  std::ifstream fin;
+  bool swap_bytes;
+  open_ucm(file, fin, swap_bytes);
+  Subs::Header::read(fin, swap_bytes);
+  fin.close();
+}
+
 // Write files
 
 /**
  * This function writes an ULTRACAM file to disk. It will over-write any existing files,
- * so be careful.
+ * so be careful. Files are written in version 2 format, i.e. followed by an index of the
+ * positions of the CCDs and windows (see Ucm_index), but remain readable as version 1 files.
  * \param file  name of file to write.
  * \param otype data type to store on disk (RAW form can save on disk space but may lose precision)
  */
@@ -122,16 +167,29 @@ void Ultracam::Frame::write(const std::string& file,  Windata::Out_type otype) c
   // 29/09/2004
   fout.write((char*)&Ultracam::MAGIC, sizeof(Subs::INT4));
 
-  // Write header then data
+  // Write header then data, recording the positions of each part for the index
+  Ultracam::Ucm_index index;
+  index.header = Ultracam::Ucm_index::offset(fout);
   Subs::Header::write(fout);
-  if(otype == Windata::NORMAL){
-    Mimage::write(fout);
-  }else{
-    Subs::INT4 nccd = Subs::INT4(this->size());
-    fout.write((char*)&nccd, sizeof(Subs::INT4));
-    for(int ic=0; ic<nccd; ic++)
-      (*this)[ic].write(fout,otype);
+
+  Subs::INT4 nccd = Subs::INT4(this->size());
+  fout.write((char*)&nccd, sizeof(Subs::INT4));
+  index.ccd.resize(nccd);
+  index.win.resize(nccd);
+  for(int ic=0; ic<nccd; ic++){
+    const Image& ccd = (*this)[ic];
+    index.ccd[ic] = Ultracam::Ucm_index::offset(fout);
+    Subs::INT4 nwin = Subs::INT4(ccd.size());
+    fout.write((char*)&nwin, sizeof(Subs::INT4));
+    index.win[ic].resize(nwin);
+    for(int iw=0; iw<nwin; iw++){
+      index.win[ic][iw] = Ultracam::Ucm_index::offset(fout);
+      ccd[iw].write(fout,otype);
+    }
   }
+
+  // Finally the index, which makes this a version 2 file
+  index.write(fout);
   fout.close();
 }
 
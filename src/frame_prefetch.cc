@@ -0,0 +1,150 @@
+#include <pthread.h>
+#include "trm/subs.h"
+#include "trm/header.h"
+#include "trm/frame.h"
+#include "trm/ultracam.h"
+#include "trm/header_items.h"
+#include "trm/frame_source.h"
+#include "trm/frame_prefetch.h"
+#include "trm/parallel.h"
+
+/** Constructor of a Frame_prefetch. This allocates the pool of frames and starts
+ * the reader thread which immediately starts to read frames.
+ * \param server the source of the frames. This should not be accessed by anything else
+ * while the Frame_prefetch exists.
+ * \param format a Frame with the correct format and header for the data
+ * \param first  the first frame to read, starting from 1
+ * \param depth  the maximum number of frames to read ahead, at least 1
+ * \param twait  time to wait between attempts to read a frame, seconds
+ * \param tmax   maximum time to wait for any one frame, seconds
+ */
+Ultracam::Frame_prefetch::Frame_prefetch(Frame_source& server, const Frame& format, size_t first, int depth,
+                                         double twait, double tmax) :
+  server(server), twait(twait), tmax(tmax), next(first), pool(), pool_nfile(), pool_items(), items_(), free_slots(), full_slots(),
+  finished(false), stop(false), failed(false), error() {
+
+  if(depth < 1)
+    throw Ultracam_Error("Ultracam::Frame_prefetch::Frame_prefetch: depth = " + Subs::str(depth) + " must be > 0");
+
+  pool.resize(depth, format);
+  pool_nfile.resize(depth, 0);
+  pool_items.resize(depth);
+  for(int i=0; i<depth; i++)
+    free_slots.push_back(i);
+
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+
+  if(pthread_create(&thread, NULL, Frame_prefetch::reader, this)){
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+    throw Ultracam_Error("Ultracam::Frame_prefetch::Frame_prefetch: failed to start reader thread");
+  }
+}
+
+/** The destructor asks the reader thread to stop and waits for it to do so. If the reader
+ * is waiting for a frame to appear this may take up to the maximum wait time.
+ */
+Ultracam::Frame_prefetch::~Frame_prefetch(){
+  pthread_mutex_lock(&mutex);
+  stop = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, NULL);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+/** Gets the next frame in sequence, waiting for it to be read if need be.
+ * \param data the Frame to load into. It must have the same format as the one used to
+ * construct the Frame_prefetch. Its pixel buffers are recycled by the reader.
+ * \param nfile returned with the number of the frame
+ * \return true if a frame was returned, false if the end of the data has been reached.
+ */
+bool Ultracam::Frame_prefetch::get(Frame& data, size_t& nfile){
+
+  pthread_mutex_lock(&mutex);
+  while(full_slots.empty() && !finished)
+    pthread_cond_wait(&cond, &mutex);
+
+  if(full_slots.empty()){
+    bool bad = failed;
+    pthread_mutex_unlock(&mutex);
+    if(bad)
+      error.rethrow("Ultracam::Frame_prefetch::get(Frame&, size_t&)");
+    return false;
+  }
+
+  int slot = full_slots.front();
+  full_slots.pop_front();
+  pthread_mutex_unlock(&mutex);
+
+  // Hand over the pixels by swapping, copy the (small) header
+  static_cast<Mimage&>(data).swap(pool[slot]);
+  static_cast<Subs::Header&>(data) = static_cast<const Subs::Header&>(pool[slot]);
+  nfile  = pool_nfile[slot];
+  items_ = pool_items[slot];
+
+  pthread_mutex_lock(&mutex);
+  free_slots.push_back(slot);
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  return true;
+}
+
+// Entry point for pthread_create
+void* Ultracam::Frame_prefetch::reader(void* arg){
+  static_cast<Frame_prefetch*>(arg)->run();
+  return NULL;
+}
+
+// Reads frames until the end of the data, an error or a request to stop.
+void Ultracam::Frame_prefetch::run(){
+
+  size_t nfile = next;
+  bool reset   = true;
+
+  for(;;){
+
+    // Wait for a free frame
+    pthread_mutex_lock(&mutex);
+    while(free_slots.empty() && !stop)
+      pthread_cond_wait(&cond, &mutex);
+    if(stop){
+      pthread_mutex_unlock(&mutex);
+      return;
+    }
+    int slot = free_slots.front();
+    free_slots.pop_front();
+    pthread_mutex_unlock(&mutex);
+
+    // The error is stored directly: get only reads it once 'failed' is set under the mutex
+    bool ok = false, bad = false;
+    try{
+      ok = server.get(pool[slot], nfile, twait, tmax, reset);
+      if(ok) pool_items[slot] = server.items();
+    }
+    catch(...){
+      bad = true;
+      error.store();
+    }
+    reset = false;
+
+    pthread_mutex_lock(&mutex);
+    if(ok){
+      pool_nfile[slot] = nfile;
+      full_slots.push_back(slot);
+      nfile++;
+    }else{
+      free_slots.push_back(slot);
+      finished = true;
+      failed   = bad;
+    }
+    pthread_cond_broadcast(&cond);
+    bool done = !ok || stop;
+    pthread_mutex_unlock(&mutex);
+
+    if(done) return;
+  }
+}
@@ -0,0 +1,541 @@
+// Make sure that we can access > 2^31 bytes
+
+#define _LARGEFILE_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <curl/curl.h>
+#include <curl/easy.h>
+#include "trm/subs.h"
+#include "trm/time.h"
+#include "trm/frame.h"
+#include "trm/ultracam.h"
+#include "trm/signal.h"
+#include "trm/header_items.h"
+#include "trm/frame_source.h"
+
+//! Default constructor
+Ultracam::Frame_source::Frame_source() : source_(0), url_(), serverdata_(), headerskip(0), lastfile(0), curl_handle(NULL),
+  frame(NULL), fd(-1), map_start(NULL), map_size(0), archive(), nthreads_(1), items_() {
+  buffer.memory = NULL;
+  buffer.size   = buffer.posn = 0;
+}
+
+/** Constructor of a Frame_source. See Frame_source::open for details.
+ * \param source source of data: either 'S' for server or 'L' for local .xml file.
+ * \param url URL of file, or name of file on a local disk. Do not add '.xml' to it.
+ * \param serverdata data compiled by parseXML
+ */
+Ultracam::Frame_source::Frame_source(char source, const std::string& url, const ServerData& serverdata) :
+  source_(0), url_(), serverdata_(), headerskip(0), lastfile(0), curl_handle(NULL),
+  frame(NULL), fd(-1), map_start(NULL), map_size(0), archive(), nthreads_(1), items_() {
+  buffer.memory = NULL;
+  buffer.size   = buffer.posn = 0;
+  open(source, url, serverdata);
+}
+
+//! Destructor
+Ultracam::Frame_source::~Frame_source(){
+  close();
+}
+
+/** Defines the source of frames. This allocates the raw data buffer and, in the
+ * case of the server, initialises the cURL handle which is then re-used for every
+ * frame so that the connection to the server can be kept alive. Any previous source
+ * is closed down first.
+ * \param source source of data: either 'S' for server or 'L' for local .xml file.
+ * \param url URL of file, as in 'http://127.0.0.1:8007/run00000001', or name of file on
+ * a local disk. Do not add '.xml' to it.
+ * \param serverdata data compiled by parseXML
+ */
+void Ultracam::Frame_source::open(char source, const std::string& url, const ServerData& serverdata){
+
+  if(source != 'S' && source != 'L')
+    throw Ultracam_Error("Ultracam::Frame_source::open(char, const std::string&, const ServerData&): "
+                         "source must be 'S' or 'L'");
+
+  close();
+
+  source_     = source;
+  url_        = url;
+  serverdata_ = serverdata;
+  lastfile    = 0;
+  headerskip  = serverdata_.headerwords*serverdata_.wordsize;
+  items_      = Header_items();
+
+  // allocate the buffer (only needed for local files if they cannot be mapped)
+  buffer.size   = std::max(1000, serverdata_.framesize);
+  buffer.memory = (char *)malloc(buffer.size);
+  if(!buffer.memory) throw Ultracam_Error("Ultracam::Frame_source::open(char, const std::string&, const ServerData&): "
+                                          "failed to allocate read buffer");
+  buffer.posn = 0;
+
+  if(source_ == 'S'){
+
+    // initialise cURL
+    curl_handle = curl_easy_init();
+    if(!curl_handle)
+      throw Ultracam_Error("Ultracam::Frame_source::open(char, const std::string&, const ServerData&): "
+                           "failed to initialise cURL");
+
+    // Send all data to WriteFunction
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+
+    // pass the buffer to the callback function
+    curl_easy_setopt(curl_handle, CURLOPT_FILE, (void *)&buffer);
+
+    // Set up an error buffer
+    error_buffer[0] = 0;
+    curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, error_buffer);
+
+  }else{
+    open_local();
+  }
+}
+
+// Releases everything
+void Ultracam::Frame_source::close(){
+  if(curl_handle){
+    curl_easy_cleanup(curl_handle);
+    curl_handle = NULL;
+  }
+  close_local();
+  if(buffer.memory){
+    free(buffer.memory);
+    buffer.memory = NULL;
+  }
+  buffer.size = buffer.posn = 0;
+  frame   = NULL;
+  source_ = 0;
+}
+
+// Opens the local file if it is not already open. The file is mapped later by local_nframes.
+// If there is no .dat file, a compressed run is opened instead.
+void Ultracam::Frame_source::open_local(){
+  if(fd < 0 && !archive.is_open()){
+    std::string file = url_ + ".dat";
+    fd = ::open(file.c_str(), O_RDONLY);
+    if(fd < 0){
+      if(!Raw_archive::exists(url_))
+        throw File_Open_Error(std::string("Ultracam::Frame_source::open_local(): failed to open ") + file);
+      archive.open(url_);
+      if(archive.framesize() != size_t(serverdata_.framesize) || archive.headerskip() != headerskip){
+        archive.close();
+        throw Ultracam_Error("Ultracam::Frame_source::open_local(): frame or header size of " + url_ + Raw_archive::extnam() +
+                             " does not match " + url_ + ".xml");
+      }
+    }
+    map_start = NULL;
+    map_size  = 0;
+  }
+}
+
+// Unmaps and closes the local file
+void Ultracam::Frame_source::close_local(){
+  if(map_start){
+    munmap(map_start, map_size);
+    map_start = NULL;
+    map_size  = 0;
+  }
+  if(fd >= 0){
+    ::close(fd);
+    fd = -1;
+  }
+  archive.close();
+  if(source_ == 'L') frame = NULL;
+}
+
+// Returns the number of complete frames in the local file. This costs a single fstat call
+// unless the file has grown, in which case the mapping is extended to cover the new frames.
+// Only complete frames are mapped so that a frame still being written is never touched.
+size_t Ultracam::Frame_source::local_nframes(){
+
+  if(archive.is_open()) return archive.nframes();
+
+  struct stat st;
+  if(fstat(fd, &st))
+    throw Ultracam_Error("size_t Ultracam::Frame_source::local_nframes(): failed to determine size of " +
+                         url_ + ".dat: " + strerror(errno));
+
+  size_t nframes = size_t(st.st_size / off_t(serverdata_.framesize));
+  size_t needed  = nframes*size_t(serverdata_.framesize);
+
+  if(needed > map_size){
+    if(map_start){
+      munmap(map_start, map_size);
+      map_start = NULL;
+      map_size  = 0;
+    }
+    void *addr = mmap(NULL, needed, PROT_READ, MAP_SHARED, fd, 0);
+    if(addr != MAP_FAILED){
+      map_start = static_cast<char*>(addr);
+      map_size  = needed;
+      madvise(map_start, map_size, MADV_SEQUENTIAL);
+    }
+  }
+  return nframes;
+}
+
+// Points frame at frame nfile (starting from 1) of the local file, which must exist. This is
+// a pointer straight into the mapping if there is one, otherwise the frame is read into the buffer.
+void Ultracam::Frame_source::local_frame(size_t nfile){
+
+  if(archive.is_open()){
+    archive.read(nfile, buffer.memory);
+    frame = buffer.memory;
+    return;
+  }
+
+  size_t offset = size_t(serverdata_.framesize)*(nfile-1);
+
+  if(map_start && offset + serverdata_.framesize <= map_size){
+    frame = map_start + offset;
+
+  }else{
+
+    size_t nread = 0;
+    while(nread < size_t(serverdata_.framesize)){
+      ssize_t n = pread(fd, buffer.memory + nread, serverdata_.framesize - nread, off_t(offset + nread));
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0)
+        throw Ultracam_Error("void Ultracam::Frame_source::local_frame(size_t):\n"
+                             " failed to read data from local disk file.");
+      nread += n;
+    }
+    frame = buffer.memory;
+  }
+}
+
+/** Gets a frame from the source.
+ * \param data       the data file to load into
+ * \param nfile the file number to read, starting from 1. Set = 0 to get the most recent frame, regardless of its number which will
+ * be returned.
+ * \param twait if you think the frame might appear while the program is running, then set twait to be the number of seconds
+ * wait between successive attempts at accessing it.
+ * \param tmax  this is the maximum amount of time worth waiting. Set <= 0 not to wait at all.
+ * \param reset allows you to start again, as needed for twopass operation (set = true for first one of second pass)
+ * \param demultiplex set this false if you are not interested in the data, but just the headers. It then avoids the demultiplexing
+ * stage.
+ * \return true if successful, false if not.
+ */
+bool Ultracam::Frame_source::get(Frame& data, size_t& nfile, double twait, double tmax, bool reset, bool demultiplex){
+  if(source_ == 0)
+    throw Ultracam_Error("bool Ultracam::Frame_source::get(Frame&, size_t&, double, double, bool, bool): no source defined");
+  if(!fetch(nfile, twait, tmax, reset)) return false;
+  interpret(data, nfile, demultiplex);
+  return true;
+}
+
+// Loads the raw data of frame nfile into the buffer, returning false if the frame
+// could not be found.
+bool Ultracam::Frame_source::fetch(size_t& nfile, double twait, double tmax, bool reset){
+
+  if(source_ == 'L' && (reset || (fd < 0 && !archive.is_open()))) open_local();
+
+  double total = 0.;
+
+  if(nfile == 0){
+
+    if(source_ == 'S'){
+
+      // If nfile == 0, it means we want the most recent frame, so we find out how many there are.
+      std::string URL = url_ + std::string("?action=get_num_frames");
+      curl_easy_setopt(curl_handle, CURLOPT_URL, URL.c_str());
+
+      nfile = 1;
+      int success = 1;
+      while((success || nfile == lastfile) && total <= tmax){
+
+        // Reset buffer
+        buffer.posn  = 0;
+
+        // Get the data
+        success = curl_easy_perform(curl_handle);
+
+        if(success != 0){
+
+          // This error is usually temporary
+          std::cerr << error_buffer << std::endl;
+          std::cerr << "Will wait one second before trying again" << std::endl;
+          Subs::sleep(1.);
+          total += 1.;
+
+        }else{
+
+          char* s = strstr(buffer.memory, "nframes=\"");
+          if(!s){
+            // Failed old method, try new server method.
+            s = strstr(buffer.memory, "appears to have");
+            if(!s)
+              throw Ultracam_Error("bool Ultracam::Frame_source::fetch(size_t&, double, double, bool):\n"
+                                   " could not find the number of frames (old or new server)");
+
+            // Chop off after number and translate
+            char* e = strchr(s+15, 'b');
+            *e = 0;
+            std::istringstream istr(s+15);
+            istr >> nfile;
+            if(!istr)
+              throw Ultracam_Error("bool Ultracam::Frame_source::fetch(size_t&, double, double, bool):\n"
+                                   " could not translate number of frames (new server)");
+
+          }else{
+
+            // Chop off quotes after number and translate
+            char* e = strchr(s+9, '"');
+            *e = 0;
+            std::istringstream istr(s+9);
+            istr >> nfile;
+            if(!istr)
+              throw Ultracam_Error("bool Ultracam::Frame_source::fetch(size_t&, double, double, bool):\n"
+                                   " could not translate number of frames (old server)");
+          }
+
+          if(nfile == lastfile){
+            if(tmax > 0.){
+              std::cerr << "Last file has not changed since last time\n";
+              std::cerr << "Will wait " << twait << " secs before trying again.\n";
+              Subs::sleep(twait);
+              total   += std::max(0.01,twait);
+              success = 1;
+            }else{
+              std::cerr << "Last file has not changed since last time\n";
+              std::cerr << "Finishing input of server data.\n";
+              return false;
+            }
+          }
+        }
+        if(global_ctrlc_set) break;
+      }
+
+    }else{
+
+      nfile = 1;
+      do{
+
+        // Determine number of files first
+        nfile = local_nframes();
+
+        if(nfile == lastfile){
+          if(tmax > 0.){
+            std::cerr << "Last file has not changed since last time = " << lastfile << std::endl;
+            std::cerr << "Will wait " << twait << " secs before trying again." << std::endl;
+            Subs::sleep(twait);
+            total   += std::max(0.01,twait);
+          }else{
+            if(nfile > 0){
+              std::cerr << "Last file has not changed since last time = " << lastfile << std::endl;
+              std::cerr << "Finishing input of data from local file." << std::endl;
+            }
+            close_local();
+            return false;
+          }
+        }
+      }while(nfile == lastfile && total <= tmax);
+
+    }
+
+    lastfile = nfile;
+
+    if(total > tmax || global_ctrlc_set){
+      if(total > tmax){
+        std::cerr << "Waited longer than the maximum = " << tmax << " secs." << std::endl;
+      }else{
+        std::cerr << "ctrl-C trapped inside Frame_source" << std::endl;
+      }
+      std::cerr << "Finishing input of server data." << std::endl;
+      close_local();
+      return false;
+    }
+  }
+
+  // OK, so we want to access file number 'nfile'
+  if(source_ == 'S'){
+
+    // For server, files start at 0
+    std::string URL = url_ + "?action=get_frame&frame=" + Subs::str(nfile - 1);
+
+    curl_easy_setopt(curl_handle, CURLOPT_URL, URL.c_str());
+
+    // keep trying because sometimes get errors when there is really no problem
+    int success = 1;
+    while(success && total <= tmax ){
+
+      buffer.posn  = 0;
+
+      // Get the data
+      success = curl_easy_perform(curl_handle);
+
+      if(success != 0){
+
+        // This error is usually temporary
+        std::cerr << error_buffer << std::endl;
+        std::cerr << "# Will wait one second before trying again" << std::endl;
+        Subs::sleep(1.);
+        total += 1.;
+
+      }else{
+
+        // Check type
+        char *content_type;
+        curl_easy_getinfo(curl_handle, CURLINFO_CONTENT_TYPE, &content_type);
+
+        if(content_type == NULL || strcmp(content_type, "image/data") != 0){
+
+          if(strcmp(buffer.memory, "observation") == 0)
+            throw Ultracam_Error("bool Ultracam::Frame_source::fetch(size_t&, double, double, bool):\n"
+                                 " wrong data returned = " + std::string(buffer.memory));
+
+          if(tmax > 0.){
+            std::cerr << "Suspect file number " << nfile << " is not ready yet." << std::endl;
+            std::cerr << "Will wait " << twait << " secs before trying again." << std::endl;
+            Subs::sleep(twait);
+            total   += std::max(0.01,twait);
+
+            // try again
+            success  = 1;
+          }else{
+            // No attempt to try again
+            return false;
+          }
+
+        }else{
+
+          // This should be good data but the fileserver of jan 2008 returns image/data
+          // even when the frame does not exist although it is only sending back a 404 error
+          if(strncmp(buffer.memory, "<h1>ERROR (404) - Not Found</h1>", 32) == 0){
+            if(tmax > 0.){
+              std::cerr << "Suspect file number " << nfile << " is not ready yet." << std::endl;
+              std::cerr << "Will wait " << twait << " secs before trying again." << std::endl;
+              Subs::sleep(twait);
+              total   += std::max(0.01,twait);
+
+              // try again
+              success  = 1;
+            }
+          }
+        }
+      }
+      if(global_ctrlc_set) break;
+    }
+
+  }else{
+
+    while(total <= tmax ){
+
+      // Compute number of frames to check that we are not asking for more than
+      // is available.
+      size_t nfile_tot = local_nframes();
+
+      if(nfile <= nfile_tot){
+
+        // OK point at the data
+        local_frame(nfile);
+
+        // everything OK
+        break;
+
+      }else{
+
+        if(tmax > 0.){
+          std::cerr << "Suspect file number " << nfile << " is not ready yet." << std::endl;
+          std::cerr << "Will wait " << twait << " secs before trying again." << std::endl;
+          Subs::sleep(twait);
+          total   += std::max(0.01,twait);
+
+        }else{
+          // No attempt to try again
+          close_local();
+          return false;
+        }
+      }
+      if(global_ctrlc_set) break;
+    }
+  }
+
+  if(total > tmax || global_ctrlc_set){
+    if(total > tmax){
+      std::cerr << "Waited longer than the maximum = " << tmax << " secs." << std::endl;
+    }else{
+      std::cerr << "ctrl-C trapped inside Frame_source" << std::endl;
+    }
+    std::cerr << "Finishing input of server data." << std::endl;
+    close_local();
+    return false;
+  }
+
+  if(source_ == 'S') frame = buffer.memory;
+
+  return true;
+}
+
+// Translates the raw data pointed to by frame into times, header items and (optionally) data.
+// The run items are loaded from the header of the first frame and the frame items from the
+// timing, so that neither the de-multiplexing nor users of items() need to search the header.
+void Ultracam::Frame_source::interpret(Frame& data, size_t nfile, bool demultiplex){
+
+  // Work out time and frame number
+  TimingInfo timing;
+  Ultracam::read_header(frame, serverdata_, timing);
+
+  if(!items_.run_set) items_.set_run(data);
+  items_.set_frame(timing);
+
+  if(timing.frame_number != int(nfile))
+    std::cerr << "WARNING: conflicting frame numbers in Ultracam::Frame_source::get: "
+              << timing.frame_number << " vs " << nfile << std::endl;
+
+  if(serverdata_.nblue > 1){
+    data.set("UT_date_blue",   new Subs::Htime(timing.ut_date_blue, "UT at the centre of the u-band exposure"));
+    data.set("Exposure_blue",  new Subs::Hfloat(timing.exposure_time_blue, "u-band exposure time, seconds"));
+    data.move_to_top("Exposure_blue");
+    data.move_to_top("UT_date_blue");
+  }
+
+  data.set("UT_date",            new Subs::Htime(timing.ut_date, "UT at the centre of the exposure"));
+  data.set("Exposure",           new Subs::Hfloat(timing.exposure_time, "Exposure time, seconds"));
+  data.move_to_top("Exposure");
+  data.move_to_top("UT_date");
+
+  data.set("Frame",              new Subs::Hdirectory("Other frame specific information"));
+  data.set("Frame.reliable",     new Subs::Hbool(timing.reliable,              "UT_date reliable?"));
+  data.set("Frame.reason",       new Subs::Hstring(timing.reason,              "Reason why UT_date is unreliable (if it is)"));
+  data.set("Frame.GPS_time",     new Subs::Htime(timing.gps_time,              "Raw GPS time stamp associated with this frame"));
+  data.set("Frame.frame_number", new Subs::Hint(timing.frame_number,           "Frame number"));
+  data.set("Frame.format",       new Subs::Hint(timing.format, "GPS format (1 < Mar 2010, 2 > Mar 2010)"));
+  if(timing.format == 1){
+    data.set("Frame.satellites",   new Subs::Hint(timing.nsatellite,             "Number of satellites used for GPS time stamp"));
+  }else if(timing.format == 2){
+    data.set("Frame.tstamp_status", new Subs::Husint(timing.tstamp_status, "Time stamp status word"));
+  }
+  data.set("Frame.vclock_frame", new Subs::Hfloat(timing.vclock_frame,  "The row transfer time used, seconds"));
+  data.set("Frame.as_documented",new Subs::Hbool(timing.default_tstamp, "Timestamps handled in default manner or not"));
+  data.set("Frame.bad_blue",     new Subs::Hbool(timing.blue_is_bad,    "Blue-side data is junk for this frame"));
+  if(serverdata_.nblue > 1)
+    data.set("Frame.reliable_blue", new Subs::Hbool(timing.reliable_blue, "UT_date_blue reliable?"));
+
+  // Store status bit
+  data.set("Frame.last", new Subs::Hbool((frame[0] & 1<<0) == 1<<0, "Last frame?"));
+
+  // Like to know if this ever occurs
+  if((frame[0] & 1<<2) == 1<<2)
+    std::cerr << "WARNING: second status bit representing a 'pon error' was set. Let Tom Marsh know if you ever see this." << std::endl;
+
+  if(demultiplex){
+    if(serverdata_.instrument == "ULTRACAM"){
+      Ultracam::de_multiplex_ultracam(frame+headerskip, data, items_, nthreads_);
+    }else if(serverdata_.readout_mode == Ultracam::ServerData::L3CCD_DRIFT){
+      Ultracam::de_multiplex_ultraspec_drift(frame+headerskip, data, items_, serverdata_.l3data.nchop);
+    }else{
+      Ultracam::de_multiplex_ultraspec(frame+headerskip, data, items_, serverdata_.l3data.nchop, nthreads_);
+    }
+  }
+}
@@ -3,11 +3,15 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstring>
+#include <stdint.h>
 
 
 void timing(char* buffer, unsigned char& day_of_month, unsigned char& month_of_year, unsigned short int& year, int& hour, int& minute,
         int& second, int& millisec);
 
+bool read_compressed(const std::string& file, char* buffer, int nbytes);
+
 int main(int argc, char* argv[]){
 
   if(argc != 2){
@@ -15,23 +19,34 @@ int main(int argc, char* argv[]){
     exit(EXIT_FAILURE);
   }
 
-  std::string file(argv[1]);
-  file += ".dat";
+  char buffer[24];
+  std::string file = std::string(argv[1]) + ".dat";
 
   std::ifstream fin(file.c_str(), std::ios::binary);
-  if(!fin){
-    std::cerr << "Could not open open " << file << " for reading" << std::endl;
-    exit(EXIT_FAILURE);
-  }
-
-  char buffer[24];
-  if (!fin.read(buffer, 24)){
-    std::cerr << "Error while trying to read first 24 bytes from " << file << std::endl;
-    exit(EXIT_FAILURE);
+  if(fin){
+    if (!fin.read(buffer, 24)){
+      std::cerr << "Error while trying to read first 24 bytes from " << file << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    fin.close();
+
+  }else{
+
+    // Fall back to a compressed run
+    file = std::string(argv[1]) + ".dcz";
+    std::ifstream fdcz(file.c_str(), std::ios::binary);
+    if(!fdcz){
+      std::cerr << "Could not open either " << argv[1] << ".dat or " << file << " for reading" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    fdcz.close();
+
+    if(!read_compressed(file, buffer, 24)){
+      std::cerr << "Error while trying to read first 24 bytes from " << file << std::endl;
+      exit(EXIT_FAILURE);
+    }
   }
 
-  fin.close();
-
   unsigned char day_of_month, month_of_year;
   unsigned short int year;
   int hour, minute, second, millisec;
@@ -83,3 +98,38 @@ void timing(char* buffer, unsigned char& day_of_month, unsigned char& month_of_y
 }
 
 
+
+// Reads the first nbytes of the timing header of the first frame of a compressed (.dcz) run.
+// The header of each frame is stored uncompressed at the start of its block, found from
+// the index at the end of the file. See Ultracam::Raw_archive for the layout.
+bool read_compressed(const std::string& file, char* buffer, int nbytes){
+
+  const int DMAGIC  = 47561012;
+  const int VERSION = 1;
+
+  std::ifstream fin(file.c_str(), std::ios::binary);
+  if(!fin) return false;
+
+  int32_t start[5];
+  if(!fin.read((char*)start, sizeof(start))) return false;
+  if(start[0] != DMAGIC){
+    std::cerr << file << " is not a compressed run, or was written on a machine of different byte order" << std::endl;
+    return false;
+  }
+  if(start[1] != VERSION){
+    std::cerr << file << " has unsupported version = " << start[1] << std::endl;
+    return false;
+  }
+  if(start[3] < nbytes) return false;
+
+  // Number of frames and offset of the index, just before the final magic number
+  uint64_t end[2];
+  if(!fin.seekg(-std::streamoff(sizeof(end) + sizeof(int32_t)), std::ios::end) || !fin.read((char*)end, sizeof(end))) return false;
+  if(end[0] == 0) return false;
+
+  uint64_t first;
+  if(!fin.seekg(std::streamoff(end[1])) || !fin.read((char*)&first, sizeof(first))) return false;
+
+  if(!fin.seekg(std::streamoff(first)) || !fin.read(buffer, nbytes)) return false;
+  return true;
+}
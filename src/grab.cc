@@ -35,7 +35,7 @@ exposure time of the bias frame in the result which is needed for bias subtracti
 
 !!head2 Invocation
 
-grab [source] (url)/(file) ndigit first (last) trim [(ncol nrow) twait tmax] skip
+grab [source] (url)/(file) ndigit first (last) trim [(ncol nrow) twait tmax nthreads] skip
 bias (biasframe) bregion (biasregion brsigma) (threshold (photon) naccum)
 
 !!head2 Arguments
@@ -74,6 +74,10 @@ can be corrupted.}
 !!arg{tmax}{Maximum time to wait before giving up (seconds). Set = 0 to quit as soon as a frame is
 not found.}
 
+!!arg{nthreads}{Number of threads to use to unpack each frame. With more than one, the CCDs
+(ULTRACAM) or windows (ULTRASPEC) are unpacked in parallel, which helps most with full-frame
+unbinned data. There is no point exceeding the number of CCDs or windows or the number of cores.}
+
 !!arg{skip}{true to skip junk data at start of drift mode runs}
 
 !!arg{bias}{true/false according to whether you want to subtract a bias frame. You can specify a full-frame
@@ -117,6 +121,8 @@ accumulating at the end, they will be written out even if they have not reach 'n
 #include "trm/frame.h"
 #include "trm/mccd.h"
 #include "trm/ultracam.h"
+#include "trm/frame_source.h"
+#include "trm/header_items.h"
 
 // Main program
 
@@ -143,6 +149,7 @@ int main(int argc, char* argv[]){
     input.sign_in("nrow",      Subs::Input::GLOBAL, Subs::Input::NOPROMPT);
     input.sign_in("twait",     Subs::Input::GLOBAL, Subs::Input::NOPROMPT);
     input.sign_in("tmax",      Subs::Input::GLOBAL, Subs::Input::NOPROMPT);
+    input.sign_in("nthreads",  Subs::Input::GLOBAL, Subs::Input::NOPROMPT);
     input.sign_in("skip",      Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
     input.sign_in("bias",      Subs::Input::GLOBAL, Subs::Input::PROMPT);
     input.sign_in("biasframe", Subs::Input::GLOBAL, Subs::Input::PROMPT);
@@ -184,6 +191,8 @@ int main(int argc, char* argv[]){
     input.get_value("twait", twait, 1., 0., 1000., "time to wait between attempts to find a frame (seconds)");
     double tmax;
     input.get_value("tmax", tmax, 2., 0., 100000., "maximum time to wait before giving up trying to find a frame (seconds)");
+    int nthreads;
+    input.get_value("nthreads", nthreads, 1, 1, 64, "number of threads to unpack each frame");
     bool skip;
     input.get_value("skip", skip, true, "skip junk data at start of drift mode runs?");
 
@@ -207,6 +216,8 @@ int main(int argc, char* argv[]){
     Subs::Header header;
     Ultracam::ServerData serverdata;
     parseXML(source, url, mwindow, header, serverdata, trim, ncol, nrow, twait, tmax);
+    Ultracam::Frame_source server(source, url, serverdata);
+    server.set_nthreads(nthreads);
 
     Ultracam::Frame data(mwindow, header);
 
@@ -271,12 +282,15 @@ int main(int argc, char* argv[]){
     int nstack = 0;
     double ttime = 0.;
 
+    // Times and exposures of each frame, without searching the header
+    const Ultracam::Header_items& items = server.items();
+
     for(;;){
 
         // Carry on reading until data are OK
         bool get_ok;
         for(;;){
-        if(!(get_ok = Ultracam::get_server_frame(source, url, data, serverdata, nfile, twait, tmax))) break;
+        if(!(get_ok = server.get(data, nfile, twait, tmax))) break;
         if(serverdata.is_junk(nfile)){
             if(skip){
             std::cerr << "Skipping file " << nfile << " which has junk data" << std::endl;
@@ -316,17 +330,17 @@ int main(int argc, char* argv[]){
         }else{
             dbuffer += data;
         }
-        ttime   += data["UT_date"]->get_double();
-        std::cout << " Frame " << nstack << " of " << naccum << ", time = " << data["UT_date"]->get_time()
+        ttime   += items.ut_date.mjd();
+        std::cout << " Frame " << nstack << " of " << naccum << ", time = " << items.ut_date
               << " added into data buffer." << std::endl;
 
         }else{
 
         // Retrieve from the data buffer if necessary
         if(naccum > 1) {
-            ttime  += data["UT_date"]->get_double();
+            ttime  += items.ut_date.mjd();
             data   += dbuffer;
-            std::cout << " Frame " << nstack << " of " << naccum << ", time = " << data["UT_date"]->get_time()
+            std::cout << " Frame " << nstack << " of " << naccum << ", time = " << items.ut_date
                   << " added into data buffer." << std::endl;
             ttime  /= nstack;
             data.set("UT_date", new Subs::Htime(Subs::Time(ttime), "mean UT date and time at the centre of accumulated exposure"));
@@ -347,7 +361,7 @@ int main(int argc, char* argv[]){
                   << " secs to disk." << std::endl;
         }else{
             std::cout << "Written " << server_file + "_" + Subs::str(int(nfile), ndigit) << ", time = "
-                  << data["UT_date"]->get_time() << ", exposure time = "  << form(data["Exposure"]->get_float())
+                  << items.ut_date << ", exposure time = "  << form(items.exposure)
                   << " secs to disk." << std::endl;
         }
 
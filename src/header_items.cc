@@ -0,0 +1,145 @@
+#include <string>
+#include "trm/subs.h"
+#include "trm/header.h"
+#include "trm/ultracam.h"
+#include "trm/header_items.h"
+
+/** The default constructor sets every item to its value for the case of it not
+ * being found in a header.
+ */
+Ultracam::Header_items::Header_items() :
+  run_set(false), instrument(), version(-1), trimmed(false), ncols(0), nrows(0),
+  readout_mode(-1), output(0), nblue(1), has_time(false), ut_date(), has_time_blue(false),
+  ut_date_blue(), has_exposure(false), exposure(0.f), has_exposure_blue(false),
+  exposure_blue(0.f), has_reliable(false), reliable(true), has_reliable_blue(false), reliable_blue(true),
+  bad_blue(false), has_satellites(false), satellites(0) {}
+
+namespace {
+
+  // Finds an item which must be present
+  Subs::Header::Hnode* need(const Subs::Header& head, const std::string& item){
+    Subs::Header::Hnode *hnode = head.find(item);
+    if(!hnode->has_data())
+      throw Ultracam::Ultracam_Error("Ultracam::Header_items::set_run: could not find header item " + item);
+    return hnode;
+  }
+
+}
+
+/** Loads the items which stay the same throughout a run. This only needs to be called once,
+ * e.g. on the first frame. The items needed to de-multiplex data of the instrument named by
+ * "Instrument.instrument" must be present: "Trimming.applied", with "Trimming.ncols" and
+ * "Trimming.nrows" if trimming was applied, then "Instrument.Output" for ULTRASPEC or
+ * "Instrument.version" and "Instrument.Readout_Mode_Flag" otherwise. The rest are optional.
+ * \param head the header to read from
+ * \exception Ultracam::Ultracam_Error is thrown if a required item is missing
+ */
+void Ultracam::Header_items::set_run(const Subs::Header& head){
+
+  Subs::Header::Hnode *hnode;
+
+  hnode = head.find("Instrument.instrument");
+  instrument = hnode->has_data() ? hnode->value->get_string() : std::string();
+
+  trimmed = need(head, "Trimming.applied")->value->get_bool();
+  ncols   = trimmed ? need(head, "Trimming.ncols")->value->get_int() : 0;
+  nrows   = trimmed ? need(head, "Trimming.nrows")->value->get_int() : 0;
+
+  if(instrument == "ULTRASPEC"){
+
+    output = need(head, "Instrument.Output")->value->get_int();
+
+    hnode = head.find("Instrument.version");
+    version = hnode->has_data() ? hnode->value->get_int() : -1;
+
+    hnode = head.find("Instrument.Readout_Mode_Flag");
+    readout_mode = hnode->has_data() ? hnode->value->get_int() : -1;
+
+  }else{
+
+    version      = need(head, "Instrument.version")->value->get_int();
+    readout_mode = need(head, "Instrument.Readout_Mode_Flag")->value->get_int();
+
+    hnode = head.find("Instrument.Output");
+    output = hnode->has_data() ? hnode->value->get_int() : 0;
+
+  }
+
+  hnode = head.find("Instrument.nblue");
+  nblue = hnode->has_data() ? hnode->value->get_int() : 1;
+
+  run_set = true;
+}
+
+/** Loads the items which change from frame to frame from a header, e.g. that of an
+ * ucm file.
+ * \param head the header to read from
+ */
+void Ultracam::Header_items::set_frame(const Subs::Header& head){
+
+  Subs::Header::Hnode *hnode;
+
+  hnode = head.find("UT_date");
+  if((has_time = hnode->has_data()))
+    hnode->value->get_value(ut_date);
+
+  hnode = head.find("Exposure");
+  if((has_exposure = hnode->has_data()))
+    hnode->value->get_value(exposure);
+  else
+    exposure = 0.f;
+
+  hnode = head.find("Frame.reliable");
+  has_reliable = hnode->has_data();
+  reliable = !has_reliable || hnode->value->get_bool();
+
+  hnode = head.find("Frame.bad_blue");
+  bad_blue = hnode->has_data() && hnode->value->get_bool();
+
+  hnode = head.find("Frame.satellites");
+  if((has_satellites = hnode->has_data()))
+    satellites = hnode->value->get_int();
+  else
+    satellites = 0;
+
+  hnode = head.find("UT_date_blue");
+  if((has_time_blue = hnode->has_data()))
+    hnode->value->get_value(ut_date_blue);
+  else
+    ut_date_blue = ut_date;
+
+  hnode = head.find("Exposure_blue");
+  if((has_exposure_blue = hnode->has_data()))
+    hnode->value->get_value(exposure_blue);
+  else
+    exposure_blue = exposure;
+
+  hnode = head.find("Frame.reliable_blue");
+  if((has_reliable_blue = hnode->has_data()))
+    reliable_blue = hnode->value->get_bool();
+  else
+    reliable_blue = reliable;
+}
+
+/** Loads the items which change from frame to frame straight from the timing information
+ * read from a raw frame. The run items must have been set first since nblue determines
+ * whether the u-band items are present.
+ * \param timing the timing information
+ */
+void Ultracam::Header_items::set_frame(const TimingInfo& timing){
+
+  has_time          = true;
+  ut_date           = timing.ut_date;
+  has_exposure      = true;
+  exposure          = timing.exposure_time;
+  has_reliable      = true;
+  reliable          = timing.reliable;
+  bad_blue          = timing.blue_is_bad;
+  has_satellites    = (timing.format == 1);
+  satellites        = has_satellites ? timing.nsatellite : 0;
+
+  has_time_blue     = has_exposure_blue = has_reliable_blue = (nblue > 1);
+  ut_date_blue      = nblue > 1 ? timing.ut_date_blue       : ut_date;
+  exposure_blue     = nblue > 1 ? timing.exposure_time_blue : exposure;
+  reliable_blue     = nblue > 1 ? timing.reliable_blue      : reliable;
+}
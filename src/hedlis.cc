@@ -38,6 +38,7 @@ hedlis list
 #include "trm/subs.h"
 #include "trm/input.h"
 #include "trm/header.h"
+#include "trm/frame.h"
 #include "trm/ultracam.h"
 
 int main(int argc, char* argv[]){
@@ -71,37 +72,12 @@ int main(int argc, char* argv[]){
     if(nfile == 0) throw Input_Error("No file names loaded");
 
     // Read the headers from the start of the ULTRACAM files
-    Subs::Header header;
+    Ultracam::Frame frame;
 
     for(size_t nf=0; nf<nfile; nf++){
       std::cout << "\nFile = " << flist[nf] << ":\n" << std::endl;
-      std::ifstream istr(flist[nf].c_str(), std::ios::binary);
-
-      // Read and test magic number which is supposed to indicate that this is a ucm file. This
-      // was introduced only in Sept 2004 so there are backwards compatibility issues to deal with
-      // too as the format changed slightly at the same time.
-      int magic;
-      istr.read((char*)&magic,sizeof(int));
-      if(!istr)
-    throw Ultracam::Ultracam_Error("Dailed to read ucm magic number");
-
-      // Check for non-native data
-      bool swap_bytes = (Subs::byte_swap(magic) == Ultracam::MAGIC);
-
-      // Check here also allows for swapping
-      bool old = !swap_bytes && (magic != Ultracam::MAGIC);
-
-      // If it is old, and we are on a bigendian machine, then
-      // we will have to swap bytes
-      if(old && Subs::is_big_endian()) swap_bytes = true;
-
-      // If 'old' then no magic number and we should wind back to start
-      if(old) istr.seekg(0);
-
-      // Finally read the header
-      header.read(istr, swap_bytes);
-      std::cout << header;
-      istr.close();
+      frame.read_header(flist[nf]);
+      std::cout << (const Subs::Header&)frame;
     }
   }
 
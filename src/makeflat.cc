@@ -71,7 +71,7 @@ using !!ref{uset.html}{uset}.
 
 !!head2 Invocation
 
-makeflat list method (sigma careful) ngroup region low high output
+makeflat list method (sigma careful) ngroup region low high output [nthreads]
 
 !!head2 Arguments
 
@@ -95,6 +95,8 @@ eliminate saturated frames. First you need to define a level to count as saturat
 bias subtraction}
 !!arg{maxsat}{This specifies the maximum percentage of pixels that can be saturated before a frame is kicked out}
 !!arg{output}{Output frame}
+!!arg{nthreads}{Number of threads to use. The frames are read in parallel when measuring their mean levels,
+and the groups of frames are combined nthreads at a time, which needs memory for up to nthreads combined CCDs. Hidden, default 1.}
 !!table
 
 !!head2 Guidance notes
@@ -119,11 +121,14 @@ the number of frames that !!emph{makeflat} says it has found for each CCD in dec
 #include <cfloat>
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include "trm/subs.h"
 #include "trm/input.h"
 #include "trm/frame.h"
 #include "trm/fdisk.h"
 #include "trm/ultracam.h"
+#include "trm/parallel.h"
 
 // Basic structure for each CCD keyed by mean value inside 'map' containers
 struct Info{
@@ -132,6 +137,143 @@ struct Info{
     Info(const std::string& fname, const size_t& np) : file(fname), npix(np) {}
 };
 
+// Mean level, number of saturated pixels and number of pixels in the region of a CCD
+struct Level{
+    float mean;
+    int nsat;
+    size_t npix;
+};
+
+// The mean level scan, one task per file. level[nf][nc] caches the result for CCD nc of file nf.
+struct Scan{
+    const std::vector<std::string>& flist;
+    const Ultracam::Frame& format;
+    const Ultracam::Mwindow& region;
+    float satval;
+    std::vector<std::vector<Level> > level;
+    Scan(const std::vector<std::string>& flist, const Ultracam::Frame& format, const Ultracam::Mwindow& region, float satval) :
+    flist(flist), format(format), region(region), satval(satval), level(flist.size()) {}
+};
+
+void scan_task(int nf, void* arg){
+
+    Scan& scan = *static_cast<Scan*>(arg);
+
+    // load in frame
+    Ultracam::Frame temp(scan.flist[nf]);
+    if(temp != scan.format)
+    throw Ultracam::Ultracam_Error(scan.flist[nf] + std::string(" is incompatible with ") + scan.flist[0]);
+
+    // compute mean and number of saturated pixels
+    Subs::Array1D<Ultracam::internal_data> buff;
+    scan.level[nf].resize(temp.size());
+    for(size_t nc=0; nc<temp.size(); nc++){
+
+    temp[nc].buffer(scan.region[nc], buff);
+
+    if(buff.size() == 0)
+        throw Ultracam::Ultracam_Error("No overlap of normalisation region and data for file = " + scan.flist[nf]);
+
+    Level& level = scan.level[nf][nc];
+    level.nsat = 0;
+    for(int n=0; n<buff.size(); n++)
+        if(buff[n] > scan.satval) level.nsat++;
+    level.mean = buff.mean();
+    level.npix = buff.size();
+    }
+}
+
+// A group of frames of similar level to be combined
+struct Group{
+    std::vector<std::string> file;
+    std::vector<double> aver;
+    double norm;
+    Ultracam::Image comb;
+    size_t nrej;
+};
+
+// The groups of one CCD, one task per group starting from group 'first'
+struct Combine_groups{
+    const Ultracam::Image& format;
+    size_t nc;
+    char method;
+    float sigma;
+    bool careful;
+    size_t mxbuff;
+    int first;
+    std::vector<Group> group;
+    Combine_groups(const Ultracam::Image& format, size_t nc, char method, float sigma, bool careful) :
+    format(format), nc(nc), method(method), sigma(sigma), careful(careful), mxbuff(0), first(0), group() {}
+};
+
+void group_task(int ng, void* arg){
+
+    Combine_groups& groups = *static_cast<Combine_groups*>(arg);
+    Group& group = groups.group[groups.first + ng];
+    int ncomb = group.file.size();
+
+    // Fdisk pointers
+    std::vector<Ultracam::Fdisk*> fptr(ncomb, (Ultracam::Fdisk*)0);
+
+    try{
+
+    size_t nbuff = groups.mxbuff / ncomb;
+    for(int nf=0; nf<ncomb; nf++)
+        fptr[nf] = new Ultracam::Fdisk(group.file[nf], nbuff, groups.nc+1);
+
+    group.comb = groups.format;
+    group.comb = 0.;
+    group.nrej = 0;
+
+    // Buffer for combining data, a row at a time, [pixel][file]
+    std::vector<Ultracam::internal_data> cdat;
+
+    // Now wind through the windows
+    for(size_t nw=0; nw<group.comb.size(); nw++){
+        Ultracam::Windata& cwin = group.comb[nw];
+        cdat.resize(size_t(cwin.nx())*ncomb);
+        for(int ny=0; ny<cwin.ny(); ny++){
+
+        // Extract and normalise data from the files.
+        for(int nf=0; nf<ncomb; nf++){
+            fptr[nf]->get_next(&cdat[nf], cwin.nx(), ncomb);
+            for(int nx=0; nx<cwin.nx(); nx++)
+            cdat[ncomb*nx+nf] = cdat[ncomb*nx+nf]/group.aver[nf]*group.norm;
+        }
+
+        for(int nx=0; nx<cwin.nx(); nx++){
+
+            Ultracam::internal_data* pdat = &cdat[ncomb*nx];
+
+            // Process the data
+            if(groups.method == 'M'){
+            if(ncomb % 2 == 0){
+                cwin[ny][nx] = (Subs::select(pdat,ncomb,ncomb/2-1) + Subs::select(pdat,ncomb,ncomb/2) ) / 2.;
+            }else{
+                cwin[ny][nx] = Subs::select(pdat,ncomb,ncomb/2);
+            }
+            }else if(groups.method == 'C'){
+            double rawmean, rawrms, mean, rms;
+            int nrej;
+            Subs::sigma_reject(pdat,ncomb,groups.sigma,groups.careful,rawmean,rawrms,mean,rms,nrej);
+            group.nrej += nrej;
+            cwin[ny][nx] = mean;
+            }
+        }
+        }
+    }
+    }
+    catch(...){
+    for(int nf=0; nf<ncomb; nf++)
+        delete fptr[nf];
+    throw;
+    }
+
+    // delete Fdisk pointers
+    for(int nf=0; nf<ncomb; nf++)
+    delete fptr[nf];
+}
+
 int main(int argc, char* argv[]){
 
     using Ultracam::Ultracam_Error;
@@ -156,6 +298,7 @@ int main(int argc, char* argv[]){
     input.sign_in("satval",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
     input.sign_in("maxsat",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
     input.sign_in("output",    Subs::Input::LOCAL,  Subs::Input::PROMPT);
+    input.sign_in("nthreads",  Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
 
     // Get inputs
     std::string stlist;
@@ -175,8 +318,8 @@ int main(int argc, char* argv[]){
     char method;
     input.get_value("method", method, 'c', "cCmM", "what combination method?");
     method = toupper(method);
-    float sigma;
-    bool careful;
+    float sigma = 3.f;
+    bool careful = true;
     if(method == 'C'){
         input.get_value("sigma",   sigma, 3.f, 1.f, FLT_MAX, "threshold multiple of RMS to reject");
         input.get_value("careful", careful, true, "reject pixels one at a time?");
@@ -218,6 +361,8 @@ int main(int argc, char* argv[]){
     input.get_value("maxsat", maxsat, 0.1f, 0.f, 100.f, "maximum percentage saturated pixels");
     std::string output;
     input.get_value("output", output, "output", "output file");
+    int nthreads;
+    input.get_value("nthreads", nthreads, 1, 1, 256, "number of threads to use");
 
     Ultracam::Image::Stats stats;
 
@@ -232,48 +377,29 @@ int main(int argc, char* argv[]){
 
         std::cout << "Computing means of each CCD." << std::endl;
 
-        Ultracam::Frame temp;
-
         int nok[out.size()];
         for(size_t nc=0; nc<out.size(); nc++)
         nok[nc] = 0;
 
-        Subs::Array1D<internal_data> buff;
+        // Read the frames in parallel, caching the mean level and saturation count of each CCD
+        Scan scan(flist, out, region, satval);
+        Ultracam::run_parallel(scan_task, &scan, nfile, nthreads);
 
+        // Store means as keys leading to information on the file, in the order of the files
         for(size_t nf=0; nf<nfile; nf++){
-
-        // load in frame
-        temp.read(flist[nf]);
-        if(temp != out)
-            throw Ultracam_Error(flist[nf] + std::string(" is incompatible with ") + flist[0]);
-
-        // compute and store mean as a key leading to information on the file
-        // number of saturated pixels is tested at this point.
         for(size_t nc=0; nc<out.size(); nc++){
-
-            temp[nc].buffer(region[nc], buff);
-
-            if(buff.size() == 0)
-            throw Ultracam_Error("No overlap of normalisation region and data for file = " + flist[nf]);
-
-            // Count number of saturated pixels
-            int nsat = 0;
-            for(int n=0; n<buff.size(); n++)
-            if(buff[n] > satval) nsat++;
-
-            float buff_mean = buff.mean();
-            if(nsat < int(buff.size()*maxsat/100.)){
-            mean[nc].insert(std::make_pair(buff_mean, Info(flist[nf], buff.size())));
-            if(buff_mean > low[nc] && buff_mean < high[nc]) nok[nc]++;
+            const Level& level = scan.level[nf][nc];
+            if(level.nsat < int(level.npix*maxsat/100.)){
+            mean[nc].insert(std::make_pair(level.mean, Info(flist[nf], level.npix)));
+            if(level.mean > low[nc] && level.mean < high[nc]) nok[nc]++;
             }else{
-            mean[nc].insert(std::make_pair(0., Info(flist[nf], buff.size())));
+            mean[nc].insert(std::make_pair(0., Info(flist[nf], level.npix)));
             }
         }
         }
 
         const size_t MXBUFF = 8000000; // total buffer size.
-        size_t nbuff; // individual buffer size.
-        int nvalid, ngroup, ncount, nstart, nend, ncomb;
+        int nvalid, ngroup, ncount, nstart, nend;
         size_t nrejtot = 0, ntot=0;
 
         // Iterator over means
@@ -327,85 +453,54 @@ int main(int argc, char* argv[]){
             // Compute number of groups
             ngroup = std::max(1, nvalid / npgroup);
 
-            // Now start the averaging in groups loop
+            // Set up the groups. Note that the normalisation adopted here ensures correct
+            // weighting according to the number and level of frames in each group
+            Combine_groups groups(out[nc], nc, method, sigma, careful);
+            groups.group.resize(ngroup);
             for(int ng=0; ng<ngroup; ng++){
             nstart = npgroup*ng;
             nend   = nstart + npgroup;
             if(ng == ngroup - 1) nend = nvalid;
 
-            // Fdisk pointers
-            std::vector<Ultracam::Fdisk*> fptr(nend-nstart);
-            std::vector<double> aver(nend-nstart);
-
-            // compute buffer size
-            nbuff = MXBUFF / (nend-nstart);
-            double norm = 0.;
-
-            // Create the Fdisks. Note that the normalisation adopted here ensures correct
-            // weighting according to the number and level of frames in each group
-            for(mmit = mean[nc].begin(), ncomb=0, ncount=0; mmit != mean[nc].end(); mmit++){
+            Group& group = groups.group[ng];
+            group.norm = 0.;
+            for(mmit = mean[nc].begin(), ncount=0; mmit != mean[nc].end(); mmit++){
                 if(mmit->first > low[nc] && mmit->first < high[nc]){
                 if(ncount >= nstart && ncount < nend){
-                    aver[ncomb]   = mmit->first;
-                    fptr[ncomb++] = new Ultracam::Fdisk(mmit->second.file, nbuff, nc+1);
-                    norm         += mmit->first;
+                    group.file.push_back(mmit->second.file);
+                    group.aver.push_back(mmit->first);
+                    group.norm += mmit->first;
                 }
                 ncount++;
                 }
             }
+            }
 
-            // Buffer for combining data
-            Ultracam::internal_data comb=0, cdat[ncomb];
-
-            // Initialise temporary file to zero.
-            temp[nc] = 0.;
-
-            // Now wind through the windows
-            for(size_t nw=0; nw<out[nc].size(); nw++){
-                ntot += temp[nc][nw].ntot();
-                for(int ny=0; ny<temp[nc][nw].ny(); ny++){
-                for(int nx=0; nx<temp[nc][nw].nx(); nx++){
-
-                    // Extract and normalise data from the files.
-                    for(int nf=0; nf<ncomb; nf++)
-                    cdat[nf] = fptr[nf]->get_next()/aver[nf]*norm;
-
-                    // Process the data
-                    if(method == 'M'){
-                    if(nfile % 2 == 0){
-                        comb = (Subs::select(cdat,ncomb,ncomb/2-1) + Subs::select(cdat,ncomb,ncomb/2) ) / 2.;
-                    }else{
-                        comb = Subs::select(cdat,ncomb,ncomb/2);
-                    }
-                    }else if(method == 'C'){
-                    double rawmean, rawrms, mean, rms;
-                    int nrej;
-                    Subs::sigma_reject(cdat,ncomb,sigma,careful,rawmean,rawrms,mean,rms,nrej);
-                    nrejtot += nrej;
-                    comb = mean;
-                    }
-
-                    // Store
-                    temp[nc][nw][ny][nx] = comb;
-
-                    // Progress indicator
-                    ndtot += ncomb;
-                    if((ndadd = (int(MXDOT*ndtot/nptot) - ndot))){
-                    for(size_t ia=0; ia<ndadd; ia++) std::cout << "." << std::flush;
-                    ndot += ndadd;
-                    }
-                }
+            // buffer size per thread
+            groups.mxbuff = MXBUFF / std::min(ngroup, nthreads);
+
+            // Combine the groups, nthreads at a time so that no more than nthreads combined
+            // images are held at once, adding each batch in, in order of group, before
+            // starting the next
+            for(groups.first=0; groups.first<ngroup; groups.first+=nthreads){
+            int nbatch = std::min(nthreads, ngroup - groups.first);
+            Ultracam::run_parallel(group_task, &groups, nbatch, nthreads);
+
+            for(int ng=groups.first; ng<groups.first+nbatch; ng++){
+                out[nc] += groups.group[ng].comb;
+                groups.group[ng].comb = Ultracam::Image();
+                nrejtot += groups.group[ng].nrej;
+                for(size_t nw=0; nw<out[nc].size(); nw++){
+                ntot  += out[nc][nw].ntot();
+                ndtot += double(out[nc][nw].ntot())*groups.group[ng].file.size();
                 }
             }
 
-
-            // Add the processed frame in.
-            out[nc] += temp[nc];
-
-            // delete Fdisk pointers
-            for(int nf=0; nf<ncomb; nf++)
-                delete fptr[nf];
-
+            // Progress indicator
+            if((ndadd = (int(MXDOT*ndtot/nptot) - ndot))){
+                for(size_t ia=0; ia<ndadd; ia++) std::cout << "." << std::flush;
+                ndot += ndadd;
+            }
             }
 
         }else{
@@ -0,0 +1,217 @@
+#include <string>
+#include <algorithm>
+#include <deque>
+#include <new>
+#include <pthread.h>
+#include "trm/subs.h"
+#include "trm/ultracam.h"
+#include "trm/parallel.h"
+
+namespace {
+
+  // The tasks of one run_parallel call
+  struct Task_list {
+    void (*task)(int, void*);
+    void* arg;
+    int ntask;
+    int next;
+    int nhelp;     // the most pool workers that may work on the list
+    int nhelping;  // the pool workers working on the list
+    bool failed;
+    Ultracam::Task_error error;
+  };
+
+  // Worker threads shared by all run_parallel calls. They are started as they are first
+  // needed and then wait for work rather than stopping, so that anything they keep in
+  // thread-specific data (buffers, caches and the like) survives from one call to the
+  // next. Calls made at the same time from different threads, or from within tasks, share
+  // the workers.
+  struct Pool {
+    pthread_mutex_t mutex;      // controls access to the pool and to the lists posted to it
+    pthread_cond_t  work;       // signalled when a list is posted
+    pthread_cond_t  done;       // signalled when a worker leaves a list
+    std::deque<Task_list*> lists;
+    int nworker;
+  };
+
+  Pool* pool = NULL;
+  pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+  // The pool is never deleted since its workers never stop
+  void make_pool(){
+    pool = new Pool;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->nworker = 0;
+  }
+
+  // Runs tasks of a list until there are none left or one has failed. 'mutex' protects
+  // the list; it must be locked on entry and is locked again on exit.
+  void run_tasks(Task_list& list, pthread_mutex_t& mutex){
+
+    while(!list.failed && list.next < list.ntask){
+
+      int n = list.next++;
+      pthread_mutex_unlock(&mutex);
+
+      try{
+        list.task(n, list.arg);
+        pthread_mutex_lock(&mutex);
+      }
+      catch(...){
+        pthread_mutex_lock(&mutex);
+        if(!list.failed){
+          list.failed = true;
+          list.error.store();
+        }
+      }
+    }
+  }
+
+  // Entry point of the pool workers, which help with any list that needs it
+  void* worker(void*){
+
+    pthread_mutex_lock(&pool->mutex);
+    for(;;){
+
+      Task_list* list = NULL;
+      for(size_t i=0; i<pool->lists.size(); i++){
+        Task_list* lptr = pool->lists[i];
+        if(!lptr->failed && lptr->next < lptr->ntask && lptr->nhelping < lptr->nhelp){
+          list = lptr;
+          break;
+        }
+      }
+
+      if(list){
+        list->nhelping++;
+        run_tasks(*list, pool->mutex);
+        if(--list->nhelping == 0)
+          pthread_cond_broadcast(&pool->done);
+      }else{
+        pthread_cond_wait(&pool->work, &pool->mutex);
+      }
+    }
+    return NULL;
+  }
+
+}
+
+void Ultracam::run_parallel(void (*task)(int n, void* arg), void* arg, int ntask, int nthreads){
+
+  Task_list list;
+  list.task     = task;
+  list.arg      = arg;
+  list.ntask    = ntask;
+  list.next     = 0;
+  list.nhelp    = std::max(0, std::min(nthreads, ntask) - 1);
+  list.nhelping = 0;
+  list.failed   = false;
+
+  if(list.nhelp == 0){
+
+    // The tasks are run in order by the calling thread, but errors go through the same
+    // path as when threads are used so that they reach the caller in the same form.
+    pthread_mutex_t mutex;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_mutex_lock(&mutex);
+    run_tasks(list, mutex);
+    pthread_mutex_unlock(&mutex);
+    pthread_mutex_destroy(&mutex);
+
+  }else{
+
+    pthread_once(&pool_once, make_pool);
+    pthread_mutex_lock(&pool->mutex);
+
+    // Make sure there are enough workers. If a thread cannot be started, the work is
+    // shared between those there are.
+    while(pool->nworker < list.nhelp){
+      pthread_t thread;
+      if(pthread_create(&thread, NULL, worker, NULL)) break;
+      pthread_detach(thread);
+      pool->nworker++;
+    }
+
+    // Post the list; the calling thread does its share too.
+    pool->lists.push_back(&list);
+    pthread_cond_broadcast(&pool->work);
+    run_tasks(list, pool->mutex);
+
+    // Withdraw the list and wait for any workers still on its last tasks
+    pool->lists.erase(std::find(pool->lists.begin(), pool->lists.end(), &list));
+    while(list.nhelping > 0)
+      pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  if(list.failed)
+    list.error.rethrow("Ultracam::run_parallel");
+}
+
+//! Destructor
+Ultracam::Task_error::~Task_error(){
+  delete subs_error;
+}
+
+/** Stores the exception being handled, replacing any stored before. It must be called from
+ * within a catch block.
+ */
+void Ultracam::Task_error::store(){
+  delete subs_error;
+  subs_error = NULL;
+  message.clear();
+  try{
+    throw;
+  }
+  catch(const File_Open_Error& err){
+    kind = FILE_OPEN; message = err;
+  }
+  catch(const Modify_Error& err){
+    kind = MODIFY; message = err;
+  }
+  catch(const Input_Error& err){
+    kind = INPUT; message = err;
+  }
+  catch(const Read_Error& err){
+    kind = READ; message = err;
+  }
+  catch(const Write_Error& err){
+    kind = WRITE; message = err;
+  }
+  catch(const Ultracam_Error& err){
+    kind = ULTRACAM; message = err;
+  }
+  catch(const Subs::Subs_Error& err){
+    kind = SUBS; subs_error = new Subs::Subs_Error(err);
+  }
+  catch(const std::string& err){
+    kind = STRING; message = err;
+  }
+  catch(const std::bad_alloc&){
+    kind = BAD_ALLOC;
+  }
+  catch(...){
+    kind = UNKNOWN;
+  }
+}
+
+/** Throws the stored error again, if there is one.
+ * \param where name of the caller, used in the message if the error was of an unrecognised type
+ */
+void Ultracam::Task_error::rethrow(const std::string& where) const {
+  switch(kind){
+  case FILE_OPEN: throw File_Open_Error(message);
+  case MODIFY:    throw Modify_Error(message);
+  case INPUT:     throw Input_Error(message);
+  case READ:      throw Read_Error(message);
+  case WRITE:     throw Write_Error(message);
+  case ULTRACAM:  throw Ultracam_Error(message);
+  case SUBS:      throw Subs::Subs_Error(*subs_error);
+  case STRING:    throw message;
+  case BAD_ALLOC: throw std::bad_alloc();
+  case UNKNOWN:   throw Ultracam_Error(where + ": task failed with an unrecognised exception");
+  case NONE:      break;
+  }
+}
@@ -0,0 +1,276 @@
+#include <cmath>
+#include <vector>
+#include "trm/subs.h"
+#include "trm/buffer2d.h"
+#include "trm/windata.h"
+#include "trm/ultracam.h"
+#include "trm/profile_fitter.h"
+
+Ultracam::Profile_fitter::Profile_fitter() :
+  atry(), nvar(0), ochisq(0.), alpha(NMAX,NMAX), beta(NMAX), talpha(NMAX,NMAX), oneda(NMAX,1), tbeta(NMAX),
+  vindex(), xoff(), wgt(), dat(), diff(), dyda(), wdyda() {}
+
+/**
+ * Carries out one iteration of the Levenberg-Marquardt method, based upon mrqmin from Numerical
+ * Recipes. The arguments and their use are exactly as for fitgaussian and fitmoffat, which call
+ * this, except that the state between iterations is kept in the Profile_fitter.
+ * \param data the data to fit
+ * \param sigma the 1-sigma uncertainties on each point, -ve to mask
+ * \param xlo the lower X index limit for the sub-region of the window to compute over
+ * \param xhi the upper X index limit for the sub-region of the window to compute over
+ * \param ylo the lower Y index limit for the sub-region of the window to compute over
+ * \param yhi the upper Y index limit for the sub-region of the window to compute over
+ * \param params the initial parameters (given and returned)
+ * \param chisq the Chi**2, returned.
+ * \param alambda set -ve to start a fit, left unchanged between iterations and set = 0 after convergence
+ * to get the covariances.
+ * \param covar 2D array of covariances, valid after a call with alambda = 0.
+ */
+void Ultracam::Profile_fitter::iterate(const Windata& data, const Windata& sigma, int xlo, int xhi, int ylo, int yhi,
+                                       Ppars& params, double& chisq, double& alambda, Subs::Buffer2D<double>& covar){
+
+  // Number of parameters (not all of which are necessarily variable).
+  int npar = params.npar();
+
+  // Ensure that 'covar' is big enough, but not in the middle of a sequence
+  if(alambda < 0. && (npar > int(covar.nrow()) || npar > int(covar.ncol()))){
+    covar.resize(npar,npar);
+  }else if(npar > int(covar.nrow()) || npar > int(covar.ncol())){
+    throw Ultracam_Error("void Ultracam::Profile_fitter::iterate(const Windata&, const Windata&, int, int, "
+                         "int, int, Ultracam::Ppars&, double&, double&, Subs::Buffer2D<double>&): "
+                         "covariance matrix too small in midst of a sequence -- should not have happened");
+  }
+
+  // Initialise a few things if alambda is set negative indicating a restart
+  if(alambda < 0.0){
+
+    // Number of variable parameters
+    nvar = 0;
+    for(int j=0; j<npar; j++)
+      if(params.get_param_state(j)) nvar++;
+
+    alambda = 0.001;
+    cof(data, sigma, params, xlo, xhi, ylo, yhi, alpha, beta, chisq);
+    ochisq = chisq;
+    atry   = params;
+  }
+
+  // If alambda set = 0, this indicates convergence and we therefore compute the covariances
+  if(alambda == 0.){
+    covariances(params, covar);
+    return;
+  }
+
+  // Alter linearised fitting matrix by augmenting diagonal elements
+  for(int j=0; j<nvar; j++){
+    for(int k=0; k<nvar; k++) covar[j][k] = alpha[j][k];
+    covar[j][j] = alpha[j][j]*(1.0+alambda);
+    oneda[j][0] = beta[j];
+  }
+
+  // Matrix solution to find a (hopefully) better solution
+  Subs::gaussj(nvar,covar,oneda);
+
+  // Lets see if the better solution really is better ...
+  for(int j=0,l=0; l<npar; l++)
+    if(params.get_param_state(l)) atry.set_param(l, params.get_param(l) + oneda[j++][0]);
+
+  cof(data, sigma, atry, xlo, xhi, ylo, yhi, talpha, tbeta, chisq);
+
+  // Get to a lower Chi**2 ==> success, else increase alambda
+  if(chisq < ochisq){
+    alambda *= 0.1;
+    ochisq   = chisq;
+    for(int j=0; j<nvar; j++){
+      for(int k=0; k<nvar; k++) alpha[j][k] = talpha[j][k];
+      beta[j] = tbeta[j];
+    }
+    params = atry;
+  }else{
+    alambda *= 10.0;
+    chisq    = ochisq;
+  }
+}
+
+/**
+ * Fits a profile from scratch, iterating until chi**2 decreases by less than 0.001 with no increase
+ * in alambda. The arguments are as for Profile_fitter::iterate; \c covar is used as workspace and
+ * should then be passed to Profile_fitter::covariances to get the covariances.
+ * \param nmax maximum number of iterations
+ * \return the number of iterations carried out
+ */
+int Ultracam::Profile_fitter::fit(const Windata& data, const Windata& sigma, int xlo, int xhi, int ylo, int yhi,
+                                  Ppars& params, double& chisq, Subs::Buffer2D<double>& covar, int nmax){
+
+  double alambda = -1., alambdaold = -2., oldchisq = 1.;
+  int ncount = 0;
+  chisq = 0.;
+  while((oldchisq - chisq > 0.001 || alambda > alambdaold || alambda > 0.001) && ncount < nmax){
+    alambdaold = alambda;
+    oldchisq   = chisq;
+    iterate(data, sigma, xlo, xhi, ylo, yhi, params, chisq, alambda, covar);
+    ncount++;
+  }
+  return ncount;
+}
+
+/**
+ * Computes the covariances of the parameters of the last fit, equivalent to a call of
+ * Profile_fitter::iterate with alambda = 0.
+ * \param params the fitted parameters
+ * \param covar the covariances, returned. It must be the matrix used during the fit.
+ */
+void Ultracam::Profile_fitter::covariances(const Ppars& params, Subs::Buffer2D<double>& covar){
+  for(int j=0; j<nvar; j++){
+    for(int k=0; k<nvar; k++) covar[j][k] = alpha[j][k];
+    oneda[j][0] = beta[j];
+  }
+  Subs::gaussj(nvar,covar,oneda);
+  covsrt(covar,params,nvar);
+}
+
+// Computes the curvature matrix alpha, the gradient beta and chi**2 for the unmasked
+// pixels of the region. Each row is handled in three steps: the unmasked pixels are gathered,
+// the model, residuals and derivatives are computed for all of them, then the sums over the
+// row are added into alpha and beta.
+void Ultracam::Profile_fitter::cof(const Windata& data, const Windata& sigma, const Ppars& params,
+                                   int xlo, int xhi, int ylo, int yhi,
+                                   Subs::Buffer2D<double>& alpha, Subs::Buffer1D<double>& beta, double& chisq){
+
+  const int npar = params.npar();
+  const int nx   = xhi - xlo + 1;
+  const bool moffat = (params.ptype == Ppars::MOFFAT);
+
+  vindex.clear();
+  for(int l=0; l<npar; l++)
+    if(params.get_param_state(l)) vindex.push_back(l);
+  const int nv = vindex.size();
+
+  // Initialise alpha, beta and chisq, which stay zero if there are no pixels
+  for(int j=0; j<nv; j++){
+    for(int k=0; k<nv; k++) alpha[j][k] = 0.;
+    beta[j] = 0.;
+  }
+  chisq = 0.;
+
+  if(nx <= 0) return;
+  if(int(xoff.size()) < nx){
+    xoff.resize(nx);
+    wgt.resize(nx);
+    dat.resize(nx);
+    diff.resize(nx);
+  }
+  if(int(dyda.size()) < NMAX*nx){
+    dyda.resize(NMAX*nx);
+    wdyda.resize(NMAX*nx);
+  }
+
+  // Pointers to the derivatives with respect to each parameter, and the weighted derivatives
+  // with respect to each variable parameter
+  double *d[NMAX], *wd[NMAX];
+  for(int l=0; l<NMAX; l++){
+    d[l]  = &dyda[l*nx];
+    wd[l] = &wdyda[l*nx];
+  }
+
+  const double sky = params.sky, height = params.height, a = params.a, b = params.b, c = params.c, pbeta = params.beta;
+  const int ix = params.x_index(), iy = params.y_index(), ih = params.height_index(), ia = params.a_index();
+  const int ib = params.b_index(), ic = params.c_index(), ibeta = params.beta_index();
+  const double thresh = Ppars::thresh();
+
+  for(int jy=ylo; jy<=yhi; jy++){
+
+    // Gather the unmasked pixels
+    const internal_data *drow = data.row(jy), *srow = sigma.row(jy);
+    int n = 0;
+    for(int jx=xlo; jx<=xhi; jx++){
+      float sig = srow[jx];
+      if(sig > 0.){
+        xoff[n] = data.xccd(jx) - params.x;
+        wgt[n]  = 1./Subs::sqr(sig);
+        dat[n]  = drow[jx];
+        n++;
+      }
+    }
+    if(n == 0) continue;
+
+    // Model, residuals and derivatives
+    const double yoff = data.yccd(jy) - params.y;
+    for(int i=0; i<n; i++) d[params.sky_index()][i] = 1.;
+
+    if(moffat){
+
+      const double yfac = params.symm ? a*yoff*yoff : c*yoff*yoff;
+      for(int i=0; i<n; i++){
+        double xo   = xoff[i];
+        double fac  = params.symm ? 1. + a*xo*xo + yfac : 1. + xo*(a*xo+2.*b*yoff) + yfac;
+        double lfac = log(fac);
+        double val1 = exp(-pbeta*lfac);
+        double val2 = height*val1;
+        double dfac = -pbeta*val2/fac;
+        diff[i]     = dat[i] - val2 - sky;
+        d[ih][i]    = val1;
+        if(params.symm){
+          d[ix][i]  = -2.*dfac*a*xo;
+          d[iy][i]  = -2.*dfac*a*yoff;
+          d[ia][i]  = dfac*(xo*xo + yoff*yoff);
+        }else{
+          d[ix][i]  = -2.*dfac*(a*xo + b*yoff);
+          d[iy][i]  = -2.*dfac*(b*xo + c*yoff);
+          d[ia][i]  = dfac*xo*xo;
+          d[ib][i]  = 2.*dfac*xo*yoff;
+          d[ic][i]  = dfac*yoff*yoff;
+        }
+        d[ibeta][i] = -val2*lfac;
+      }
+
+    }else{
+
+      // Beyond the threshold the profile and its derivatives are taken to be zero
+      const double yefac = params.symm ? a*yoff*yoff : c*yoff*yoff;
+      for(int i=0; i<n; i++){
+        double xo     = xoff[i];
+        double efac   = params.symm ? a*xo*xo + yefac : xo*(a*xo+2.*b*yoff) + yefac;
+        double expon1 = efac < thresh ? exp(-efac) : 0.;
+        double expon2 = height*expon1;
+        diff[i]       = efac < thresh ? dat[i] - sky - expon2 : dat[i] - sky;
+        d[ih][i]      = expon1;
+        if(params.symm){
+          d[ix][i]    =  2.*expon2*a*xo;
+          d[iy][i]    =  2.*expon2*a*yoff;
+          d[ia][i]    =    -expon2*(xo*xo+yoff*yoff);
+        }else{
+          d[ix][i]    =  2.*expon2*(a*xo + b*yoff);
+          d[iy][i]    =  2.*expon2*(b*xo + c*yoff);
+          d[ia][i]    =    -expon2*xo*xo;
+          d[ib][i]    = -2.*expon2*xo*yoff;
+          d[ic][i]    =    -expon2*yoff*yoff;
+        }
+      }
+    }
+
+    // Accumulate the normal equations over the row
+    for(int j=0; j<nv; j++){
+      const double *dj = d[vindex[j]];
+      double *wdj = wd[j];
+      double bsum = 0.;
+      for(int i=0; i<n; i++){
+        wdj[i] = wgt[i]*dj[i];
+        bsum  += wdj[i]*diff[i];
+      }
+      beta[j] += bsum;
+      for(int k=0; k<=j; k++){
+        const double *dk = d[vindex[k]];
+        double asum = 0.;
+        for(int i=0; i<n; i++) asum += wdj[i]*dk[i];
+        alpha[j][k] += asum;
+      }
+    }
+    double csum = 0.;
+    for(int i=0; i<n; i++) csum += wgt[i]*diff[i]*diff[i];
+    chisq += csum;
+  }
+
+  for(int j=1; j<nv; j++)
+    for(int k=0; k<j; k++) alpha[k][j] = alpha[j][k];
+}
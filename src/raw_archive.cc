@@ -0,0 +1,342 @@
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "trm/subs.h"
+#include "trm/ultracam.h"
+#include "trm/raw_archive.h"
+
+namespace {
+
+  // Number of values per Rice group
+  const size_t NGROUP = 32;
+
+  // Largest quotient coded in unary; larger ones are followed by the raw value
+  const unsigned int QMAX = 16;
+
+  // Number of bits used to store the Rice parameter of each group
+  const int KBITS = 4;
+
+  // Accumulates bits, most significant first, into a byte vector
+  class Bit_writer {
+  public:
+    Bit_writer(std::vector<unsigned char>& out) : out(out), acc(0), nbits(0) {}
+
+    // Adds the n (<= 32) lowest bits of value
+    void put(uint32_t value, int n){
+      acc    = (acc << n) | (value & ((uint64_t(1) << n) - 1));
+      nbits += n;
+      while(nbits >= 8){
+        nbits -= 8;
+        out.push_back((unsigned char)(acc >> nbits));
+      }
+    }
+
+    // Writes out any remaining bits, padded with zeroes
+    void flush(){
+      if(nbits) out.push_back((unsigned char)(acc << (8-nbits)));
+      nbits = 0;
+    }
+
+  private:
+    std::vector<unsigned char>& out;
+    uint64_t acc;
+    int nbits;
+  };
+
+  // Reads bits written by Bit_writer
+  class Bit_reader {
+  public:
+    Bit_reader(const unsigned char* p, const unsigned char* end) : p(p), end(end), acc(0), nbits(0) {}
+
+    // Returns the next n (<= 32) bits
+    uint32_t get(int n){
+      while(nbits < n){
+        if(p == end)
+          throw Ultracam::Read_Error("Ultracam::Raw_archive::read(size_t, char*) const: compressed frame is truncated");
+        acc    = (acc << 8) | *p++;
+        nbits += 8;
+      }
+      nbits -= n;
+      return uint32_t(acc >> nbits) & uint32_t((uint64_t(1) << n) - 1);
+    }
+
+    // Returns the number of 1 bits before the next 0 bit, up to QMAX, consuming the 0 bit if found
+    unsigned int unary(){
+      unsigned int q = 0;
+      while(q < QMAX && get(1)) q++;
+      return q;
+    }
+
+  private:
+    const unsigned char *p, *end;
+    uint64_t acc;
+    int nbits;
+  };
+
+  // Codes nword little-endian 16-bit words starting at in as the differences between each word
+  // and the one stride words before it, mapped to unsigned values and Rice coded in groups.
+  void encode(const unsigned char* in, size_t nword, size_t stride, std::vector<unsigned char>& out){
+
+    Bit_writer bits(out);
+    uint16_t u[NGROUP];
+
+    for(size_t i=0; i<nword; i+=NGROUP){
+      size_t n = std::min(NGROUP, nword-i);
+
+      // Differences, interleaving positive and negative values so that small ones stay small
+      uint32_t sum = 0;
+      for(size_t j=0; j<n; j++){
+        size_t iw = i + j;
+        uint16_t w = uint16_t(in[2*iw] | (in[2*iw+1] << 8));
+        uint16_t p = iw >= stride ? uint16_t(in[2*(iw-stride)] | (in[2*(iw-stride)+1] << 8)) : 0;
+        int16_t d  = int16_t(uint16_t(w - p));
+        u[j] = uint16_t((uint16_t(d) << 1) ^ uint16_t(d >> 15));
+        sum += u[j];
+      }
+
+      // Rice parameter, roughly log2 of the mean value
+      unsigned int k = 0;
+      while(k < 15 && (uint32_t(n) << (k+1)) <= sum) k++;
+      bits.put(k, KBITS);
+
+      for(size_t j=0; j<n; j++){
+        unsigned int q = u[j] >> k;
+        if(q < QMAX){
+          bits.put(((1U << q) - 1) << 1, q+1);
+          if(k) bits.put(u[j], k);
+        }else{
+          bits.put((1U << QMAX) - 1, QMAX);
+          bits.put(u[j], 16);
+        }
+      }
+    }
+    bits.flush();
+  }
+
+  // Reverses encode
+  void decode(const unsigned char* in, const unsigned char* end, size_t nword, size_t stride, unsigned char* out){
+
+    Bit_reader bits(in, end);
+
+    for(size_t i=0; i<nword; i+=NGROUP){
+      size_t n = std::min(NGROUP, nword-i);
+      unsigned int k = bits.get(KBITS);
+
+      for(size_t j=0; j<n; j++){
+        unsigned int q = bits.unary();
+        uint16_t v = q < QMAX ? uint16_t((q << k) | (k ? bits.get(k) : 0)) : uint16_t(bits.get(16));
+        uint16_t d = uint16_t((v >> 1) ^ uint16_t(-(v & 1)));
+        size_t iw = i + j;
+        uint16_t p = iw >= stride ? uint16_t(out[2*(iw-stride)] | (out[2*(iw-stride)+1] << 8)) : 0;
+        uint16_t w = uint16_t(p + d);
+        out[2*iw]   = (unsigned char)(w & 0xff);
+        out[2*iw+1] = (unsigned char)(w >> 8);
+      }
+    }
+  }
+
+}
+
+Ultracam::Raw_archive::Raw_archive() : map_start(NULL), map_size(0), framesize_(0), headerskip_(0), stride_(1),
+                                       nframes_(0), index(NULL) {}
+
+Ultracam::Raw_archive::~Raw_archive(){
+  close();
+}
+
+/** Tests whether a compressed run exists
+ * \param file the run name, without extension
+ */
+bool Ultracam::Raw_archive::exists(const std::string& file){
+  std::ifstream ftest((file + extnam()).c_str());
+  return ftest.good();
+}
+
+/** Opens a compressed run by mapping it into memory and locating its index.
+ * \param file the run name, without extension
+ */
+void Ultracam::Raw_archive::open(const std::string& file){
+
+  close();
+
+  std::string name = file + extnam();
+  int fd = ::open(name.c_str(), O_RDONLY);
+  if(fd < 0)
+    throw File_Open_Error("Ultracam::Raw_archive::open(const std::string&): failed to open " + name);
+
+  struct stat st;
+  if(fstat(fd, &st)){
+    ::close(fd);
+    throw Read_Error("Ultracam::Raw_archive::open(const std::string&): failed to determine size of " + name + ": " +
+                     strerror(errno));
+  }
+
+  const size_t NSTART = 5*sizeof(Subs::INT4), NEND = 2*sizeof(uint64_t) + sizeof(Subs::INT4);
+  if(size_t(st.st_size) < NSTART + NEND){
+    ::close(fd);
+    throw Read_Error("Ultracam::Raw_archive::open(const std::string&): " + name + " is too short to be a compressed run");
+  }
+
+  void *addr = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(addr == MAP_FAILED)
+    throw Read_Error("Ultracam::Raw_archive::open(const std::string&): failed to map " + name + ": " + strerror(errno));
+  map_start = static_cast<char*>(addr);
+  map_size  = size_t(st.st_size);
+
+  Subs::INT4 start[5], magic;
+  uint64_t end[2];
+  memcpy(start, map_start, NSTART);
+  memcpy(end, map_start + map_size - NEND, sizeof(end));
+  memcpy(&magic, map_start + map_size - sizeof(Subs::INT4), sizeof(Subs::INT4));
+
+  if(start[0] != DMAGIC || magic != DMAGIC){
+    bool swapped = Subs::byte_swap(start[0]) == DMAGIC;
+    close();
+    if(swapped)
+      throw Read_Error("Ultracam::Raw_archive::open(const std::string&): " + name + " was written on a machine of different byte order");
+    throw Read_Error("Ultracam::Raw_archive::open(const std::string&): " + name + " is not a complete compressed run");
+  }
+  if(start[1] != VERSION){
+    close();
+    throw Read_Error("Ultracam::Raw_archive::open(const std::string&): " + name + " has unrecognised version = " +
+                     Subs::str(start[1]));
+  }
+
+  framesize_  = start[2];
+  headerskip_ = start[3];
+  stride_     = start[4];
+  nframes_    = end[0];
+  if(stride_ < 1 || headerskip_ > framesize_ || end[1] + sizeof(uint64_t)*(nframes_+1) + NEND != map_size){
+    close();
+    throw Read_Error("Ultracam::Raw_archive::open(const std::string&): index of " + name + " is corrupt");
+  }
+  index = map_start + end[1];
+  madvise(map_start, map_size, MADV_SEQUENTIAL);
+}
+
+/** Unmaps the run
+ */
+void Ultracam::Raw_archive::close(){
+  if(map_start){
+    munmap(map_start, map_size);
+    map_start = NULL;
+    map_size  = 0;
+  }
+  index   = NULL;
+  nframes_ = 0;
+}
+
+/** Decompresses a frame.
+ * \param nfile the frame number, starting from 1
+ * \param buffer buffer of at least framesize() bytes to receive the raw frame
+ */
+void Ultracam::Raw_archive::read(size_t nfile, char* buffer) const {
+
+  if(!map_start)
+    throw Ultracam_Error("Ultracam::Raw_archive::read(size_t, char*) const: no compressed run open");
+  if(nfile < 1 || nfile > nframes_)
+    throw Ultracam_Error("Ultracam::Raw_archive::read(size_t, char*) const: frame number = " + Subs::str(nfile) +
+                         " is out of range 1 to " + Subs::str(nframes_));
+
+  uint64_t off[2];
+  memcpy(off, index + sizeof(uint64_t)*(nfile-1), sizeof(off));
+  if(off[0] > off[1] || off[1] > map_size || off[1] - off[0] < framesize_ - 2*((framesize_ - headerskip_)/2))
+    throw Read_Error("Ultracam::Raw_archive::read(size_t, char*) const: index entry of frame " + Subs::str(nfile) + " is corrupt");
+
+  // Header and any odd byte are stored as they are
+  const unsigned char *p = reinterpret_cast<const unsigned char*>(map_start + off[0]);
+  const unsigned char *end = reinterpret_cast<const unsigned char*>(map_start + off[1]);
+  size_t nword = (framesize_ - headerskip_)/2;
+  size_t nraw  = framesize_ - 2*nword;
+  memcpy(buffer, p, headerskip_);
+  if(nraw > headerskip_) memcpy(buffer + framesize_ - 1, p + headerskip_, 1);
+
+  decode(p + nraw, end, nword, stride_, reinterpret_cast<unsigned char*>(buffer + headerskip_));
+}
+
+Ultracam::Raw_archive_writer::~Raw_archive_writer(){
+  try{
+    close();
+  }
+  catch(...){}
+}
+
+/** Opens a compressed run for output, over-writing any that already exists.
+ * \param file the run name, without extension
+ * \param framesize number of bytes per frame
+ * \param headerskip number of bytes of the timing header at the start of each frame
+ * \param stride number of 16-bit words between successive pixels from the same readout,
+ * 2*(number of CCDs) for ULTRACAM, 1 for ULTRASPEC. Any value gives lossless compression
+ * but the wrong value compresses less well.
+ */
+void Ultracam::Raw_archive_writer::open(const std::string& file, size_t framesize, size_t headerskip, size_t stride){
+
+  close();
+
+  if(headerskip > framesize || stride < 1)
+    throw Ultracam_Error("Ultracam::Raw_archive_writer::open(const std::string&, size_t, size_t, size_t): invalid frame size = " +
+                         Subs::str(framesize) + ", header size = " + Subs::str(headerskip) + " or stride = " + Subs::str(stride));
+
+  std::string name = file + Raw_archive::extnam();
+  fout.open(name.c_str(), std::ios::binary);
+  if(!fout)
+    throw File_Open_Error("Ultracam::Raw_archive_writer::open(const std::string&, size_t, size_t, size_t): failed to open " + name);
+
+  framesize_  = framesize;
+  headerskip_ = headerskip;
+  stride_     = stride;
+  offset.clear();
+
+  Subs::INT4 start[5] = {Raw_archive::DMAGIC, Raw_archive::VERSION, Subs::INT4(framesize), Subs::INT4(headerskip),
+                         Subs::INT4(stride)};
+  fout.write((char*)start, sizeof(start));
+  offset.push_back(sizeof(start));
+}
+
+/** Compresses one raw frame and adds it to the end of the run.
+ * \param frame the raw frame, framesize bytes long
+ */
+void Ultracam::Raw_archive_writer::write(const char* frame){
+
+  if(!fout.is_open())
+    throw Ultracam_Error("Ultracam::Raw_archive_writer::write(const char*): no compressed run open");
+
+  size_t nword = (framesize_ - headerskip_)/2;
+  buff.assign(frame, frame + headerskip_);
+  if(framesize_ - 2*nword > headerskip_) buff.push_back((unsigned char)frame[framesize_-1]);
+  encode(reinterpret_cast<const unsigned char*>(frame + headerskip_), nword, stride_, buff);
+
+  fout.write((char*)&buff[0], buff.size());
+  if(!fout)
+    throw Write_Error("Ultracam::Raw_archive_writer::write(const char*): failed to write frame " + Subs::str(offset.size()));
+  offset.push_back(offset.back() + buff.size());
+}
+
+/** Writes the index, which makes the run readable, and closes the file. Does nothing if no
+ * run is open.
+ */
+void Ultracam::Raw_archive_writer::close(){
+
+  if(!fout.is_open()) return;
+
+  uint64_t end[2] = {offset.size()-1, offset.back()};
+  Subs::INT4 magic = Raw_archive::DMAGIC;
+  fout.write((char*)&offset[0], sizeof(uint64_t)*offset.size());
+  fout.write((char*)end, sizeof(end));
+  fout.write((char*)&magic, sizeof(Subs::INT4));
+  bool ok = fout.good();
+  fout.close();
+  offset.clear();
+  if(!ok)
+    throw Write_Error("Ultracam::Raw_archive_writer::close(): failed to write index");
+}
@@ -1,8 +1,11 @@
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <map>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <sys/stat.h>
 #include "trm/subs.h"
 #include "trm/time.h"
 #include "trm/aperture.h"
@@ -26,6 +29,9 @@ namespace Reduce {
   extern std::vector<float> pepper;
   extern std::vector<float> saturation;
   extern TERM_OUT terminal_output;
+  extern int prefetch_depth;
+  extern int nthreads;
+  extern bool roi_calibration;
   extern bool gain_const;
   extern float gain;
   extern Ultracam::Frame gain_frame;
@@ -49,10 +55,13 @@ namespace Reduce {
   extern float aperture_twopass_counts;
   extern int   aperture_twopass_npoly;
   extern float aperture_twopass_sigma;
+  extern std::string aperture_twopass_file;
+  extern std::string aperture_twopass_key;
 
   // Extraction and profiles
   extern std::map<int,Reduce::Extraction> extraction_control;
   extern std::vector<float> star_radius;
+  extern int extraction_subdiv;
   extern PROFILE_FIT_METHOD profile_fit_method;
   extern PROFILE_FIT_METHOD extraction_weights;
   extern float profile_fit_fwhm;
@@ -63,6 +72,7 @@ namespace Reduce {
   extern SKY_METHOD sky_method;
   extern SKY_ERROR  sky_error;
   extern float sky_thresh;
+  extern float sky_annulus_tolerance;
 
   // Calibration
   extern bool bias;
@@ -418,6 +428,24 @@ void Ultracam::read_reduce_file(const std::string& file, const std::string& logf
     Reduce::logger.logit("Aperture radii", p->second);
   }
 
+  if(badInput(reduce, "extraction_subdiv", p)){
+    Reduce::extraction_subdiv = 0;
+    Reduce::logger.logit("Weight subdivision undefined [option = \"extraction_subdiv\"]; extraction weights will be computed exactly.");
+  }else{
+    istr.str(p->second);
+    istr >> Reduce::extraction_subdiv;
+    if(!istr) throw Input_Error("Could not translate extraction_subdiv value");
+    istr.clear();
+
+    if(Reduce::extraction_subdiv < 0)
+      throw Input_Error("extraction_subdiv = " + Subs::str(Reduce::extraction_subdiv) + " must be >= 0");
+
+    if(Reduce::extraction_subdiv == 0)
+      Reduce::logger.logit("Extraction weights will be computed exactly.");
+    else
+      Reduce::logger.logit("Subdivisions per pixel for cached extraction weights", Reduce::extraction_subdiv);
+  }
+
   // Aperture file
   if(badInput(reduce, "aperture_file", p))
     throw Input_Error("Aperture file undefined. [option = \"aperture_file\"]");
@@ -631,6 +659,14 @@ void Ultracam::read_reduce_file(const std::string& file, const std::string& logf
 
     Reduce::logger.logit("Rejection threshold for two pass mode", Reduce::aperture_twopass_sigma, " sigma.");
 
+    // File in which to keep the results of the first pass. Optional.
+    if(badInput(reduce, "aperture_twopass_file", p)){
+      Reduce::aperture_twopass_file = "";
+      Reduce::logger.logit("Two pass file undefined [option = \"aperture_twopass_file\"]; the first pass will always be carried out.");
+    }else{
+      Reduce::aperture_twopass_file = p->second;
+      Reduce::logger.logit("Two pass file", p->second);
+    }
   }
 
   if(profile_fits_needed){
@@ -892,8 +928,12 @@ void Ultracam::read_reduce_file(const std::string& file, const std::string& logf
     Reduce::sky_method = Reduce::CLIPPED_MEAN;
   }else if(Subs::toupper(p->second) == "MEDIAN"){
     Reduce::sky_method = Reduce::MEDIAN;
+  }else if(Subs::toupper(p->second) == "HISTOGRAM_MEAN"){
+    Reduce::sky_method = Reduce::HISTOGRAM_MEAN;
+  }else if(Subs::toupper(p->second) == "HISTOGRAM_MEDIAN"){
+    Reduce::sky_method = Reduce::HISTOGRAM_MEDIAN;
   }else{
-    throw Input_Error("sky_method must be one of 'clipped_mean' or 'median'");
+    throw Input_Error("sky_method must be one of 'clipped_mean', 'median', 'histogram_mean' or 'histogram_median'");
   }
 
   Reduce::logger.logit("Sky estimation method", p->second);
@@ -926,6 +966,22 @@ void Ultracam::read_reduce_file(const std::string& file, const std::string& logf
 
   Reduce::logger.logit("Sky RMS clip threshold", p->second);
 
+  // Tolerance for re-using sky annulus pixels
+  if(badInput(reduce, "sky_annulus_tolerance", p)){
+    Reduce::sky_annulus_tolerance = -1.f;
+    Reduce::logger.logit("Sky annulus tolerance undefined [option = \"sky_annulus_tolerance\"]; sky annuli will be computed pixel by pixel.");
+  }else{
+    istr.str(p->second);
+    istr >> Reduce::sky_annulus_tolerance;
+    if(!istr) throw Input_Error("Could not translate sky_annulus_tolerance value");
+    istr.clear();
+
+    if(Reduce::sky_annulus_tolerance < 0.f)
+      Reduce::logger.logit("Sky annuli will be computed pixel by pixel.");
+    else
+      Reduce::logger.logit("Sky annulus re-use tolerance (unbinned pixels)", Reduce::sky_annulus_tolerance);
+  }
+
   // Image display device
   if(badInput(reduce, "image_device", p))
     throw Input_Error("Image plot device undefined. [option = \"image_device\"]");
@@ -1507,5 +1563,107 @@ void Ultracam::read_reduce_file(const std::string& file, const std::string& logf
 
   logit("Terminal output", p->second);
 
+  // Number of frames to read ahead. Optional.
+  if(badInput(reduce, "prefetch_depth", p)){
+    Reduce::prefetch_depth = 0;
+    Reduce::logger.logit("Frame read-ahead undefined [option = \"prefetch_depth\"]; frames will be read as needed.");
+  }else{
+    istr.str(p->second);
+    istr >> Reduce::prefetch_depth;
+    if(!istr) throw Input_Error("Could not translate prefetch_depth value");
+    istr.clear();
+
+    if(Reduce::prefetch_depth < 0)
+      throw Input_Error("prefetch_depth = " + Subs::str(Reduce::prefetch_depth) + " must be >= 0");
+
+    Reduce::logger.logit("Number of frames to read ahead", Reduce::prefetch_depth);
+  }
+
+  if(badInput(reduce, "nthreads", p)){
+    Reduce::nthreads = 1;
+    Reduce::logger.logit("Number of threads undefined [option = \"nthreads\"]; frames will be processed in a single thread.");
+  }else{
+    istr.str(p->second);
+    istr >> Reduce::nthreads;
+    if(!istr) throw Input_Error("Could not translate nthreads value");
+    istr.clear();
+
+    if(Reduce::nthreads < 1)
+      throw Input_Error("nthreads = " + Subs::str(Reduce::nthreads) + " must be >= 1");
+
+    Reduce::logger.logit("Number of threads per frame", Reduce::nthreads);
+  }
+
+  if(badInput(reduce, "roi_calibration", p)){
+    Reduce::roi_calibration = false;
+    Reduce::logger.logit("Calibration region undefined [option = \"roi_calibration\"]; whole frames will be calibrated.");
+  }else if(Subs::toupper(p->second) == "YES"){
+    Reduce::roi_calibration = true;
+    Reduce::logger.logit("Only the regions around apertures will be calibrated.");
+  }else if(Subs::toupper(p->second) == "NO"){
+    Reduce::roi_calibration = false;
+    Reduce::logger.logit("Whole frames will be calibrated.");
+  }else{
+    throw Input_Error("\"roi_calibration\" must be either \"yes\" or \"no\".");
+  }
+
+  // Gather the settings that the first pass of two pass mode depends upon. The first pass is
+  // only skipped if they match those stored in the two pass file. Options that only affect the
+  // extraction, the plots, the output or the speed are left out, except that the extraction
+  // settings matter to the first pass too if apertures with too few counts are rejected.
+  if(Reduce::aperture_twopass && !Reduce::aperture_twopass_file.empty()){
+
+    const bool extract = Reduce::aperture_twopass_counts > 0.f;
+    const char *always[] = {"version", "cr_to_start", "clobber", "abort_behaviour", "star_aperture_radii",
+                            "aperture_twopass_npoly", "aperture_twopass_sigma", "aperture_twopass_file",
+                            "image_device", "terminal_output", "prefetch_depth", "nthreads", "cosmic_",
+                            "lightcurve_", "position_", "transmission_", "seeing_"};
+    const char *extraction[] = {"extraction_subdiv", "pepper", "saturation", "sky_"};
+
+    std::ostringstream key;
+    key.precision(17);
+    for(CI ci=reduce.begin(); ci!=reduce.end(); ci++){
+      bool skip = false;
+      for(size_t i=0; i<sizeof(always)/sizeof(always[0]) && !skip; i++)
+        skip = (ci->first.compare(0, strlen(always[i]), always[i]) == 0);
+      for(size_t i=0; i<sizeof(extraction)/sizeof(extraction[0]) && !skip && !extract; i++)
+        skip = (ci->first.compare(0, strlen(extraction[i]), extraction[i]) == 0);
+      if(!skip) key << ci->first << " = " << ci->second << "\n";
+    }
+
+    // Calibration frames are named above, but may be re-made without being renamed, so their sizes
+    // and modification times are added too. Gain and readout values that are numbers are not files.
+    const char *calibration[] = {"calibration_bias", "calibration_dark", "calibration_flat", "calibration_bad",
+                                 "calibration_gain", "calibration_readout"};
+    for(size_t i=0; i<sizeof(calibration)/sizeof(calibration[0]); i++){
+      CI ci = reduce.find(calibration[i]);
+      struct stat st;
+      if(ci != reduce.end() && stat(Subs::filnam(ci->second, Ultracam::Frame::extnam()).c_str(), &st) == 0)
+        key << calibration[i] << " file = " << st.st_size << " bytes, modified " << st.st_mtime << "\n";
+    }
+
+    // Aperture types and extraction methods decide which profile fits are made; the radii only matter
+    // to the extraction
+    for(std::map<int,Reduce::Extraction>::const_iterator cit=Reduce::extraction_control.begin(); cit!=Reduce::extraction_control.end(); cit++){
+      const Reduce::Extraction& ext = cit->second;
+      key << "extraction_control = " << cit->first + 1 << " " << ext.aperture_type << " " << ext.extraction_method;
+      if(extract)
+        key << " " << ext.star_scale << " " << ext.star_min << " " << ext.star_max
+            << " " << ext.inner_sky_scale << " " << ext.inner_sky_min << " " << ext.inner_sky_max
+            << " " << ext.outer_sky_scale << " " << ext.outer_sky_min << " " << ext.outer_sky_max;
+      key << "\n";
+    }
+
+    // The apertures themselves, since their file may have been edited
+    for(size_t nccd=0; nccd<Reduce::aperture_master.size(); nccd++){
+      for(size_t naper=0; naper<Reduce::aperture_master[nccd].size(); naper++){
+        Ultracam::Aperture app = Reduce::aperture_master[nccd][naper];
+        if(!extract) app.set_radii(1.f, 2.f, 3.f);
+        key << "aperture " << nccd + 1 << " " << naper + 1 << ": " << app << "\n";
+      }
+    }
+    Reduce::aperture_twopass_key = key.str();
+  }
+
 }
 
@@ -260,6 +260,17 @@ fits are made to the position offsets. This is the threshold used for rejection
 during this process. This is the final check after the maximum shift tests and the minimum number
 of counts for dodgy positions. !!emph{Required if aperture_twopass = yes}.}
 
+!!arg{aperture_twopass_file}{In two pass mode, the name of a file in which to keep the positions, shapes and
+validity measured during the first pass. If the file exists and was written with the same data and the
+same settings for the first pass, the first pass is skipped and the results are read from the file instead,
+so re-running reduce with, for example, different extraction radii or sky settings only reads the data once.
+Otherwise the first pass is carried out as usual and the file is over-written at its end. The
+settings compared are all those of the reduce file except ones which only affect the extraction, plots,
+output or speed (the extraction settings are compared too if aperture_twopass_counts > 0), along with the
+apertures, ignoring their radii, and the data source and first frame. Calibration frames are compared by name,
+size and modification time. The second pass stops at the last frame in the file, so if the run has grown since
+the file was written, delete it to reduce the new frames too. Leave blank for no file.}
+
 !!arg{extraction_control}{This is the most complicated and important option. You need one 'extraction_control' line per CCD.
 The idea is to give you independent control over the reduction used for each CCD. What you choose here has the
 most important effect over the end results. You will not necessarily want the same for
@@ -358,7 +369,20 @@ this parameter a series of radii. These will be used during reduction to extract
 is used, ALL CCDs will be extracted in this way and no plotting will occur. If the aperture radius type is fixed,
 the numbers you give will be interpreted directly as radii in pixels. If variable they will be taken to be
 scaling factors times the seeing. Use the script !!ref{splitr.html}{splitr} to split up the multiplexed log file
-that results from this parameter.}
+that results from this parameter. All the radii of an aperture are extracted together, with the sky estimated just once
+and a single pass over the pixels, so extra radii add little to the time taken.}
+
+!!arg{extraction_subdiv}{The weights given to the pixels of the star apertures depend upon where the aperture
+lies relative to the pixels, its radius and, for optimal extraction, the profile. Computing them takes a good
+part of the extraction time. If this is set > 0, the weights are instead kept and re-used whenever an aperture
+recurs with a position and radius that are the same to within 1/extraction_subdiv of a binned pixel and, for
+optimal extraction, a profile whose coefficients are the same to within a fraction of about 1/extraction_subdiv.
+The position, radius and profile are rounded for this purpose so that variable apertures and profiles fitted
+afresh each frame can still re-use weights. Rounding the position is equivalent to moving the aperture by up to
+1/(2*extraction_subdiv) pixels and changes the weights of pixels at the edge of the aperture by up to about
+1/extraction_subdiv; rounding the radius and profile changes them by less than this, and all the rounding together
+by up to about 1.5/extraction_subdiv. Values of 20 or more make this negligible compared to the uncertainty in
+the positions and profile. Not applied to apertures with extra star apertures. Optional; defaults to 0, which computes the weights exactly for every aperture and frame.}
 
 !!arg{profile_fit_method}{'gaussian' or 'moffat'. You can try these out with 'rtplot' and 'plot' to see
 which is to be preferred. 'moffat'normally seems a fair bit better. !!emph{Required} if variable apertures
@@ -540,6 +564,24 @@ the aperture number of your brightest reference to give an accurate warning of s
 only a rough guide, but could be useful. This line consists of the estimated peppering level for each CCD. Note that this applies to
 unbinned pixels. Binned pixels have correspondingly higher levels which the program computes.}
 
+!!arg{prefetch_depth}{Number of frames to read ahead when reading from the server or a local .dat
+file. If > 0 a separate thread reads and de-multiplexes the next few frames while the current one is
+being reduced, which for long runs can nearly hide the I/O time. Each extra frame costs as much memory
+as a data frame. 0 to read frames only as they are needed. Ignored for lists of ucm files.
+Optional; defaults to 0.}
+
+!!arg{nthreads}{Number of threads to use when processing each frame. This is used to unpack the raw
+data of each frame from the server or a local .dat file, with the CCDs (ULTRACAM) or windows (ULTRASPEC)
+handled in parallel, to calibrate the CCDs in parallel, to reposition the apertures, with the position
+measurements and profile fits of all apertures of all CCDs made in parallel, and to extract the fluxes of all
+apertures and radii in parallel. Profile fits are made one at a time if they are being plotted. The extra threads are started once and kept for the whole run, along with their working buffers and caches. The log file is the same whatever the number of threads. Optional; defaults to 1.}
+
+!!arg{roi_calibration}{yes/no to restrict the bias subtraction, dark subtraction, flat fielding and computation
+of variances to the regions around the apertures which are needed for repositioning and extraction, rather than
+the whole of every frame. For full-frame data with a few targets this saves most of the time spent on calibration.
+The regions allow for the largest shifts permitted by the aperture repositioning parameters and for the outermost sky
+radii. The whole frame is still calibrated for the first frame and any frames that are plotted. Optional; defaults to no.}
+
 !!arg{readout}{Readout noise, or if preceded by '@', the name of readout noise
 frame giving the readout noise for every pixel !!emph{in terms of variance} (counts**2).
 !!emph{Required}.}
@@ -551,11 +593,23 @@ sene of exceeding 65535. This line consists of the estimated saturation level of
 regardless of sky estimation method as it is needed in deriving uncertainty
 estimates. !!emph{Required}.}
 
+!!arg{sky_annulus_tolerance}{The pixels in a sky annulus, less any masked regions, depend only upon
+the radii, the masks, the binning and the position of the aperture relative to the pixel grid. If this
+is >= 0, reduce keeps lists of annulus pixels and re-uses them for any aperture whose position relative
+to the pixel grid is within sky_annulus_tolerance unbinned pixels in X and Y of one already computed, which
+saves testing every pixel of the box around the outer radius on every frame. 0 re-uses a list only for
+exactly the same sub-pixel position, as happens with fixed apertures. Larger values are equivalent to moving
+the annulus by up to this amount. Negative values, the default, compute the annulus pixel by pixel.}
+
 !!arg{sky_error}{Method to use for estimating error in sky background estimate.
 Options: 'variance', 'photon'. !!emph{Required}.}
 
 !!arg{sky_method}{Method to use for sky estimation. Options: 'clipped_mean',
-'median', 'mode'. !!emph{Required}.}
+'median', 'histogram_mean', 'histogram_median'. The last two compute the clipped mean and median from a histogram
+of the sky pixel values with bins 1 count wide, rather than by repeated passes through the pixels and sorting.
+This is faster for large sky annuli, but they are only approximations to 'clipped_mean' and 'median': pixels are
+clipped as if they had the mean value of their bin, and the median is the mean value of the bin holding the middle
+value, so the results typically differ by a fraction of a count. !!emph{Required}.}
 
 !!arg{terminal_output}{Mode of terminal output. Options: "none", "little", "medium", "full".
 !!emph{Required}.}
@@ -600,6 +654,11 @@ The output files are ASCII and self-documenting.
 #include "trm/mccd.h"
 #include "trm/frame.h"
 #include "trm/ultracam.h"
+#include "trm/frame_source.h"
+#include "trm/frame_prefetch.h"
+#include "trm/header_items.h"
+#include "trm/calibrate.h"
+#include "trm/parallel.h"
 #include "trm/reduce.h"
 
 // Variables that are set by reading from the input file with read_reduce_file.
@@ -624,6 +683,9 @@ namespace Reduce {
     float readout;                                     // The readout if readout_const
     Ultracam::Frame readout_frame;                     // The readout frame if !readout_const
     TERM_OUT terminal_output;                          // Terminal output mode
+    int prefetch_depth;                                // Number of frames to read ahead, 0 to read as needed
+    int nthreads;                                      // Number of threads to use within each frame
+    bool roi_calibration;                              // Only calibrate regions around apertures
 
     // Aperture parameters
     Ultracam::Maperture aperture_master;               // Initial aperture file
@@ -639,10 +701,13 @@ namespace Reduce {
     float aperture_twopass_counts;                     // Minimum number of counts to be a valid aperture, two pass mode
     int   aperture_twopass_npoly;                      // Number of poly terms, two pass mode
     float aperture_twopass_sigma;                      // Rejection threshold for poly fits, two pass mode
+    std::string aperture_twopass_file;                 // File to keep the first pass results in, two pass mode
+    std::string aperture_twopass_key;                  // Settings the first pass results depend upon, two pass mode
 
     // Extraction and profile fitting
     std::map<int,Reduce::Extraction> extraction_control;    // Extraction control parameters for each CCD
     std::vector<float> star_radius;                         // Radii to use when extracting multiple times.
+    int extraction_subdiv;                                  // Pixel subdivision for cached extraction weights, 0 for none
     PROFILE_FIT_METHOD profile_fit_method;             // Type of profile fitting to use
     PROFILE_FIT_METHOD extraction_weights;             // Weighting to use when extracting
     float profile_fit_fwhm;                            // Initial FWHM to use for profile fitting
@@ -653,6 +718,7 @@ namespace Reduce {
     SKY_METHOD sky_method;                             // Sky estimation method
     SKY_ERROR  sky_error;                              // Sky uncertainty estimation method
     float sky_thresh;                                    // RMS clip limit for rejection of sky data
+    float sky_annulus_tolerance;                         // Tolerance for re-using sky annulus pixels, < 0 for none
 
     // Calibration parameters
     bool bias;                                         // Whether there is a bias frame or not
@@ -756,6 +822,21 @@ private:
     double xstart, range;
 };
 
+// Owns the frame prefetcher of a pass. Its destructor stops the reader thread, so that this
+// happens before the source and frames that the reader uses are destroyed even if an exception
+// is thrown out of the frame loop.
+class Prefetch_owner {
+public:
+    Prefetch_owner() : ptr(NULL) {}
+    ~Prefetch_owner(){delete ptr;}
+    void reset(Ultracam::Frame_prefetch* prefetch){delete ptr; ptr = prefetch;}
+    Ultracam::Frame_prefetch* get() const {return ptr;}
+private:
+    Prefetch_owner(const Prefetch_owner&);
+    Prefetch_owner& operator=(const Prefetch_owner&);
+    Ultracam::Frame_prefetch* ptr;
+};
+
 // Structure used to store polynomial fits for each aperture in two pass mode
 struct Polyfit {
     bool ok;
@@ -763,6 +844,43 @@ struct Polyfit {
     std::vector<double> y;
 };
 
+// An aperture of one CCD to be extracted at all of the star radii, and the results for each radius
+struct Extraction_job {
+    size_t nccd;
+    size_t naper;
+    Ultracam::Aperture aperture;
+    Reduce::EXTRACTION_METHOD method;
+    std::vector<float> rstar, counts, sigma;
+    float sky;
+    int nsky, nrej;
+    std::vector<int> worst;
+    std::vector<Reduce::ERROR_CODES> ecode;
+};
+
+// All the extractions of a frame along with the data they need. The extractions are
+// independent of each other and are carried out in parallel into this table; the results
+// are then written out in the usual order so that the log is the same however many threads
+// are used.
+struct Extraction_table {
+    const Ultracam::Frame *data, *dvar, *bad;
+    const std::vector<std::vector<std::vector<std::pair<int,int> > > > *zapped;
+    const std::vector<Reduce::Meanshape> *shape;
+    std::vector<Extraction_job> job;
+};
+
+// Carries out extraction n of an Extraction_table, for run_parallel
+void extraction_task(int n, void* arg){
+    Extraction_table& table = *static_cast<Extraction_table*>(arg);
+    Extraction_job& job = table.job[n];
+    const size_t nccd = job.nccd;
+    Ultracam::extract_flux((*table.data)[nccd], (*table.dvar)[nccd], (*table.bad)[nccd], Reduce::gain_frame[nccd],
+                           Reduce::bias_frame[nccd], job.aperture, job.rstar, Reduce::sky_method,
+                           Reduce::sky_thresh, Reduce::sky_error, job.method, (*table.zapped)[nccd][job.naper],
+                           (*table.shape)[nccd], Reduce::pepper[nccd], Reduce::saturation[nccd],
+                           job.counts, job.sigma, job.sky, job.nsky, job.nrej, job.ecode, job.worst,
+                           Reduce::extraction_subdiv, Reduce::sky_annulus_tolerance);
+}
+
 // ************************************************************
 //
 // Main program starts here!
@@ -872,7 +990,13 @@ int main(int argc, char* argv[]){
         Ultracam::Mwindow mwindow;
         Subs::Header header;
         Ultracam::ServerData serverdata;
-        Ultracam::Frame data, dvar, bad, tframe;
+        Ultracam::Frame_source server;
+        Ultracam::Frame data, dvar, bad;
+        Ultracam::Calibrator calibrator;
+        std::vector<float> dark_scale;
+        Ultracam::Maperture roi_aperture;
+        std::vector<float> roi_radius1, roi_radius2;
+        std::vector<std::vector<Ultracam::Pixel_box> > roi_boxes;
         double twait, tmax;
         int ncol, nrow;
         if(source == 'S' || source == 'L'){
@@ -899,6 +1023,8 @@ int main(int argc, char* argv[]){
 
             // Finally, read the XML file.
             parseXML(source, url, mwindow, header, serverdata, trim, ncol, nrow, twait, tmax);
+            server.open(source, url, serverdata);
+            server.set_nthreads(Reduce::nthreads);
 
             if(source == 'S'){
                 Reduce::logger.logit("Server file name", url);
@@ -1089,7 +1215,10 @@ int main(int argc, char* argv[]){
         float expose; // exposure time
         float expose_blue; // blue exposure time
         bool first_file, has_a_time; // are we on the first data file? do we have a time?
+        Ultracam::Header_items file_items; // header items of ucm files
+        const Ultracam::Header_items *items = NULL; // header items of the current frame
         std::vector<Reduce::Meanshape> shape; // Vector of shape parameters for each CCD.
+        Reduce::Rejig_state rejig_state; // State of aperture repositioning from frame to frame
         std::vector<std::vector<Ultracam::Fxy> > errors; // Vectors of position uncertainties for all apertures
         std::vector<Reduce::Twopass>  twopass; // Structure for storage of position offset information in two-pass case
         Reduce::Twopass twop; // Temporary element for storage of position offset information in two-pass case
@@ -1113,6 +1242,44 @@ int main(int argc, char* argv[]){
             maxpass = 2;
         }
 
+        // Skip the first pass if its results can be read from the two pass file. They must have come
+        // from the same data, starting apertures and settings.
+        bool twopass_read = false;
+        std::string twopass_key;
+        if(Reduce::aperture_twopass && !Reduce::aperture_twopass_file.empty()){
+            if(source == 'S' || source == 'L'){
+                twopass_key = std::string("source = ") + source + "\nurl = " + url + "\nfirst = " + Subs::str(first) +
+                    "\ntrim = " + (trim ? Subs::str(ncol) + " " + Subs::str(nrow) : std::string("no")) + "\n";
+            }else{
+                twopass_key = "source = U\n";
+                for(size_t i=0; i<file.size(); i++)
+                    twopass_key += "file = " + file[i] + "\n";
+            }
+            twopass_key += Reduce::aperture_twopass_key;
+
+            // Radii clamped as by rejig_apertures at the start of the first pass
+            Ultracam::Maperture start = Reduce::aperture_master;
+            for(size_t nccd=0; nccd<start.size(); nccd++){
+                if(Reduce::extraction_control.find(nccd) != Reduce::extraction_control.end()){
+                    const Reduce::Extraction& ext = Reduce::extraction_control[nccd];
+                    for(size_t naper=0; naper<start[nccd].size(); naper++){
+                        Ultracam::Aperture &app = start[nccd][naper];
+                        app.set_radii(Subs::clamp(ext.star_min,      app.rstar(), ext.star_max),
+                                      Subs::clamp(ext.inner_sky_min, app.rsky1(), ext.inner_sky_max),
+                                      Subs::clamp(ext.outer_sky_min, app.rsky2(), ext.outer_sky_max));
+                    }
+                }
+            }
+
+            if(Reduce::read_twopass(Reduce::aperture_twopass_file, twopass_key, start, twopass, blue_is_bad)){
+                aperture     = start;
+                twopass_read = true;
+                Reduce::logger.logit("First pass results read from", Reduce::aperture_twopass_file);
+            }else{
+                Reduce::logger.logit("First pass results will be saved to", Reduce::aperture_twopass_file);
+            }
+        }
+
         // Buffers for storage of zapped pixels
         std::vector<std::vector<std::vector<std::pair<int,int> > > > zapped;
         for(size_t nccd=0; nccd<Reduce::aperture_master.size(); nccd++)
@@ -1125,14 +1292,25 @@ int main(int argc, char* argv[]){
         // buffer for storing results for one frame
         std::vector<std::vector<Reduce::Point> > all_ccds;
 
+        // extractions of one frame
+        Extraction_table extraction;
+        extraction.data   = &data;
+        extraction.dvar   = &dvar;
+        extraction.bad    = &bad;
+        extraction.zapped = &zapped;
+        extraction.shape  = &shape;
+
         // Finally get going
         // maxpass passes through the data will occur.
         for(int npass=1; npass<=maxpass; npass++){
 
             nfile      = first;
             first_file = true;
+            const bool skip_pass = (npass == 1 && twopass_read);
             if(Reduce::aperture_twopass){
-                if(npass == 1)
+                if(skip_pass)
+                    std::cout << "Skipping first pass of two pass mode; positions read from " << Reduce::aperture_twopass_file << std::endl;
+                else if(npass == 1)
                     std::cout << "Carrying out first pass of two pass mode to determine the positions" << std::endl;
                 else
                     std::cout << "Carrying out second pass of two pass mode to extract fluxes" << std::endl;
@@ -1140,7 +1318,22 @@ int main(int argc, char* argv[]){
             }
             int nexp = 0;
 
-            for(;;){
+            // Read frames ahead in a separate thread if wanted
+            Prefetch_owner prefetch_owner;
+            if(!skip_pass && (source == 'S' || source == 'L') && Reduce::prefetch_depth > 0)
+                prefetch_owner.reset(new Ultracam::Frame_prefetch(server, data, first, Reduce::prefetch_depth, twait, tmax));
+            Ultracam::Frame_prefetch *prefetch = prefetch_owner.get();
+
+            while(!skip_pass){
+
+                // The second pass ends at the last frame of the first, even if the run has grown since, as it
+                // may have if the first pass results were read from the two pass file
+                if(npass == 2 && size_t(nexp) == twopass.size()){
+                    if(twopass_read && !twopass.empty())
+                        std::cout << "Second pass ends at frame " << twopass.back().nfile << ", the last in " << Reduce::aperture_twopass_file
+                                  << "; delete it to reduce any later frames" << std::endl;
+                    break;
+                }
 
                 // Data input section
                 if(source == 'S' || source == 'L'){
@@ -1148,11 +1341,16 @@ int main(int argc, char* argv[]){
                     // Carry on reading until data & time are OK
                     bool get_ok, reset = (npass == 2 && nfile == first);
                     for(;;){
-                        if(!(get_ok = Ultracam::get_server_frame(source, url, data, serverdata, nfile, twait, tmax, reset))) break;
-                        ut_date       = data["UT_date"]->get_time();
-                        reliable      = data["Frame.reliable"]->get_bool();
-                        ut_date_blue  = serverdata.nblue > 1 ? data["UT_date_blue"]->get_time() : ut_date;
-                        reliable_blue = serverdata.nblue > 1 ? data["Frame.reliable_blue"]->get_bool() : reliable;
+                        if(prefetch){
+                            if(!(get_ok = prefetch->get(data, nfile))) break;
+                        }else{
+                            if(!(get_ok = server.get(data, nfile, twait, tmax, reset))) break;
+                        }
+                        items         = prefetch ? &prefetch->items() : &server.items();
+                        ut_date       = items->ut_date;
+                        reliable      = items->reliable;
+                        ut_date_blue  = items->ut_date_blue;
+                        reliable_blue = items->reliable_blue;
 
                         if(serverdata.is_junk(nfile)){
                             std::cerr << "Skipping file " << nfile << " which has junk data" << newl;
@@ -1170,12 +1368,12 @@ int main(int argc, char* argv[]){
                        (Reduce::terminal_output == Reduce::FULL || Reduce::terminal_output == Reduce::MEDIUM || Reduce::terminal_output == Reduce::LITTLE)){
                         if(Reduce::aperture_twopass){
                             if(npass == 1){
-                                std::cout << "Computing positions for frame number " << nfile << ", time = " << data["UT_date"]->get_time() << std::endl;
+                                std::cout << "Computing positions for frame number " << nfile << ", time = " << ut_date << std::endl;
                             }else{
-                                std::cout << "Extracting fluxes from frame number " << nfile << ", time = " << data["UT_date"]->get_time() << std::endl;
+                                std::cout << "Extracting fluxes from frame number " << nfile << ", time = " << ut_date << std::endl;
                             }
                         }else{
-                            std::cout << "Processing frame number " << nfile << ", time = " << data["UT_date"]->get_time() << std::endl;
+                            std::cout << "Processing frame number " << nfile << ", time = " << ut_date << std::endl;
                         }
                     }
                     has_a_time = true;
@@ -1184,11 +1382,18 @@ int main(int argc, char* argv[]){
 
                     if(nfile == file.size()) break;
                     do{
-                        data.read(file[nfile]);
+                        // Only the header is needed to decide whether to skip a file
+                        data.read_header(file[nfile]);
+                        file_items.set_frame(data);
+                        if((hnode = data.find("Instrument.nblue"))->has_data())
+                            file_items.nblue = hnode->value->get_int();
+                        else
+                            file_items.nblue = 1;
+                        items = &file_items;
+
                         // Find the time associated with the file
-                        hnode = data.find("UT_date");
-                        if(hnode->has_data()){
-                            hnode->value->get_value(ut_date);
+                        if(items->has_time){
+                            ut_date    = items->ut_date;
                             has_a_time = true;
                         }else if(!lplot && hcopy == "null"){
                             std::cout << "No header item 'UT_date' found in file " << file[nfile] << ". Will just print time = file number to the log file but continue to reduce" << std::endl;
@@ -1200,11 +1405,11 @@ int main(int argc, char* argv[]){
                         if(has_a_time && ut_date < ttime) nfile++;
                     }while(nfile < file.size() && has_a_time && ut_date < ttime);
                     if(nfile == file.size()) break;
+                    data.read(file[nfile]);
 
                     // time assumed reliable unless proven otherwise. This ensures that
                     // data read using fits2ucm can be reduced.
-                    hnode = data.find("Frame.reliable");
-                    reliable = !hnode->has_data() || hnode->value->get_bool();
+                    reliable = items->reliable;
 
                     if(has_a_time){
 
@@ -1212,23 +1417,21 @@ int main(int argc, char* argv[]){
                            (Reduce::terminal_output == Reduce::FULL || Reduce::terminal_output == Reduce::MEDIUM || Reduce::terminal_output == Reduce::LITTLE)){
                             if(Reduce::aperture_twopass){
                                 if(npass == 1){
-                                    std::cout << "Computing positions for file = " << file[nfile] << ", time = " << data["UT_date"]->get_time() << std::endl;
+                                    std::cout << "Computing positions for file = " << file[nfile] << ", time = " << ut_date << std::endl;
                                 }else{
-                                    std::cout << "Extracting fluxes from file = " << file[nfile] << ", time = " << data["UT_date"]->get_time() << std::endl;
+                                    std::cout << "Extracting fluxes from file = " << file[nfile] << ", time = " << ut_date << std::endl;
                                 }
                             }else{
-                                std::cout << "Processing file = " << file[nfile] << ", time = " << data["UT_date"]->get_time() << std::endl;
+                                std::cout << "Processing file = " << file[nfile] << ", time = " << ut_date << std::endl;
                             }
                         }
 
                         // Check case of u-band co-adds
-                        if((hnode = data.find("Instrument.nblue"))->has_data() && hnode->value->get_int() > 1){
-                            hnode = data.find("UT_date_blue");
-                            if(hnode->has_data()){
-                                hnode->value->get_value(ut_date_blue);
-                                hnode = data.find("Frame.reliable_blue");
-                                if(hnode->has_data()){
-                                    reliable_blue = hnode->value->get_bool();
+                        if(items->nblue > 1){
+                            if(items->has_time_blue){
+                                ut_date_blue = items->ut_date_blue;
+                                if(items->has_reliable_blue){
+                                    reliable_blue = items->reliable_blue;
                                 }else{
                                     throw Ultracam_Error("Found UT_date_blue but no corresponding Frame.reliable_blue in file " + file[nfile]);
                                 }
@@ -1257,9 +1460,8 @@ int main(int argc, char* argv[]){
                 }
 
                 // Data now read in, get exposure times
-                hnode = data.find("Exposure");
-                if(hnode->has_data()){
-                    hnode->value->get_value(expose);
+                if(items->has_exposure){
+                    expose = items->exposure;
                 }else{
                     if(Reduce::abort_behaviour == Reduce::FUSSY)
                         throw Ultracam::Ultracam_Error("Fussy mode: failed to find header item 'Exposure' in file " + file[nfile]);
@@ -1267,10 +1469,9 @@ int main(int argc, char* argv[]){
                     expose = 0.;
                 }
 
-                if((hnode = data.find("Instrument.nblue"))->has_data() && hnode->value->get_int() > 1){
-                    hnode = data.find("Exposure_blue");
-                    if(hnode->has_data()){
-                        hnode->value->get_value(expose_blue);
+                if(items->nblue > 1){
+                    if(items->has_exposure_blue){
+                        expose_blue = items->exposure_blue;
                     }else{
                         if(Reduce::abort_behaviour == Reduce::FUSSY)
                             throw Ultracam::Ultracam_Error("Fussy mode: failed to find header item 'Exposure_blue' in file " + file[nfile]);
@@ -1280,8 +1481,7 @@ int main(int argc, char* argv[]){
                 }else{
                     expose_blue = expose;
                 }
-                hnode = data.find("Frame.bad_blue");
-                blue_is_bad = (hnode->has_data() && hnode->value->get_bool());
+                blue_is_bad = items->bad_blue;
 
                 // Check numbers of CCDs
                 if(Reduce::bias && data.size() != Reduce::bias_frame.size())
@@ -1381,14 +1581,51 @@ int main(int argc, char* argv[]){
                         Reduce::readout_frame = Reduce::readout*Reduce::readout;
                     }
 
-                    // initialise format of bad pixels and bias frame if there is not one
-                    bad = data;
+                    // Bad pixels initialised to zero or the input frame if there is one. They are only
+                    // read thereafter, so this need only be done once.
+                    if(Reduce::bad_pixel){
+                        bad = Reduce::bad_pixel_frame;
+                    }else{
+                        bad = data;
+                        bad = 0;
+                    }
+
+                    // initialise format of bias frame if there is not one
 
                     if(!Reduce::bias){
                         Reduce::bias_frame = data;
                         Reduce::bias_frame = 0;
                     }
 
+                    // Set up the calibration now that the frames have their final form
+                    calibrator.set(Reduce::bias ? &Reduce::bias_frame : NULL, Reduce::dark ? &Reduce::dark_frame : NULL,
+                                   Reduce::flat ? &Reduce::flat_frame : NULL, Reduce::gain_frame, Reduce::readout_frame);
+
+                    // Radii around apertures within which calibration is needed if it is restricted to regions
+                    // of interest. On the first pass this allows for the maximum shifts of the apertures and the
+                    // search boxes used to find them; on the second it need only cover the sky annuli. An extra
+                    // couple of binned pixels are added for safety.
+                    if(Reduce::roi_calibration){
+                        roi_aperture = Reduce::aperture_master;
+                        roi_radius1.resize(data.size());
+                        roi_radius2.resize(data.size());
+                        const float slack = 2*std::max(data[0][0].xbin(), data[0][0].ybin());
+                        const float move  = (Reduce::aperture_reposition_mode == Reduce::REFERENCE_PLUS_TWEAK ? Reduce::aperture_search_max_shift : 0.f) +
+                            std::max(Reduce::aperture_search_max_shift, Reduce::aperture_tweak_max_shift) + 2*Reduce::aperture_tweak_max_shift;
+                        const float search = std::max(std::max(Reduce::aperture_search_half_width + Reduce::aperture_search_fwhm,
+                                                               Reduce::aperture_tweak_half_width + Reduce::aperture_tweak_fwhm),
+                                                      Reduce::profile_fit_hwidth + Reduce::profile_fit_fwhm);
+                        for(size_t nccd=0; nccd<data.size(); nccd++){
+                            float sky = 0.f;
+                            if(Reduce::extraction_control.find(nccd) != Reduce::extraction_control.end())
+                                sky = Reduce::extraction_control[nccd].outer_sky_max;
+                            for(size_t naper=0; naper<Reduce::aperture_master[nccd].size(); naper++)
+                                sky = std::max(sky, Reduce::aperture_master[nccd][naper].rsky2());
+                            roi_radius1[nccd] = move + std::max(search, sky) + slack;
+                            roi_radius2[nccd] = sky + slack;
+                        }
+                    }
+
                 }
 
                 // Check frame formats
@@ -1410,48 +1647,54 @@ int main(int argc, char* argv[]){
                 if(data != Reduce::gain_frame)
                     throw Ultracam_Error("gain frame does not have same format as data frame");
 
-                // Now have data read in and calibration files in correct form, so apply calibration
-                if(Reduce::bias) data -= Reduce::bias_frame;
-
-                // Define variance frame after bias subtraction but before dark subtraction
-                dvar  = data;
-                dvar.max(0);
-                dvar /= Reduce::gain_frame;
-                dvar += Reduce::readout_frame;
-
-                // Have to care here because of u'-band co-add possibility. Note that we also have to
+                // Now have data read in and calibration files in correct form, so apply calibration.
+                // Have to care here with the dark because of u'-band co-add possibility. Note that we also have to
                 // account for the dark counts implicitly removed by bias subtraction.
                 if(Reduce::dark){
-                    if(expose == expose_blue){
-                        data -= (expose-bias_expose)/(dark_expose-dark_bias_expose)*Reduce::dark_frame;
-                    }else{
-                        tframe = Reduce::dark_frame;
-                        for(size_t i=0; i<tframe.size(); i++){
-                            if(i != 2)
-                                tframe[i] *= (expose-bias_expose)/(dark_expose-dark_bias_expose);
-                            else
-                                tframe[i] *= (expose_blue-bias_expose)/(dark_expose-dark_bias_expose);
-                        }
-                        data -= tframe;
+                    dark_scale.resize(data.size());
+                    for(size_t i=0; i<data.size(); i++){
+                        if(i != 2 || expose == expose_blue)
+                            dark_scale[i] = (expose-bias_expose)/(dark_expose-dark_bias_expose);
+                        else
+                            dark_scale[i] = (expose_blue-bias_expose)/(dark_expose-dark_bias_expose);
                     }
                 }
 
-                if(Reduce::flat){
-                    data /= Reduce::flat_frame;
-                    dvar /= Reduce::flat_frame;
-                    dvar /= Reduce::flat_frame;
-                }
+                // Bias, variance frame (defined after bias subtraction but before dark subtraction),
+                // dark and flat field all in one pass. If wanted, only the regions around the apertures
+                // are calibrated, except for the first frame and any frame that will be plotted. On the
+                // first pass, rejig_apertures starts from the current apertures of a CCD if they are all valid,
+                // otherwise from the last set that was, so the regions are defined from the same apertures.
+                // On the second pass the calibration is left until the aperture positions are known.
+                const bool full_calibration = !Reduce::roi_calibration || first_file ||
+                    (implot && (nfile - first) % (image_skip + 1) == 0);
 
-                // Bad pixels initialised to zero or the input frame if there is one.
-                if(Reduce::bad_pixel)
-                    bad = Reduce::bad_pixel_frame;
-                else
-                    bad = 0;
+                if(full_calibration){
+                    calibrator.apply(data, dvar, dark_scale, Reduce::nthreads);
+
+                }else if(npass == 1){
+                    for(size_t nccd=0; nccd<aperture.size(); nccd++){
+                        if(Reduce::extraction_control.find(nccd) != Reduce::extraction_control.end()){
+                            bool ap_ok = true;
+                            for(size_t naper=0; naper<aperture[nccd].size(); naper++){
+                                if(!aperture[nccd][naper].valid()){
+                                    ap_ok = false;
+                                    break;
+                                }
+                            }
+                            if(ap_ok) roi_aperture[nccd] = aperture[nccd];
+                        }else{
+                            roi_aperture[nccd].clear();
+                        }
+                    }
+                    Ultracam::aperture_boxes(data, roi_aperture, roi_radius1, roi_boxes);
+                    calibrator.apply(data, dvar, dark_scale, roi_boxes, Reduce::nthreads);
+                }
 
                 // Update the apertures
                 if(npass == 1){
 
-                    Ultracam::rejig_apertures(data, dvar, profile_fit_plot, blue_is_bad, aperture, shape, errors);
+                    Ultracam::rejig_apertures(data, dvar, profile_fit_plot, blue_is_bad, rejig_state, aperture, shape, errors, Reduce::nthreads);
 
                     // Compute and store the reference positions and offsets
                     if(Reduce::aperture_twopass){
@@ -1481,7 +1724,8 @@ int main(int argc, char* argv[]){
                             }
                         }
 
-                        // Set the time
+                        // Set the frame number and time
+                        twop.nfile = nfile;
                         if(has_a_time)
                             twop.time = ut_date.mjd();
                         else
@@ -1553,6 +1797,10 @@ int main(int argc, char* argv[]){
                     else
                         xtime = double(nfile+1);
 
+                    if(size_t(nexp) >= twopass.size() || twopass[nexp].nfile != nfile)
+                        throw Ultracam_Error("reduce: frame " + Subs::str(nfile) + " does not match the first pass of two pass mode; "
+                                             "the data must have changed since the first pass was made");
+
                     shape = twopass[nexp].shape;
 
                     for(size_t nccd=0; nccd<aperture.size(); nccd++){
@@ -1615,6 +1863,12 @@ int main(int argc, char* argv[]){
                     }
                 }
 
+                // Calibrate the regions around the second pass apertures
+                if(!full_calibration && npass == 2){
+                    Ultracam::aperture_boxes(data, aperture, roi_radius2, roi_boxes);
+                    calibrator.apply(data, dvar, dark_scale, roi_boxes, Reduce::nthreads);
+                }
+
                 // Cosmic ray cleaning section - needs fixing.
 
                 if(Reduce::cosmic_clean){
@@ -1697,6 +1951,50 @@ int main(int argc, char* argv[]){
 
                     all_ccds.resize(data.size());
 
+                    // First carry out all the extractions, in parallel if wanted. Each aperture is
+                    // extracted at all the star radii at once. They are stored in the order of the
+                    // CCDs and apertures that they are written out in below.
+                    extraction.job.clear();
+                    for(size_t nccd=0; nccd<data.size(); nccd++){
+                        if(Reduce::extraction_control.find(nccd) != Reduce::extraction_control.end()){
+                            const Reduce::Extraction& control = Reduce::extraction_control[nccd];
+                            for(size_t naper=0; naper<aperture[nccd].size(); naper++){
+                                if(!blue_is_bad || nccd != 2){
+                                    Extraction_job job;
+                                    job.nccd     = nccd;
+                                    job.naper    = naper;
+                                    job.aperture = aperture[nccd][naper];
+                                    job.method   = control.extraction_method;
+                                    job.sky      = 0.;
+                                    job.nsky     = job.nrej = 0;
+
+                                    // Modify the aperture if necessary
+                                    if(Reduce::star_radius.size() > 0){
+                                        for(size_t nradius=0; nradius<Reduce::star_radius.size(); nradius++){
+                                            float rstar = 0;
+                                            if(control.aperture_type       == Reduce::VARIABLE){
+                                                rstar = Subs::clamp(control.star_min, float(shape[nccd].fwhm*Reduce::star_radius[nradius]),
+                                                                    control.star_max);
+                                            }else if(control.aperture_type == Reduce::FIXED){
+                                                rstar = Subs::clamp(control.star_min, Reduce::star_radius[nradius], control.star_max);
+                                            }
+                                            job.aperture.set_rstar(rstar);
+                                            job.rstar.push_back(rstar);
+                                        }
+                                    }else{
+                                        job.rstar.push_back(job.aperture.rstar());
+                                    }
+                                    extraction.job.push_back(job);
+                                }
+                            }
+                        }
+                    }
+
+                    Ultracam::run_parallel(extraction_task, &extraction, extraction.job.size(), Reduce::nthreads);
+
+                    // Now write out the results
+                    size_t njob;
+
                     // Loop over multiple radii
                     // Results for one time will be written out in order
                     // CCD 1, radius 1
@@ -1708,6 +2006,7 @@ int main(int argc, char* argv[]){
 
                     do {
 
+                        njob = 0;
                         for(size_t nccd=0; nccd<data.size(); nccd++){
 
                             if(Reduce::extraction_control.find(nccd) != Reduce::extraction_control.end()){
@@ -1775,20 +2074,9 @@ int main(int argc, char* argv[]){
                                     float xmeas = 0., ymeas = 0., exmeas = -1., eymeas = -1.;
 
                                     if(!blue_is_bad || nccd != 2){
-                                        // Modify the aperture if necessary
-                                        if(Reduce::star_radius.size() > 0){
-                                            float rstar = 0;
-                                            if(Reduce::extraction_control[nccd].aperture_type       == Reduce::VARIABLE){
-                                                rstar = Subs::clamp(Reduce::extraction_control[nccd].star_min,
-                                                                    float(shape[nccd].fwhm*Reduce::star_radius[nradius]),
-                                                                    Reduce::extraction_control[nccd].star_max);
-                                            }else if(Reduce::extraction_control[nccd].aperture_type == Reduce::FIXED){
-                                                rstar = Subs::clamp(Reduce::extraction_control[nccd].star_min,
-                                                                    Reduce::star_radius[nradius],
-                                                                    Reduce::extraction_control[nccd].star_max);
-                                            }
-                                            app.set_rstar(rstar);
-                                        }
+                                        // Keep the aperture radius as used
+                                        if(Reduce::star_radius.size() > 0)
+                                            app.set_rstar(extraction.job[njob].rstar[nradius]);
 
                                         // I/O. Information to identify aperture and its position as used and the measure position and its uncertainty
                                         if(!aperture[nccd][naper].linked()){
@@ -1822,13 +2110,15 @@ int main(int argc, char* argv[]){
                                     }
 
                                     if(!blue_is_bad || nccd != 2){
-                                        // Extract the flux
-                                        Ultracam::extract_flux(data[nccd], dvar[nccd], bad[nccd], Reduce::gain_frame[nccd],
-                                                               Reduce::bias_frame[nccd], app, Reduce::sky_method,
-                                                               Reduce::sky_thresh, Reduce::sky_error,
-                                                               Reduce::extraction_control[nccd].extraction_method, zapped[nccd][naper],
-                                                               shape[nccd], Reduce::pepper[nccd], Reduce::saturation[nccd],
-                                                               counts, sigma, sky, nsky, nrej, ecode, worst);
+                                        // Retrieve the flux
+                                        const Extraction_job& job = extraction.job[njob++];
+                                        counts = job.counts[nradius];
+                                        sigma  = job.sigma[nradius];
+                                        sky    = job.sky;
+                                        nsky   = job.nsky;
+                                        nrej   = job.nrej;
+                                        ecode  = job.ecode[nradius];
+                                        worst  = job.worst[nradius];
 
                                         if(Reduce::abort_behaviour == Reduce::FUSSY){
 
@@ -1903,8 +2193,14 @@ int main(int argc, char* argv[]){
 
             }
 
+            prefetch_owner.reset(NULL);
+
             if(Reduce::aperture_twopass && npass == 1){
 
+                // Keep the results for next time
+                if(!twopass_read && !Reduce::aperture_twopass_file.empty())
+                    Reduce::write_twopass(Reduce::aperture_twopass_file, twopass_key, aperture, twopass, blue_is_bad);
+
                 Reduce::logger.ofstr()<< hashb << std::string("Two pass mode polynomial fitting results.") << newl;
 
                 // Now we have all the positional data stored in the structure 'twopass',
@@ -1,10 +1,14 @@
 #include <map>
+#include <string>
+#include <vector>
+#include <sstream>
 #include "trm/subs.h"
 #include "trm/ultracam.h"
 #include "trm/aperture.h"
 #include "trm/mccd.h"
 #include "trm/frame.h"
 #include "trm/reduce.h"
+#include "trm/parallel.h"
 
 // Globals read by read_reduce_file
 
@@ -34,39 +38,475 @@ namespace Reduce {
     extern Ultracam::Frame readout_frame;
 };
 
+namespace {
+
+    using Ultracam::Ultracam_Error;
+    using Ultracam::Aperture;
+    using Ultracam::Windata;
+    using Ultracam::Fxy;
+
+    // A message about an aperture. Messages are collected as the apertures are measured and
+    // printed afterwards in order of CCD and aperture, so that the output does not depend upon
+    // the order in which the measurements are made. A FATAL message is thrown as an Ultracam_Error
+    // once all those before it have been printed.
+    struct Message {
+        enum STREAM {COUT, CERR, FATAL};
+        Message(STREAM stream, const std::string& text) : stream(stream), text(text) {}
+        STREAM stream;
+        std::string text;
+    };
+
+    typedef std::vector<Message> Log;
+
+    // Prints the messages of each CCD in turn, throwing at the first fatal one
+    void print_log(const std::vector<Log>& log){
+        for(size_t nccd=0; nccd<log.size(); nccd++){
+            for(size_t i=0; i<log[nccd].size(); i++){
+                const Message& message = log[nccd][i];
+                if(message.stream == Message::FATAL)
+                    throw Ultracam_Error(message.text);
+                else if(message.stream == Message::COUT)
+                    std::cout << message.text << std::endl;
+                else
+                    std::cerr << message.text << std::endl;
+            }
+        }
+    }
+
+    // The measurement of one aperture. Each measurement works on its own copy of the
+    // aperture and touches nothing else, so that all of them can be made at once. The
+    // results are then merged in order of CCD and aperture by the calling thread.
+    struct Star {
+
+        Star(size_t nccd, size_t naper, const Aperture& app) :
+            nccd(nccd), naper(naper), app(app), nref(0), offset_x(0.f), offset_y(0.f), shape(),
+            found(false), error_set(false), error(), dx(0.), dy(0.), profile(), wgt(0.), fwhm(0.), log() {}
+
+        size_t nccd, naper;        // CCD and aperture numbers
+        Aperture app;              // the aperture, updated by the measurement
+
+        int nref;                  // number of reference stars located, for search_aperture
+        float offset_x, offset_y;  // mean shift of the reference stars, for search_aperture
+        Reduce::Meanshape shape;   // mean shape of the reference stars, for fit_aperture
+
+        bool found;                // reference star measured successfully
+        bool error_set;            // position uncertainty measured
+        Fxy error;                 // position uncertainty
+        double dx, dy;             // shift of a reference star, binned pixels
+        Ultracam::Ppars profile;   // fitted profile of a reference star
+        double wgt, fwhm;          // weight and FWHM of the fitted profile of a reference star
+        Log log;                   // messages
+    };
+
+    // Arguments for star_task
+    struct Star_tasks {
+        const Ultracam::Frame *data, *dvar;
+        const Subs::Plot *plot;
+        void (*measure)(Star& star, const Star_tasks& tasks);
+        std::vector<Star> star;
+    };
+
+    // Task for run_parallel: makes measurement n
+    void star_task(int n, void* arg){
+        Star_tasks* tasks = static_cast<Star_tasks*>(arg);
+        tasks->measure(tasks->star[n], *tasks);
+    }
+
+    // Measures the position of a reference star from the last one
+    void search_reference(Star& star, const Star_tasks& tasks){
+
+        Aperture *app = &star.app;
+        const size_t nccd = star.nccd, naper = star.naper;
+        float xstart, ystart, fwhm_x, fwhm_y, ex, ey, shift;
+        int hwidth_x, hwidth_y;
+        double xpos, ypos;
+
+        try{
+
+            const Windata &dwin = (*tasks.data)[nccd].enclose(app->xref(), app->yref());
+            const Windata &vwin = (*tasks.dvar)[nccd].enclose(app->xref(), app->yref());
+
+            xstart   = dwin.xcomp(app->xref());
+            ystart   = dwin.ycomp(app->yref());
+            fwhm_x   = Reduce::aperture_search_fwhm/dwin.xbin();
+            fwhm_x   = fwhm_x > 1.f ? fwhm_x : 1.f;
+            fwhm_y   = Reduce::aperture_search_fwhm/dwin.ybin();
+            fwhm_y   = fwhm_y > 1.f ? fwhm_y : 1.f;
+            hwidth_x = Reduce::aperture_search_half_width/dwin.xbin();
+            hwidth_x = hwidth_x > int(fwhm_x+1.) ? hwidth_x : int(fwhm_x+1.);
+            hwidth_y = Reduce::aperture_search_half_width/dwin.ybin();
+            hwidth_y = hwidth_y > int(fwhm_y+1.) ? hwidth_y : int(fwhm_y+1.);
+
+            // Remeasure the position
+
+            Ultracam::findpos(dwin, vwin, dwin.nx(), dwin.ny(), fwhm_x, fwhm_y, hwidth_x, hwidth_y,
+                              xstart, ystart, Reduce::aperture_positions_stable, xpos, ypos, ex, ey);
+
+            // Check that position has not shifted more than expected
+            if((shift = sqrt(Subs::sqr(dwin.xbin()*(xpos-xstart)) + Subs::sqr(dwin.ybin()*(ypos-ystart))))
+               < Reduce::aperture_search_max_shift){
+
+                star.dx    = xpos-xstart;
+                star.dy    = ypos-ystart;
+                star.found = true;
+
+                app->set_xref(dwin.xccd(xpos));
+                app->set_yref(dwin.yccd(ypos));
+
+                star.error     = Fxy(ex, ey);
+                star.error_set = true;
+
+            }else{
+
+                app->set_valid(false);
+                if(Reduce::abort_behaviour == Reduce::RELAXED){
+                    std::ostringstream msg;
+                    msg << "Ultracam::rejig_apertures 1: CCD " << nccd + 1 << ", aperture " << naper+1
+                        << " shifted by more than the maximum. Shift = " << shift << " cf " << Reduce::aperture_search_max_shift;
+                    star.log.push_back(Message(Message::COUT, msg.str()));
+                }else if(Reduce::abort_behaviour == Reduce::FUSSY){
+                    throw Ultracam_Error("Ultracam::rejig_apertures 1: Fussy mode: CCD " + Subs::str(nccd+1) + ", aperture " + Subs::str(naper+1) +
+                                         " shifted by more than the maximum.");
+                }
+            }
+        }
+        catch(const Ultracam_Error& err){
+            app->set_valid(false);
+            if(Reduce::abort_behaviour == Reduce::FUSSY)
+                star.log.push_back(Message(Message::FATAL, "Ultracam::rejig_apertures: fussy mode: " + err));
+        }
+    }
+
+    // Measures the position of an unlinked aperture, starting from its last position shifted
+    // by the mean shift of the reference stars if they were used
+    void search_aperture(Star& star, const Star_tasks& tasks){
+
+        Aperture *app = &star.app;
+        const size_t nccd = star.nccd, naper = star.naper;
+        const int nref = star.nref;
+        float xstart, ystart, fwhm_x, fwhm_y, ex, ey, shift, max_shift;
+        int hwidth_x, hwidth_y;
+        double xpos, ypos;
+
+        try{
+
+            // Get references to windata
+            const Windata &dwin = (*tasks.data)[nccd].enclose(app->xref(), app->yref());
+            const Windata &vwin = (*tasks.dvar)[nccd].enclose(app->xref(), app->yref());
+
+            // Avoid double compensating the change for reference apertures.
+            if(app->ref() && nref > 0){
+                xstart   = dwin.xcomp(app->xref());
+                ystart   = dwin.ycomp(app->yref());
+            }else{
+                xstart   = dwin.xcomp(app->xref()) + star.offset_x;
+                ystart   = dwin.ycomp(app->yref()) + star.offset_y;
+            }
+
+            // If reference_plus_tweak, then we use more restrictive criteria
+            // in repositioning the apertures because we believe that we are already
+            // close the right value from the reference reposition, unless the reference
+            // reposition failed (nref == 0)
+            if(Reduce::aperture_reposition_mode == Reduce::REFERENCE_PLUS_TWEAK && nref > 0){
+                fwhm_x    = Reduce::aperture_tweak_fwhm/dwin.xbin();
+                fwhm_y    = Reduce::aperture_tweak_fwhm/dwin.ybin();
+                hwidth_x  = Reduce::aperture_tweak_half_width/dwin.xbin();
+                hwidth_y  = Reduce::aperture_tweak_half_width/dwin.ybin();
+                max_shift = Reduce::aperture_tweak_max_shift;
+            }else{
+                fwhm_x    = Reduce::aperture_search_fwhm/dwin.xbin();
+                fwhm_y    = Reduce::aperture_search_fwhm/dwin.ybin();
+                hwidth_x  = Reduce::aperture_search_half_width/dwin.xbin();
+                hwidth_y  = Reduce::aperture_search_half_width/dwin.ybin();
+                max_shift = Reduce::aperture_search_max_shift;
+            }
+            fwhm_x   = fwhm_x > 1.f ? fwhm_x : 1.f;
+            fwhm_y   = fwhm_y > 1.f ? fwhm_y : 1.f;
+            hwidth_x = hwidth_x > int(fwhm_x+1.) ? hwidth_x : int(fwhm_x+1.);
+            hwidth_y = hwidth_y > int(fwhm_y+1.) ? hwidth_y : int(fwhm_y+1.);
+
+            // Remeasure the position
+            if(Reduce::aperture_reposition_mode == Reduce::REFERENCE_PLUS_TWEAK && nref > 0){
+                Ultracam::findpos(dwin, vwin, dwin.nx(), dwin.ny(), fwhm_x, fwhm_y, hwidth_x, hwidth_y,
+                                  xstart, ystart, true, xpos, ypos, ex, ey);
+            }else{
+                Ultracam::findpos(dwin, vwin, dwin.nx(), dwin.ny(), fwhm_x, fwhm_y, hwidth_x, hwidth_y,
+                                  xstart, ystart, Reduce::aperture_positions_stable, xpos, ypos, ex, ey);
+            }
+
+            // Check that the shift is not too large
+            if((shift = sqrt(Subs::sqr(dwin.xbin()*(xpos-xstart)) + Subs::sqr(dwin.ybin()*(ypos-ystart)))) < max_shift){
+
+                star.error     = Fxy(ex, ey);
+                star.error_set = true;
+
+                app->set_xref(dwin.xccd(xpos));
+                app->set_yref(dwin.yccd(ypos));
+
+                // If the aperture is offset from another position, then it will be tweaked
+                // in some cases using more restrictive criteria.
+                if((app->xoff() != 0. || app->yoff() != 0.) && Reduce::aperture_reposition_mode == Reduce::INDIVIDUAL_PLUS_TWEAK){
+
+                    xstart   = dwin.xcomp(app->xpos());
+                    ystart   = dwin.ycomp(app->ypos());
+                    hwidth_x = Reduce::aperture_tweak_half_width/dwin.xbin();
+                    hwidth_y = Reduce::aperture_tweak_half_width/dwin.ybin();
+                    fwhm_x   = Reduce::aperture_tweak_fwhm/dwin.xbin();
+                    fwhm_y   = Reduce::aperture_tweak_fwhm/dwin.ybin();
+
+                    Ultracam::findpos(dwin, vwin, dwin.nx(), dwin.ny(), fwhm_x, fwhm_y, hwidth_x, hwidth_y,
+                                      xstart, ystart, true, xpos, ypos, ex, ey);
+
+                    // Check shift is not too large
+                    if((shift = sqrt(Subs::sqr(dwin.xbin()*(xpos-xstart)) + Subs::sqr(dwin.ybin()*(ypos-ystart))))
+                       < Reduce::aperture_tweak_max_shift){
+
+                        star.error = Fxy(ex, ey);
+
+                        app->set_xoff(dwin.xccd(xpos) - app->xref());
+                        app->set_yoff(dwin.yccd(ypos) - app->yref());
+
+                    }else{
+
+                        app->set_valid(false);
+                        if(Reduce::abort_behaviour == Reduce::RELAXED){
+                            std::ostringstream msg;
+                            msg << "Ultracam::rejig_apertures 2: CCD " << nccd + 1 << ", aperture " << naper+1
+                                << " shifted by more than the maximum. Shift = " << shift << " cf " << Reduce::aperture_tweak_max_shift;
+                            star.log.push_back(Message(Message::CERR, msg.str()));
+                        }else if(Reduce::abort_behaviour == Reduce::FUSSY){
+                            throw Ultracam_Error("Ultracam::rejig_apertures 2: fussy mode: CCD " + Subs::str(nccd+1) + ", aperture " + Subs::str(naper+1) +
+                                                 " shifted by more than the maximum.");
+                        }
+                    }
+                }
+
+            }else{
+
+                app->set_valid(false);
+                if(Reduce::abort_behaviour == Reduce::RELAXED){
+                    std::ostringstream msg;
+                    msg << "Ultracam::rejig_apertures 3: CCD " << nccd + 1 << ", aperture " << naper+1
+                        << " shifted by more than the maximum. Shift = "  << shift << " cf " << max_shift;
+                    star.log.push_back(Message(Message::CERR, msg.str()));
+                }else if(Reduce::abort_behaviour == Reduce::FUSSY){
+                    throw Ultracam_Error("Ultracam::rejig_apertures 3: fussy mode: CCD " + Subs::str(nccd+1) +
+                                         ", aperture " + Subs::str(naper+1) + " shifted by more than the maximum.");
+                }
+            }
+        }
+        catch(const Ultracam_Error& err){
+            app->set_valid(false);
+            if(Reduce::abort_behaviour == Reduce::FUSSY)
+                star.log.push_back(Message(Message::FATAL, "Ultracam::rejig_apertures: fussy mode: " + err));
+        }
+    }
+
+    // Fits the profile of a reference star, shape included
+    void fit_reference(Star& star, const Star_tasks& tasks){
+
+        Aperture *app = &star.app;
+        const size_t nccd = star.nccd, naper = star.naper;
+        float shift;
+
+        try{
+
+            // Obtain initial value of 'a'
+            double a = 1./2./Subs::sqr(Reduce::profile_fit_fwhm/Constants::EFAC);
+
+            Ultracam::Ppars& profile = star.profile;
+            if(Reduce::profile_fit_method == Reduce::GAUSSIAN){
+
+                // Gaussian fit section.
+                profile.set(0., 0., 0., 0., a, 0., a, Reduce::profile_fit_symm);
+
+            }else if(Reduce::profile_fit_method == Reduce::MOFFAT){
+
+                // Moffat fit section.
+                profile.set(0., 0., 0., 0., a, 0., a, Reduce::profile_fit_beta, Reduce::profile_fit_symm);
+
+            }
+
+            Ultracam::Iprofile iprofile;
+            Ultracam::fit_plot_profile((*tasks.data)[nccd], (*tasks.dvar)[nccd], profile, false, true, app->xref(), app->yref(), app->mask(), 0., 0,
+                                       Reduce::profile_fit_hwidth, *tasks.plot, Reduce::profile_fit_sigma, iprofile, false);
+
+            // Check shift is not too large (compared against fine tweak settings)
+            if((shift = sqrt(Subs::sqr(profile.x-app->xref()) + Subs::sqr(profile.y-app->yref()))) < Reduce::aperture_tweak_max_shift){
+
+                star.error     = Fxy(iprofile.ex, iprofile.ey);
+                star.error_set = true;
+
+                // Update aperture position
+                app->set_xref(profile.x);
+                app->set_yref(profile.y);
+
+                // Shape values are averaged with a single weight.
+                star.wgt   = 1./iprofile.covar[profile.a_index()][profile.a_index()];
+                star.fwhm  = iprofile.fwhm;
+                star.found = true;
+
+            }else{
+
+                app->set_valid(false);
+                if(Reduce::abort_behaviour == Reduce::RELAXED){
+                    std::ostringstream msg;
+                    msg << "4. CCD " << nccd + 1 << ", aperture " << naper+1
+                        << " shifted by more than the maximum. Shift = " << shift << " cf " << Reduce::aperture_tweak_max_shift;
+                    star.log.push_back(Message(Message::CERR, msg.str()));
+                }else if(Reduce::abort_behaviour == Reduce::FUSSY){
+                    throw Ultracam_Error("Ultracam::rejig_apertures 4: fussy mode: CCD " + Subs::str(nccd+1) +
+                                         ", aperture " + Subs::str(naper+1) + " shifted by more than the maximum.");
+                }
+            }
+        }
+        catch(const std::string& err){
+            if(Reduce::abort_behaviour == Reduce::FUSSY){
+                star.log.push_back(Message(Message::FATAL, "Ultracam::rejig_apertures: fussy mode, reference fit: " + err));
+            }else if(Reduce::abort_behaviour == Reduce::RELAXED){
+                star.log.push_back(Message(Message::CERR, "Reference fit, CCD " + Subs::str(nccd+1) + ", aperture " + Subs::str(naper+1) + ": " + err));
+                app->set_valid(false);
+            }
+        }
+    }
+
+    // Fits the position of a non-reference star with the shape fixed at the mean shape of the reference stars
+    void fit_aperture(Star& star, const Star_tasks& tasks){
+
+        Aperture *app = &star.app;
+        const size_t nccd = star.nccd, naper = star.naper;
+        const Reduce::Meanshape& shape = star.shape;
+        float shift;
+
+        try{
+
+            Ultracam::Ppars profile;
+            if(Reduce::profile_fit_method == Reduce::GAUSSIAN){
+                // Gaussian fit section.
+                profile.set(0., 0., 0., 0., shape.a, shape.b, shape.c, Reduce::profile_fit_symm);
+
+            }else if(Reduce::profile_fit_method == Reduce::MOFFAT){
+
+                // Moffat fit section.
+                profile.set(0., 0., 0., 0., shape.a, shape.b, shape.c, shape.beta, Reduce::profile_fit_symm);
+                profile.var_beta = false;
+
+            }
+            profile.var_a = profile.var_b = profile.var_c = false;
+
+            Ultracam::Iprofile iprofile;
+            Ultracam::fit_plot_profile((*tasks.data)[nccd], (*tasks.dvar)[nccd], profile, false, true, app->xref(), app->yref(), app->mask(), 0., 0,
+                                       Reduce::profile_fit_hwidth, *tasks.plot, Reduce::profile_fit_sigma, iprofile, false);
+
+            // Check shift is not too large (compared against fine tweak settings)
+            if((shift = sqrt(Subs::sqr(profile.x-app->xref()) + Subs::sqr(profile.y-app->yref()))) < Reduce::aperture_tweak_max_shift){
+
+                star.error     = Fxy(iprofile.ex, iprofile.ey);
+                star.error_set = true;
+
+                // Update aperture position
+                app->set_xref(profile.x);
+                app->set_yref(profile.y);
+
+            }else{
+
+                app->set_valid(false);
+                if(Reduce::abort_behaviour == Reduce::RELAXED){
+                    std::ostringstream msg;
+                    msg << "5. CCD " << nccd + 1 << ", aperture " << naper+1
+                        << " shifted by more than the maximum. Shift = " << shift << " cf " << Reduce::aperture_tweak_max_shift;
+                    star.log.push_back(Message(Message::CERR, msg.str()));
+                }else if(Reduce::abort_behaviour == Reduce::FUSSY){
+                    throw Ultracam_Error("Ultracam::rejig_apertures 5: fussy mode: CCD " + Subs::str(nccd+1) + ", aperture " + Subs::str(naper+1) +
+                                         " shifted by more than the maximum.");
+                }
+            }
+        }
+        catch(const std::string& err){
+            if(Reduce::abort_behaviour == Reduce::FUSSY){
+                star.log.push_back(Message(Message::FATAL, "Ultracam::rejig_apertures: fussy mode, position fit: " + err));
+            }else if(Reduce::abort_behaviour == Reduce::RELAXED){
+                star.log.push_back(Message(Message::CERR, "Position fit, CCD " + Subs::str(nccd+1) + ", aperture " + Subs::str(naper+1) + ": " + err));
+                app->set_valid(false);
+            }
+        }
+    }
+
+    // Makes all the measurements, then copies the apertures, uncertainties and messages back
+    // in order. The measurements of each CCD are left in 'tasks' for any further merging.
+    void measure_all(Star_tasks& tasks, int nthreads, Ultracam::Maperture& aperture,
+                     std::vector<std::vector<Fxy> >& errors, std::vector<Log>& log){
+
+        Ultracam::run_parallel(star_task, &tasks, tasks.star.size(), nthreads);
+
+        for(size_t n=0; n<tasks.star.size(); n++){
+            Star& star = tasks.star[n];
+            aperture[star.nccd][star.naper] = star.app;
+            if(star.error_set) errors[star.nccd][star.naper] = star.error;
+            log[star.nccd].insert(log[star.nccd].end(), star.log.begin(), star.log.end());
+        }
+    }
+
+    // Updates the linked apertures of a CCD, without fitting
+    void update_linked(Ultracam::CCD<Aperture>& aperture, std::map<int,int>& link, std::vector<Fxy>& errors){
+        for(size_t naper=0; naper<aperture.size(); naper++){
+            Aperture *app  = &aperture[naper];
+            if(app->linked()){
+
+                Aperture *app1 = &aperture[link[naper]];
+                errors[naper] = errors[link[naper]];
+
+                if(app->valid() && app1->valid()){
+                    app->set_xref(app1->xref());
+                    app->set_yref(app1->yref());
+                }else{
+                    app->set_valid(false);
+                }
+            }
+        }
+    }
+
+}
+
 /** Routine to handle the aperture updating part of 'reduce'. This is essentially to isolate this
  * long section out from 'reduce'. The best way to get an idea what this does would be to read the
  * help in 'reduce'. To save time various operations are done on the first call to this routine
  * which assume that subsequent calls are made with the same number of CCDs and apertures, therefore
  * these should not be altered.
+ *
+ * The position measurements and profile fits of the individual apertures are independent of each other
+ * within each of the stages of repositioning (reference stars, then the rest) and are made in parallel
+ * over all apertures of all CCDs. Their results are then combined in order of CCD and aperture, exactly
+ * as if they had been made one after the other, and so do not depend upon the number of threads. Profile
+ * fits are made one at a time if they are being plotted.
  * \param data      the data frame, bias & dark subtracted and flat-fielded
  * \param dvar      estimated variances on each point of data frame. Assumed to have identical format to data
  * \param profile_fit_plot Plot for profile fits
  * \param blue_is_bad is the blue data bad or not in the sense of there is data rather than junk from the nblue option
+ * \param state     state carried from one call to the next; should start default-constructed and not be altered
  * \param aperture  the aperture file, input and returned
  * \param shape     profile fitting shape parameters, returned
  * \param errors    uncertainties on aperture positions, returned. For the linked apertures these will be set equal to
  * the uncertainties on the master apertures that they are linked to. If the static reposition option is used,
  * they will all be set equal to 0
+ * \param nthreads  number of threads to use for the measurements
  */
 
 void Ultracam::rejig_apertures(const Frame& data, const Frame& dvar, const Subs::Plot& profile_fit_plot, bool blue_is_bad,
-                   Maperture& aperture, std::vector<Reduce::Meanshape>& shape, std::vector<std::vector<Fxy> >& errors){
-
-    // Stuff that must be saved between calls
-    static bool first = true;
-    static std::vector<std::map<int,int> > aperture_link;
-    static Maperture previous_aperture;
+                               Reduce::Rejig_state& state, Maperture& aperture, std::vector<Reduce::Meanshape>& shape,
+                               std::vector<std::vector<Fxy> >& errors, int nthreads){
 
     // To save time, we will not re-do linked apertures, but first we need
-    // to work out which apertures they are linked to. Store the results in the following maps
+    // to work out which apertures they are linked to. Store the results in the link maps
     // Also use this chance to check validity of apertures
+    std::vector<std::map<int,int> >& aperture_link = state.link;
+    Maperture& previous_aperture = state.previous;
     Aperture *app, *app1;
     bool ap_ok;
     float rstar = 0, rsky1 = 0, rsky2 = 0;
 
-    if(first){
-    first = false;
+    if(state.first){
+    state.first = false;
 
     // Check validity of apertures
     for(size_t nccd=0; nccd<Reduce::aperture_master.size(); nccd++){
@@ -157,266 +597,119 @@ void Ultracam::rejig_apertures(const Frame& data, const Frame& dvar, const Subs:
     }
     }
 
-    float xstart, ystart, fwhm_x, fwhm_y, ex, ey, shift, max_shift;
-    float offset_x, offset_y;
-    int hwidth_x, hwidth_y, nref;
-    double xpos, ypos;
-
-    if(Reduce::aperture_reposition_mode == Reduce::STATIC){
-
-    // Do nothing
-
-    }else if(Reduce::aperture_reposition_mode == Reduce::INDIVIDUAL ||
-         Reduce::aperture_reposition_mode == Reduce::INDIVIDUAL_PLUS_TWEAK ||
-         Reduce::aperture_reposition_mode == Reduce::REFERENCE_PLUS_TWEAK ){
-
-    // Go through adjusting the position of every aperture for every CCD
-    for(size_t nccd=0; nccd<data.size(); nccd++){
-
-        if(nccd != 2 || !blue_is_bad){
-
-        if(Reduce::extraction_control.find(nccd) != Reduce::extraction_control.end()){
-            nref = 0;
-            offset_x = offset_y = 0.f;
-
-            if(Reduce::aperture_reposition_mode == Reduce::REFERENCE_PLUS_TWEAK && aperture[nccd].size() > 0){
-
-            // In this case try first to determine a shift from reference apertures
-
-            // Loop over apertures
-            for(size_t naper=0; naper<aperture[nccd].size(); naper++){
-
-                app = &aperture[nccd][naper];
+    // CCDs to be dealt with
+    std::vector<bool> process(data.size());
+    for(size_t nccd=0; nccd<data.size(); nccd++)
+        process[nccd] = (nccd != 2 || !blue_is_bad) && Reduce::extraction_control.find(nccd) != Reduce::extraction_control.end();
 
-                // Only consider reference apertures
-                if(app->valid() && app->ref()){
+    // Threads to use for profile fits, which can only be plotted one at a time
+    const int nthreads_fit = profile_fit_plot.is_open() ? 1 : nthreads;
 
-                try{
+    Star_tasks tasks;
+    tasks.data = &data;
+    tasks.dvar = &dvar;
+    tasks.plot = &profile_fit_plot;
 
-                    const Windata &dwin = data[nccd].enclose(app->xref(), app->yref());
-                    const Windata &vwin = dvar[nccd].enclose(app->xref(), app->yref());
+    std::vector<Log> log(data.size());
 
-                    xstart   = dwin.xcomp(app->xref());
-                    ystart   = dwin.ycomp(app->yref());
-                    fwhm_x   = Reduce::aperture_search_fwhm/dwin.xbin();
-                    fwhm_x   = fwhm_x > 1.f ? fwhm_x : 1.f;
-                    fwhm_y   = Reduce::aperture_search_fwhm/dwin.ybin();
-                    fwhm_y   = fwhm_y > 1.f ? fwhm_y : 1.f;
-                    hwidth_x = Reduce::aperture_search_half_width/dwin.xbin();
-                    hwidth_x = hwidth_x > int(fwhm_x+1.) ? hwidth_x : int(fwhm_x+1.);
-                    hwidth_y = Reduce::aperture_search_half_width/dwin.ybin();
-                    hwidth_y = hwidth_y > int(fwhm_y+1.) ? hwidth_y : int(fwhm_y+1.);
-
-                    // Remeasure the position
-
-                    Ultracam::findpos(dwin, vwin, dwin.nx(), dwin.ny(), fwhm_x, fwhm_y, hwidth_x, hwidth_y,
-                              xstart, ystart, Reduce::aperture_positions_stable, xpos, ypos, ex, ey);
-
-                    // Check that position has not shifted more than expected
-                    if((shift = sqrt(Subs::sqr(dwin.xbin()*(xpos-xstart)) + Subs::sqr(dwin.ybin()*(ypos-ystart))))
-                       < Reduce::aperture_search_max_shift){
-
-                    offset_x += xpos-xstart;
-                    offset_y += ypos-ystart;
-
-                    nref++;
-                    app->set_xref(dwin.xccd(xpos));
-                    app->set_yref(dwin.yccd(ypos));
-
-                    errors[nccd][naper] = Fxy(ex, ey);
+    if(Reduce::aperture_reposition_mode == Reduce::STATIC){
 
-                    }else{
+        // Do nothing
 
-                    app->set_valid(false);
-                    if(Reduce::abort_behaviour == Reduce::RELAXED){
-                        std::cout << "Ultracam::rejig_apertures 1: CCD " << nccd + 1 << ", aperture " << naper+1
-                              << " shifted by more than the maximum. Shift = " << shift << " cf " << Reduce::aperture_search_max_shift << std::endl;
-                    }else if(Reduce::abort_behaviour == Reduce::FUSSY){
-                        throw Ultracam_Error("Ultracam::rejig_apertures 1: Fussy mode: CCD " + Subs::str(nccd+1) + ", aperture " + Subs::str(naper+1) +
-                                 " shifted by more than the maximum.");
-                    }
+    }else if(Reduce::aperture_reposition_mode == Reduce::INDIVIDUAL ||
+             Reduce::aperture_reposition_mode == Reduce::INDIVIDUAL_PLUS_TWEAK ||
+             Reduce::aperture_reposition_mode == Reduce::REFERENCE_PLUS_TWEAK ){
+
+        // Adjust the position of every aperture for every CCD. In the reference_plus_tweak
+        // case, first try to determine a shift from the reference apertures.
+        std::vector<int> nref(data.size(), 0);
+        std::vector<float> offset_x(data.size(), 0.f), offset_y(data.size(), 0.f);
+
+        if(Reduce::aperture_reposition_mode == Reduce::REFERENCE_PLUS_TWEAK){
+
+            tasks.measure = search_reference;
+            tasks.star.clear();
+            for(size_t nccd=0; nccd<data.size(); nccd++){
+                if(process[nccd]){
+                    for(size_t naper=0; naper<aperture[nccd].size(); naper++){
+                        app = &aperture[nccd][naper];
+                        if(app->valid() && app->ref()) tasks.star.push_back(Star(nccd, naper, *app));
                     }
                 }
-                catch(const Ultracam_Error& err){
-                    app->set_valid(false);
-                    if(Reduce::abort_behaviour == Reduce::FUSSY)
-                    throw Ultracam_Error("Ultracam::rejig_apertures: fussy mode: " + err);
-                }
-                }
-            }
-            if(nref > 0){
-                offset_x /= nref;
-                offset_y /= nref;
-
-            }else{
-                if(Reduce::abort_behaviour == Reduce::FUSSY)
-                throw Ultracam_Error("Ultracam::rejig_apertures: fussy mode: CCD " + Subs::str(nccd+1) + ", failed to lock on to any reference star.");
-
-                std::cerr << "Ultracam::rejig_apertures: CCD " << (nccd+1) << ", failed to lock on to any reference star." << std::endl;
             }
-            }else{
-            nref = 0;
+            measure_all(tasks, nthreads, aperture, errors, log);
+
+            for(size_t n=0; n<tasks.star.size(); n++){
+                const Star& star = tasks.star[n];
+                if(star.found){
+                    offset_x[star.nccd] += star.dx;
+                    offset_y[star.nccd] += star.dy;
+                    nref[star.nccd]++;
+                }
             }
 
-            // Only carry out next bit if a reference aperture was located
-            if(Reduce::aperture_reposition_mode != Reduce::REFERENCE_PLUS_TWEAK || nref > 0){
-
-            // Loop over apertures
-            for(size_t naper=0; naper<aperture[nccd].size(); naper++){
-
-                // Only adjust unlinked apertures. Note that if reference_plus_tweak is in effect
-                // the reference apertures will get re-adjusted here but that is OK because the
-                // first time may be rather crude
-                app = &aperture[nccd][naper];
-
-                if(app->valid() && !app->linked()){
-
-                try{
+            for(size_t nccd=0; nccd<data.size(); nccd++){
+                if(process[nccd] && aperture[nccd].size() > 0){
+                    if(nref[nccd] > 0){
+                        offset_x[nccd] /= nref[nccd];
+                        offset_y[nccd] /= nref[nccd];
 
-                    // Get references to windata
-                    const Windata &dwin = data[nccd].enclose(app->xref(), app->yref());
-                    const Windata &vwin = dvar[nccd].enclose(app->xref(), app->yref());
-
-                    // Avoid double compensating the change for reference apertures.
-                    if(app->ref() && nref > 0){
-                    xstart   = dwin.xcomp(app->xref());
-                    ystart   = dwin.ycomp(app->yref());
                     }else{
-                    xstart   = dwin.xcomp(app->xref()) + offset_x;
-                    ystart   = dwin.ycomp(app->yref()) + offset_y;
+                        if(Reduce::abort_behaviour == Reduce::FUSSY)
+                            log[nccd].push_back(Message(Message::FATAL, "Ultracam::rejig_apertures: fussy mode: CCD " + Subs::str(nccd+1) +
+                                                        ", failed to lock on to any reference star."));
+                        else
+                            log[nccd].push_back(Message(Message::CERR, "Ultracam::rejig_apertures: CCD " + Subs::str(nccd+1) +
+                                                        ", failed to lock on to any reference star."));
                     }
+                }
+            }
+        }
 
-                    // If reference_plus_tweak, then we use more restrictive criteria
-                    // in repositioning the apertures because we believe that we are already
-                    // close the right value from the reference reposition, unless the reference
-                    // reposition failed (nref == 0)
-                    if(Reduce::aperture_reposition_mode == Reduce::REFERENCE_PLUS_TWEAK && nref > 0){
-                    fwhm_x    = Reduce::aperture_tweak_fwhm/dwin.xbin();
-                    fwhm_y    = Reduce::aperture_tweak_fwhm/dwin.ybin();
-                    hwidth_x  = Reduce::aperture_tweak_half_width/dwin.xbin();
-                    hwidth_y  = Reduce::aperture_tweak_half_width/dwin.ybin();
-                    max_shift = Reduce::aperture_tweak_max_shift;
-                    }else{
-                    fwhm_x    = Reduce::aperture_search_fwhm/dwin.xbin();
-                    fwhm_y    = Reduce::aperture_search_fwhm/dwin.ybin();
-                    hwidth_x  = Reduce::aperture_search_half_width/dwin.xbin();
-                    hwidth_y  = Reduce::aperture_search_half_width/dwin.ybin();
-                    max_shift = Reduce::aperture_search_max_shift;
-                    }
-                    fwhm_x   = fwhm_x > 1.f ? fwhm_x : 1.f;
-                    fwhm_y   = fwhm_y > 1.f ? fwhm_y : 1.f;
-                    hwidth_x = hwidth_x > int(fwhm_x+1.) ? hwidth_x : int(fwhm_x+1.);
-                    hwidth_y = hwidth_y > int(fwhm_y+1.) ? hwidth_y : int(fwhm_y+1.);
-
-                    // Remeasure the position
-                    if(Reduce::aperture_reposition_mode == Reduce::REFERENCE_PLUS_TWEAK && nref > 0){
-                    Ultracam::findpos(dwin, vwin, dwin.nx(), dwin.ny(), fwhm_x, fwhm_y, hwidth_x, hwidth_y,
-                              xstart, ystart, true, xpos, ypos, ex, ey);
-                    }else{
-                    Ultracam::findpos(dwin, vwin, dwin.nx(), dwin.ny(), fwhm_x, fwhm_y, hwidth_x, hwidth_y,
-                              xstart, ystart, Reduce::aperture_positions_stable, xpos, ypos, ex, ey);
-                    }
-
-                    //		cerr << nccd+1 << " " << naper+1 << " " << xstart << " " << ystart << " " << xpos << " " << ypos << endl;
-
-                    // Check that the shift is not too large
-                    if((shift = sqrt(Subs::sqr(dwin.xbin()*(xpos-xstart)) + Subs::sqr(dwin.ybin()*(ypos-ystart)))) < max_shift){
-
-                    errors[nccd][naper] = Fxy(ex, ey);
-
-                    app->set_xref(dwin.xccd(xpos));
-                    app->set_yref(dwin.yccd(ypos));
-
-                    // If the aperture is offset from another position, then it will be tweaked
-                    // in some cases using more restrictive criteria.
-                    if((app->xoff() != 0. || app->yoff() != 0.) && Reduce::aperture_reposition_mode == Reduce::INDIVIDUAL_PLUS_TWEAK){
-
-                        xstart   = dwin.xcomp(app->xpos());
-                        ystart   = dwin.ycomp(app->ypos());
-                        hwidth_x = Reduce::aperture_tweak_half_width/dwin.xbin();
-                        hwidth_y = Reduce::aperture_tweak_half_width/dwin.ybin();
-                        fwhm_x   = Reduce::aperture_tweak_fwhm/dwin.xbin();
-                        fwhm_y   = Reduce::aperture_tweak_fwhm/dwin.ybin();
-
-                        Ultracam::findpos(dwin, vwin, dwin.nx(), dwin.ny(), fwhm_x, fwhm_y, hwidth_x, hwidth_y,
-                                  xstart, ystart, true, xpos, ypos, ex, ey);
-
-                        // Check shift is not too large
-                        if((shift = sqrt(Subs::sqr(dwin.xbin()*(xpos-xstart)) + Subs::sqr(dwin.ybin()*(ypos-ystart))))
-                           < Reduce::aperture_tweak_max_shift){
-
-                        errors[nccd][naper] = Fxy(ex, ey);
-
-                        app->set_xoff(dwin.xccd(xpos) - app->xref());
-                        app->set_yoff(dwin.yccd(ypos) - app->yref());
-
-                        }else{
-
-                        app->set_valid(false);
-                        if(Reduce::abort_behaviour == Reduce::RELAXED){
-                            std::cerr << "Ultracam::rejig_apertures 2: CCD " << nccd + 1 << ", aperture " << naper+1
-                                  << " shifted by more than the maximum. Shift = " << shift << " cf " << Reduce::aperture_tweak_max_shift << std::endl;
-                        }else if(Reduce::abort_behaviour == Reduce::FUSSY){
-                            throw Ultracam_Error("Ultracam::rejig_apertures 2: fussy mode: CCD " + Subs::str(nccd+1) + ", aperture " + Subs::str(naper+1) +
-                                     " shifted by more than the maximum.");
-                        }
-                        }
-                    }
-
-                    }else{
-
-                    app->set_valid(false);
-                    if(Reduce::abort_behaviour == Reduce::RELAXED){
-                        std::cerr << "Ultracam::rejig_apertures 3: CCD " << nccd + 1 << ", aperture " << naper+1
-                              << " shifted by more than the maximum. Shift = "  << shift << " cf " << max_shift << std::endl;
-                    }else if(Reduce::abort_behaviour == Reduce::FUSSY){
-                        throw Ultracam_Error("Ultracam::rejig_apertures 3: fussy mode: CCD " + Subs::str(nccd+1) +
-                                 ", aperture " + Subs::str(naper+1) + " shifted by more than the maximum.");
-                    }
+        // Now the unlinked apertures of every CCD on which a reference aperture was located, if need be. Note
+        // that if reference_plus_tweak is in effect the reference apertures will get re-adjusted here but that
+        // is OK because the first time may be rather crude
+        tasks.measure = search_aperture;
+        tasks.star.clear();
+        for(size_t nccd=0; nccd<data.size(); nccd++){
+            if(process[nccd] && (Reduce::aperture_reposition_mode != Reduce::REFERENCE_PLUS_TWEAK || nref[nccd] > 0)){
+                for(size_t naper=0; naper<aperture[nccd].size(); naper++){
+                    app = &aperture[nccd][naper];
+                    if(app->valid() && !app->linked()){
+                        tasks.star.push_back(Star(nccd, naper, *app));
+                        tasks.star.back().nref     = nref[nccd];
+                        tasks.star.back().offset_x = offset_x[nccd];
+                        tasks.star.back().offset_y = offset_y[nccd];
                     }
                 }
-                catch(const Ultracam_Error& err){
-                    app->set_valid(false);
-                    if(Reduce::abort_behaviour == Reduce::FUSSY)
-                    throw Ultracam_Error("Ultracam::rejig_apertures: fussy mode: " + err);
-                }
-                }
             }
+        }
+        measure_all(tasks, nthreads, aperture, errors, log);
 
-            // Now update the linked apertures, without fitting
-            for(size_t naper=0; naper<aperture[nccd].size(); naper++){
-                app  = &aperture[nccd][naper];
-                if(app->linked()){
+        for(size_t nccd=0; nccd<data.size(); nccd++){
+            if(process[nccd]){
+                if(Reduce::aperture_reposition_mode != Reduce::REFERENCE_PLUS_TWEAK || nref[nccd] > 0){
 
-                app1 = &aperture[nccd][aperture_link[nccd][naper]];
-                errors[nccd][naper] = errors[nccd][aperture_link[nccd][naper]];
+                    // Now update the linked apertures, without fitting
+                    update_linked(aperture[nccd], aperture_link[nccd], errors[nccd]);
 
-                if(app->valid() && app1->valid()){
-                    app->set_xref(app1->xref());
-                    app->set_yref(app1->yref());
                 }else{
-                    app->set_valid(false);
-                }
+                    // No reference stars located, invalidate all other apertures
+                    for(size_t naper=0; naper<aperture[nccd].size(); naper++)
+                        aperture[nccd][naper].set_valid(false);
                 }
             }
-            }else{
-            // No reference stars located, invalidate all other apertures
-            for(size_t naper=0; naper<aperture[nccd].size(); naper++)
-                aperture[nccd][naper].set_valid(false);
-            }
-        }
         }
     }
-    }
+
+    print_log(log);
+    log.assign(data.size(), Log());
 
     // Now adjust aperture positions with profile fits, if wanted and if reference apertures are set
+    std::vector<bool> fit(data.size(), false);
     for(size_t nccd=0; nccd<data.size(); nccd++){
 
-    if(nccd != 2 || !blue_is_bad){
-
-        if(Reduce::extraction_control.find(nccd) != Reduce::extraction_control.end()){
-
-        if(aperture[nccd].size()){
+        if(process[nccd] && aperture[nccd].size()){
 
             // Initialise.
             // The profile fit method and extraction weights may look unnecessary in the context
@@ -427,197 +720,99 @@ void Ultracam::rejig_apertures(const Frame& data, const Frame& dvar, const Subs:
             shape[nccd].extraction_weights   = Reduce::extraction_weights;
             shape[nccd].fwhm = shape[nccd].a = shape[nccd].b = shape[nccd].c = shape[nccd].beta = 0.;
 
-            if(Reduce::extraction_control[nccd].aperture_type     == Reduce::VARIABLE ||
-               Reduce::extraction_control[nccd].extraction_method == Reduce::OPTIMAL){
+            fit[nccd] = (Reduce::extraction_control[nccd].aperture_type     == Reduce::VARIABLE ||
+                         Reduce::extraction_control[nccd].extraction_method == Reduce::OPTIMAL);
+        }
+    }
 
-            // First deal with reference targets, if there are any.
-            double wgt, sumw = 0.;
+    // First deal with reference targets, if there are any.
+    tasks.measure = fit_reference;
+    tasks.star.clear();
+    for(size_t nccd=0; nccd<data.size(); nccd++){
+        if(fit[nccd]){
             for(size_t naper=0; naper<aperture[nccd].size(); naper++){
                 app = &aperture[nccd][naper];
-                if(app->valid() && app->ref()){
-
-                try{
-
-                    // Obtain initial value of 'a'
-                    double a = 1./2./Subs::sqr(Reduce::profile_fit_fwhm/Constants::EFAC);
-
-                    Ultracam::Ppars profile;
-                    if(Reduce::profile_fit_method == Reduce::GAUSSIAN){
-
-                    // Gaussian fit section.
-                    profile.set(0., 0., 0., 0., a, 0., a, Reduce::profile_fit_symm);
-
-                    }else if(Reduce::profile_fit_method == Reduce::MOFFAT){
-
-                    // Moffat fit section.
-                    profile.set(0., 0., 0., 0., a, 0., a, Reduce::profile_fit_beta, Reduce::profile_fit_symm);
-
-                    }
-
-                    Ultracam::Iprofile iprofile;
-                    Ultracam::fit_plot_profile(data[nccd], dvar[nccd], profile, false, true, app->xref(), app->yref(), app->mask(), 0., 0,
-                                   Reduce::profile_fit_hwidth, profile_fit_plot, Reduce::profile_fit_sigma, iprofile, false);
-
-                    // Check shift is not too large (compared agaiinst fine tweak settings)
-                    if((shift = sqrt(Subs::sqr(profile.x-app->xref()) + Subs::sqr(profile.y-app->yref()))) < Reduce::aperture_tweak_max_shift){
-
-                    errors[nccd][naper] = Fxy(iprofile.ex, iprofile.ey);
-
-                    // Update aperture position
-                    app->set_xref(profile.x);
-                    app->set_yref(profile.y);
-
-                    // Average shape values. Use single weight.
-                    wgt   = 1./iprofile.covar[profile.a_index()][profile.a_index()];
-                    shape[nccd].fwhm  += wgt*iprofile.fwhm;
-                    shape[nccd].a     += wgt*profile.a;
-                    shape[nccd].b     += wgt*profile.b;
-                    shape[nccd].c     += wgt*profile.c;
-                    if(Reduce::profile_fit_method == Reduce::MOFFAT)
-                        shape[nccd].beta += wgt*profile.beta;
-                    sumw += wgt;
-                    shape[nccd].set = true;
+                if(app->valid() && app->ref()) tasks.star.push_back(Star(nccd, naper, *app));
+            }
+        }
+    }
+    measure_all(tasks, nthreads_fit, aperture, errors, log);
+
+    // Average shape values
+    std::vector<double> sumw(data.size(), 0.);
+    for(size_t n=0; n<tasks.star.size(); n++){
+        const Star& star = tasks.star[n];
+        if(star.found){
+            double wgt = star.wgt;
+            Reduce::Meanshape& mshape = shape[star.nccd];
+            mshape.fwhm  += wgt*star.fwhm;
+            mshape.a     += wgt*star.profile.a;
+            mshape.b     += wgt*star.profile.b;
+            mshape.c     += wgt*star.profile.c;
+            if(Reduce::profile_fit_method == Reduce::MOFFAT)
+                mshape.beta += wgt*star.profile.beta;
+            sumw[star.nccd] += wgt;
+            mshape.set = true;
+        }
+    }
 
-                    }else{
+    // Now adjust non-reference apertures
+    tasks.measure = fit_aperture;
+    tasks.star.clear();
+    for(size_t nccd=0; nccd<data.size(); nccd++){
 
-                    app->set_valid(false);
-                    if(Reduce::abort_behaviour == Reduce::RELAXED){
-                        std::cerr << "4. CCD " << nccd + 1 << ", aperture " << naper+1
-                              << " shifted by more than the maximum. Shift = " << shift << " cf " << Reduce::aperture_tweak_max_shift << std::endl;
-                    }else if(Reduce::abort_behaviour == Reduce::FUSSY){
-                        throw Ultracam_Error("Ultracam::rejig_apertures 4: fussy mode: CCD " + Subs::str(nccd+1) +
-                                 ", aperture " + Subs::str(naper+1) + " shifted by more than the maximum.");
-                    }
-                    }
-                }
-                catch(const std::string& err){
-                    if(Reduce::abort_behaviour == Reduce::FUSSY){
-                    throw Ultracam_Error("Ultracam::rejig_apertures: fussy mode, reference fit: " + err);
-                    }else if(Reduce::abort_behaviour == Reduce::RELAXED){
-                    std::cerr << "Reference fit, CCD " << nccd+1 << ", aperture " << naper+1 << ": " << err << std::endl;
-                    app->set_valid(false);
-                    }
-                }
-                }
-            }
+        if(!fit[nccd]) continue;
 
-            // Now adjust non-reference apertures
-            if(!shape[nccd].set){
+        if(!shape[nccd].set){
 
-                // No valid fit made, invalidate all apertures
-                for(size_t naper=0; naper<aperture[nccd].size(); naper++)
+            // No valid fit made, invalidate all apertures
+            for(size_t naper=0; naper<aperture[nccd].size(); naper++)
                 aperture[nccd][naper].set_valid(false);
+            fit[nccd] = false;
 
-            }else{
+        }else{
 
-                // Derive mean shape parameters
-                shape[nccd].fwhm /= sumw;
-                shape[nccd].a    /= sumw;
-                shape[nccd].b    /= sumw;
-                shape[nccd].c    /= sumw;
-                if(Reduce::profile_fit_method == Reduce::MOFFAT)
-                shape[nccd].beta /= sumw;
+            // Derive mean shape parameters
+            shape[nccd].fwhm /= sumw[nccd];
+            shape[nccd].a    /= sumw[nccd];
+            shape[nccd].b    /= sumw[nccd];
+            shape[nccd].c    /= sumw[nccd];
+            if(Reduce::profile_fit_method == Reduce::MOFFAT)
+                shape[nccd].beta /= sumw[nccd];
 
-                // Recompute aperture radii if not fixed
-                if(Reduce::extraction_control[nccd].aperture_type == Reduce::VARIABLE){
+            // Recompute aperture radii if not fixed
+            if(Reduce::extraction_control[nccd].aperture_type == Reduce::VARIABLE){
                 rstar = Subs::clamp(Reduce::extraction_control[nccd].star_min,      float(Reduce::extraction_control[nccd].star_scale*shape[nccd].fwhm),      Reduce::extraction_control[nccd].star_max);
                 rsky1 = Subs::clamp(Reduce::extraction_control[nccd].inner_sky_min, float(Reduce::extraction_control[nccd].inner_sky_scale*shape[nccd].fwhm), Reduce::extraction_control[nccd].inner_sky_max);
                 rsky2 = Subs::clamp(Reduce::extraction_control[nccd].outer_sky_min, float(Reduce::extraction_control[nccd].outer_sky_scale*shape[nccd].fwhm), Reduce::extraction_control[nccd].outer_sky_max);
 
                 // A check for something which should never happen
-                if(rsky1 >= rsky2)
-                    throw Ultracam_Error("rejig_apertures: inner radius of sky annulus >= outer; should not happen");
+                if(rsky1 >= rsky2){
+                    log[nccd].push_back(Message(Message::FATAL, "rejig_apertures: inner radius of sky annulus >= outer; should not happen"));
+                    fit[nccd] = false;
+                    continue;
                 }
 
-                for(size_t naper=0; naper<aperture[nccd].size(); naper++){
+                // Adjust radii of apertures
+                for(size_t naper=0; naper<aperture[nccd].size(); naper++)
+                    aperture[nccd][naper].set_radii(rstar, rsky1, rsky2);
+            }
 
+            // Only fit unlinked, unreferenced apertures
+            for(size_t naper=0; naper<aperture[nccd].size(); naper++){
                 app = &aperture[nccd][naper];
-
-                // Adjust radii of apertures if need be
-                if(Reduce::extraction_control[nccd].aperture_type == Reduce::VARIABLE)
-                    app->set_radii(rstar, rsky1, rsky2);
-
-                // Only fit unlinked, unreferenced apertures
                 if(app->valid() && !app->ref() && aperture_link[nccd].find(naper) == aperture_link[nccd].end()){
-
-                    try{
-
-                    // Get references to windatas
-                    // const Windata &rwin = Reduce::readout_frame[nccd].enclose(app->xref(), app->yref());
-                    // const Windata &gwin = Reduce::gain_frame[nccd].enclose(app->xref(), app->yref());
-                    // read = rwin[0][0], gain = gwin[0][0];
-
-                    Ultracam::Ppars profile;
-                    if(Reduce::profile_fit_method == Reduce::GAUSSIAN){
-                        // Gaussian fit section.
-                        profile.set(0., 0., 0., 0., shape[nccd].a, shape[nccd].b, shape[nccd].c, Reduce::profile_fit_symm);
-
-                    }else if(Reduce::profile_fit_method == Reduce::MOFFAT){
-
-                        // Moffat fit section.
-                        profile.set(0., 0., 0., 0., shape[nccd].a, shape[nccd].b, shape[nccd].c, shape[nccd].beta, Reduce::profile_fit_symm);
-                        profile.var_beta = false;
-
-                    }
-                    profile.var_a = profile.var_b = profile.var_c = false;
-
-                    Ultracam::Iprofile iprofile;
-                    Ultracam::fit_plot_profile(data[nccd], dvar[nccd], profile, false, true, app->xref(), app->yref(), app->mask(), 0., 0,
-                                   Reduce::profile_fit_hwidth, profile_fit_plot, Reduce::profile_fit_sigma, iprofile, false);
-
-                    // Check shift is not too large (compared agaiinst fine tweak settings)
-                    if((shift = sqrt(Subs::sqr(profile.x-app->xref()) + Subs::sqr(profile.y-app->yref()))) < Reduce::aperture_tweak_max_shift){
-
-                        errors[nccd][naper] = Fxy(iprofile.ex, iprofile.ey);
-                        // Update aperture position
-                        app->set_xref(profile.x);
-                        app->set_yref(profile.y);
-
-                    }else{
-
-                        app->set_valid(false);
-                        if(Reduce::abort_behaviour == Reduce::RELAXED){
-                        std::cerr << "5. CCD " << nccd + 1 << ", aperture " << naper+1
-                              << " shifted by more than the maximum. Shift = " << shift << " cf " << Reduce::aperture_tweak_max_shift << std::endl;
-                        }else if(Reduce::abort_behaviour == Reduce::FUSSY){
-                        throw Ultracam_Error("Ultracam::rejig_apertures 5: fussy mode: CCD " + Subs::str(nccd+1) + ", aperture " + Subs::str(naper+1) +
-                                     " shifted by more than the maximum.");
-                        }
-                    }
-                    }
-                    catch(const std::string& err){
-                    if(Reduce::abort_behaviour == Reduce::FUSSY){
-                        throw Ultracam_Error("Ultracam::rejig_apertures: fussy mode, position fit: " + err);
-                    }else if(Reduce::abort_behaviour == Reduce::RELAXED){
-                        std::cerr << "Position fit, CCD " << nccd+1 << ", aperture " << naper+1 << ": " << err << std::endl;
-                        app->set_valid(false);
-                    }
-                    }
-                }
-                }
-
-                // Finally update the linked apertures
-                for(size_t naper=0; naper<aperture[nccd].size(); naper++){
-
-                app  = &aperture[nccd][naper];
-                if(app->linked()){
-
-                    app1 = &aperture[nccd][aperture_link[nccd][naper]];
-                    errors[nccd][naper] = errors[nccd][aperture_link[nccd][naper]];
-
-                    if(app->valid() && app1->valid()){
-                    app->set_xref(app1->xref());
-                    app->set_yref(app1->yref());
-                    }else{
-                    app->set_valid(false);
-                    }
+                    tasks.star.push_back(Star(nccd, naper, *app));
+                    tasks.star.back().shape = shape[nccd];
                 }
-                }
-            }
             }
         }
-        }
-    }
     }
-}
+    measure_all(tasks, nthreads_fit, aperture, errors, log);
 
+    // Finally update the linked apertures
+    for(size_t nccd=0; nccd<data.size(); nccd++)
+        if(fit[nccd]) update_linked(aperture[nccd], aperture_link[nccd], errors[nccd]);
+
+    print_log(log);
+}
@@ -29,7 +29,7 @@ This is a feature I'm afraid.
 
 !!head2 Program call
 
-rtplot [device source] ((url)/(file) first trim [(ncol nrow) twait tmax])/(flist) [pause] nccd [def] (defect transform) [setup]
+rtplot [device source] ((url)/(file) first trim [(ncol nrow) twait tmax nthreads])/(flist) [pause] nccd [def] (defect transform) [setup]
 setwin bias (biasframe) (threshold (photon) naccum) (lowlevel highlevel) ([stack]) xleft xright yleft yright iset (i1 i2)/(p1 p2)
 (profit) ([method symm (beta) fwhm hwidth readout gain sigrej onedsrch (fwhm1d hwidth1d) (fdevice)])
 
@@ -68,6 +68,10 @@ can be corrupted.}
 !!arg{tmax}{Maximum time to wait before giving up, set = 0 to give up immediately. (Only for data from
 a server).}
 
+!!arg{nthreads}{Number of threads to use to unpack each frame. With more than one, the CCDs
+(ULTRACAM) or windows (ULTRASPEC) are unpacked in parallel, which helps most with full-frame
+unbinned data. (Only for data from a server or local file)}
+
 !!arg{flist}{If source = 'U', this is the name of a list of ULTRACAM files to reduce. These should be arranged in
 temporal order to help the reduction move from one exposure to the next successfully.}
 
@@ -243,6 +247,7 @@ See also !!ref{plot.html}{plot} for standard plots.
 #include "trm/defect.h"
 #include "trm/frame.h"
 #include "trm/ultracam.h"
+#include "trm/frame_source.h"
 #include "trm/signal.h"
 
 // Main program
@@ -267,6 +272,7 @@ int main(int argc, char* argv[]){
         input.sign_in("nrow",      Subs::Input::GLOBAL, Subs::Input::NOPROMPT);
         input.sign_in("twait",     Subs::Input::GLOBAL, Subs::Input::NOPROMPT);
         input.sign_in("tmax",      Subs::Input::GLOBAL, Subs::Input::NOPROMPT);
+        input.sign_in("nthreads",  Subs::Input::GLOBAL, Subs::Input::NOPROMPT);
         input.sign_in("flist",     Subs::Input::GLOBAL, Subs::Input::PROMPT);
         input.sign_in("pause",     Subs::Input::LOCAL,  Subs::Input::NOPROMPT);
         input.sign_in("nccd",      Subs::Input::LOCAL,  Subs::Input::PROMPT);
@@ -324,9 +330,11 @@ int main(int argc, char* argv[]){
         int ncol, nrow;
         std::vector<std::string> file;
         double twait, tmax;
+        int nthreads;
         Ultracam::Mwindow mwindow;
         Subs::Header header;
         Ultracam::ServerData serverdata;
+        Ultracam::Frame_source server;
         Ultracam::Frame data, dvar;
 
         if(source == 'S' || source == 'L'){
@@ -340,6 +348,7 @@ int main(int argc, char* argv[]){
             input.get_value("twait", twait, 1., 0., 1000., "time to wait between attempts to find a frame (seconds)");
             input.get_value("tmax", tmax, 2., 0., 1000., "maximum time to wait before giving up trying to find a "
                             "frame (seconds)");
+            input.get_value("nthreads", nthreads, 1, 1, 64, "number of threads to unpack each frame");
 
             // Add extra stuff to URL if need be.
             if(url.find("http://") == std::string::npos && source == 'S'){
@@ -355,6 +364,8 @@ int main(int argc, char* argv[]){
 
             // Parse the XML file
             Ultracam::parseXML(source, url, mwindow, header, serverdata, trim, ncol, nrow, twait, tmax);
+            server.open(source, url, serverdata);
+            server.set_nthreads(nthreads);
 
             // Initialise standard data frame
             data.format(mwindow, header);
@@ -598,7 +609,7 @@ int main(int argc, char* argv[]){
                     // Ensure we always request last frame, if that is what is wanted
                     nfile = first == 0 ? 0 : nfile;
 
-                    if(!Ultracam::get_server_frame(source, url, data, serverdata, nfile, twait, tmax)){
+                    if(!server.get(data, nfile, twait, tmax)){
                         stopped = true;
                         break;
                     }
@@ -153,6 +153,7 @@ lies in a given percentile range or not. This is the upperlimit in percent}
 #include "trm/window.h"
 #include "trm/aperture.h"
 #include "trm/ultracam.h"
+#include "trm/frame_source.h"
 
 // Main program
 
@@ -219,6 +220,7 @@ int main(int argc, char* argv[]){
     Ultracam::Mwindow mwindow;
     Subs::Header header;
     Ultracam::ServerData serverdata;
+    Ultracam::Frame_source server;
     Ultracam::Frame data, dvar;
     double twait, tmax;
     int ncol, nrow;
@@ -249,6 +251,7 @@ int main(int argc, char* argv[]){
         }
 
         parseXML(source, url, mwindow, header, serverdata, trim, ncol, nrow, twait, tmax);
+        server.open(source, url, serverdata);
         data.format(mwindow, header);
 
     }else{
@@ -434,7 +437,7 @@ int main(int argc, char* argv[]){
             // Carry on reading until data & time are OK
             bool get_ok = false, reset = (npass == 2 && nfile == first);
             while(last == 0 || nfile <= last){
-            if(!(get_ok = Ultracam::get_server_frame(source, url, data, serverdata, nfile, twait, tmax, reset))) break;
+            if(!(get_ok = server.get(data, nfile, twait, tmax, reset))) break;
             ut_date       = data["UT_date"]->get_time();
             ut_date_blue  = serverdata.nblue > 1 ? data["UT_date_blue"]->get_time() : ut_date;
             reliable      = data["Frame.reliable"]->get_bool();
@@ -1,8 +1,230 @@
+#include <cmath>
+#include <limits>
+#include <vector>
 #include "trm/subs.h"
 #include "trm/windata.h"
 #include "trm/aperture.h"
 #include "trm/ultracam.h"
 #include "trm/reduce.h"
+#include "trm/parallel.h"
+
+namespace {
+
+  // Number of bins of the sky histogram, not counting the overflow bin
+  const int NHIST = 16384;
+
+  // Maximum number of clipping cycles of the histogram estimator
+  const int MAX_ITER = 100;
+
+  // Maximum number of sky annuli cached by each thread
+  const size_t MAX_ANNULUS = 256;
+
+  // The pixels of a sky annulus with its masks applied, as offsets from the pixel nearest
+  // to the aperture centre, in the order of the rows. They depend only upon the offset of
+  // the aperture centre from this pixel (fx, fy, binned pixels), the binning factors, the
+  // radii and the masks.
+  struct Annulus {
+    double fx, fy;
+    int xbin, ybin;
+    float rsky1, rsky2;
+    std::vector<Ultracam::sky_mask> mask;
+    std::vector<int> ox, oy;
+
+    // Checks whether the annulus can be used for a given aperture, with the centre offset
+    // allowed to differ by up to tol unbinned pixels in X and Y.
+    bool matches(double fx, double fy, int xbin, int ybin, const Ultracam::Aperture& aperture, float tol) const {
+      if(fabs(fx - this->fx)*xbin > tol || fabs(fy - this->fy)*ybin > tol ||
+         xbin != this->xbin || ybin != this->ybin || aperture.rsky1() != rsky1 || aperture.rsky2() != rsky2 ||
+         aperture.nmask() != int(mask.size()))
+        return false;
+      for(int nm=0; nm<aperture.nmask(); nm++)
+        if(aperture.mask(nm).x != mask[nm].x || aperture.mask(nm).y != mask[nm].y || aperture.mask(nm).z != mask[nm].z)
+          return false;
+      return true;
+    }
+
+    // Computes the pixels in the same way as sky_estimate does when not using the cache
+    void set(double fx, double fy, int xbin, int ybin, const Ultracam::Aperture& aperture){
+      this->fx   = fx;
+      this->fy   = fy;
+      this->xbin = xbin;
+      this->ybin = ybin;
+      rsky1      = aperture.rsky1();
+      rsky2      = aperture.rsky2();
+      mask       = aperture.mask();
+      ox.clear();
+      oy.clear();
+
+      const int hx = int(rsky2/xbin) + 2, hy = int(rsky2/ybin) + 2;
+      float sd, sdy, sr1 = Subs::sqr(rsky1), sr2 = Subs::sqr(rsky2);
+      float dx, dy;
+      for(int ky=-hy; ky<=hy; ky++){
+        dy  = float((ky - fy)*ybin);
+        sdy = Subs::sqr(dy);
+        for(int kx=-hx; kx<=hx; kx++){
+          dx = float((kx - fx)*xbin);
+          sd = sdy + Subs::sqr(dx);
+          if(sd > sr1 && sd < sr2){
+            bool masked = false;
+            for(size_t nm=0; nm<mask.size(); nm++){
+              if(Subs::sqr(dx - mask[nm].x) + Subs::sqr(dy - mask[nm].y) < Subs::sqr(mask[nm].z)){
+                masked = true;
+                break;
+              }
+            }
+            if(!masked){
+              ox.push_back(kx);
+              oy.push_back(ky);
+            }
+          }
+        }
+      }
+    }
+  };
+
+  // Buffers for the sky pixels. There is one set per thread so that apertures can be
+  // extracted concurrently, each set being kept for the life of its thread to avoid
+  // allocation overheads. The histogram is left zeroed after each use.
+  struct Sky_buffers {
+    Sky_buffers() : back(2000), back_var(2000), hcount(NHIST+1, 0), hsum(NHIST+1, 0.), hsumsq(NHIST+1, 0.),
+                    annulus(), next_annulus(0) {}
+    Subs::Buffer1D<float> back, back_var;
+    std::vector<int> hcount;
+    std::vector<double> hsum, hsumsq;
+    std::vector<Annulus> annulus;
+    size_t next_annulus;
+  };
+
+  // The buffers of each thread
+  Ultracam::Thread_cache<Sky_buffers> sky_buffers;
+
+  // Clipped mean, RMS and median of n values computed from a histogram rather than by
+  // repeated passes over the values and selection. The bins are 1 count wide starting
+  // from the smallest value, with everything beyond NHIST counts in a single overflow
+  // bin; if that would place the median in the overflow bin, the bins are widened to
+  // span all the values. Clipping is carried out bin by bin, a bin being kept if the
+  // mean of its values is within thresh RMS of the current mean, until the bins kept
+  // stop changing. Each value is thus clipped as if it had its bin's mean value, and the
+  // median is the mean value of the bin containing the finite value of rank n/2 (counting
+  // from 0). Both are approximations to Subs::sigma_reject and the selection used for MEDIAN,
+  // which need not agree exactly even for integer data. NaN and infinite values are
+  // left out of the histogram and counted as rejected. Apart from one pass over the values
+  // to fill the histogram, the work depends upon the range of the values rather than their
+  // number.
+  void histogram_sky(const float* value, int n, float thresh, Sky_buffers& buffers,
+                     double& mean, double& rms, int& nrej, float& median){
+
+    // Range and number of the finite values
+    const float big = std::numeric_limits<float>::max();
+    float vmin = big, vmax = -big;
+    int nfin = 0;
+    for(int i=0; i<n; i++){
+      if(std::fabs(value[i]) <= big){
+        vmin = std::min(vmin, value[i]);
+        vmax = std::max(vmax, value[i]);
+        nfin++;
+      }
+    }
+    if(nfin == 0){
+      mean   = rms = 0.;
+      median = 0.f;
+      nrej   = n;
+      return;
+    }
+
+    // ntop is the highest bin in use
+    double lo = floor(vmin), width = 1.;
+    int ntop = NHIST;
+    if(floor(vmax) - lo < NHIST){
+      ntop = int(floor(vmax) - lo);
+    }else{
+      int nover = 0;
+      for(int i=0; i<n; i++)
+        if(std::fabs(value[i]) <= big && value[i] - lo >= NHIST) nover++;
+      if(2*nover >= nfin)
+        width = (double(vmax) - lo)/(NHIST - 1);
+    }
+
+    int*    hcount = &buffers.hcount[0];
+    double* hsum   = &buffers.hsum[0];
+    double* hsumsq = &buffers.hsumsq[0];
+    for(int i=0; i<n; i++){
+      if(!(std::fabs(value[i]) <= big)) continue;
+      double x = (value[i] - lo)/width;
+      int k = x < NHIST ? int(x) : NHIST;
+      hcount[k]++;
+      hsum[k]   += value[i];
+      hsumsq[k] += double(value[i])*value[i];
+    }
+
+    // Median: mean value of the bin containing the value of rank nfin/2
+    int ncum = 0, k = 0;
+    while(ncum + hcount[k] <= nfin/2)
+      ncum += hcount[k++];
+    median = float(hsum[k]/hcount[k]);
+
+    // Clipped mean, starting from all bins
+    int klo = 0, khi = ntop, nok = nfin;
+    double sum = 0., sumsq = 0.;
+    for(k=0; k<=ntop; k++){
+      sum   += hsum[k];
+      sumsq += hsumsq[k];
+    }
+
+    for(int nit=0; nit<MAX_ITER; nit++){
+      mean = sum/nok;
+      rms  = nok > 1 ? sqrt(std::max(0., (sumsq - nok*mean*mean)/(nok-1))) : 0.;
+
+      // Range of bins to keep: a bin is kept if its mean value is within
+      // thresh*rms of the mean. Bins with no values are immaterial.
+      double lower = mean - thresh*rms, upper = mean + thresh*rms;
+      int nlo = 0, nhi = ntop;
+      while(nlo <= ntop && (hcount[nlo] == 0 || hsum[nlo]/hcount[nlo] <= lower)) nlo++;
+      while(nhi >= nlo  && (hcount[nhi] == 0 || hsum[nhi]/hcount[nhi] >= upper)) nhi--;
+      if(nlo > nhi || (nlo == klo && nhi == khi)) break;
+
+      klo = nlo;
+      khi = nhi;
+      nok = 0;
+      sum = sumsq = 0.;
+      for(k=klo; k<=khi; k++){
+        nok   += hcount[k];
+        sum   += hsum[k];
+        sumsq += hsumsq[k];
+      }
+    }
+    nrej = n - nok;
+
+    // Leave the histogram empty for the next call, including the overflow bin
+    for(k=0; k<=ntop; k++){
+      hcount[k] = 0;
+      hsum[k]   = hsumsq[k] = 0.;
+    }
+    hcount[NHIST] = 0;
+    hsum[NHIST]   = hsumsq[NHIST] = 0.;
+  }
+
+  // Returns a cached annulus for an aperture, computing it if need be
+  const Annulus& get_annulus(double fx, double fy, int xbin, int ybin, const Ultracam::Aperture& aperture,
+                             float tol, Sky_buffers& buffers){
+    for(size_t i=0; i<buffers.annulus.size(); i++)
+      if(buffers.annulus[i].matches(fx, fy, xbin, ybin, aperture, tol))
+        return buffers.annulus[i];
+
+    // Not found; add a new one or replace the oldest
+    Annulus* annulus;
+    if(buffers.annulus.size() < MAX_ANNULUS){
+      buffers.annulus.push_back(Annulus());
+      annulus = &buffers.annulus.back();
+    }else{
+      annulus = &buffers.annulus[buffers.next_annulus];
+      buffers.next_annulus = (buffers.next_annulus + 1) % MAX_ANNULUS;
+    }
+    annulus->set(fx, fy, xbin, ybin, aperture);
+    return *annulus;
+  }
+
+}
 
 /** Routine to carry out the determination of the sky of a given aperture
  * and appropriate windows. This routine serves to encapsulate this routine
@@ -15,7 +237,10 @@
  * \param sky_method method of estimating the sky, CLIPPED_MEAN or MEDIAN. I generally prefer CLIPPED_MEAN
  * since the median is digitized and the +/- 0.5 count digitisation noise can be significant compared to
  * the true statistical uncertainty on the sky estimate, 'sky_sigma'. This can show up as nasty jumps in
- * time series data.
+ * time series data. HISTOGRAM_MEAN and HISTOGRAM_MEDIAN are approximations to these computed from a
+ * histogram of the sky values with bins normally 1 count wide, which is quicker for large sky annuli. Values are
+ * clipped as if they had the mean value of their bin, and the median is the mean value of the bin holding
+ * the value of rank nsky/2, so the results typically differ from CLIPPED_MEAN and MEDIAN by a fraction of a count.
  * \param sky_thresh   threshold number of RMS to reject at.
  * \param sky_error  method of estimating the error on the sky.  PHOTON or VARIANCE. In the case of PHOTON,
  * the sky_sigma returned is based upon the standard variance estimate computed from readout noise
@@ -29,14 +254,21 @@
  * \param nsky       returned, total number of sky pixels
  * \param nrej       returned, number of sky pixels rejected (so actual number of sky pixels used = nsky-nrej)
  * \param overlap    returned, true if sky annulus overlaps edge of data window
+ * \param annulus_tol if >= 0, the sky pixels are taken from a list cached for each thread, which is
+ * re-computed only when the aperture centre moves by more than annulus_tol unbinned pixels in X or Y
+ * relative to the pixel grid, or the radii, masks or binning change. A tolerance of 0 re-uses a list
+ * only for exactly the same sub-pixel position. If < 0 the annulus is computed pixel by pixel.
  */
 
 void Ultracam::sky_estimate(const Aperture& aperture, const Windata& dwin, const Windata& vwin, const Windata& bwin,
                 Reduce::SKY_METHOD sky_method, float sky_thresh, Reduce::SKY_ERROR sky_error,
-                float& sky, float& sky_sigma, double& rms, int& nsky, int& nrej, bool& overlap){
+                float& sky, float& sky_sigma, double& rms, int& nsky, int& nrej, bool& overlap,
+                float annulus_tol){
 
-    // Static buffers to reduce allocation overheads
-    static Subs::Buffer1D<float> sky_back(2000), sky_back_var(2000);
+    // Per-thread buffers to reduce allocation overheads
+    Sky_buffers& buffers = sky_buffers.get();
+    Subs::Buffer1D<float>& sky_back     = buffers.back;
+    Subs::Buffer1D<float>& sky_back_var = buffers.back_var;
 
     // Initialise
     sky       = 0.f;
@@ -71,6 +303,25 @@ void Ultracam::sky_estimate(const Aperture& aperture, const Windata& dwin, const
     }
 
     // Load sky pixels into buffers
+    if(annulus_tol >= 0.f){
+
+    // Use a cached list of annulus pixels, offset from the pixel nearest the aperture centre
+    double cx = dwin.xcomp(double(aperture.xpos())), cy = dwin.ycomp(double(aperture.ypos()));
+    int ixc = int(floor(cx + 0.5)), iyc = int(floor(cy + 0.5));
+    const Annulus& annulus = get_annulus(cx - ixc, cy - iyc, dwin.xbin(), dwin.ybin(), aperture, annulus_tol, buffers);
+
+    for(size_t i=0; i<annulus.ox.size(); i++){
+        int iy = iyc + annulus.oy[i];
+        int ix = ixc + annulus.ox[i];
+        if(iy >= ylo && iy <= yhi && ix >= xlo && ix <= xhi && bwin[iy][ix] < 0.5f){
+        if(sky_error == Reduce::PHOTON) sky_back_var.push_back(vwin[iy][ix]);
+        sky_back.push_back(dwin[iy][ix]);
+        nsky++;
+        }
+    }
+
+    }else{
+
     float sd, sdy, sr1 = Subs::sqr(aperture.rsky1()), sr2 = Subs::sqr(aperture.rsky2());
     float dx, dy;
     for(int iy=ylo; iy<=yhi; iy++){
@@ -103,13 +354,20 @@ void Ultracam::sky_estimate(const Aperture& aperture, const Windata& dwin, const
     }
     }
 
+    }
+
     // Clipped mean to guard against cosmic rays
     double rawmean=0., rawrms=0., mean=0.;
     rms = 0.;
 
     if(nsky){
 
-    Subs::sigma_reject(sky_back.ptr(), nsky, sky_thresh, true, rawmean, rawrms, mean, rms, nrej);
+    float median = 0.f;
+    bool histogram = (sky_method == Reduce::HISTOGRAM_MEAN || sky_method == Reduce::HISTOGRAM_MEDIAN);
+    if(histogram)
+        histogram_sky(sky_back.ptr(), nsky, sky_thresh, buffers, mean, rms, nrej, median);
+    else
+        Subs::sigma_reject(sky_back.ptr(), nsky, sky_thresh, true, rawmean, rawrms, mean, rms, nrej);
 
     if(nrej < nsky){
 
@@ -142,8 +400,10 @@ void Ultracam::sky_estimate(const Aperture& aperture, const Windata& dwin, const
         sky_sigma = sqrt(sky_sigma);
 
         // Estimate sky background
-        if(sky_method == Reduce::CLIPPED_MEAN){
+        if(sky_method == Reduce::CLIPPED_MEAN || sky_method == Reduce::HISTOGRAM_MEAN){
         sky = mean;
+        }else if(sky_method == Reduce::HISTOGRAM_MEDIAN){
+        sky = median;
         }else if(sky_method == Reduce::MEDIAN){
         if(nsky % 2 == 0)
             sky = Subs::select(sky_back.ptr(), nsky-1, nsky/2);
@@ -232,6 +232,8 @@ user-defined fixed limits, 'automatic' which sets to the total range and 'percen
 #include "trm/mccd.h"
 #include "trm/frame.h"
 #include "trm/ultracam.h"
+#include "trm/frame_source.h"
+#include "trm/header_items.h"
 
 // Variables that are set by reading from the input file with read_reduce_file.
 // Enclosed in a namespace for safety.
@@ -379,6 +381,7 @@ int main(int argc, char* argv[]){
     Ultracam::Mwindow mwindow;
     Subs::Header header;
     Ultracam::ServerData serverdata;
+    Ultracam::Frame_source server;
     Ultracam::Frame data, dvar, bad, sky;
     double twait, tmax;
     int ncol, nrow;
@@ -406,6 +409,7 @@ int main(int argc, char* argv[]){
 
         // Finally, read the XML file.
         parseXML(source, url, mwindow, header, serverdata, trim, ncol, nrow, twait, tmax);
+        server.open(source, url, serverdata);
 
         if(source == 'S'){
         Sreduce::logger.logit("Server file name", url);
@@ -510,7 +514,8 @@ int main(int argc, char* argv[]){
 
     // Declare the objects required for the reduction
     bool reliable = false; // Is the time reliable?
-    Subs::Header::Hnode* hnode; // Iterator through headers
+    Ultracam::Header_items file_items; // header items of ucm files
+    const Ultracam::Header_items *items = NULL; // header items of the current frame
     Subs::Time ut_date;
     const Subs::Time TEST_TIME(1,Subs::Date::Jan,1999); // the time and a check time
     float expose; // exposure time
@@ -561,11 +566,12 @@ int main(int argc, char* argv[]){
         // Carry on reading until data & time are OK
         bool get_ok, reset = (nfile == first);
         for(;;){
-            if(!(get_ok = Ultracam::get_server_frame(source, url, data, serverdata, nfile, twait, tmax, reset))) break;
+            if(!(get_ok = server.get(data, nfile, twait, tmax, reset))) break;
 
-            reliable   = data["Frame.reliable"]->get_bool();
-            ut_date    = data["UT_date"]->get_time();
-            nsatellite = data["Frame.satellites"]->get_int();
+            items      = &server.items();
+            reliable   = items->reliable;
+            ut_date    = items->ut_date;
+            nsatellite = items->satellites;
 
             if(serverdata.is_junk(nfile)){
             std::cerr << "Skipping file " << nfile << " which has junk data" << newl;
@@ -585,10 +591,12 @@ int main(int argc, char* argv[]){
 
         if(nfile == file.size()) break;
         do{
-            data.read(file[nfile]);
-            hnode = data.find("UT_date");
-            if(hnode->has_data()){
-            hnode->value->get_value(ut_date);
+            // Only the header is needed to decide whether to skip a file
+            data.read_header(file[nfile]);
+            file_items.set_frame(data);
+            items = &file_items;
+            if(items->has_time){
+            ut_date = items->ut_date;
             has_a_time = true;
             }else{
             std::cout << "No header item 'UT_date' found in file " << file[nfile] << ". Will just print time = file number to the log file but continue to reduce" << std::endl;
@@ -597,18 +605,16 @@ int main(int argc, char* argv[]){
             if(has_a_time && Sreduce::abort_behaviour != Sreduce::VERY_RELAXED && ut_date < TEST_TIME) nfile++;
         }while(nfile < file.size() && has_a_time && Sreduce::abort_behaviour != Sreduce::VERY_RELAXED && ut_date < TEST_TIME);
         if(nfile == file.size()) break;
+        data.read(file[nfile]);
 
-        hnode = data.find("Frame.reliable");
-        reliable = (hnode->has_data() && hnode->value->get_bool());
-        hnode = data.find("Frame.satellites");
-        nsatellite = hnode->has_data() ? hnode->value->get_int() : 0;
+        reliable = items->has_reliable && items->reliable;
+        nsatellite = items->satellites;
 
         }
 
         // Data now read in
-        hnode = data.find("Exposure");
-        if(hnode->has_data()){
-        hnode->value->get_value(expose);
+        if(items->has_exposure){
+        expose = items->exposure;
         }else{
         if(Sreduce::abort_behaviour == Sreduce::FUSSY)
             throw Ultracam::Ultracam_Error("Fussy mode: failed to find header item 'Exposure' in file " + file[nfile]);
@@ -773,10 +779,10 @@ int main(int argc, char* argv[]){
             vbuffer += dvar;
         }
         if(has_a_time){
-            ttime   += data["UT_date"]->get_double();
+            ttime   += ut_date.mjd();
             texpose += expose;
             if(Sreduce::terminal_output == Sreduce::FULL || Sreduce::terminal_output == Sreduce::MEDIUM || Sreduce::terminal_output == Sreduce::LITTLE)
-            std::cout << " Frame " << nstack << " of " << Sreduce::naccum << ", time = " << data["UT_date"]->get_time()
+            std::cout << " Frame " << nstack << " of " << Sreduce::naccum << ", time = " << ut_date
                   << " added into data buffer." << std::endl;
         }else{
             if(Sreduce::terminal_output == Sreduce::FULL || Sreduce::terminal_output == Sreduce::MEDIUM || Sreduce::terminal_output == Sreduce::LITTLE)
@@ -789,10 +795,10 @@ int main(int argc, char* argv[]){
             data += dbuffer;
             dvar += vbuffer;
             if(has_a_time){
-            ttime   += data["UT_date"]->get_double();
+            ttime   += ut_date.mjd();
             texpose += expose;
             if(Sreduce::terminal_output == Sreduce::FULL || Sreduce::terminal_output == Sreduce::MEDIUM || Sreduce::terminal_output == Sreduce::LITTLE)
-                std::cout << " Frame " << nstack << " of " << Sreduce::naccum << ", time = " << data["UT_date"]->get_time()
+                std::cout << " Frame " << nstack << " of " << Sreduce::naccum << ", time = " << ut_date
                       << " added into data buffer." << std::endl;
             ttime  /= nstack;
             data.set("UT_date",  new Subs::Htime(Subs::Time(ttime), "mean UT date and time at the centre of accumulated exposure"));
@@ -882,6 +888,7 @@ int main(int argc, char* argv[]){
         // Write the spectrum to disk in molly format
         std::cerr << "Writing spectrum out in molly format" << std::endl;
         Subs::Header mhead;
+        Subs::Header::Hnode* hnode;
         mhead.set("Xtra",       new Subs::Hdirectory("Molly data"));
         mhead.set("Xtra.FCODE", new Subs::Hint(2, "Molly format code"));
         mhead.set("Xtra.UNITS", new Subs::Hstring("COUNTS          ", "Units of fluxes"));
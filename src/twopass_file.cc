@@ -0,0 +1,205 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include "trm/subs.h"
+#include "trm/aperture.h"
+#include "trm/mccd.h"
+#include "trm/ultracam.h"
+#include "trm/reduce.h"
+
+/*
+ * Two pass files store the results of the first pass of reduce's two pass mode so that
+ * later runs with the same positional settings can go straight to the second pass. They
+ * are binary, in the byte order of the machine that wrote them, and consist of:
+ *
+ * magic number, version, length of the key and the key itself, number of CCDs, then for
+ * each CCD the number of apertures and for each aperture its final X and Y reference
+ * positions and validity, then whether the blue data of the last frame were junk, then the
+ * number of frames and for each frame its number, time, and for each CCD the mean shape,
+ * reference position and validity and the offsets of each aperture. The file ends with the
+ * magic number again so that truncated files are spotted.
+ */
+
+namespace {
+
+  const Subs::INT4 VERSION = 2;
+
+  template <class T>
+  void put(std::ofstream& fout, const T& value){
+    fout.write((const char*)&value, sizeof(T));
+  }
+
+  void put_bool(std::ofstream& fout, bool value){
+    char c = value ? 1 : 0;
+    fout.write(&c, 1);
+  }
+
+  template <class T>
+  bool get(std::ifstream& fin, T& value){
+    return bool(fin.read((char*)&value, sizeof(T)));
+  }
+
+  bool get_bool(std::ifstream& fin, bool& value){
+    char c;
+    if(!fin.read(&c, 1)) return false;
+    value = (c != 0);
+    return true;
+  }
+
+  // Reads a count and checks it against the expected value
+  bool get_count(std::ifstream& fin, size_t expected){
+    Subs::INT4 n;
+    return get(fin, n) && n >= 0 && size_t(n) == expected;
+  }
+
+}
+
+/**
+ * Writes the results of the first pass of two pass mode to a file from which read_twopass can
+ * recover them.
+ * \param file     the file to write
+ * \param key      the settings that the results depend upon. read_twopass only accepts the file if
+ * given the same key.
+ * \param aperture the apertures as left by the first pass
+ * \param twopass  the positions, shapes and offsets measured during the first pass, one per frame
+ * \param blue_is_bad whether the blue data of the last frame of the first pass were junk, which
+ * governs whether CCD 3 is included in the fits that follow the first pass
+ */
+void Reduce::write_twopass(const std::string& file, const std::string& key, const Ultracam::Maperture& aperture,
+                           const std::vector<Twopass>& twopass, bool blue_is_bad){
+
+  std::ofstream fout(file.c_str(), std::ios::binary);
+  if(!fout)
+    throw Ultracam::File_Open_Error("Reduce::write_twopass: failed to open " + file);
+
+  put(fout, TWOPASS_MAGIC);
+  put(fout, VERSION);
+  put(fout, Subs::INT4(key.length()));
+  fout.write(key.data(), key.length());
+
+  put(fout, Subs::INT4(aperture.size()));
+  for(size_t nccd=0; nccd<aperture.size(); nccd++){
+    put(fout, Subs::INT4(aperture[nccd].size()));
+    for(size_t naper=0; naper<aperture[nccd].size(); naper++){
+      put(fout, aperture[nccd][naper].xref());
+      put(fout, aperture[nccd][naper].yref());
+      put_bool(fout, aperture[nccd][naper].valid());
+    }
+  }
+  put_bool(fout, blue_is_bad);
+
+  put(fout, Subs::INT4(twopass.size()));
+  for(size_t nexp=0; nexp<twopass.size(); nexp++){
+    const Twopass& twop = twopass[nexp];
+    put(fout, Subs::INT4(twop.nfile));
+    put(fout, twop.time);
+    for(size_t nccd=0; nccd<aperture.size(); nccd++){
+      const Meanshape& shape = twop.shape[nccd];
+      put_bool(fout, shape.profile_fit_symm);
+      put(fout, Subs::INT4(shape.profile_fit_method));
+      put(fout, Subs::INT4(shape.extraction_weights));
+      put(fout, shape.fwhm);
+      put(fout, shape.a);
+      put(fout, shape.b);
+      put(fout, shape.c);
+      put(fout, shape.beta);
+      put_bool(fout, shape.set);
+      put(fout, twop.ref_pos[nccd].x);
+      put(fout, twop.ref_pos[nccd].y);
+      put_bool(fout, twop.ref_valid[nccd]);
+      for(size_t naper=0; naper<aperture[nccd].size(); naper++){
+        const Offset& off = twop.offset[nccd][naper];
+        put(fout, off.x);
+        put(fout, off.y);
+        put(fout, off.xe);
+        put(fout, off.ye);
+        put_bool(fout, off.ok);
+      }
+    }
+  }
+  put(fout, TWOPASS_MAGIC);
+
+  if(!fout)
+    throw Ultracam::Write_Error("Reduce::write_twopass: error while writing " + file);
+}
+
+/**
+ * Reads the results of the first pass of two pass mode written by write_twopass, if the file
+ * exists and was written with the same key and apertures. Nothing is changed unless the whole
+ * file is read successfully.
+ * \param file     the file to read
+ * \param key      the settings that the results must have been obtained with
+ * \param aperture the apertures at the start of the first pass, which must have the same
+ * numbers of CCDs and apertures as when the file was written. Their positions and validity are
+ * set to those at the end of the first pass.
+ * \param twopass  the positions, shapes and offsets measured during the first pass, returned
+ * \param blue_is_bad returned, whether the blue data of the last frame of the first pass were junk
+ * \return true if the file was read, false if it did not exist or does not match
+ */
+bool Reduce::read_twopass(const std::string& file, const std::string& key, Ultracam::Maperture& aperture,
+                          std::vector<Twopass>& twopass, bool& blue_is_bad){
+
+  std::ifstream fin(file.c_str(), std::ios::binary);
+  if(!fin) return false;
+
+  Subs::INT4 magic, version, nkey;
+  if(!get(fin, magic) || magic != TWOPASS_MAGIC || !get(fin, version) || version != VERSION ||
+     !get(fin, nkey) || nkey < 0 || size_t(nkey) != key.length()) return false;
+  std::string fkey(nkey, ' ');
+  if(nkey > 0 && !fin.read(&fkey[0], nkey)) return false;
+  if(fkey != key) return false;
+
+  Ultracam::Maperture result(aperture);
+  if(!get_count(fin, result.size())) return false;
+  for(size_t nccd=0; nccd<result.size(); nccd++){
+    if(!get_count(fin, result[nccd].size())) return false;
+    for(size_t naper=0; naper<result[nccd].size(); naper++){
+      double xref, yref;
+      bool valid;
+      if(!get(fin, xref) || !get(fin, yref) || !get_bool(fin, valid)) return false;
+      result[nccd][naper].set_xref(xref);
+      result[nccd][naper].set_yref(yref);
+      result[nccd][naper].set_valid(valid);
+    }
+  }
+  bool bad_blue;
+  if(!get_bool(fin, bad_blue)) return false;
+
+  Subs::INT4 nentry;
+  if(!get(fin, nentry) || nentry < 0) return false;
+  std::vector<Twopass> temp(nentry);
+  for(Subs::INT4 nexp=0; nexp<nentry; nexp++){
+    Twopass& twop = temp[nexp];
+    Subs::INT4 nfile;
+    if(!get(fin, nfile) || !get(fin, twop.time)) return false;
+    twop.nfile = nfile;
+    twop.shape.resize(result.size());
+    twop.ref_pos.resize(result.size());
+    twop.ref_valid.resize(result.size());
+    twop.offset.resize(result.size());
+    for(size_t nccd=0; nccd<result.size(); nccd++){
+      Meanshape& shape = twop.shape[nccd];
+      Subs::INT4 method, weights;
+      bool valid;
+      if(!get_bool(fin, shape.profile_fit_symm) || !get(fin, method) || !get(fin, weights) ||
+         !get(fin, shape.fwhm) || !get(fin, shape.a) || !get(fin, shape.b) || !get(fin, shape.c) ||
+         !get(fin, shape.beta) || !get_bool(fin, shape.set) ||
+         !get(fin, twop.ref_pos[nccd].x) || !get(fin, twop.ref_pos[nccd].y) || !get_bool(fin, valid)) return false;
+      shape.profile_fit_method = PROFILE_FIT_METHOD(method);
+      shape.extraction_weights = PROFILE_FIT_METHOD(weights);
+      twop.ref_valid[nccd] = valid;
+      twop.offset[nccd].resize(result[nccd].size());
+      for(size_t naper=0; naper<result[nccd].size(); naper++){
+        Offset& off = twop.offset[nccd][naper];
+        if(!get(fin, off.x) || !get(fin, off.y) || !get(fin, off.xe) || !get(fin, off.ye) || !get_bool(fin, off.ok))
+          return false;
+      }
+    }
+  }
+  if(!get(fin, magic) || magic != TWOPASS_MAGIC) return false;
+
+  aperture    = result;
+  blue_is_bad = bad_blue;
+  twopass.swap(temp);
+  return true;
+}
@@ -17,7 +17,8 @@
 !!emph{ucm2fits} reads an Ultracam ".ucm" file or files and writes out an equivalent
 FITS format file or files. Optionally it can either send all CCDs into a single
 FITS file or it can split them up into one file per CCD. The headers are written as
-a binary table in the FITS file.
+a binary table in the FITS file. Both the original ucm format and version 2 files, which
+have an index of CCD and window positions appended, can be read.
 
 The FITS files consist of a dummy HDU first followed by one HDU per window, starting from the lower-left
 window, then the lower-right, then the next pair etc. If all CCDs are in the file, then the windows are first from CCD1,
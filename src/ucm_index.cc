@@ -0,0 +1,114 @@
+#include <vector>
+#include <fstream>
+#include "trm/subs.h"
+#include "trm/ultracam.h"
+#include "trm/ucm_index.h"
+
+/** Reads the index of a version 2 ucm file. The position of the stream is
+ * left unchanged whether or not an index is found.
+ * \param fin the input file, opened for binary input
+ * \param swap_bytes whether to swap bytes
+ * \return true if an index was found and read, false if the file has no index
+ */
+bool Ultracam::Ucm_index::read(std::ifstream& fin, bool swap_bytes){
+
+  std::streampos pos = fin.tellg();
+
+  // Footer: offset of index and magic number
+  Subs::INT4 ioff, magic, version, nccd, nwin;
+  fin.seekg(-2*std::streamoff(sizeof(Subs::INT4)), std::ios::end);
+  fin.read((char*)&ioff, sizeof(Subs::INT4));
+  fin.read((char*)&magic, sizeof(Subs::INT4));
+  if(swap_bytes){
+    ioff  = Subs::byte_swap(ioff);
+    magic = Subs::byte_swap(magic);
+  }
+  if(!fin || magic != IMAGIC){
+    fin.clear();
+    fin.seekg(pos);
+    return false;
+  }
+
+  // The index itself, which starts with the magic number and version again
+  fin.seekg(ioff);
+  fin.read((char*)&magic, sizeof(Subs::INT4));
+  fin.read((char*)&version, sizeof(Subs::INT4));
+  if(swap_bytes){
+    magic   = Subs::byte_swap(magic);
+    version = Subs::byte_swap(version);
+  }
+  if(!fin || magic != IMAGIC){
+    fin.clear();
+    fin.seekg(pos);
+    return false;
+  }
+  if(version != VERSION)
+    throw Read_Error("Ultracam::Ucm_index::read(std::ifstream&, bool): unrecognised ucm version = " + Subs::str(version));
+
+  fin.read((char*)&header, sizeof(Subs::INT4));
+  fin.read((char*)&nccd, sizeof(Subs::INT4));
+  if(swap_bytes){
+    header = Subs::byte_swap(header);
+    nccd   = Subs::byte_swap(nccd);
+  }
+  if(!fin)
+    throw Read_Error("Ultracam::Ucm_index::read(std::ifstream&, bool): failed to read start of index");
+
+  ccd.resize(nccd);
+  win.resize(nccd);
+  for(int ic=0; ic<nccd; ic++){
+    fin.read((char*)&ccd[ic], sizeof(Subs::INT4));
+    fin.read((char*)&nwin, sizeof(Subs::INT4));
+    if(swap_bytes){
+      ccd[ic] = Subs::byte_swap(ccd[ic]);
+      nwin    = Subs::byte_swap(nwin);
+    }
+    if(!fin)
+      throw Read_Error("Ultracam::Ucm_index::read(std::ifstream&, bool): failed to read CCD " + Subs::str(ic+1) + " of index");
+    win[ic].resize(nwin);
+    if(nwin){
+      fin.read((char*)&win[ic][0], sizeof(Subs::INT4)*nwin);
+      if(swap_bytes) Subs::byte_swap(&win[ic][0], nwin);
+    }
+    if(!fin)
+      throw Read_Error("Ultracam::Ucm_index::read(std::ifstream&, bool): failed to read windows of CCD " + Subs::str(ic+1) + " of index");
+  }
+
+  fin.seekg(pos);
+  return true;
+}
+
+/** Writes the index, followed by its offset and the magic number which end the file.
+ * \param fout the output file, positioned just after the data
+ */
+void Ultracam::Ucm_index::write(std::ofstream& fout) const {
+
+  Subs::INT4 ioff = offset(fout), magic = IMAGIC, version = VERSION, nccd = ccd.size(), nwin;
+
+  fout.write((char*)&magic, sizeof(Subs::INT4));
+  fout.write((char*)&version, sizeof(Subs::INT4));
+  fout.write((char*)&header, sizeof(Subs::INT4));
+  fout.write((char*)&nccd, sizeof(Subs::INT4));
+  for(int ic=0; ic<nccd; ic++){
+    nwin = win[ic].size();
+    fout.write((char*)&ccd[ic], sizeof(Subs::INT4));
+    fout.write((char*)&nwin, sizeof(Subs::INT4));
+    if(nwin)
+      fout.write((char*)&win[ic][0], sizeof(Subs::INT4)*nwin);
+  }
+  fout.write((char*)&ioff, sizeof(Subs::INT4));
+  fout.write((char*)&magic, sizeof(Subs::INT4));
+
+  if(!fout)
+    throw Write_Error("Ultracam::Ucm_index::write(std::ofstream&): failed to write index");
+}
+
+/** Returns the current position of an output file, checking that it fits in an index.
+ * \param fout the output file
+ */
+Subs::INT4 Ultracam::Ucm_index::offset(std::ofstream& fout){
+  std::streamoff pos = fout.tellp();
+  if(pos < 0 || pos > std::streamoff(2147483647))
+    throw Write_Error("Ultracam::Ucm_index::offset(std::ofstream&): file position out of range of ucm index");
+  return Subs::INT4(pos);
+}
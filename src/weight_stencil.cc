@@ -0,0 +1,257 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "trm/subs.h"
+#include "trm/reduce.h"
+#include "trm/weight_stencil.h"
+#include "trm/parallel.h"
+
+namespace {
+
+  // Maximum number of stencils cached by each thread
+  const size_t MAX_STENCIL = 512;
+
+  // Number of hash buckets of the cache, a power of 2
+  const size_t NBUCKET = 1024;
+
+  // A cache of stencils. Once full, the oldest entries are replaced first, apart from any
+  // returned earlier in the same call of Weight_stencil::get. Each bucket lists the entries
+  // whose keys hash to it.
+  struct Stencil_cache {
+    Stencil_cache() : stencil(), next(0), slot(), bucket(NBUCKET) {}
+    ~Stencil_cache(){
+      for(size_t i=0; i<stencil.size(); i++)
+        delete stencil[i];
+    }
+    std::vector<Ultracam::Weight_stencil*> stencil;
+    size_t next;
+    std::vector<size_t> slot; // entries returned by the current call
+    std::vector<std::vector<size_t> > bucket;
+  };
+
+  // The cache of each thread
+  Ultracam::Thread_cache<Stencil_cache> stencil_cache;
+
+  // Rounds value to the nearest integer, returning false if it is not finite or too large
+  bool round_to_int(double value, int& q){
+    if(!(std::fabs(value) < 1.e9)) return false;
+    q = int(Subs::nint(value));
+    return true;
+  }
+
+  // Rounds the logarithm of a positive value to 1/nsubdiv
+  bool round_log(double value, int nsubdiv, int& q){
+    return value > 0. && round_to_int(nsubdiv*std::log(value), q);
+  }
+
+  // The value for a rounded logarithm
+  double unround_log(int q, int nsubdiv){
+    return std::exp(double(q)/nsubdiv);
+  }
+
+}
+
+/** Returns the stencils of weights for several radii of a star aperture. The stencils are centred
+ * on the pixel nearest to the aperture centre. The aperture centre is offset from the centre of this
+ * pixel by qx/nsubdiv and qy/nsubdiv binned pixels in X and Y, and so qx and qy should lie between
+ * -nsubdiv/2 and +nsubdiv/2. The radii and profile are rounded as described for Weight_stencil.
+ * None of the stencils returned is removed from the cache to make room for another in the same
+ * call, so all of them remain valid together until the next call from the same thread.
+ * \param qx rounded X offset of aperture from the centre pixel, units of 1/nsubdiv binned pixels
+ * \param qy rounded Y offset of aperture from the centre pixel, units of 1/nsubdiv binned pixels
+ * \param nsubdiv number of subdivisions per binned pixel
+ * \param nrad number of radii
+ * \param rstar radii of the star aperture, unbinned pixels
+ * \param xbin X binning factor
+ * \param ybin Y binning factor
+ * \param extraction_method type of extraction
+ * \param shape profile parameters, only used for optimal extraction
+ * \param stencil returned, pointers to the stencils for each radius
+ * \return false if the parameters cannot be rounded, as for a profile with a coefficient that is
+ * not positive or not finite. The weights must then be computed directly.
+ */
+bool Ultracam::Weight_stencil::get(int qx, int qy, int nsubdiv, int nrad, const float* rstar, int xbin, int ybin,
+                                   Reduce::EXTRACTION_METHOD extraction_method, const Reduce::Meanshape& shape,
+                                   const Weight_stencil** stencil){
+
+  Key key[nrad];
+  for(int k=0; k<nrad; k++)
+    if(!make_key(qx, qy, nsubdiv, rstar[k], xbin, ybin, extraction_method, shape, key[k])) return false;
+
+  Stencil_cache& cache = stencil_cache.get();
+  cache.slot.clear();
+  for(int k=0; k<nrad; k++){
+
+    std::vector<size_t>& bucket = cache.bucket[key[k].hash() & (NBUCKET-1)];
+    size_t i = cache.stencil.size();
+    for(size_t j=0; j<bucket.size(); j++){
+      if(cache.stencil[bucket[j]]->key_ == key[k]){
+        i = bucket[j];
+        break;
+      }
+    }
+
+    if(i == cache.stencil.size()){
+
+      Weight_stencil* ptr = new Weight_stencil(key[k]);
+
+      // If the cache is full, replace the oldest entry not yet returned by this call. If there
+      // is none, the cache grows instead.
+      if(cache.stencil.size() >= MAX_STENCIL){
+        for(size_t n=0; n<cache.stencil.size(); n++){
+          size_t j = (cache.next + n) % cache.stencil.size();
+          if(std::find(cache.slot.begin(), cache.slot.end(), j) == cache.slot.end()){
+            i = j;
+            break;
+          }
+        }
+      }
+
+      if(i == cache.stencil.size()){
+        cache.stencil.push_back(ptr);
+      }else{
+        std::vector<size_t>& old = cache.bucket[cache.stencil[i]->key_.hash() & (NBUCKET-1)];
+        old.erase(std::find(old.begin(), old.end(), i));
+        delete cache.stencil[i];
+        cache.stencil[i] = ptr;
+        cache.next = (i + 1) % cache.stencil.size();
+      }
+      bucket.push_back(i);
+    }
+
+    cache.slot.push_back(i);
+    stencil[k] = cache.stencil[i];
+  }
+  return true;
+}
+
+// Rounds the parameters. Those that do not affect the weights are set to 0 so that they
+// do not stop keys from matching.
+bool Ultracam::Weight_stencil::make_key(int qx, int qy, int nsubdiv, float rstar, int xbin, int ybin,
+                                        Reduce::EXTRACTION_METHOD extraction_method,
+                                        const Reduce::Meanshape& shape, Key& key){
+
+  key.qx      = qx;
+  key.qy      = qy;
+  key.nsubdiv = nsubdiv;
+  key.xbin    = xbin;
+  key.ybin    = ybin;
+  key.method  = int(extraction_method);
+  key.fit = key.symm = key.weights = key.qa = key.qb = key.qc = key.qbeta = 0;
+
+  if(!round_to_int(rstar/(double(std::min(xbin, ybin))/nsubdiv), key.qrad)) return false;
+
+  if(extraction_method != Reduce::OPTIMAL) return true;
+
+  key.fit  = int(shape.profile_fit_method);
+  key.symm = shape.profile_fit_symm;
+  if(!round_log(shape.a, nsubdiv, key.qa)) return false;
+
+  if(!shape.profile_fit_symm){
+    if(!round_log(shape.c, nsubdiv, key.qc)) return false;
+    double scale = std::sqrt(unround_log(key.qa, nsubdiv)*unround_log(key.qc, nsubdiv))/nsubdiv;
+    if(!round_to_int(shape.b/scale, key.qb)) return false;
+  }
+
+  if(shape.profile_fit_method == Reduce::MOFFAT){
+    key.weights = int(shape.extraction_weights);
+    if(!round_log(shape.beta, nsubdiv, key.qbeta)) return false;
+  }
+
+  return true;
+}
+
+//! Do two keys match?
+bool Ultracam::Weight_stencil::Key::operator==(const Key& key) const {
+  return qx == key.qx && qy == key.qy && nsubdiv == key.nsubdiv && xbin == key.xbin && ybin == key.ybin &&
+    method == key.method && qrad == key.qrad && fit == key.fit && symm == key.symm && weights == key.weights &&
+    qa == key.qa && qb == key.qb && qc == key.qc && qbeta == key.qbeta;
+}
+
+//! Hash value of a key
+size_t Ultracam::Weight_stencil::Key::hash() const {
+  const int value[] = {qx, qy, nsubdiv, xbin, ybin, method, qrad, fit, symm, weights, qa, qb, qc, qbeta};
+  size_t h = 0;
+  for(size_t i=0; i<sizeof(value)/sizeof(int); i++)
+    h = 31*h + size_t(value[i]);
+  return h ^ (h >> 16);
+}
+
+// Computes the weights in the same way as extract_flux does pixel by pixel, from the rounded parameters
+Ultracam::Weight_stencil::Weight_stencil(const Key& key) : key_(key), hx_(0), hy_(0), wgt(), in() {
+
+  const int    xbin = key.xbin, ybin = key.ybin, nsubdiv = key.nsubdiv;
+  const double qx = key.qx, qy = key.qy;
+  const float  rstar = key.qrad*(double(std::min(xbin, ybin))/nsubdiv);
+  const Reduce::EXTRACTION_METHOD extraction_method = Reduce::EXTRACTION_METHOD(key.method);
+
+  Reduce::Meanshape shape;
+  if(extraction_method == Reduce::OPTIMAL){
+    shape.profile_fit_method = Reduce::PROFILE_FIT_METHOD(key.fit);
+    shape.profile_fit_symm   = key.symm;
+    shape.a = shape.c = unround_log(key.qa, nsubdiv);
+    if(!shape.profile_fit_symm){
+      shape.c = unround_log(key.qc, nsubdiv);
+      shape.b = key.qb*std::sqrt(shape.a*shape.c)/nsubdiv;
+    }
+    if(shape.profile_fit_method == Reduce::MOFFAT){
+      shape.extraction_weights = Reduce::PROFILE_FIT_METHOD(key.weights);
+      shape.beta = unround_log(key.qbeta, nsubdiv);
+    }
+  }
+
+  hx_ = int(rstar/xbin) + 2;
+  hy_ = int(rstar/ybin) + 2;
+  wgt.resize((2*hx_+1)*(2*hy_+1));
+  in.resize((2*hx_+1)*(2*hy_+1));
+
+  bool  same = (xbin == ybin);
+  float r, rpix = 0.f, weight = 0.f, fac, sdx, dx, sdy, dy;
+  if(same) rpix = xbin/2.;
+
+  for(int ky=-hy_, k=0; ky<=hy_; ky++){
+    sdy = Subs::sqr(dy = float((ky - qy/nsubdiv)*ybin));
+
+    for(int kx=-hx_; kx<=hx_; kx++, k++){
+      sdx = Subs::sqr(dx = float((kx - qx/nsubdiv)*xbin));
+
+      r = sqrt(sdx + sdy);
+      if(!same){
+        if(r == 0.f)
+          rpix = rstar/2.;
+        else
+          rpix = sqrt(Subs::sqr(xbin)*sdx + Subs::sqr(ybin)*sdy)/r/2.;
+      }
+
+      in[k]  = (r < rstar + rpix);
+      wgt[k] = 0.f;
+
+      if(in[k]){
+
+        if(extraction_method == Reduce::OPTIMAL){
+
+          if(shape.profile_fit_symm)
+            fac = shape.a*(sdx + sdy);
+          else
+            fac = shape.a*sdx + 2.*shape.b*dx*dy + shape.c*sdy;
+
+          if(shape.profile_fit_method == Reduce::GAUSSIAN){
+            weight = exp(-fac);
+          }else if(shape.profile_fit_method == Reduce::MOFFAT){
+            if(shape.extraction_weights == Reduce::GAUSSIAN)
+              weight = exp(-log(2.)/(pow(2.,1./shape.beta)-1)*fac);
+            else
+              weight = 1./pow(1.+fac, shape.beta);
+          }
+        }else{
+          weight = 1.;
+        }
+
+        // Apply linear taper at edge
+        if(r > rstar - rpix) weight *= (rstar+rpix-r)/(2.*rpix);
+
+        wgt[k] = std::max(0.f, weight);
+      }
+    }
+  }
+}